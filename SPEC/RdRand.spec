@@ -59,6 +59,7 @@ rm -vf $RPM_BUILD_ROOT{%{_libdir}/librdrand.la,%{_libdir}/librdrand.a,%{_libdir}
 %{_mandir}/man3/librdrand.3*
 %{_includedir}/librdrand.h
 %{_includedir}/librdrand-aes.h
+%{_includedir}/librdrand-drbg.h
 %{_libdir}/librdrand.so
 %{_libdir}/pkgconfig/*
 
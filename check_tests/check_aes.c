@@ -27,6 +27,8 @@
 #include <string.h>
 #include <check.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "./tools.h"
 #include "../src/librdrand.h"
 #include "../src/librdrand-aes.private.h"
@@ -57,6 +59,28 @@ START_TEST(aes_malloc_correct) {
   keys_free();
 }
 END_TEST
+
+// Keys and nonces share cache lines in one page aligned arena
+START_TEST(aes_malloc_arena) {
+  unsigned int i;
+
+  ck_assert(keys_allocate(5, DEFAULT_KEY_LEN) == TRUE);
+  ck_assert(AES_CFG.arena.base != NULL);
+  ck_assert((uintptr_t)AES_CFG.arena.base % sysconf(_SC_PAGESIZE) == 0);
+  for (i=0; i < 5; i++) {
+    ck_assert((uintptr_t)AES_CFG.keys.keys[i] % 64 == 0);
+    ck_assert(AES_CFG.keys.nonces[i] - AES_CFG.keys.keys[i] < 64);
+    ck_assert(AES_CFG.keys.keys[i] > (unsigned char *)AES_CFG.arena.base);
+    ck_assert(AES_CFG.keys.keys[i] < (unsigned char *)AES_CFG.arena.base + AES_CFG.arena.size);
+  }
+  for (i=0; i < 6; i++)
+    ck_assert((uintptr_t)&AES_CFG.schedules[i] % 64 == 0);
+
+  keys_free();
+  ck_assert(AES_CFG.arena.base == NULL);
+  ck_assert(AES_CFG.keys.keys == NULL);
+}
+END_TEST
 // }}} allocation tests
 
 // {{{ keys manual setting 
@@ -351,6 +375,7 @@ aes_creation_suite(void) {
   tc = tcase_create("Mallocs");
   tcase_add_test(tc, aes_malloc_bad);
   tcase_add_test(tc, aes_malloc_correct);
+  tcase_add_test(tc, aes_malloc_arena);
   suite_add_tcase(s, tc);
 
   tc = tcase_create("Settings");
@@ -523,6 +548,714 @@ aes_generation_suite(void) {
 }
 // }}} aes_generation_suite
 // }}} AES generation
+/** ******************************************************************/
+/**                      AES contexts                                */
+/** ******************************************************************/
+// {{{ AES contexts
+#define CTX_TEST_SIZE (MAX_COUNTER * 10 + 77)
+#define CTX_TEST_THREADS 4
+
+// {{{ CTX SETUP MACRO
+#define SETUP_CTX_KEYS() \
+  unsigned char key[16];\
+  unsigned char *keys[1] = {key};\
+  unsigned char nonce_counter[16]={0};\
+  unsigned char *nonces[1] = {nonce_counter};\
+  char key_hex[32]="c96b8a45affc5c9050378dd32168c381";\
+  char nonce_hex[16]="41e31e41e3f8c26f";\
+  hex2byte(key_hex, SIZEOF(key_hex), key, SIZEOF(key));\
+  hex2byte(nonce_hex, SIZEOF(nonce_hex), nonce_counter, SIZEOF(nonce_counter)/2);
+// }}}
+
+// {{{ aes_ctx_enc_buffer
+START_TEST (aes_ctx_enc_buffer) {
+    SETUP_CTX_KEYS();
+    unsigned char input[64];
+    unsigned char output[64]={0};
+    char expected_result_hex[64] = "2c6e98c0f3e667673bb3fe2fb1b2ca4dfb2211f3bdf0231ab266fa8a045f8562";
+    unsigned char expected_result[32];
+    rdrand_aes_ctx_t *ctx = rdrand_aes_ctx_create();
+
+    ck_assert(ctx != NULL);
+    memset(input, -1, SIZEOF(input));
+    hex2byte(expected_result_hex, 64, expected_result, 32);
+
+    ck_assert(rdrand_aes_ctx_set_keys(ctx, 1, 16, keys, nonces) == 1);
+    ck_assert(rdrand_aes_ctx_enc_buffer(ctx, output, input, 32) == 1);
+    ck_assert(memcmp(output, expected_result, 32) == 0);
+
+    // in place
+    ck_assert(rdrand_aes_ctx_set_keys(ctx, 1, 16, keys, nonces) == 1);
+    ck_assert(rdrand_aes_ctx_enc_buffer(ctx, input, input, 32) == 1);
+    ck_assert(memcmp(input, expected_result, 32) == 0);
+
+    rdrand_aes_ctx_destroy(ctx);
+}
+END_TEST
+// }}}
+
+// {{{ aes_ctx_independent
+// Interleaved use of two contexts and the global one doesn't mix their streams
+START_TEST (aes_ctx_independent) {
+    SETUP_CTX_KEYS();
+    static unsigned char input[CTX_TEST_SIZE], out_a[CTX_TEST_SIZE],
+                         out_b[CTX_TEST_SIZE], out_g[CTX_TEST_SIZE];
+    rdrand_aes_ctx_t *a = rdrand_aes_ctx_create();
+    rdrand_aes_ctx_t *b = rdrand_aes_ctx_create();
+    size_t done;
+
+    ck_assert(a != NULL && b != NULL);
+    memset(input, -1, CTX_TEST_SIZE);
+    ck_assert(rdrand_aes_ctx_set_keys(a, 1, 16, keys, nonces) == 1);
+    ck_assert(rdrand_aes_ctx_set_keys(b, 1, 16, keys, nonces) == 1);
+    ck_assert(rdrand_set_aes_keys(1, 16, keys, nonces) == 1);
+
+    ck_assert(rdrand_aes_ctx_enc_buffer(a, out_a, input, CTX_TEST_SIZE) == 1);
+    for (done = 0; done + MAX_BUFFER_SIZE <= CTX_TEST_SIZE; done += MAX_BUFFER_SIZE) {
+        ck_assert(rdrand_aes_ctx_enc_buffer(b, out_b + done, input, MAX_BUFFER_SIZE) == 1);
+        ck_assert(rdrand_enc_buffer(out_g + done, input, MAX_BUFFER_SIZE) == 1);
+    }
+    ck_assert(rdrand_aes_ctx_enc_buffer(b, out_b + done, input, CTX_TEST_SIZE - done) == 1);
+    ck_assert(rdrand_enc_buffer(out_g + done, input, CTX_TEST_SIZE - done) == 1);
+
+    ck_assert(memcmp(out_a, out_b, CTX_TEST_SIZE) == 0);
+    ck_assert(memcmp(out_a, out_g, CTX_TEST_SIZE) == 0);
+
+    rdrand_clean_aes();
+    rdrand_aes_ctx_destroy(a);
+    rdrand_aes_ctx_destroy(b);
+}
+END_TEST
+// }}}
+
+// {{{ aes_ctx_threads
+typedef struct {
+    rdrand_aes_ctx_t *ctx;
+    unsigned char *out;
+    int result;
+} ctx_thread_t;
+
+static void *ctx_thread(void *arg) {
+    ctx_thread_t *t = arg;
+    unsigned char input[MAX_BUFFER_SIZE];
+    size_t done;
+
+    memset(input, -1, MAX_BUFFER_SIZE);
+    t->result = 1;
+    for (done = 0; done < CTX_TEST_SIZE; done += MAX_BUFFER_SIZE) {
+        size_t len = CTX_TEST_SIZE - done < MAX_BUFFER_SIZE ? CTX_TEST_SIZE - done : MAX_BUFFER_SIZE;
+        t->result &= rdrand_aes_ctx_enc_buffer(t->ctx, t->out + done, input, len) == 1;
+    }
+    return NULL;
+}
+
+// Contexts used from several threads at once give the same streams as alone
+START_TEST (aes_ctx_threads) {
+    SETUP_CTX_KEYS();
+    static unsigned char input[CTX_TEST_SIZE], expected[CTX_TEST_SIZE],
+                         out[CTX_TEST_THREADS][CTX_TEST_SIZE];
+    pthread_t threads[CTX_TEST_THREADS];
+    ctx_thread_t args[CTX_TEST_THREADS];
+    rdrand_aes_ctx_t *ref = rdrand_aes_ctx_create();
+    unsigned int i;
+
+    memset(input, -1, CTX_TEST_SIZE);
+    ck_assert(rdrand_aes_ctx_set_keys(ref, 1, 16, keys, nonces) == 1);
+    ck_assert(rdrand_aes_ctx_enc_buffer(ref, expected, input, CTX_TEST_SIZE) == 1);
+    rdrand_aes_ctx_destroy(ref);
+
+    for (i = 0; i < CTX_TEST_THREADS; i++) {
+        args[i].ctx = rdrand_aes_ctx_create();
+        args[i].out = out[i];
+        ck_assert(rdrand_aes_ctx_set_keys(args[i].ctx, 1, 16, keys, nonces) == 1);
+        ck_assert(pthread_create(&threads[i], NULL, ctx_thread, &args[i]) == 0);
+    }
+    for (i = 0; i < CTX_TEST_THREADS; i++) {
+        ck_assert(pthread_join(threads[i], NULL) == 0);
+        ck_assert(args[i].result);
+        ck_assert(memcmp(out[i], expected, CTX_TEST_SIZE) == 0);
+        rdrand_aes_ctx_destroy(args[i].ctx);
+    }
+}
+END_TEST
+// }}}
+
+// {{{ aes_ctx_random_key
+START_TEST (aes_ctx_random_key) {
+    unsigned char a[MAX_BUFFER_SIZE * 3 + 5], b[MAX_BUFFER_SIZE * 3 + 5];
+    rdrand_aes_ctx_t *ctx_a = rdrand_aes_ctx_create();
+    rdrand_aes_ctx_t *ctx_b = rdrand_aes_ctx_create();
+
+    ck_assert(rdrand_aes_ctx_set_random_key(ctx_a) == 1);
+    ck_assert(rdrand_aes_ctx_set_random_key(ctx_b) == 1);
+    ck_assert(rdrand_aes_ctx_get_bytes(ctx_a, a, sizeof(a), 3) == sizeof(a));
+    ck_assert(rdrand_aes_ctx_get_bytes(ctx_b, b, sizeof(b), 3) == sizeof(b));
+    // every context has its own key
+    ck_assert(memcmp(a, b, sizeof(a)) != 0);
+
+    rdrand_aes_ctx_destroy(ctx_a);
+    rdrand_aes_ctx_destroy(ctx_b);
+    rdrand_aes_ctx_destroy(NULL);
+}
+END_TEST
+// }}}
+
+// {{{ aes_ctx_split
+START_TEST (aes_ctx_split) {
+    SETUP_CTX_KEYS();
+    static unsigned char input[CTX_TEST_SIZE], expected[CTX_TEST_SIZE],
+                         out_0[CTX_TEST_SIZE], out_1[CTX_TEST_SIZE], again[CTX_TEST_SIZE];
+    unsigned char iv[16] = {0}, block[16];
+    rdrand_aes_ctx_t *ref = rdrand_aes_ctx_create();
+    rdrand_aes_ctx_t *s0, *s1, *s1_again;
+    EVP_CIPHER_CTX *en;
+    int len;
+
+    memset(input, -1, CTX_TEST_SIZE);
+    ck_assert(rdrand_aes_ctx_set_keys(ref, 1, 16, keys, nonces) == 1);
+    s0 = rdrand_aes_ctx_split(ref, 0);
+    s1 = rdrand_aes_ctx_split(ref, 1);
+    s1_again = rdrand_aes_ctx_split(ref, 1);
+    ck_assert(s0 != NULL && s1 != NULL && s1_again != NULL);
+
+    // stream 0 is the context itself
+    ck_assert(rdrand_aes_ctx_enc_buffer(ref, expected, input, CTX_TEST_SIZE) == 1);
+    ck_assert(rdrand_aes_ctx_enc_buffer(s0, out_0, input, CTX_TEST_SIZE) == 1);
+    ck_assert(memcmp(out_0, expected, CTX_TEST_SIZE) == 0);
+
+    // other streams are deterministic, but differ
+    ck_assert(rdrand_aes_ctx_enc_buffer(s1, out_1, input, CTX_TEST_SIZE) == 1);
+    ck_assert(rdrand_aes_ctx_enc_buffer(s1_again, again, input, CTX_TEST_SIZE) == 1);
+    ck_assert(memcmp(out_1, again, CTX_TEST_SIZE) == 0);
+    ck_assert(memcmp(out_1, expected, CTX_TEST_SIZE) != 0);
+
+    // the stream number is in the upper half of the counter
+    memcpy(iv, nonce_counter, 8);
+    iv[11] = 1;
+    en = EVP_CIPHER_CTX_new();
+    ck_assert(EVP_EncryptInit_ex(en, EVP_aes_128_ctr(), NULL, key, iv) == 1);
+    ck_assert(EVP_EncryptUpdate(en, block, &len, input, 16) == 1);
+    ck_assert(memcmp(out_1, block, 16) == 0);
+    EVP_CIPHER_CTX_free(en);
+
+    // random keys are generated for every stream
+    ck_assert(rdrand_aes_ctx_set_random_key(ref) == 1);
+    rdrand_aes_ctx_destroy(s1);
+    s1 = rdrand_aes_ctx_split(ref, 1);
+    ck_assert(s1 != NULL);
+    ck_assert(rdrand_aes_ctx_enc_buffer(ref, out_0, input, CTX_TEST_SIZE) == 1);
+    ck_assert(rdrand_aes_ctx_enc_buffer(s1, out_1, input, CTX_TEST_SIZE) == 1);
+    ck_assert(memcmp(out_0, out_1, CTX_TEST_SIZE) != 0);
+
+    rdrand_aes_ctx_destroy(ref);
+    rdrand_aes_ctx_destroy(s0);
+    rdrand_aes_ctx_destroy(s1);
+    rdrand_aes_ctx_destroy(s1_again);
+}
+END_TEST
+// }}}
+
+// {{{ aes_ctx_rekey_interval
+// Keys change after the set interval, the rotated keys are deterministic
+START_TEST (aes_ctx_rekey_interval) {
+    SETUP_CTX_KEYS();
+    unsigned char input[MAX_BUFFER_SIZE], out[2][MAX_BUFFER_SIZE], again[MAX_BUFFER_SIZE];
+    unsigned char old_key[16];
+    rdrand_aes_ctx_t *ctx = rdrand_aes_ctx_create();
+    rdrand_aes_ctx_t *ref = rdrand_aes_ctx_create();
+    unsigned int i;
+
+    ck_assert(ctx != NULL && ref != NULL);
+    memset(input, -1, MAX_BUFFER_SIZE);
+
+    // boundaries
+    ck_assert(rdrand_aes_ctx_set_rekey_interval(ctx, 0) == 0);
+    ck_assert(rdrand_aes_ctx_set_rekey_interval(ctx, RDRAND_AES_MAX_REKEY_INTERVAL + 1) == 0);
+    ck_assert(rdrand_aes_ctx_set_rekey_interval(ctx, RDRAND_AES_MAX_REKEY_INTERVAL) == 1);
+    ck_assert(rdrand_set_aes_rekey_interval(0) == 0);
+
+    // a key change before every buffer but the first one
+    ck_assert(rdrand_aes_ctx_set_rekey_interval(ctx, MAX_BUFFER_SIZE) == 1);
+    ck_assert(rdrand_aes_ctx_set_keys(ctx, 1, 16, keys, nonces) == 1);
+    ck_assert(rdrand_aes_ctx_set_keys(ref, 1, 16, keys, nonces) == 1);
+    ck_assert(ctx->keys.next_counter == MAX_BUFFER_SIZE);
+    for (i=0; i < 5; i++) {
+        memcpy(old_key, ctx->keys.keys[0], 16);
+        ck_assert(rdrand_aes_ctx_enc_buffer(ctx, out[i%2], input, MAX_BUFFER_SIZE) == 1);
+        ck_assert(ctx->activation == i);
+        if (i > 0) {
+            ck_assert(memcmp(old_key, ctx->keys.keys[0], 16) != 0);
+            ck_assert(memcmp(out[0], out[1], MAX_BUFFER_SIZE) != 0);
+        }
+    }
+    // the same as with the default interval until the first change
+    ck_assert(rdrand_aes_ctx_enc_buffer(ref, again, input, MAX_BUFFER_SIZE) == 1);
+    ck_assert(rdrand_aes_ctx_set_keys(ctx, 1, 16, keys, nonces) == 1);
+    ck_assert(rdrand_aes_ctx_enc_buffer(ctx, out[0], input, MAX_BUFFER_SIZE) == 1);
+    ck_assert(memcmp(out[0], again, MAX_BUFFER_SIZE) == 0);
+
+    // rotated keys don't depend on how the data was split
+    ck_assert(rdrand_aes_ctx_enc_buffer(ref, again, input, MAX_BUFFER_SIZE) == 1);
+    ck_assert(rdrand_aes_ctx_enc_buffer(ref, again, input, MAX_BUFFER_SIZE) == 1);
+    ck_assert(rdrand_aes_ctx_enc_buffer(ctx, out[0], input, 100) == 1);
+    ck_assert(rdrand_aes_ctx_enc_buffer(ctx, out[0], input, MAX_BUFFER_SIZE) == 1);
+    ck_assert(memcmp(out[0], again, MAX_BUFFER_SIZE) == 0);
+
+    // a lower interval applies to the current key too
+    ck_assert(rdrand_aes_ctx_set_rekey_interval(ctx, 16) == 1);
+    ck_assert(ctx->keys.next_counter <= 16);
+
+    rdrand_aes_ctx_destroy(ctx);
+    rdrand_aes_ctx_destroy(ref);
+}
+END_TEST
+// }}}
+
+// {{{ aes_ctx_buffer_size
+// Buffer sizes which divide the rekey interval give the same output,
+// by enc_buffer and get_bytes of every kernel
+START_TEST (aes_ctx_buffer_size) {
+    SETUP_CTX_KEYS();
+    static const int kernels[] = {AES_KERNEL_EVP, AES_KERNEL_AESNI, AES_KERNEL_VAES};
+    static const unsigned int sizes[] = {16, 256, MAX_BUFFER_SIZE, MAX_COUNTER, RDRAND_AES_MAX_BUFFER_SIZE};
+    static unsigned char input[MAX_COUNTER * 10], expected[MAX_COUNTER * 10], out[MAX_COUNTER * 10];
+    rdrand_aes_ctx_t *ctx = rdrand_aes_ctx_create();
+    unsigned int i, k;
+
+    ck_assert(ctx != NULL);
+    memset(input, -1, SIZEOF(input));
+
+    // boundaries
+    ck_assert(rdrand_aes_ctx_set_buffer_size(ctx, 0) == 0);
+    ck_assert(rdrand_aes_ctx_set_buffer_size(ctx, 8) == 0);
+    ck_assert(rdrand_aes_ctx_set_buffer_size(ctx, 1000) == 0);
+    ck_assert(rdrand_aes_ctx_set_buffer_size(ctx, 2 * RDRAND_AES_MAX_BUFFER_SIZE) == 0);
+    ck_assert(rdrand_set_aes_buffer_size(3) == 0);
+
+    ck_assert(rdrand_aes_ctx_set_keys(ctx, 1, 16, keys, nonces) == 1);
+    ck_assert(rdrand_aes_ctx_enc_buffer(ctx, expected, input, SIZEOF(input)) == 1);
+
+    for (i = 0; i < SIZEOF(sizes); i++) {
+        ck_assert(rdrand_aes_ctx_set_buffer_size(ctx, sizes[i]) == 1);
+        ck_assert(rdrand_aes_ctx_set_keys(ctx, 1, 16, keys, nonces) == 1);
+        ck_assert(rdrand_aes_ctx_enc_buffer(ctx, out, input, SIZEOF(input)) == 1);
+        ck_assert(memcmp(out, expected, SIZEOF(out)) == 0);
+
+        // the stub RdRand gives the same input
+        for (k = 0; k < SIZEOF(kernels); k++) {
+            if (!aes_native_supported(kernels[k]))
+                continue;
+            ck_assert(aes_ctx_use_kernel(ctx, kernels[k]) == 1);
+            ck_assert(rdrand_aes_ctx_set_keys(ctx, 1, 16, keys, nonces) == 1);
+            memset(out, 0, SIZEOF(out));
+            ck_assert(rdrand_aes_ctx_get_bytes(ctx, out, SIZEOF(out), -1) == SIZEOF(out));
+            ck_assert(memcmp(out, expected, SIZEOF(out)) == 0);
+        }
+        ck_assert(aes_ctx_use_kernel(ctx, AES_KERNEL_AUTO) == 1);
+    }
+
+    rdrand_aes_ctx_destroy(ctx);
+}
+END_TEST
+// }}}
+
+// {{{ aes_ctx_random_reserve
+// Random keys are taken from a reserve generated in batches, used bytes are wiped
+START_TEST (aes_ctx_random_reserve) {
+    static const unsigned char zero[4096];
+    unsigned char old_key[DEFAULT_KEY_LEN];
+    rdrand_aes_ctx_t *ctx = rdrand_aes_ctx_create();
+    unsigned int i, changes = 0, refills = 0;
+    size_t pos;
+
+    ck_assert(ctx != NULL);
+    ck_assert(rdrand_aes_ctx_set_random_key(ctx) == 1);
+    ck_assert(ctx->reserve.buf != NULL);
+    pos = ctx->reserve.pos;
+    // a key and a nonce for each key of the first cycle and the next one
+    ck_assert(ctx->cycle > 1);
+    ck_assert(pos == 2 * ctx->cycle * 2 * DEFAULT_KEY_LEN);
+    ck_assert(memcmp(ctx->reserve.buf, zero, pos) == 0);
+
+    for (i = 0; i < 500; i++) {
+        memcpy(old_key, ctx->keys.keys[0], DEFAULT_KEY_LEN);
+        ctx->keys.next_counter = 0;
+        ck_assert(counter_ctx(ctx, 1) == 1);
+        if (memcmp(old_key, ctx->keys.keys[0], DEFAULT_KEY_LEN) != 0)
+            changes++;
+        if (ctx->reserve.pos < pos)
+            refills++;
+        pos = ctx->reserve.pos;
+        ck_assert(memcmp(ctx->reserve.buf, zero, pos) == 0);
+    }
+    ck_assert(changes == 500);
+    ck_assert(refills > 0);
+
+    rdrand_aes_ctx_destroy(ctx);
+}
+END_TEST
+// }}}
+
+// {{{ aes_ctx_stream
+// A stream is AES-128-CTR of the key from nonce || 0, any slice of it
+// can be read directly, with both kernels
+START_TEST (aes_ctx_stream) {
+    unsigned char key[16], nonce_counter[16] = {0};
+    char key_hex[32] = "c96b8a45affc5c9050378dd32168c381";
+    char nonce_hex[16] = "41e31e41e3f8c26f";
+    static const int kernels[] = {AES_KERNEL_EVP, AES_KERNEL_AESNI, AES_KERNEL_VAES};
+    static const unsigned long long offsets[] = {0, 1, 15, 16, 17, 4095, 5000, CTX_TEST_SIZE/2};
+    static unsigned char zero[CTX_TEST_SIZE], expected[CTX_TEST_SIZE], out[CTX_TEST_SIZE];
+    unsigned char iv[16] = {0}, tail[100];
+    rdrand_aes_ctx_t *ctx, *s1;
+    EVP_CIPHER_CTX *en;
+    unsigned int k, i;
+    size_t len;
+    int out_len;
+
+    hex2byte(key_hex, SIZEOF(key_hex), key, SIZEOF(key));
+    hex2byte(nonce_hex, SIZEOF(nonce_hex), nonce_counter, SIZEOF(nonce_counter)/2);
+    memcpy(iv, nonce_counter, 8);
+    en = EVP_CIPHER_CTX_new();
+    ck_assert(EVP_EncryptInit_ex(en, EVP_aes_128_ctr(), NULL, key, iv) == 1);
+    ck_assert(EVP_EncryptUpdate(en, expected, &out_len, zero, CTX_TEST_SIZE) == 1);
+
+    for (k = 0; k < SIZEOF(kernels); k++) {
+        if (!aes_native_supported(kernels[k]))
+            continue;
+        ctx = rdrand_aes_ctx_create();
+        ck_assert(aes_ctx_use_kernel(ctx, kernels[k]) == 1);
+        ck_assert(rdrand_aes_ctx_set_stream(ctx, 8, key, nonce_counter) == 0);
+        ck_assert(rdrand_aes_ctx_set_stream(ctx, 16, key, nonce_counter) == 1);
+
+        // read in uneven pieces, the key is never changed
+        for (len = 0; len < CTX_TEST_SIZE; len += 3001)
+            ck_assert(rdrand_aes_ctx_keystream(ctx, out + len,
+                        CTX_TEST_SIZE - len < 3001 ? CTX_TEST_SIZE - len : 3001)
+                    == (CTX_TEST_SIZE - len < 3001 ? CTX_TEST_SIZE - len : 3001));
+        ck_assert(memcmp(out, expected, CTX_TEST_SIZE) == 0);
+
+        // seek back and forth, from the middle of blocks
+        for (i = 0; i < SIZEOF(offsets); i++) {
+            ck_assert(rdrand_aes_ctx_keystream(ctx, out, 7) == 7);
+            ck_assert(rdrand_aes_ctx_seek(ctx, offsets[i]) == 1);
+            ck_assert(rdrand_aes_ctx_keystream(ctx, out, 1000) == 1000);
+            ck_assert(memcmp(out, expected + offsets[i], 1000) == 0);
+        }
+
+        // XOR into data
+        memset(out, -1, CTX_TEST_SIZE);
+        ck_assert(rdrand_aes_ctx_seek(ctx, 0) == 1);
+        ck_assert(rdrand_aes_ctx_enc_buffer(ctx, out, out, CTX_TEST_SIZE) == 1);
+        for (i = 0; i < CTX_TEST_SIZE; i++)
+            ck_assert(out[i] == (unsigned char)~expected[i]);
+
+        // the next stream starts where this one ends
+        s1 = rdrand_aes_ctx_split(ctx, 1);
+        ck_assert(s1 != NULL);
+        ck_assert(rdrand_aes_ctx_keystream(s1, out, 1000) == 1000);
+        iv[11] = 1;
+        ck_assert(EVP_EncryptInit_ex(en, EVP_aes_128_ctr(), NULL, key, iv) == 1);
+        ck_assert(EVP_EncryptUpdate(en, tail, &out_len, zero, 100) == 1);
+        ck_assert(memcmp(out, tail, 100) == 0);
+        iv[11] = 0;
+        ck_assert(rdrand_aes_ctx_seek(s1, RDRAND_AES_STREAM_LENGTH - 40) == 1);
+        ck_assert(rdrand_aes_ctx_keystream(s1, tail, 100) == 40);
+        ck_assert(rdrand_aes_ctx_keystream(s1, tail, 100) == 0);
+        ck_assert(rdrand_aes_ctx_seek(s1, RDRAND_AES_STREAM_LENGTH + 1) == 0);
+
+        // RdRand doesn't get into a stream
+        ck_assert(rdrand_aes_ctx_get_bytes(ctx, out, 100, 3) == 0);
+        rdrand_aes_ctx_destroy(s1);
+        rdrand_aes_ctx_destroy(ctx);
+    }
+    EVP_CIPHER_CTX_free(en);
+}
+END_TEST
+// }}}
+
+// {{{ aes_ctx_suite
+Suite *
+aes_ctx_suite(void) {
+    Suite *s = suite_create("AES contexts suite");
+    TCase *tc;
+
+    tc = tcase_create("contexts");
+    tcase_add_test(tc, aes_ctx_enc_buffer);
+    tcase_add_test(tc, aes_ctx_independent);
+    tcase_add_test(tc, aes_ctx_threads);
+    tcase_add_test(tc, aes_ctx_random_key);
+    tcase_add_test(tc, aes_ctx_split);
+    tcase_add_test(tc, aes_ctx_rekey_interval);
+    tcase_add_test(tc, aes_ctx_buffer_size);
+    tcase_add_test(tc, aes_ctx_random_reserve);
+    tcase_add_test(tc, aes_ctx_stream);
+    suite_add_tcase(s, tc);
+
+  return s;
+}
+// }}} aes_ctx_suite
+
+// {{{ AES kernels
+#define KERNEL_TEST_SIZE 5000
+
+static const int NATIVE_KERNELS[] = {AES_KERNEL_AESNI, AES_KERNEL_VAES};
+
+// {{{ aes_kernel_evp
+// Native kernels give the same stream as OpenSSL, split into any pieces
+START_TEST (aes_kernel_evp) {
+    static const size_t pieces[] = {1, 15, 16, 17, 100, 127, 128, 129, 255, 256, 257, 1000};
+    static const unsigned int bits[] = {128, 256};
+    static unsigned char input[KERNEL_TEST_SIZE], expected[KERNEL_TEST_SIZE], out[KERNEL_TEST_SIZE];
+    unsigned char key[32], iv[16];
+    aes_native_t native;
+    EVP_CIPHER_CTX *en;
+    size_t i, done, len;
+    unsigned int k, b, carry;
+    int out_len;
+
+    for (i = 0; i < KERNEL_TEST_SIZE; i++)
+        input[i] = i * 31 + 7;
+    for (i = 0; i < sizeof(key); i++)
+        key[i] = i * 7 + 3;
+
+    for (k = 0; k < SIZEOF(NATIVE_KERNELS); k++) {
+        if (!aes_native_supported(NATIVE_KERNELS[k]))
+            continue;
+        for (b = 0; b < SIZEOF(bits); b++) {
+            // carry within the lower half and over all the 128 bits
+            for (carry = 0; carry < 2; carry++) {
+                memset(iv, 0xa5, sizeof(iv));
+                memset(iv + (carry ? 0 : 8), 0xff, carry ? 16 : 8);
+                iv[15] = 0xf0;
+
+                en = EVP_CIPHER_CTX_new();
+                ck_assert(EVP_EncryptInit_ex(en, bits[b] == 128 ? EVP_aes_128_ctr() : EVP_aes_256_ctr(),
+                            NULL, key, iv) == 1);
+                ck_assert(EVP_EncryptUpdate(en, expected, &out_len, input, KERNEL_TEST_SIZE) == 1);
+                EVP_CIPHER_CTX_free(en);
+
+                ck_assert(aes_native_set_key(&native, key, bits[b], iv) == 1);
+                for (done = 0, i = 0; done < KERNEL_TEST_SIZE; done += len, i++) {
+                    len = pieces[i % SIZEOF(pieces)];
+                    if (len > KERNEL_TEST_SIZE - done)
+                        len = KERNEL_TEST_SIZE - done;
+                    aes_native_ctr(&native, NATIVE_KERNELS[k], out + done, input + done, len);
+                }
+                ck_assert(memcmp(out, expected, KERNEL_TEST_SIZE) == 0);
+
+                // in place
+                memcpy(out, input, KERNEL_TEST_SIZE);
+                ck_assert(aes_native_set_key(&native, key, bits[b], iv) == 1);
+                aes_native_ctr(&native, NATIVE_KERNELS[k], out, out, KERNEL_TEST_SIZE);
+                ck_assert(memcmp(out, expected, KERNEL_TEST_SIZE) == 0);
+            }
+        }
+    }
+}
+END_TEST
+// }}}
+
+// {{{ aes_kernel_ctx
+// Contexts give the same output with EVP and the native kernels,
+// including the key changes
+START_TEST (aes_kernel_ctx) {
+    SETUP_CTX_KEYS();
+    static unsigned char input[CTX_TEST_SIZE], expected[CTX_TEST_SIZE], out[CTX_TEST_SIZE];
+    rdrand_aes_ctx_t *evp, *native;
+    size_t done, len;
+    unsigned int k;
+
+    memset(input, -1, CTX_TEST_SIZE);
+    for (k = 0; k < SIZEOF(NATIVE_KERNELS); k++) {
+        if (!aes_native_supported(NATIVE_KERNELS[k]))
+            continue;
+        evp = rdrand_aes_ctx_create();
+        native = rdrand_aes_ctx_create();
+        ck_assert(aes_ctx_use_kernel(evp, AES_KERNEL_EVP) == 1);
+        ck_assert(aes_ctx_use_kernel(native, NATIVE_KERNELS[k]) == 1);
+        ck_assert(rdrand_aes_ctx_set_keys(evp, 1, 16, keys, nonces) == 1);
+        ck_assert(rdrand_aes_ctx_set_keys(native, 1, 16, keys, nonces) == 1);
+
+        for (done = 0; done < CTX_TEST_SIZE; done += len) {
+            len = CTX_TEST_SIZE - done < 3001 ? CTX_TEST_SIZE - done : 3001;
+            ck_assert(rdrand_aes_ctx_enc_buffer(evp, expected + done, input + done, len) == 1);
+            ck_assert(rdrand_aes_ctx_enc_buffer(native, out + done, input + done, len) == 1);
+        }
+        ck_assert(memcmp(out, expected, CTX_TEST_SIZE) == 0);
+
+        // the stub RdRand gives always the same data
+        ck_assert(rdrand_aes_ctx_get_bytes(evp, expected, CTX_TEST_SIZE, 3) == CTX_TEST_SIZE);
+        ck_assert(rdrand_aes_ctx_get_bytes(native, out, CTX_TEST_SIZE, 3) == CTX_TEST_SIZE);
+        ck_assert(memcmp(out, expected, CTX_TEST_SIZE) == 0);
+
+        rdrand_aes_ctx_destroy(evp);
+        rdrand_aes_ctx_destroy(native);
+    }
+}
+END_TEST
+// }}}
+
+// {{{ chacha_kernel_evp
+// ChaCha20 kernels give the same stream as OpenSSL, also when the low
+// word of the counter carries into the high one
+START_TEST (chacha_kernel_evp) {
+    static const int kernels[] = {AES_KERNEL_CHACHA_AVX2, AES_KERNEL_CHACHA_AVX512};
+    static const size_t pieces[] = {1, 63, 64, 65, 100, 511, 512, 513, 1023, 1024, 1025, 3000};
+    static unsigned char input[KERNEL_TEST_SIZE], expected[KERNEL_TEST_SIZE], out[KERNEL_TEST_SIZE];
+    unsigned char key[32], iv[16];
+    aes_native_t native;
+    EVP_CIPHER_CTX *en;
+    size_t i, done, len;
+    unsigned int k;
+    int out_len;
+
+    for (i = 0; i < KERNEL_TEST_SIZE; i++)
+        input[i] = i * 31 + 7;
+    for (i = 0; i < sizeof(key); i++)
+        key[i] = i * 7 + 3;
+    // 64 bit little endian counter 0x12345678fffffffa, then the nonce
+    memset(iv, 0xa5, sizeof(iv));
+    memset(iv, 0xff, 4);
+    iv[0] = 0xfa;
+    iv[4] = 0x78;
+    iv[5] = 0x56;
+    iv[6] = 0x34;
+    iv[7] = 0x12;
+
+    en = EVP_CIPHER_CTX_new();
+    ck_assert(EVP_EncryptInit_ex(en, EVP_chacha20(), NULL, key, iv) == 1);
+    ck_assert(EVP_EncryptUpdate(en, expected, &out_len, input, KERNEL_TEST_SIZE) == 1);
+    EVP_CIPHER_CTX_free(en);
+
+    for (k = 0; k < SIZEOF(kernels); k++) {
+        if (!chacha_native_supported(kernels[k]))
+            continue;
+        ck_assert(chacha_native_set_key(&native, key, iv) == 1);
+        for (done = 0, i = 0; done < KERNEL_TEST_SIZE; done += len, i++) {
+            len = pieces[i % SIZEOF(pieces)];
+            if (len > KERNEL_TEST_SIZE - done)
+                len = KERNEL_TEST_SIZE - done;
+            chacha_native_xor(&native, kernels[k], out + done, input + done, len);
+        }
+        ck_assert(memcmp(out, expected, KERNEL_TEST_SIZE) == 0);
+
+        // in place
+        memcpy(out, input, KERNEL_TEST_SIZE);
+        ck_assert(chacha_native_set_key(&native, key, iv) == 1);
+        chacha_native_xor(&native, kernels[k], out, out, KERNEL_TEST_SIZE);
+        ck_assert(memcmp(out, expected, KERNEL_TEST_SIZE) == 0);
+    }
+    // ChaCha20 kernels don't do AES and the other way round
+    ck_assert(chacha_native_supported(AES_KERNEL_AESNI) == 0);
+    ck_assert(aes_native_supported(AES_KERNEL_CHACHA_AVX2) == 0);
+}
+END_TEST
+// }}}
+
+// {{{ aes_ctx_ciphers
+// Every cipher gives the same output with every kernel, including the
+// key changes, and starts as OpenSSL with the nonce and a zero counter
+START_TEST (aes_ctx_ciphers) {
+    static const int kernels[] = {AES_KERNEL_AUTO, AES_KERNEL_AESNI, AES_KERNEL_VAES,
+        AES_KERNEL_CHACHA_AVX2, AES_KERNEL_CHACHA_AVX512};
+    static unsigned char input[CTX_TEST_SIZE], expected[CTX_TEST_SIZE], out[CTX_TEST_SIZE];
+    unsigned char key[2][32], nonce[2][8], iv[16], block[64];
+    unsigned char *keys[2] = {key[0], key[1]}, *nonces[2] = {nonce[0], nonce[1]};
+    rdrand_aes_ctx_t *evp, *ctx, *split;
+    EVP_CIPHER_CTX *en;
+    unsigned int k, i;
+    int cipher, len;
+
+    memset(input, 0x5a, CTX_TEST_SIZE);
+    for (i = 0; i < 32; i++) {
+        key[0][i] = i * 7 + 3;
+        key[1][i] = i * 11 + 1;
+    }
+    memcpy(nonce[0], "\x41\xe3\x1e\x41\xe3\xf8\xc2\x6f", 8);
+    memcpy(nonce[1], "\x01\x02\x03\x04\x05\x06\x07\x08", 8);
+
+    ck_assert(strcmp(rdrand_cipher_name(RDRAND_CIPHER_AES256_CTR), "aes256-ctr") == 0);
+    ck_assert(rdrand_cipher_name(RDRAND_CIPHER_COUNT) == NULL);
+    ck_assert(rdrand_cipher_key_length(RDRAND_CIPHER_CHACHA20) == 32);
+
+    for (cipher = RDRAND_CIPHER_AES256_CTR; cipher < RDRAND_CIPHER_COUNT; cipher++) {
+        evp = rdrand_aes_ctx_create();
+        ck_assert(rdrand_aes_ctx_set_cipher(evp, cipher) == 1);
+        ck_assert(aes_ctx_use_kernel(evp, AES_KERNEL_EVP) == 1);
+        // 256 bit keys only, no streams
+        ck_assert(rdrand_aes_ctx_set_keys(evp, 2, 16, keys, nonces) == 0);
+        ck_assert(rdrand_aes_ctx_set_stream(evp, 16, key[0], nonce[0]) == 0);
+        ck_assert(rdrand_aes_ctx_set_keys(evp, 2, 32, keys, nonces) == 1);
+        ck_assert(rdrand_aes_ctx_set_rekey_interval(evp, 1024) == 1);
+        ck_assert(rdrand_aes_ctx_enc_buffer(evp, expected, input, CTX_TEST_SIZE) == 1);
+
+        // the first key with the nonce and the counter at zero
+        memset(iv, 0, sizeof(iv));
+        memcpy(iv + (cipher == RDRAND_CIPHER_CHACHA20 ? 8 : 0), nonce[0], 8);
+        en = EVP_CIPHER_CTX_new();
+        ck_assert(EVP_EncryptInit_ex(en, cipher == RDRAND_CIPHER_CHACHA20 ? EVP_chacha20()
+                    : EVP_aes_256_ctr(), NULL, key[0], iv) == 1);
+        ck_assert(EVP_EncryptUpdate(en, block, &len, input, sizeof(block)) == 1);
+        ck_assert(memcmp(expected, block, sizeof(block)) == 0);
+        EVP_CIPHER_CTX_free(en);
+
+        for (k = 0; k < SIZEOF(kernels); k++) {
+            ctx = rdrand_aes_ctx_create();
+            ck_assert(rdrand_aes_ctx_set_cipher(ctx, cipher) == 1);
+            if (aes_ctx_use_kernel(ctx, kernels[k]) != 1) {
+                rdrand_aes_ctx_destroy(ctx);
+                continue;
+            }
+            ck_assert(rdrand_aes_ctx_set_keys(ctx, 2, 32, keys, nonces) == 1);
+            ck_assert(rdrand_aes_ctx_set_rekey_interval(ctx, 1024) == 1);
+            ck_assert(rdrand_aes_ctx_enc_buffer(ctx, out, input, CTX_TEST_SIZE) == 1);
+            ck_assert(memcmp(out, expected, CTX_TEST_SIZE) == 0);
+            rdrand_aes_ctx_destroy(ctx);
+        }
+
+        // streams keep the cipher and differ
+        split = rdrand_aes_ctx_split(evp, 1);
+        ck_assert(split != NULL);
+        ck_assert(rdrand_aes_ctx_enc_buffer(split, out, input, CTX_TEST_SIZE) == 1);
+        ck_assert(memcmp(out, expected, CTX_TEST_SIZE) != 0);
+        rdrand_aes_ctx_destroy(split);
+
+        // random keys have the length of the cipher
+        ck_assert(rdrand_aes_ctx_set_random_key(evp) == 1);
+        ck_assert(evp->keys.key_length == 32);
+        ck_assert(rdrand_aes_ctx_get_bytes(evp, out, CTX_TEST_SIZE, 3) == CTX_TEST_SIZE);
+        rdrand_aes_ctx_destroy(evp);
+    }
+
+    // a kernel of another cipher is not taken
+    ctx = rdrand_aes_ctx_create();
+    ck_assert(rdrand_aes_ctx_set_cipher(ctx, RDRAND_CIPHER_COUNT) == 0);
+    ck_assert(aes_ctx_use_kernel(ctx, AES_KERNEL_CHACHA_AVX2) == 0);
+    ck_assert(rdrand_aes_ctx_set_keys(ctx, 2, 32, keys, nonces) == 0);
+    rdrand_aes_ctx_destroy(ctx);
+}
+END_TEST
+// }}}
+
+// {{{ aes_kernel_suite
+Suite *
+aes_kernel_suite(void) {
+    Suite *s = suite_create("AES kernels suite");
+    TCase *tc;
+
+    tc = tcase_create("kernels");
+    tcase_add_test(tc, aes_kernel_evp);
+    tcase_add_test(tc, aes_kernel_ctx);
+    tcase_add_test(tc, chacha_kernel_evp);
+    tcase_add_test(tc, aes_ctx_ciphers);
+    suite_add_tcase(s, tc);
+
+  return s;
+}
+// }}} aes_kernel_suite
+// }}} AES kernels
+// }}} AES contexts
 /** *******************************************************************/
 /**             MAIN                                                  */
 /** *******************************************************************/
@@ -547,6 +1280,12 @@ int main(void) {
    s = aes_generation_suite ();
    srunner_add_suite(sr, s);
 
+   s = aes_ctx_suite ();
+   srunner_add_suite(sr, s);
+
+   s = aes_kernel_suite ();
+   srunner_add_suite(sr, s);
+
 
   srunner_run_all(sr, CK_NORMAL);
   number_failed = srunner_ntests_failed(sr);
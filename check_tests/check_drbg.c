@@ -0,0 +1,293 @@
+/* vim: set expandtab cindent fdm=marker ts=4 sw=4: */
+/*
+ * Copyright (C) 2013-2025 Jirka Hladky hladky DOT jiri AT gmail DOT com
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+    Now the legal stuff is done. This file contain the tests for Check
+    unit testing.
+*/
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "./tools.h"
+#include "../src/librdrand.h"
+#include "../src/librdrand-aes.private.h"
+#include "../src/librdrand-drbg.h"
+
+
+// {{{ CTR_DRBG
+#define DRBG_TEST_SIZE 200003
+
+static const int KERNELS[] = {AES_KERNEL_EVP, AES_KERNEL_AESNI, AES_KERNEL_VAES};
+
+// Known answers of OpenSSL CTR-DRBG, AES-256 with the derivation
+// function. Entropy 00..2f, nonce 20..2f, personalization "librdrand".
+static const unsigned char KAT_GENERATE[64] = {
+    0x7d, 0x9a, 0xdf, 0x9c, 0x43, 0x00, 0xf7, 0xac,
+    0x09, 0x70, 0x5b, 0xc8, 0x6b, 0xc3, 0xba, 0x32,
+    0x8d, 0x95, 0x91, 0xb4, 0xb0, 0x4e, 0x84, 0xc0,
+    0xfd, 0xdc, 0xaf, 0xea, 0x49, 0x53, 0xe9, 0xd5,
+    0xeb, 0x0a, 0x26, 0x87, 0xe8, 0x16, 0x2d, 0x47,
+    0x40, 0xf4, 0x49, 0x45, 0x4b, 0xa3, 0x4f, 0x0d,
+    0xe2, 0xfd, 0x35, 0xde, 0x6b, 0x74, 0xe1, 0x6e,
+    0xcb, 0x9c, 0xc3, 0x99, 0xd5, 0x80, 0xb5, 0x56,
+};
+// then with additional input 40..5f
+static const unsigned char KAT_ADDITIONAL[64] = {
+    0x9c, 0x95, 0xf7, 0x43, 0x2d, 0x44, 0x7d, 0xb1,
+    0xfd, 0xdd, 0xa4, 0x8d, 0x77, 0xb7, 0xcc, 0xd0,
+    0xa9, 0xd8, 0x4b, 0xb9, 0x13, 0x27, 0xb3, 0xbc,
+    0xab, 0x58, 0xde, 0x5f, 0x0f, 0x64, 0xbe, 0x3c,
+    0xda, 0x3c, 0x03, 0x57, 0xa6, 0xed, 0x34, 0xb3,
+    0x33, 0x04, 0x92, 0x56, 0xdf, 0x9c, 0x71, 0x6f,
+    0xa3, 0xde, 0xf4, 0xcf, 0x3d, 0xeb, 0xa3, 0x0b,
+    0x9c, 0xeb, 0xc6, 0x68, 0x8d, 0xbb, 0x2b, 0x56,
+};
+// then after a reseed by entropy 80..af and additional input 40..4f
+static const unsigned char KAT_RESEED[64] = {
+    0xb2, 0x64, 0xbf, 0xc1, 0xaa, 0x99, 0xbc, 0x97,
+    0xa7, 0x78, 0xa9, 0x5e, 0xdc, 0xc5, 0xaf, 0xac,
+    0x9e, 0x68, 0xdb, 0xf3, 0xa8, 0xf6, 0x2c, 0xe9,
+    0x8a, 0xcc, 0x8d, 0x22, 0x68, 0xc7, 0x0c, 0xc3,
+    0x4d, 0x83, 0x08, 0xd5, 0x76, 0x6a, 0x87, 0xdc,
+    0xa1, 0x95, 0xe8, 0xf8, 0xa7, 0x5d, 0xfe, 0xb5,
+    0x9b, 0x05, 0x4e, 0xab, 0x4d, 0xf3, 0xd1, 0x4d,
+    0x74, 0x05, 0x8b, 0x5d, 0xec, 0x0f, 0x59, 0xaf,
+};
+
+static rdrand_drbg_t *kat_instance(int kernel) {
+    unsigned char entropy[48], nonce[16];
+    rdrand_drbg_t *d;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(entropy); i++)
+        entropy[i] = i;
+    for (i = 0; i < sizeof(nonce); i++)
+        nonce[i] = 0x20 + i;
+
+    d = rdrand_drbg_create();
+    ck_assert(d != NULL);
+    ck_assert(drbg_use_kernel(d, kernel) == 1);
+    ck_assert(rdrand_drbg_instantiate_with(d, entropy, sizeof(entropy),
+                nonce, sizeof(nonce), "librdrand", 9) == 1);
+    return d;
+}
+
+// {{{ drbg_kat
+START_TEST (drbg_kat) {
+    unsigned char entropy[48], additional[32], out[64];
+    rdrand_drbg_t *d;
+    unsigned int i, k;
+
+    for (i = 0; i < sizeof(entropy); i++)
+        entropy[i] = 0x80 + i;
+    for (i = 0; i < sizeof(additional); i++)
+        additional[i] = 0x40 + i;
+
+    for (k = 0; k < SIZEOF(KERNELS); k++) {
+        if (!aes_native_supported(KERNELS[k]))
+            continue;
+        d = kat_instance(KERNELS[k]);
+        ck_assert(rdrand_drbg_generate(d, out, 64, NULL, 0) == 64);
+        ck_assert(memcmp(out, KAT_GENERATE, 64) == 0);
+        ck_assert(rdrand_drbg_generate(d, out, 64, additional, 32) == 64);
+        ck_assert(memcmp(out, KAT_ADDITIONAL, 64) == 0);
+        ck_assert(rdrand_drbg_reseed_with(d, entropy, 48, additional, 16) == 1);
+        ck_assert(rdrand_drbg_generate(d, out, 64, NULL, 0) == 64);
+        ck_assert(memcmp(out, KAT_RESEED, 64) == 0);
+        rdrand_drbg_destroy(d);
+    }
+}
+END_TEST
+// }}}
+
+// {{{ drbg_kernels
+// Native kernels give the same output as EVP, over more requests
+START_TEST (drbg_kernels) {
+    static unsigned char expected[DRBG_TEST_SIZE], out[DRBG_TEST_SIZE];
+    rdrand_drbg_t *d;
+    unsigned int k;
+
+    d = kat_instance(AES_KERNEL_EVP);
+    ck_assert(rdrand_drbg_generate(d, expected, DRBG_TEST_SIZE, "add", 3) == DRBG_TEST_SIZE);
+    rdrand_drbg_destroy(d);
+
+    for (k = 1; k < SIZEOF(KERNELS); k++) {
+        if (!aes_native_supported(KERNELS[k]))
+            continue;
+        d = kat_instance(KERNELS[k]);
+        memset(out, 0, DRBG_TEST_SIZE);
+        ck_assert(rdrand_drbg_generate(d, out, DRBG_TEST_SIZE, "add", 3) == DRBG_TEST_SIZE);
+        ck_assert(memcmp(out, expected, DRBG_TEST_SIZE) == 0);
+        rdrand_drbg_destroy(d);
+    }
+}
+END_TEST
+// }}}
+
+// {{{ drbg_uninstantiated
+START_TEST (drbg_uninstantiated) {
+    unsigned char out[16];
+    rdrand_drbg_t *d = rdrand_drbg_create();
+
+    ck_assert(d != NULL);
+    ck_assert(rdrand_drbg_generate(d, out, sizeof(out), NULL, 0) == 0);
+    ck_assert(rdrand_drbg_reseed(d, NULL, 0) == 0);
+    ck_assert(rdrand_drbg_reseed_with(d, out, sizeof(out), NULL, 0) == 0);
+    rdrand_drbg_destroy(d);
+    rdrand_drbg_destroy(NULL);
+}
+END_TEST
+// }}}
+
+// {{{ drbg_reseed_interval
+// The stub RdSeed gives always the same data, so two instances differ
+// only by the reseeds.
+START_TEST (drbg_reseed_interval) {
+    unsigned char a[3 * RDRAND_DRBG_MAX_REQUEST], b[3 * RDRAND_DRBG_MAX_REQUEST];
+    rdrand_drbg_t *x, *y;
+
+    x = rdrand_drbg_create();
+    y = rdrand_drbg_create();
+    ck_assert(rdrand_drbg_set_reseed_interval(x, 0) == 0);
+    ck_assert(rdrand_drbg_set_reseed_interval(x, RDRAND_DRBG_MAX_RESEED_INTERVAL + 1) == 0);
+    ck_assert(rdrand_drbg_set_reseed_interval(x, RDRAND_DRBG_MAX_RESEED_INTERVAL) == 1);
+    ck_assert(rdrand_drbg_set_reseed_interval(x, 2) == 1);
+
+    ck_assert(rdrand_drbg_instantiate(x, "pers", 4) == 1);
+    ck_assert(rdrand_drbg_instantiate(y, "pers", 4) == 1);
+    ck_assert(rdrand_drbg_generate(x, a, sizeof(a), NULL, 0) == sizeof(a));
+    ck_assert(rdrand_drbg_generate(y, b, sizeof(b), NULL, 0) == sizeof(b));
+    // the first two requests are the same, x is reseeded before the third
+    ck_assert(memcmp(a, b, 2 * RDRAND_DRBG_MAX_REQUEST) == 0);
+    ck_assert(memcmp(a + 2 * RDRAND_DRBG_MAX_REQUEST, b + 2 * RDRAND_DRBG_MAX_REQUEST,
+                RDRAND_DRBG_MAX_REQUEST) != 0);
+
+    // an explicit reseed
+    ck_assert(rdrand_drbg_reseed(y, NULL, 0) == 1);
+    rdrand_drbg_destroy(x);
+    rdrand_drbg_destroy(y);
+}
+END_TEST
+// }}}
+
+// {{{ drbg_get_bytes
+static void *drbg_thread(void *arg) {
+    if (rdrand_drbg_get_bytes(arg, 1000) != 1000)
+        return arg;
+    return NULL;
+}
+
+// Every thread has a DRBG of its own
+START_TEST (drbg_get_bytes) {
+    unsigned char a[1000], b[1000], c[1000];
+    pthread_t thread;
+    void *result;
+
+    ck_assert(rdrand_drbg_get_bytes(a, sizeof(a)) == sizeof(a));
+    ck_assert(rdrand_drbg_get_bytes(b, sizeof(b)) == sizeof(b));
+    ck_assert(memcmp(a, b, sizeof(a)) != 0);
+
+    ck_assert(pthread_create(&thread, NULL, drbg_thread, c) == 0);
+    ck_assert(pthread_join(thread, &result) == 0);
+    ck_assert(result == NULL);
+    ck_assert(memcmp(a, c, sizeof(a)) != 0);
+    ck_assert(memcmp(b, c, sizeof(b)) != 0);
+}
+END_TEST
+// }}}
+
+// {{{ drbg_fork
+// A child must not generate the same data as its parent, even by
+// an instance which was never used by rdrand_drbg_get_bytes
+START_TEST (drbg_fork) {
+    unsigned char a[1000], b[1000];
+    rdrand_drbg_t *d;
+    int fds[2], status;
+    pid_t pid;
+
+    d = rdrand_drbg_create();
+    ck_assert(d != NULL);
+    ck_assert(rdrand_drbg_instantiate(d, "pers", 4) == 1);
+    ck_assert(pipe(fds) == 0);
+
+    pid = fork();
+    ck_assert(pid >= 0);
+    if (pid == 0)
+    {
+        close(fds[0]);
+        if (rdrand_drbg_generate(d, b, sizeof(b), NULL, 0) != sizeof(b)
+                || write(fds[1], b, sizeof(b)) != sizeof(b))
+            _exit(1);
+        _exit(0);
+    }
+    close(fds[1]);
+    ck_assert(rdrand_drbg_generate(d, a, sizeof(a), NULL, 0) == sizeof(a));
+    ck_assert(read(fds[0], b, sizeof(b)) == sizeof(b));
+    close(fds[0]);
+    ck_assert(waitpid(pid, &status, 0) == pid);
+    ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    ck_assert(memcmp(a, b, sizeof(a)) != 0);
+    rdrand_drbg_destroy(d);
+}
+END_TEST
+// }}}
+
+// {{{ drbg_suite
+Suite *
+drbg_suite(void) {
+    Suite *s = suite_create("CTR_DRBG suite");
+    TCase *tc;
+
+    tc = tcase_create("drbg");
+    tcase_add_test(tc, drbg_kat);
+    tcase_add_test(tc, drbg_kernels);
+    tcase_add_test(tc, drbg_uninstantiated);
+    tcase_add_test(tc, drbg_reseed_interval);
+    tcase_add_test(tc, drbg_get_bytes);
+    tcase_add_test(tc, drbg_fork);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+// }}} drbg_suite
+// }}} CTR_DRBG
+
+
+int main(void) {
+    Suite *s;
+    SRunner *sr;
+    int number_failed;
+
+    s = drbg_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    fprintf(stderr, "\n-----------------\n");
+    if (number_failed == 0)
+        return EXIT_SUCCESS;
+    return EXIT_FAILURE;
+}
@@ -31,6 +31,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <check.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "./tools.h"
 #include "../src/librdrand.h"
 #include "../src/librdrand-aes.private.h"
@@ -102,6 +105,35 @@ int compareConfigs(cnf_t a, cnf_t b) {
         fprintf(stderr, "ERROR: Different threads! %u/%u\n",a.threads,b.threads);
         return FALSE;
     }
+    if (a.aes_rekey != b.aes_rekey) {
+        fprintf(stderr, "ERROR: Different aes_rekey! %u/%u\n",a.aes_rekey,b.aes_rekey);
+        return FALSE;
+    }
+    if (a.cipher != b.cipher) {
+        fprintf(stderr, "ERROR: Different cipher! %d/%d\n",a.cipher,b.cipher);
+        return FALSE;
+    }
+    if (a.aes_seek != b.aes_seek || a.aes_stream != b.aes_stream
+            || a.aes_seek_flag != b.aes_seek_flag) {
+        fprintf(stderr, "ERROR: Different aes_seek/aes_stream! %llu/%llu %u/%u\n",
+            a.aes_seek, b.aes_seek, a.aes_stream, b.aes_stream);
+        return FALSE;
+    }
+    if (a.splice_flag != b.splice_flag || a.pipe_size != b.pipe_size
+            || a.uring_flag != b.uring_flag || a.uring_depth != b.uring_depth
+            || a.direct_flag != b.direct_flag || a.direct_fd != b.direct_fd
+            || a.shards != b.shards || !str_compare(a.output_pattern, b.output_pattern)
+            || a.mmap_flag != b.mmap_flag
+            || !str_compare(a.wipe_device, b.wipe_device) || a.verify_flag != b.verify_flag) {
+        fprintf(stderr, "ERROR: Different output mode!\n");
+        return FALSE;
+    }
+    if (a.autotune_flag != b.autotune_flag
+            || !str_compare(a.tune_filename, b.tune_filename)
+            || a.max_chunk_size != b.max_chunk_size) {
+        fprintf(stderr, "ERROR: Different autotune!\n");
+        return FALSE;
+    }
     if (a.bytes != b.bytes) {
         fprintf(stderr, "ERROR: Different bytes! %zd/%zd\n",a.bytes,b.bytes);
         return FALSE;
@@ -183,6 +215,75 @@ START_TEST (parseArgs_aes)
 }
 END_TEST
 
+START_TEST (parseArgs_method_rdseed)
+{
+    // default config
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    // correct result
+    cnf_t cc = DEFAULT_CONFIG_SETTING;
+    cc.chunk_size=MAX_CHUNK_SIZE;
+    cc.method=GET_RDSEED;
+    // arguments
+    int argc = 3;
+    char *argv[] = {"rdrand-gen","-m","rdseed"};
+    // call
+    ck_assert(parse_args(argc, argv,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+}
+END_TEST
+
+START_TEST (parseArgs_method_ctr_drbg)
+{
+    // default config
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    // correct result
+    cnf_t cc = DEFAULT_CONFIG_SETTING;
+    cc.chunk_size=MAX_CHUNK_SIZE;
+    cc.method=GET_CTR_DRBG;
+    // arguments
+    int argc = 3;
+    char *argv[] = {"rdrand-gen","-m","ctr_drbg"};
+    // call
+    ck_assert(parse_args(argc, argv,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+}
+END_TEST
+
+START_TEST (parseArgs_autotune)
+{
+    // default config
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    // correct result
+    cnf_t cc = DEFAULT_CONFIG_SETTING;
+    cc.chunk_size=MAX_CHUNK_SIZE;
+    cc.autotune_flag=1;
+    // arguments
+    char *argv[] = {"rdrand-gen","--autotune"};
+    char *argv_file[] = {"rdrand-gen","-F","tune.txt"};
+    // call
+    optind = 0; // restart getopt
+    ck_assert(parse_args(2, argv,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+
+    // a cache file implies --autotune
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    cc.tune_filename="tune.txt";
+    optind = 0;
+    ck_assert(parse_args(3, argv_file,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+
+    // a tuned chunk limit, above MAX_CHUNK_SIZE
+    config.max_chunk_size = 8192;
+    config.bytes = 1024*1024;
+    compute_chunk_size(&config);
+    ck_assert(config.chunk_size == 8192);
+    ck_assert(config.chunk_count == 8);
+    config.bytes = 0;
+    compute_chunk_size(&config);
+    ck_assert(config.chunk_size == 8192);
+}
+END_TEST
+
 START_TEST (parseArgs_amount_missingNumber)
 {
     // default config
@@ -373,6 +474,284 @@ START_TEST (parseArgs_threads_positive)
 }
 END_TEST
 
+START_TEST (parseArgs_aes_rekey)
+{
+    // default config
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    // correct result
+    cnf_t cc = DEFAULT_CONFIG_SETTING;
+    cc.chunk_size=MAX_CHUNK_SIZE;
+    cc.aes_flag=1;
+    cc.aes_rekey=64*1024;
+    // arguments
+    int argc = 4;
+    char *argv[] = {"rdrand-gen","-a","--aes-rekey","64K"};
+    // call
+    ck_assert(parse_args(argc, argv,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+}
+END_TEST
+
+START_TEST (parseArgs_aes_rekey_bad)
+{
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    char *argv_zero[] = {"rdrand-gen","-a","-r","0"};
+    char *argv_big[] = {"rdrand-gen","-a","-r","2G"};
+    char *argv_no_aes[] = {"rdrand-gen","-r","1M"};
+
+    ck_assert(parse_args(4, argv_zero,&config) == EXIT_FAILURE);
+    optind = 0; // restart getopt
+    ck_assert(parse_args(4, argv_big,&config) == EXIT_FAILURE);
+    optind = 0;
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    ck_assert(parse_args(3, argv_no_aes,&config) == EXIT_FAILURE);
+}
+END_TEST
+
+START_TEST (parseArgs_cipher)
+{
+    // default config
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    // correct result
+    cnf_t cc = DEFAULT_CONFIG_SETTING;
+    cc.chunk_size=MAX_CHUNK_SIZE;
+    cc.aes_flag=1;
+    cc.cipher=RDRAND_CIPHER_CHACHA20;
+    // arguments
+    char *argv[] = {"rdrand-gen","-a","--cipher","chacha20"};
+    char *argv_auto[] = {"rdrand-gen","-a","-c","auto"};
+    char *argv_unknown[] = {"rdrand-gen","-a","-c","des"};
+    char *argv_no_aes[] = {"rdrand-gen","-c","aes256-ctr"};
+    char *argv_auto_keys[] = {"rdrand-gen","-a","-c","auto","-k","keys.txt"};
+    // call
+    optind = 0; // restart getopt
+    ck_assert(parse_args(4, argv,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    cc.cipher=CIPHER_AUTO;
+    optind = 0;
+    ck_assert(parse_args(4, argv_auto,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(4, argv_unknown,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(3, argv_no_aes,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(6, argv_auto_keys,&config) == EXIT_FAILURE);
+}
+END_TEST
+
+START_TEST (parseArgs_direct)
+{
+    // default config
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    // correct result
+    cnf_t cc = DEFAULT_CONFIG_SETTING;
+    cc.output_filename="out";
+    cc.direct_flag=1;
+    cc.threads=3;
+    cc.bytes=40000;
+    // chunks of whole O_DIRECT blocks, the rest is the ending
+    cc.blocks=5000;
+    cc.chunk_size=1536;
+    cc.chunk_count=1;
+    cc.ending_bytes=3136;
+    // arguments
+    char *argv[] = {"rdrand-gen","--direct","-o","out","-t","3","-n","40000"};
+    char *argv_no_file[] = {"rdrand-gen","-D","-n","40000"};
+    char *argv_splice[] = {"rdrand-gen","-D","-S","-o","out"};
+    // call
+    optind = 0; // restart getopt
+    ck_assert(parse_args(8, argv,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(4, argv_no_file,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(5, argv_splice,&config) == EXIT_FAILURE);
+}
+END_TEST
+
+START_TEST (parseArgs_shards)
+{
+    // default config
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    // correct result
+    cnf_t cc = DEFAULT_CONFIG_SETTING;
+    cc.output_pattern="out.%03d";
+    cc.threads=3;
+    cc.shards=3;
+    cc.bytes=1024*1024;
+    compute_chunk_size(&cc);
+    // arguments
+    char *argv[] = {"rdrand-gen","--output-pattern","out.%03d","-t","3","-n","1M"};
+    char *argv_one[] = {"rdrand-gen","-j","4","-n","1M"};
+    char *argv_no_amount[] = {"rdrand-gen","-j","4","-o","out"};
+    char *argv_bad_pattern[] = {"rdrand-gen","-P","out.%s","-n","1M"};
+    char *argv_two_numbers[] = {"rdrand-gen","-P","out.%d.%d","-n","1M"};
+    char *argv_output[] = {"rdrand-gen","-P","out.%d","-o","out","-n","1M"};
+    char *argv_zero[] = {"rdrand-gen","--shards","0","-n","1M"};
+    char *argv_mmap[] = {"rdrand-gen","--mmap","-o","out","-t","3","-n","1M"};
+    char *argv_mmap_stdout[] = {"rdrand-gen","-M","-n","1M"};
+    // call
+    optind = 0; // restart getopt
+    ck_assert(parse_args(7, argv,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+
+    // the number of shards is given, the ranges are in one output
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    cc = (cnf_t)DEFAULT_CONFIG_SETTING;
+    cc.shards=4;
+    cc.bytes=1024*1024;
+    compute_chunk_size(&cc);
+    optind = 0;
+    ck_assert(parse_args(5, argv_one,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(5, argv_no_amount,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(5, argv_bad_pattern,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(5, argv_two_numbers,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(7, argv_output,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(5, argv_zero,&config) == EXIT_FAILURE);
+
+    // the mapped output has a range for every thread
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    cc = (cnf_t)DEFAULT_CONFIG_SETTING;
+    cc.output_filename="out";
+    cc.mmap_flag=1;
+    cc.threads=3;
+    cc.shards=3;
+    cc.bytes=1024*1024;
+    compute_chunk_size(&cc);
+    optind = 0;
+    ck_assert(parse_args(8, argv_mmap,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(4, argv_mmap_stdout,&config) == EXIT_FAILURE);
+}
+END_TEST
+
+START_TEST (parseArgs_wipe)
+{
+    // default config
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    // correct result
+    cnf_t cc = DEFAULT_CONFIG_SETTING;
+    cc.wipe_device="/dev/loop0";
+    cc.verify_flag=1;
+    cc.method=GET_AES_STREAM;
+    cc.threads=4;
+    compute_chunk_size(&cc);
+    // arguments
+    char *argv[] = {"rdrand-gen","--wipe","/dev/loop0","--verify","-t","4"};
+    char *argv_keys[] = {"rdrand-gen","-w","/dev/loop0","-k","keys.txt","-s","1G","-i","2"};
+    char *argv_verify[] = {"rdrand-gen","-y","-o","out"};
+    char *argv_output[] = {"rdrand-gen","-w","/dev/loop0","-o","out"};
+    char *argv_method[] = {"rdrand-gen","-w","/dev/loop0","-m","reseed_delay"};
+    char *argv_aes[] = {"rdrand-gen","-w","/dev/loop0","-a"};
+    // call
+    optind = 0; // restart getopt
+    ck_assert(parse_args(6, argv,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+
+    // the wipe may go over the end of a stream, there is no limit
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    cc = (cnf_t)DEFAULT_CONFIG_SETTING;
+    cc.wipe_device="/dev/loop0";
+    cc.aeskeys_filename="keys.txt";
+    cc.method=GET_AES_STREAM;
+    cc.aes_seek=1024*1024*1024;
+    cc.aes_stream=2;
+    cc.aes_seek_flag=1;
+    compute_chunk_size(&cc);
+    optind = 0;
+    ck_assert(parse_args(9, argv_keys,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(4, argv_verify,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(5, argv_output,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(5, argv_method,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(4, argv_aes,&config) == EXIT_FAILURE);
+}
+END_TEST
+
+START_TEST (parseArgs_aes_stream)
+{
+    // default config
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    // correct result
+    cnf_t cc = DEFAULT_CONFIG_SETTING;
+    cc.method=GET_AES_STREAM;
+    cc.aeskeys_filename="keys.txt";
+    cc.aes_seek=1024*1024;
+    cc.aes_stream=3;
+    cc.aes_seek_flag=1;
+    cc.bytes=64*1024;
+    compute_chunk_size(&cc);
+    // arguments
+    int argc = 11;
+    char *argv[] = {"rdrand-gen","-m","aes_stream","-k","keys.txt",
+        "--seek","1M","--stream","3","-n","64K"};
+    // call
+    optind = 0; // restart getopt
+    ck_assert(parse_args(argc, argv,&config) == EXIT_SUCCESS);
+    ck_assert(compareConfigs(config, cc));
+
+    // without an amount, the rest of the stream
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(7, argv,&config) == EXIT_SUCCESS);
+    ck_assert(config.bytes == RDRAND_AES_STREAM_LENGTH - 1024*1024);
+}
+END_TEST
+
+START_TEST (parseArgs_aes_stream_bad)
+{
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    char *argv_no_keys[] = {"rdrand-gen","-m","aes_stream"};
+    char *argv_aes[] = {"rdrand-gen","-m","aes_stream","-k","keys.txt","-a"};
+    char *argv_end[] = {"rdrand-gen","-m","aes_stream","-k","keys.txt","-s","60G","-n","8G"};
+    char *argv_seek[] = {"rdrand-gen","-s","0"};
+
+    optind = 0; // restart getopt
+    ck_assert(parse_args(3, argv_no_keys,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(6, argv_aes,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(9, argv_end,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(3, argv_seek,&config) == EXIT_FAILURE);
+}
+END_TEST
 
 Suite *
 parseArgs_suite (void)
@@ -384,6 +763,9 @@ parseArgs_suite (void)
   tcase_add_test (tc, parseArgs_no_args);
   tcase_add_test (tc, parseArgs_help);
   tcase_add_test (tc, parseArgs_aes);
+  tcase_add_test (tc, parseArgs_method_rdseed);
+  tcase_add_test (tc, parseArgs_method_ctr_drbg);
+  tcase_add_test (tc, parseArgs_autotune);
   suite_add_tcase (s, tc);
 
   tc = tcase_create ("Amount");
@@ -402,6 +784,14 @@ parseArgs_suite (void)
   tcase_add_test (tc, parseArgs_threads_negative);
   tcase_add_test (tc, parseArgs_threads_withoutNumber);
   tcase_add_test (tc, parseArgs_threads_positive);
+  tcase_add_test (tc, parseArgs_aes_rekey);
+  tcase_add_test (tc, parseArgs_aes_rekey_bad);
+  tcase_add_test (tc, parseArgs_cipher);
+  tcase_add_test (tc, parseArgs_direct);
+  tcase_add_test (tc, parseArgs_shards);
+  tcase_add_test (tc, parseArgs_wipe);
+  tcase_add_test (tc, parseArgs_aes_stream);
+  tcase_add_test (tc, parseArgs_aes_stream_bad);
   suite_add_tcase (s, tc);
 
   return s;
@@ -447,6 +837,30 @@ START_TEST (keys_read_line){
 END_TEST
 // }}} keys_read_line
 
+// {{{ keys_read_line_256
+// a 256 bit key has a 64 bit nonce too
+START_TEST (keys_read_line_256){
+    unsigned char key[RDRAND_MAX_KEY_LENGTH], nonce[RDRAND_MAX_KEY_LENGTH];
+    unsigned char *keys[1] = {key}, *nonces[1] = {nonce};
+    unsigned int key_len, nonce_len, res;
+    FILE *f = tmpfile();
+
+    fprintf(f, "%s%s%s\n", FIXED_KEY, FIXED_KEY, FIXED_NONCE);
+    fprintf(f, "%s%s%s0\n", FIXED_KEY, FIXED_KEY, FIXED_NONCE);
+    rewind(f);
+
+    res = load_key_line(f, keys, &key_len, nonces, &nonce_len);
+    ck_assert_msg(res == E_OK, "Bad return code from load_key_lin: %u\n",res);
+    ck_assert(key_len == 32 && nonce_len == 8);
+    ck_assert(memcmp(key, key + 16, 16) == 0);
+    // too long
+    res = load_key_line(f, keys, &key_len, nonces, &nonce_len);
+    ck_assert(res == E_KEY_NONCE_BAD_LENGTH);
+    fclose(f);
+}
+END_TEST
+// }}} keys_read_line_256
+
 
 // {{{ keys_open_file
 START_TEST (keys_open_file){
@@ -474,6 +888,7 @@ keys_load_suite (void) {
 
   tc = tcase_create ("Opening the key file");
   tcase_add_test (tc, keys_read_line);
+  tcase_add_test (tc, keys_read_line_256);
   tcase_add_test (tc, keys_open_file);
   suite_add_tcase (s, tc);
  
@@ -544,6 +959,25 @@ START_TEST (run_amount_generation_5)
 }
 END_TEST
 
+// The reseed methods give whole 64bit values, the ending bytes too
+START_TEST (run_amount_generation_reseed_tail)
+{
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    char *argv[] = {"rdrand-gen", "-m", "reseed_rdseed", "-t", "2", "-n", "100003"};
+    size_t generated;
+
+    ck_assert(parse_args(7, argv,&config) == EXIT_SUCCESS);
+    ck_assert(config.ending_bytes % 8 != 0);
+    config.output = tmpfile();
+    ck_assert(config.output != NULL);
+
+    generated=generate(&config);
+    ck_assert(generated == 100003);
+    ck_assert(ftell(config.output) == 100003);
+    fclose(config.output);
+}
+END_TEST
+
 START_TEST (run_amount_generation_20k)
 {
     // default config
@@ -572,6 +1006,455 @@ START_TEST (run_amount_generation_20k)
 }
 END_TEST
 
+START_TEST (run_amount_generation_pipeline)
+{
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    int argc = 5;
+    char *argv[] = {"rdrand-gen", "-t", "4", "-n", "1000003"};
+    unsigned char *buf;
+    size_t generated, i;
+
+    ck_assert(parse_args(argc, argv,&config) == EXIT_SUCCESS);
+    config.output = tmpfile();
+    ck_assert(config.output != NULL);
+
+    generated=generate(&config);
+    ck_assert(generated == 1000003);
+
+    // all chunks have to be written, in full
+    ck_assert(fseek(config.output, 0, SEEK_END) == 0);
+    ck_assert(ftell(config.output) == 1000003);
+    rewind(config.output);
+    buf = malloc(1000003);
+    ck_assert(buf != NULL);
+    ck_assert(fread(buf, 1, 1000003, config.output) == 1000003);
+    for (i = 0; i < 1000003; i++)
+        ck_assert(buf[i] == 0xff);
+    free(buf);
+    fclose(config.output);
+}
+END_TEST
+
+START_TEST (run_amount_generation_pipeline_aes)
+{
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    int argc = 6;
+    char *argv[] = {"rdrand-gen", "-a", "-t", "3", "-n", "1000003"};
+    size_t generated;
+
+    ck_assert(parse_args(argc, argv,&config) == EXIT_SUCCESS);
+    rdrand_set_aes_random_key();
+
+    stdout_to_null();
+    generated=generate(&config);
+    stdout_restore();
+
+    rdrand_clean_aes();
+    ck_assert(generated == 1000003);
+}
+END_TEST
+
+START_TEST (run_amount_generation_parallel_aes)
+{
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    int argc = 6;
+    char *argv[] = {"rdrand-gen", "-a", "-t", "3", "-n", "1000003"};
+    unsigned char *buf, *expected;
+    size_t generated;
+
+    ck_assert(parse_args(argc, argv,&config) == EXIT_SUCCESS);
+    config.aes_threads = 3;
+    ck_assert(test_set_aes_keys() == 1);
+    config.output = tmpfile();
+    ck_assert(config.output != NULL);
+
+    generated=generate(&config);
+    ck_assert(generated == 1000003);
+
+    // chunk i is encrypted by the stream i%3
+    expected = test_expected_chunks(config.chunk_size*8, config.chunk_count*config.threads,
+            config.ending_bytes, 3);
+    buf = malloc(1000003);
+    ck_assert(expected != NULL && buf != NULL);
+    rewind(config.output);
+    ck_assert(fread(buf, 1, 1000003, config.output) == 1000003);
+    ck_assert(memcmp(buf, expected, 1000003) == 0);
+
+    free(buf);
+    free(expected);
+    fclose(config.output);
+    rdrand_clean_aes();
+}
+END_TEST
+
+START_TEST (run_amount_generation_many_threads)
+{
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    int argc = 5;
+    // buffers for so many threads used not to fit on the stack
+    char *argv[] = {"rdrand-gen", "-t", "600", "-n", "4M"};
+    size_t generated;
+
+    ck_assert(parse_args(argc, argv,&config) == EXIT_SUCCESS);
+
+    stdout_to_null();
+    generated=generate(&config);
+    stdout_restore();
+
+    ck_assert(generated == 4*1024*1024);
+}
+END_TEST
+
+// {{{ run_amount_generation_splice
+typedef struct pipe_reader_s {
+    int fd;
+    unsigned char *buf;
+    size_t len;
+} pipe_reader_t;
+
+static void *pipe_reader(void *arg)
+{
+    pipe_reader_t *r = arg;
+    ssize_t n;
+
+    // read slowly at first, so the writer fills the whole pipe
+    usleep(100000);
+    while (r->len < 4000003 && (n = read(r->fd, r->buf + r->len, 4000003 - r->len)) > 0)
+        r->len += n;
+    return NULL;
+}
+
+// The chunks are spliced into a pipe and their slots filled again
+// many times: every chunk has to be read as it was encrypted.
+START_TEST (run_amount_generation_splice)
+{
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    int argc = 7;
+    char *argv[] = {"rdrand-gen", "-a", "-S", "-t", "2", "-n", "4000003"};
+    pipe_reader_t reader;
+    pthread_t thread;
+    unsigned char *expected;
+    size_t generated;
+    int fds[2];
+
+    ck_assert(parse_args(argc, argv,&config) == EXIT_SUCCESS);
+    ck_assert(config.splice_flag == 1);
+    config.aes_threads = 1;
+    ck_assert(test_set_aes_keys() == 1);
+    ck_assert(pipe(fds) == 0);
+    config.output = fdopen(fds[1], "w");
+    ck_assert(config.output != NULL);
+    reader.fd = fds[0];
+    reader.len = 0;
+    reader.buf = malloc(4000003);
+    ck_assert(reader.buf != NULL);
+    ck_assert(pthread_create(&thread, NULL, pipe_reader, &reader) == 0);
+
+    generated=generate(&config);
+    ck_assert(config.pipe_size > 0);
+    fclose(config.output);
+    ck_assert(pthread_join(thread, NULL) == 0);
+    close(fds[0]);
+    ck_assert(generated == 4000003);
+    ck_assert(reader.len == 4000003);
+
+    expected = test_expected_chunks(config.chunk_size*8, config.chunk_count*config.threads,
+            config.ending_bytes, 1);
+    ck_assert(expected != NULL);
+    ck_assert(memcmp(reader.buf, expected, 4000003) == 0);
+
+    free(reader.buf);
+    free(expected);
+    rdrand_clean_aes();
+}
+END_TEST
+// }}}
+
+// {{{ run_amount_generation_uring
+// The chunks are written by io_uring, in any order, behind the data
+// which were already in the file; the ending bytes behind them.
+START_TEST (run_amount_generation_uring)
+{
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    int argc = 7;
+    char *argv[] = {"rdrand-gen", "-a", "--io-uring", "-t", "3", "-n", "4000003"};
+    char *argv_splice[] = {"rdrand-gen", "-S", "-U"};
+    unsigned char *buf, *expected;
+    size_t generated;
+
+    optind = 0;
+    ck_assert(parse_args(3, argv_splice,&config) == EXIT_FAILURE);
+    config = (cnf_t)DEFAULT_CONFIG_SETTING;
+    optind = 0;
+    ck_assert(parse_args(argc, argv,&config) == EXIT_SUCCESS);
+    ck_assert(config.uring_flag == 1);
+    config.aes_threads = 1;
+    ck_assert(test_set_aes_keys() == 1);
+    config.output = tmpfile();
+    ck_assert(config.output != NULL);
+    ck_assert(fwrite("head", 1, 4, config.output) == 4);
+
+    generated=generate(&config);
+    ck_assert(config.uring_depth > 0);
+    ck_assert(generated == 4000003);
+
+    expected = test_expected_chunks(config.chunk_size*8, config.chunk_count*config.threads,
+            config.ending_bytes, 1);
+    buf = malloc(4000007);
+    ck_assert(expected != NULL && buf != NULL);
+    ck_assert(fflush(config.output) == 0);
+    ck_assert(fseek(config.output, 0, SEEK_END) == 0);
+    ck_assert(ftell(config.output) == 4000007);
+    rewind(config.output);
+    ck_assert(fread(buf, 1, 4000007, config.output) == 4000007);
+    ck_assert(memcmp(buf, "head", 4) == 0);
+    ck_assert(memcmp(buf + 4, expected, 4000003) == 0);
+
+    free(buf);
+    free(expected);
+    fclose(config.output);
+    rdrand_clean_aes();
+}
+END_TEST
+// }}}
+
+// {{{ run_amount_generation_direct
+// Whole chunks go by O_DIRECT, the unaligned ending bytes behind them
+// by the stream; with io_uring too.
+START_TEST (run_amount_generation_direct)
+{
+    cnf_t config;
+    char path[] = "/tmp/rdrand-gen-direct-XXXXXX";
+    char *argv[] = {"rdrand-gen", "-a", "-D", "-o", path, "-t", "3", "-n", "4000003", "-U"};
+    unsigned char *buf, *expected;
+    size_t generated;
+    int fd, uring;
+
+    fd = mkstemp(path);
+    ck_assert(fd >= 0);
+    close(fd);
+    buf = malloc(4000003);
+    ck_assert(buf != NULL);
+
+    for (uring = 0; uring < 2; uring++) {
+        config = (cnf_t)DEFAULT_CONFIG_SETTING;
+        optind = 0;
+        ck_assert(parse_args(9 + uring, argv,&config) == EXIT_SUCCESS);
+        ck_assert(config.direct_flag == 1 && config.uring_flag == uring);
+        ck_assert(config.chunk_size % 512 == 0);
+        config.aes_threads = 1;
+        ck_assert(test_set_aes_keys() == 1);
+        config.output = fopen(path, "wb");
+        ck_assert(config.output != NULL);
+
+        generated=generate(&config);
+        ck_assert(generated == 4000003);
+        ck_assert(config.direct_fd == -1);
+        ck_assert(fclose(config.output) == 0);
+
+        expected = test_expected_chunks(config.chunk_size*8, config.chunk_count*config.threads,
+                config.ending_bytes, 1);
+        ck_assert(expected != NULL);
+        rdrand_clean_aes();
+
+        config.output = fopen(path, "rb");
+        ck_assert(config.output != NULL);
+        ck_assert(fread(buf, 1, 4000003, config.output) == 4000003);
+        ck_assert(fgetc(config.output) == EOF);
+        ck_assert(memcmp(buf, expected, 4000003) == 0);
+        fclose(config.output);
+        free(expected);
+    }
+
+    unlink(path);
+    free(buf);
+}
+END_TEST
+// }}}
+
+// {{{ run_amount_generation_shards
+// The ranges of the shards make the same output as one stream
+START_TEST (run_amount_generation_shards)
+{
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    char *argv[] = {"rdrand-gen", "-m", "aes_stream", "-k", "keys.txt", "-j", "3", "-n", "1000003"};
+    unsigned char *buf, *expected;
+    size_t generated;
+
+    ck_assert(parse_args(9, argv,&config) == EXIT_SUCCESS);
+    ck_assert(test_set_aes_stream() == 1);
+    config.output = tmpfile();
+    ck_assert(config.output != NULL);
+    ck_assert(fwrite("head", 1, 4, config.output) == 4);
+
+    generated=generate(&config);
+    ck_assert(generated == 1000003);
+
+    expected = test_expected_stream(0, 1000003);
+    buf = malloc(1000007);
+    ck_assert(expected != NULL && buf != NULL);
+
+    // the stream goes on behind the ranges
+    ck_assert(fwrite("tail", 1, 4, config.output) == 4);
+    ck_assert(fflush(config.output) == 0);
+    rewind(config.output);
+    ck_assert(fread(buf, 1, 1000007, config.output) == 1000007);
+    ck_assert(memcmp(buf, "head", 4) == 0);
+    ck_assert(memcmp(buf + 4, expected, 1000003) == 0);
+    ck_assert(fread(buf, 1, 4, config.output) == 4);
+    ck_assert(memcmp(buf, "tail", 4) == 0);
+
+    free(buf);
+    free(expected);
+    fclose(config.output);
+    rdrand_clean_aes();
+}
+END_TEST
+
+// The mapped ranges make the same output as one stream, behind
+// the data which were already in the file
+START_TEST (run_amount_generation_mmap)
+{
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    char path[] = "/tmp/rdrand-gen-mmap-XXXXXX";
+    char *argv[] = {"rdrand-gen", "-m", "aes_stream", "-k", "keys.txt", "-M", "-o", path,
+        "-t", "3", "-n", "1000003"};
+    unsigned char *buf, *expected;
+    size_t generated;
+    int fd;
+
+    fd = mkstemp(path);
+    ck_assert(fd >= 0);
+    close(fd);
+
+    ck_assert(parse_args(12, argv,&config) == EXIT_SUCCESS);
+    ck_assert(config.shards == 3);
+    ck_assert(test_set_aes_stream() == 1);
+    config.output = fopen(path, "wb");
+    ck_assert(config.output != NULL);
+    ck_assert(fwrite("head", 1, 4, config.output) == 4);
+
+    generated=generate(&config);
+    ck_assert(generated == 1000003);
+    ck_assert(fclose(config.output) == 0);
+
+    expected = test_expected_stream(0, 1000003);
+    buf = malloc(1000007);
+    ck_assert(expected != NULL && buf != NULL);
+    config.output = fopen(path, "rb");
+    ck_assert(config.output != NULL);
+    ck_assert(fread(buf, 1, 1000007, config.output) == 1000007);
+    ck_assert(fgetc(config.output) == EOF);
+    ck_assert(memcmp(buf, "head", 4) == 0);
+    ck_assert(memcmp(buf + 4, expected, 1000003) == 0);
+    fclose(config.output);
+
+    unlink(path);
+    free(buf);
+    free(expected);
+    rdrand_clean_aes();
+}
+END_TEST
+
+// The wiped file is the AES stream from the offset, going on with
+// the next stream behind the end of one, and it is verified
+START_TEST (run_amount_generation_wipe)
+{
+    char path[] = "/tmp/rdrand-gen-wipe-XXXXXX";
+    char seek[32];
+    char *argv[] = {"rdrand-gen", "-w", path, "-y", "-k", "keys.txt", "-t", "3", "-s", seek};
+    unsigned long long seeks[] = {5, RDRAND_AES_STREAM_LENGTH - 1000};
+    unsigned char *buf, *expected;
+    size_t generated, j;
+    int fd;
+
+    fd = mkstemp(path);
+    ck_assert(fd >= 0);
+    ck_assert(ftruncate(fd, 1000003) == 0);
+    close(fd);
+    buf = malloc(1000003);
+    ck_assert(buf != NULL);
+
+    for (j = 0; j < sizeof(seeks)/sizeof(seeks[0]); j++)
+    {
+        cnf_t config = DEFAULT_CONFIG_SETTING;
+
+        snprintf(seek, sizeof(seek), "%llu", seeks[j]);
+        optind = 0;
+        ck_assert(parse_args(10, argv,&config) == EXIT_SUCCESS);
+        ck_assert(test_set_aes_stream() == 1);
+
+        // the whole file, in 3 regions
+        generated=generate(&config);
+        ck_assert(generated == 1000003);
+        ck_assert(config.bytes == 1000003);
+
+        expected = test_expected_stream(seeks[j], 1000003);
+        ck_assert(expected != NULL);
+        fd = open(path, O_RDONLY);
+        ck_assert(fd >= 0);
+        ck_assert(read(fd, buf, 1000003) == 1000003);
+        ck_assert(read(fd, buf, 1) == 0);
+        close(fd);
+        ck_assert(memcmp(buf, expected, 1000003) == 0);
+        free(expected);
+        rdrand_clean_aes();
+    }
+
+    // more than the file has
+    {
+        cnf_t config = DEFAULT_CONFIG_SETTING;
+        char *argv_big[] = {"rdrand-gen", "-w", path, "-k", "keys.txt", "-n", "2M"};
+
+        optind = 0;
+        ck_assert(parse_args(7, argv_big,&config) == EXIT_SUCCESS);
+        ck_assert(test_set_aes_stream() == 1);
+        ck_assert(generate(&config) == 0);
+        rdrand_clean_aes();
+    }
+
+    unlink(path);
+    free(buf);
+}
+END_TEST
+
+// Every shard goes to its own file
+START_TEST (run_amount_generation_shards_pattern)
+{
+    cnf_t config = DEFAULT_CONFIG_SETTING;
+    char dir[] = "/tmp/rdrand-gen-shards-XXXXXX";
+    char pattern[64], name[64];
+    char *argv[] = {"rdrand-gen", "-P", pattern, "-t", "4", "-n", "100005"};
+    unsigned char buf[25005];
+    size_t generated, i, len;
+    unsigned int shard;
+    FILE *f;
+
+    ck_assert(mkdtemp(dir) != NULL);
+    snprintf(pattern, sizeof(pattern), "%s/out.%%03d", dir);
+    ck_assert(parse_args(7, argv,&config) == EXIT_SUCCESS);
+    ck_assert(config.shards == 4);
+
+    generated=generate(&config);
+    ck_assert(generated == 100005);
+
+    // ranges of whole 64bit blocks, the last one gets the rest
+    for (shard = 0; shard < 4; shard++) {
+        snprintf(name, sizeof(name), "%s/out.%03u", dir, shard);
+        f = fopen(name, "rb");
+        ck_assert(f != NULL);
+        len = fread(buf, 1, sizeof(buf), f);
+        ck_assert(len == (shard < 3 ? 25000 : 25005));
+        for (i = 0; i < len; i++)
+            ck_assert(buf[i] == 0xff);
+        fclose(f);
+        unlink(name);
+    }
+    rmdir(dir);
+}
+END_TEST
+// }}}
+
 Suite *
 run_suite (void)
 {
@@ -582,6 +1465,18 @@ run_suite (void)
   tcase_add_test (tc, run_amount_generation_16);
   tcase_add_test (tc, run_amount_generation_5);
   tcase_add_test (tc, run_amount_generation_20k);
+  tcase_add_test (tc, run_amount_generation_reseed_tail);
+  tcase_add_test (tc, run_amount_generation_pipeline);
+  tcase_add_test (tc, run_amount_generation_pipeline_aes);
+  tcase_add_test (tc, run_amount_generation_parallel_aes);
+  tcase_add_test (tc, run_amount_generation_many_threads);
+  tcase_add_test (tc, run_amount_generation_splice);
+  tcase_add_test (tc, run_amount_generation_uring);
+  tcase_add_test (tc, run_amount_generation_direct);
+  tcase_add_test (tc, run_amount_generation_shards);
+  tcase_add_test (tc, run_amount_generation_shards_pattern);
+  tcase_add_test (tc, run_amount_generation_mmap);
+  tcase_add_test (tc, run_amount_generation_wipe);
   suite_add_tcase (s, tc);
 
   return s;
@@ -28,6 +28,9 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
 #include <check.h>
 #include "../src/librdrand.h"
 
@@ -139,6 +142,19 @@ START_TEST (rdrand_step_64_stub)
 }
 END_TEST
 
+START_TEST (rdseed_step_64_stub)
+{
+  unsigned char dst[DEST_SIZE] = {0};
+  ck_assert_int_eq (rdseed64_step((uint64_t *)&dst),RDRAND_SUCCESS);
+  
+  // test if it wrote just into the place it should
+  ck_assert(test_zeros(dst, DEST_SIZE, 8, DEST_SIZE));
+  
+  // test if it set all to 1
+  ck_assert(test_ones(dst, DEST_SIZE, 0, 8));
+}
+END_TEST
+
 Suite *
 rdrand_stub_methods_suite (void)
 {
@@ -148,6 +164,7 @@ rdrand_stub_methods_suite (void)
   tcase_add_test (tc_steps, rdrand_step_16_stub);
   tcase_add_test (tc_steps, rdrand_step_32_stub);
   tcase_add_test (tc_steps, rdrand_step_64_stub);
+  tcase_add_test (tc_steps, rdseed_step_64_stub);
   suite_add_tcase (s, tc_steps);
 
   return s;
@@ -206,6 +223,79 @@ START_TEST (rdrand_step_64_native)
 }
 END_TEST
 
+START_TEST (rdseed_step_64_native)
+{
+  unsigned char dst[DEST_SIZE] = {0};
+  int rc, retry;
+
+  if(rdseed_testSupport() != RDRAND_SUPPORTED)
+    return;
+
+  // RDSEED underflows quite often, give it a few chances
+  for(retry = 0; retry < 1000; retry++)
+    if((rc = rdseed64_step_native((uint64_t *)&dst)) == RDRAND_SUCCESS)
+      break;
+  ck_assert_int_eq (rc, RDRAND_SUCCESS);
+  
+  // test if it wrote just into the place it should
+  ck_assert(test_zeros(dst, DEST_SIZE, 8, DEST_SIZE));
+  
+  // test if it wrote something (rarely can fail)
+  TEST_BYTES_PRINT=0;
+  ck_assert_msg(test_zeros(dst, DEST_SIZE, 0, 8)==FALSE, 
+		"This test can rarely fail if rdseed generates a byte all zeros. \
+		Try it once more to be sure.\n");
+  TEST_BYTES_PRINT=1;
+}
+END_TEST
+
+START_TEST (features_probe)
+{
+  unsigned int features = rdrand_get_features();
+
+  // the probe is cached, so it has to be stable
+  ck_assert_int_eq (rdrand_get_features(), features);
+  // and consistent with the support tests
+  ck_assert_int_eq ((features & RDRAND_FEATURE_RDRAND) != 0,
+                    rdrand_testSupport() == RDRAND_SUPPORTED);
+  ck_assert_int_eq ((features & RDRAND_FEATURE_RDSEED) != 0,
+                    rdseed_testSupport() == RDRAND_SUPPORTED);
+  // all AVX-512 parts have AVX2 as well
+  if (features & RDRAND_FEATURE_AVX512F)
+    ck_assert(features & RDRAND_FEATURE_AVX2);
+}
+END_TEST
+
+START_TEST (features_unsupported)
+{
+  unsigned int features = rdrand_get_features();
+  unsigned char dst[DEST_SIZE] = {0};
+  uint16_t x_16;
+  uint32_t x_32;
+  uint64_t x_64;
+
+  // without RDSEED the seed functions fail, RDRAND still works
+  rdrand_bind_features(features & ~RDRAND_FEATURE_RDSEED);
+  ck_assert_int_eq (rdseed_get_uint16_retry(&x_16, RETRY_LIMIT), RDRAND_FAILURE);
+  ck_assert_int_eq (rdseed_get_uint32_retry(&x_32, RETRY_LIMIT), RDRAND_FAILURE);
+  ck_assert_int_eq (rdseed_get_uint64_retry(&x_64, RETRY_LIMIT), RDRAND_FAILURE);
+  ck_assert_int_eq (rdseed_get_uint64_array_retry((uint64_t *)&dst, 1, RETRY_LIMIT), 0);
+  ck_assert_int_eq (rdseed_get_bytes_retry(dst, DEST_SIZE, RETRY_LIMIT), 0);
+  ck_assert(test_zeros(dst, DEST_SIZE, 0, DEST_SIZE));
+  ck_assert_int_eq (rdrand_get_uint64_retry(&x_64, RETRY_LIMIT), RDRAND_SUCCESS);
+
+  // without RDRAND nothing is generated
+  rdrand_bind_features(0);
+  ck_assert_int_eq (rdrand_get_uint16_retry(&x_16, RETRY_LIMIT), RDRAND_FAILURE);
+  ck_assert_int_eq (rdrand_get_uint64_retry(&x_64, RETRY_LIMIT), RDRAND_FAILURE);
+  ck_assert_int_eq (rdrand_get_bytes_retry(dst, DEST_SIZE, RETRY_LIMIT), 0);
+  ck_assert(test_zeros(dst, DEST_SIZE, 0, DEST_SIZE));
+
+  rdrand_bind_features(features);
+  ck_assert_int_eq (rdseed_get_uint64_retry(&x_64, RETRY_LIMIT), RDRAND_SUCCESS);
+}
+END_TEST
+
 Suite *
 rdrand_native_steps_methods_suite (void)
 {
@@ -215,6 +305,9 @@ rdrand_native_steps_methods_suite (void)
   tcase_add_test (tc_steps, rdrand_step_16_native);
   tcase_add_test (tc_steps, rdrand_step_32_native);
   tcase_add_test (tc_steps, rdrand_step_64_native);
+  tcase_add_test (tc_steps, rdseed_step_64_native);
+  tcase_add_test (tc_steps, features_probe);
+  tcase_add_test (tc_steps, features_unsupported);
   suite_add_tcase (s, tc_steps);
 
   return s;
@@ -513,6 +606,74 @@ START_TEST (array_64)
 END_TEST
 
 
+START_TEST (array_64_groups)
+{
+  // more than a few whole groups of the bulk kernel and an odd tail
+  unsigned int words=21;
+  unsigned int size=words*8;
+  
+  unsigned char dst[21*8+8] = {0};
+  ck_assert_int_eq (rdrand_get_uint64_array_retry((uint64_t *)&dst, words, RETRY_LIMIT), words);
+  // test if it wrote just into the place it should
+  ck_assert(test_zeros(dst, sizeof(dst), size, sizeof(dst)));
+  // test if it wrote something (rarely can fail)
+  ck_assert(test_ones(dst, sizeof(dst), 0, size));
+}
+END_TEST
+
+
+START_TEST (array_long)
+{
+  // size_t variants, counts with odd heads before the 64 bit part
+  unsigned int size=23*2;
+  unsigned char dst[23*2+8] = {0};
+
+  ck_assert_int_eq (rdrand_get_uint16_array_retry_long((uint16_t *)&dst, 23, RETRY_LIMIT), 23);
+  ck_assert(test_zeros(dst, sizeof(dst), size, sizeof(dst)));
+  ck_assert(test_ones(dst, sizeof(dst), 0, size));
+
+  memset(dst, 0, sizeof(dst));
+  size=11*4;
+  ck_assert_int_eq (rdrand_get_uint32_array_retry_long((uint32_t *)&dst, 11, RETRY_LIMIT), 11);
+  ck_assert(test_zeros(dst, sizeof(dst), size, sizeof(dst)));
+  ck_assert(test_ones(dst, sizeof(dst), 0, size));
+
+  memset(dst, 0, sizeof(dst));
+  size=5*8;
+  ck_assert_int_eq (rdrand_get_uint64_array_retry_long((uint64_t *)&dst, 5, RETRY_LIMIT), 5);
+  ck_assert(test_zeros(dst, sizeof(dst), size, sizeof(dst)));
+  ck_assert(test_ones(dst, sizeof(dst), 0, size));
+}
+END_TEST
+
+
+START_TEST (array_rdseed)
+{
+  unsigned int size=ARRAY_SIZE-1;
+  unsigned int offset=3;
+  
+  /* 64bit values */
+  {{{
+	  unsigned char dst[ARRAY_SIZE] = {0};
+	  ck_assert_int_eq (rdseed_get_uint64_array_retry((uint64_t *)&dst, size/8, RETRY_LIMIT), size/8);
+	  // test if it wrote just into the place it should
+	  ck_assert(test_zeros(dst, ARRAY_SIZE, size, ARRAY_SIZE));
+	  ck_assert(test_ones(dst, ARRAY_SIZE, 0, size));
+  }}}	
+  
+  /* unaligned bytes with a tail */
+  {{{
+	  unsigned char dst[ARRAY_SIZE] = {0};
+	  ck_assert_int_eq (rdseed_get_bytes_retry(dst+offset, size/2+1, RETRY_LIMIT), size/2+1);
+	  // test if it wrote just into the place it should
+	  ck_assert(test_zeros(dst, ARRAY_SIZE, 0, offset));
+	  ck_assert(test_zeros(dst, ARRAY_SIZE, offset+size/2+1, ARRAY_SIZE));
+	  ck_assert(test_ones(dst, ARRAY_SIZE, offset, offset+size/2+1));
+  }}}	
+}
+END_TEST
+
+
 START_TEST (array_reseed_delay_64)
 {
   unsigned int size=ARRAY_SIZE-1;
@@ -598,6 +759,84 @@ START_TEST (array_reseed_skip_64)
 END_TEST
 
 
+// The values are made by a CTR_DRBG from the stub RdSeed, so they
+// are not the stub ones, and every block of 128 has a seed of its own
+START_TEST (array_reseed_rdseed_64)
+{
+  unsigned int size=ARRAY_SIZE-1;
+  uint64_t big[300] = {0};
+  unsigned int i, zeros = 0;
+
+  unsigned char dst[ARRAY_SIZE] = {0};
+  ck_assert_int_eq (rdrand_get_uint64_array_reseed_rdseed((uint64_t *)&dst, size/8, RETRY_LIMIT), size/8);
+  // test if it wrote just into the place it should
+  ck_assert(test_zeros(dst, ARRAY_SIZE, size, ARRAY_SIZE));
+  // test if it wrote something (rarely can fail)
+  TEST_BYTES_PRINT=0;
+  ck_assert(!test_zeros(dst, ARRAY_SIZE, 0, size));
+  ck_assert(!test_ones(dst, ARRAY_SIZE, 0, size));
+  TEST_BYTES_PRINT=1;
+
+  // more blocks, the last one partial
+  ck_assert_int_eq (rdrand_get_uint64_array_reseed_rdseed(big, 300, RETRY_LIMIT), 300);
+  for (i = 0; i < 300; i++)
+    zeros += big[i] == 0;
+  ck_assert(zeros == 0);
+  ck_assert(memcmp(big, big + 128, 128*sizeof(uint64_t)) != 0);
+  ck_assert(memcmp(big + 128, big + 256, 44*sizeof(uint64_t)) != 0);
+}
+END_TEST
+
+
+#define WRITE_SIZE (1024*1024 + 5)
+
+/**
+ * Read the whole file back and check it is all ones.
+ */
+int test_written(int fd, size_t size)
+{
+  unsigned char *buf = calloc(size + 1, 1);
+  ssize_t rc;
+  size_t got = 0;
+  int ok;
+
+  if (buf == NULL || lseek(fd, 0, SEEK_SET) != 0)
+    return FALSE;
+  while ((rc = read(fd, buf + got, size + 1 - got)) > 0)
+    got += rc;
+  ok = got == size && test_ones(buf, size, 0, size);
+  free(buf);
+  return ok;
+}
+
+START_TEST (write_fwrite)
+{
+  FILE *f = tmpfile();
+
+  ck_assert(f != NULL);
+  ck_assert_int_eq (rdrand_fwrite(f, WRITE_SIZE, RETRY_LIMIT), WRITE_SIZE);
+  ck_assert_int_eq (rdrand_fwrite(f, 0, RETRY_LIMIT), 0);
+  fflush(f);
+  ck_assert(test_written(fileno(f), WRITE_SIZE));
+  fclose(f);
+}
+END_TEST
+
+START_TEST (write_fd)
+{
+  FILE *f = tmpfile();
+
+  ck_assert(f != NULL);
+  ck_assert_int_eq (rdrand_write_fd(fileno(f), WRITE_SIZE, RETRY_LIMIT), WRITE_SIZE);
+  ck_assert_int_eq (rdrand_write_fd(fileno(f), 7, RETRY_LIMIT), 7);
+  ck_assert(test_written(fileno(f), WRITE_SIZE + 7));
+  // nothing can be written to an invalid descriptor
+  ck_assert_int_eq (rdrand_write_fd(-1, WRITE_SIZE, RETRY_LIMIT), 0);
+  fclose(f);
+}
+END_TEST
+
+
 Suite *
 arrays_suite (void)
 {
@@ -608,9 +847,275 @@ arrays_suite (void)
   tcase_add_test (tc_steps, array_16);
   tcase_add_test (tc_steps, array_32);
   tcase_add_test (tc_steps, array_64);
+  tcase_add_test (tc_steps, array_64_groups);
+  tcase_add_test (tc_steps, array_long);
+  tcase_add_test (tc_steps, array_rdseed);
   tcase_add_test (tc_steps, array_bytes);
   tcase_add_test (tc_steps, array_reseed_delay_64);
   tcase_add_test (tc_steps, array_reseed_skip_64);
+  tcase_add_test (tc_steps, array_reseed_rdseed_64);
+  tcase_add_test (tc_steps, write_fwrite);
+  tcase_add_test (tc_steps, write_fd);
+  suite_add_tcase (s, tc_steps);
+
+  return s;
+}
+
+/** *******************************************************************/
+/**             POOL                                                  */
+/** *******************************************************************/
+
+START_TEST (pool_values)
+{
+  uint64_t u64 = 0;
+  uint32_t u32 = 0;
+
+  rdrand_pool_flush();
+  ck_assert_int_eq (rdrand_pool_available(), 0);
+  ck_assert_int_eq (rdrand_pool_get_u64(&u64), RDRAND_SUCCESS);
+  ck_assert(test_ones((unsigned char *)&u64, sizeof(u64), 0, sizeof(u64)));
+  ck_assert_int_eq (rdrand_pool_available(), RDRAND_POOL_DEFAULT_SIZE - 8);
+  ck_assert_int_eq (rdrand_pool_get_u32(&u32), RDRAND_SUCCESS);
+  ck_assert(test_ones((unsigned char *)&u32, sizeof(u32), 0, sizeof(u32)));
+  ck_assert_int_eq (rdrand_pool_available(), RDRAND_POOL_DEFAULT_SIZE - 12);
+  rdrand_pool_flush();
+  ck_assert_int_eq (rdrand_pool_available(), 0);
+}
+END_TEST
+
+START_TEST (pool_bytes)
+{
+  unsigned int size=ARRAY_SIZE-1;
+  unsigned char dst[ARRAY_SIZE] = {0};
+  unsigned char big[RDRAND_POOL_DEFAULT_SIZE + 1] = {0};
+  int i;
+
+  // small pool, so the draws go across refills
+  ck_assert_int_eq (rdrand_pool_set_size(128), RDRAND_SUCCESS);
+  for (i = 0; i < 5; i++)
+  {
+    memset(dst, 0, ARRAY_SIZE);
+    ck_assert_int_eq (rdrand_pool_get_bytes(dst, size - i), size - i);
+    ck_assert(test_zeros(dst, ARRAY_SIZE, size - i, ARRAY_SIZE));
+    ck_assert(test_ones(dst, ARRAY_SIZE, 0, size - i));
+  }
+  // bigger than the pool, generated directly
+  ck_assert_int_eq (rdrand_pool_get_bytes(big, RDRAND_POOL_DEFAULT_SIZE), RDRAND_POOL_DEFAULT_SIZE);
+  ck_assert(test_zeros(big, sizeof(big), RDRAND_POOL_DEFAULT_SIZE, sizeof(big)));
+  ck_assert(test_ones(big, sizeof(big), 0, RDRAND_POOL_DEFAULT_SIZE));
+
+  ck_assert_int_eq (rdrand_pool_set_size(0), RDRAND_FAILURE);
+  ck_assert_int_eq (rdrand_pool_set_size(100), RDRAND_FAILURE);
+  ck_assert_int_eq (rdrand_pool_set_size(RDRAND_POOL_MAX_SIZE + 64), RDRAND_FAILURE);
+  ck_assert_int_eq (rdrand_pool_set_size(RDRAND_POOL_DEFAULT_SIZE), RDRAND_SUCCESS);
+}
+END_TEST
+
+START_TEST (pool_fork)
+{
+  uint64_t u64;
+  pid_t pid;
+  int status;
+
+  ck_assert_int_eq (rdrand_pool_get_u64(&u64), RDRAND_SUCCESS);
+  ck_assert(rdrand_pool_available() > 0);
+
+  pid = fork();
+  ck_assert(pid >= 0);
+  if (pid == 0)
+    _exit(rdrand_pool_available() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+  ck_assert_int_eq (waitpid(pid, &status, 0), pid);
+  ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+  // the parent keeps its pool
+  ck_assert(rdrand_pool_available() > 0);
+}
+END_TEST
+
+static void *pool_thread(void *arg)
+{
+  uint64_t *value = arg;
+
+  if (rdrand_pool_get_u64(value) != RDRAND_SUCCESS)
+    return NULL;
+  return value;
+}
+
+START_TEST (pool_threads)
+{
+  pthread_t threads[4];
+  uint64_t values[4] = {0};
+  void *ret;
+  int i;
+
+  for (i = 0; i < 4; i++)
+    ck_assert_int_eq (pthread_create(&threads[i], NULL, pool_thread, &values[i]), 0);
+  for (i = 0; i < 4; i++)
+  {
+    ck_assert_int_eq (pthread_join(threads[i], &ret), 0);
+    ck_assert(ret == &values[i]);
+    ck_assert(values[i] == UINT64_MAX);
+  }
+}
+END_TEST
+
+
+Suite *
+pool_suite (void)
+{
+  Suite *s = suite_create ("Pool suite");
+
+  TCase *tc_steps = tcase_create ("pool");
+  tcase_add_test (tc_steps, pool_values);
+  tcase_add_test (tc_steps, pool_bytes);
+  tcase_add_test (tc_steps, pool_fork);
+  tcase_add_test (tc_steps, pool_threads);
+  suite_add_tcase (s, tc_steps);
+
+  return s;
+}
+
+/** *******************************************************************/
+/**             PARALLEL                                              */
+/** *******************************************************************/
+
+#define PARALLEL_SIZE (4*1024*1024 + 13)
+
+START_TEST (parallel_fill)
+{
+  unsigned char *dst = calloc(PARALLEL_SIZE + 8, 1);
+  unsigned int threads;
+
+  ck_assert(dst != NULL);
+  for (threads = 0; threads <= 5; threads++)
+  {
+    memset(dst, 0, PARALLEL_SIZE + 8);
+    // unaligned start and end
+    ck_assert_int_eq (rdrand_fill_parallel(dst + 3, PARALLEL_SIZE, threads, RETRY_LIMIT), PARALLEL_SIZE);
+    ck_assert(test_zeros(dst, PARALLEL_SIZE + 8, 0, 3));
+    ck_assert(test_zeros(dst, PARALLEL_SIZE + 8, PARALLEL_SIZE + 3, PARALLEL_SIZE + 8));
+    ck_assert(test_ones(dst, PARALLEL_SIZE + 8, 3, PARALLEL_SIZE + 3));
+  }
+  free(dst);
+}
+END_TEST
+
+START_TEST (parallel_fill_small)
+{
+  unsigned int size=ARRAY_SIZE-1;
+  unsigned char dst[ARRAY_SIZE] = {0};
+
+  // too small to be split, filled by the calling thread
+  ck_assert_int_eq (rdrand_fill_parallel(dst, size, 8, RETRY_LIMIT), size);
+  ck_assert(test_zeros(dst, ARRAY_SIZE, size, ARRAY_SIZE));
+  ck_assert(test_ones(dst, ARRAY_SIZE, 0, size));
+  ck_assert_int_eq (rdrand_fill_parallel(dst, 0, 8, RETRY_LIMIT), 0);
+}
+END_TEST
+
+START_TEST (parallel_fill_fork)
+{
+  unsigned char *dst = calloc(PARALLEL_SIZE, 1);
+  pid_t pid;
+  int status;
+
+  ck_assert(dst != NULL);
+  // start the workers, then check the child can start its own
+  ck_assert_int_eq (rdrand_fill_parallel(dst, PARALLEL_SIZE, 4, RETRY_LIMIT), PARALLEL_SIZE);
+  pid = fork();
+  ck_assert(pid >= 0);
+  if (pid == 0)
+  {
+    memset(dst, 0, PARALLEL_SIZE);
+    _exit(rdrand_fill_parallel(dst, PARALLEL_SIZE, 4, RETRY_LIMIT) == PARALLEL_SIZE &&
+        test_ones(dst, PARALLEL_SIZE, 0, PARALLEL_SIZE) ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  ck_assert_int_eq (waitpid(pid, &status, 0), pid);
+  ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+  free(dst);
+}
+END_TEST
+
+
+Suite *
+parallel_suite (void)
+{
+  Suite *s = suite_create ("Parallel suite");
+
+  TCase *tc_steps = tcase_create ("parallel");
+  tcase_add_test (tc_steps, parallel_fill);
+  tcase_add_test (tc_steps, parallel_fill_small);
+  tcase_add_test (tc_steps, parallel_fill_fork);
+  suite_add_tcase (s, tc_steps);
+
+  return s;
+}
+
+/** *******************************************************************/
+/**             AUTOTUNE                                              */
+/** *******************************************************************/
+
+START_TEST (autotune_sizes)
+{
+  rdrand_tune_t tune = { .threads = 2, .rekey_interval = 1024 };
+
+  ck_assert_int_eq (rdrand_autotune(&tune), RDRAND_SUCCESS);
+  ck_assert(tune.chunk_size >= RDRAND_TUNE_MIN_CHUNK && tune.chunk_size <= RDRAND_TUNE_MAX_CHUNK);
+  ck_assert((tune.chunk_size & (tune.chunk_size - 1)) == 0);
+  // no bigger than a key encrypts
+  ck_assert(tune.aes_buffer_size >= RDRAND_TUNE_MIN_AES_BUFFER && tune.aes_buffer_size <= 1024);
+  ck_assert(tune.chunk_rate > 0 && tune.aes_rate > 0);
+}
+END_TEST
+
+START_TEST (autotune_file)
+{
+  rdrand_tune_t tune = { .threads = 3, .chunk_size = 64*1024, .aes_buffer_size = 4096,
+      .chunk_rate = 1e9, .aes_rate = 2e9 };
+  rdrand_tune_t loaded = { .threads = 3 };
+  char path[] = "/tmp/librdrand-tune-XXXXXX";
+  FILE *f;
+  int fd;
+
+  fd = mkstemp(path);
+  ck_assert(fd >= 0);
+  close(fd);
+
+  ck_assert_int_eq (rdrand_tune_save(&tune, path), RDRAND_SUCCESS);
+  ck_assert_int_eq (rdrand_tune_load(&loaded, path), RDRAND_SUCCESS);
+  ck_assert(loaded.chunk_size == tune.chunk_size);
+  ck_assert(loaded.aes_buffer_size == tune.aes_buffer_size);
+  ck_assert(loaded.aes_rate == tune.aes_rate);
+
+  // made for other settings
+  loaded.threads = 4;
+  ck_assert_int_eq (rdrand_tune_load(&loaded, path), RDRAND_FAILURE);
+  loaded.threads = 3;
+  loaded.rekey_interval = 100;
+  ck_assert_int_eq (rdrand_tune_load(&loaded, path), RDRAND_FAILURE);
+
+  // made on another CPU
+  f = fopen(path, "a");
+  ck_assert(f != NULL);
+  fprintf(f, "cpu another\n");
+  fclose(f);
+  loaded.rekey_interval = 0;
+  ck_assert_int_eq (rdrand_tune_load(&loaded, path), RDRAND_FAILURE);
+
+  unlink(path);
+  ck_assert_int_eq (rdrand_tune_load(&loaded, path), RDRAND_FAILURE);
+}
+END_TEST
+
+
+Suite *
+autotune_suite (void)
+{
+  Suite *s = suite_create ("Autotune suite");
+
+  TCase *tc_steps = tcase_create ("autotune");
+  tcase_add_test (tc_steps, autotune_sizes);
+  tcase_add_test (tc_steps, autotune_file);
   suite_add_tcase (s, tc_steps);
 
   return s;
@@ -644,6 +1149,15 @@ int main (void){
   s = arrays_suite ();
   srunner_add_suite(sr, s);
   
+  s = pool_suite ();
+  srunner_add_suite(sr, s);
+  
+  s = parallel_suite ();
+  srunner_add_suite(sr, s);
+  
+  s = autotune_suite ();
+  srunner_add_suite(sr, s);
+  
   srunner_run_all (sr, CK_NORMAL);
   number_failed = srunner_ntests_failed (sr);
   srunner_free (sr);
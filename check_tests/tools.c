@@ -7,6 +7,7 @@
 #include <sys/stat.h> 
 #include <fcntl.h>
 #include "tools.h"
+#include "../src/librdrand-aes.h"
 
 void mem_dump(unsigned char *mem, unsigned int length) {
     unsigned i;
@@ -66,3 +67,87 @@ void stdout_restore(){
     dup2(stdout_bak, 1);
     close(stdout_bak);
 }
+
+// {{{ AES fixtures
+static unsigned char test_key[16], test_nonce[8];
+
+static void test_key_setup(void) {
+    size_t i;
+
+    for (i = 0; i < sizeof(test_key); i++)
+        test_key[i] = i;
+    for (i = 0; i < sizeof(test_nonce); i++)
+        test_nonce[i] = 0xa0 + i;
+}
+
+int test_set_aes_keys(void) {
+    unsigned char *keys[1] = {test_key}, *nonces[1] = {test_nonce};
+
+    test_key_setup();
+    return rdrand_set_aes_keys(1, sizeof(test_key), keys, nonces);
+}
+
+int test_set_aes_stream(void) {
+    test_key_setup();
+    return rdrand_set_aes_stream(sizeof(test_key), test_key, test_nonce);
+}
+
+unsigned char *test_expected_chunks(size_t chunk_bytes, size_t chunks,
+        size_t ending_bytes, unsigned int streams) {
+    rdrand_aes_ctx_t *aes[streams];
+    unsigned char *expected;
+    size_t seq, len = chunks*chunk_bytes + ending_bytes;
+    unsigned int i;
+    int ok = 1;
+
+    expected = malloc(len);
+    if (expected == NULL)
+        return NULL;
+    memset(expected, 0xff, len);
+    for (i = 0; i < streams; i++)
+        if ((aes[i] = rdrand_aes_split(i)) == NULL)
+            ok = 0;
+    for (seq = 0; ok && seq < chunks; seq++)
+        ok = rdrand_aes_ctx_enc_buffer(aes[seq % streams],
+                expected + seq*chunk_bytes, expected + seq*chunk_bytes, chunk_bytes);
+    if (ok)
+        ok = rdrand_aes_ctx_enc_buffer(aes[0],
+                expected + seq*chunk_bytes, expected + seq*chunk_bytes, ending_bytes);
+    for (i = 0; i < streams; i++)
+        if (aes[i] != NULL)
+            rdrand_aes_ctx_destroy(aes[i]);
+    if (!ok) {
+        free(expected);
+        return NULL;
+    }
+    return expected;
+}
+
+unsigned char *test_expected_stream(unsigned long long offset, size_t len) {
+    rdrand_aes_ctx_t *ks;
+    unsigned char *expected;
+    size_t first;
+    int ok;
+
+    expected = malloc(len);
+    if (expected == NULL)
+        return NULL;
+    first = RDRAND_AES_STREAM_LENGTH - offset < len ? RDRAND_AES_STREAM_LENGTH - offset : len;
+    ks = rdrand_aes_split(0);
+    ok = ks != NULL && rdrand_aes_ctx_seek(ks, offset) == 1
+        && rdrand_aes_ctx_keystream(ks, expected, first) == first;
+    if (ks != NULL)
+        rdrand_aes_ctx_destroy(ks);
+    if (ok && first < len) {
+        ks = rdrand_aes_split(1);
+        ok = ks != NULL && rdrand_aes_ctx_keystream(ks, expected + first, len - first) == len - first;
+        if (ks != NULL)
+            rdrand_aes_ctx_destroy(ks);
+    }
+    if (!ok) {
+        free(expected);
+        return NULL;
+    }
+    return expected;
+}
+// }}}
@@ -13,5 +13,26 @@ void dump_hex_byte_string (const unsigned char* data, const unsigned int size, c
 void stdout_to_null();
 void stdout_restore();
 
+/**
+ * Fixture of the rdrand-gen AES tests: the key is 0, 1, 2, ...,
+ * the nonce 0xa0, 0xa1, ...
+ */
+int test_set_aes_keys(void);
+int test_set_aes_stream(void);
+
+/**
+ * Output of the stub (only ones) encrypted as rdrand-gen does it:
+ * the chunk i by the stream i%streams, the ending bytes by the stream 0.
+ * Returns a malloc'd buffer of chunks*chunk_bytes + ending_bytes bytes.
+ */
+unsigned char *test_expected_chunks(size_t chunk_bytes, size_t chunks,
+        size_t ending_bytes, unsigned int streams);
+
+/**
+ * len bytes of the keystream of the stream 0 from the offset,
+ * going on with the stream 1 behind its end. Returns a malloc'd buffer.
+ */
+unsigned char *test_expected_stream(unsigned long long offset, size_t len);
+
 #endif // CHECK_TOOLS_H
 
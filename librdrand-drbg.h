@@ -0,0 +1 @@
+src/librdrand-drbg.h
\ No newline at end of file
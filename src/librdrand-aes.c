@@ -27,9 +27,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <openssl/rand.h>
 #include <openssl/evp.h>
 #include "./librdrand.h"
+#include "./librdrand.private.h"
 #include "./librdrand-aes.private.h"
 #include "./librdrand-aes.h"
 
@@ -48,6 +51,29 @@
 
 aes_cfg_t AES_CFG = {.keys={.amount=0}};
 
+// RdRand bytes encrypted at once by the native kernels
+#define AES_FUSED_GROUP 256
+
+// Random key material generated at once, enough for about
+// a hundred key changes (key, nonce and interval)
+#define AES_RESERVE_SIZE 4096
+
+// RdSeed is tried only a few times, then RdRand takes over
+#define AES_RESERVE_RDSEED_RETRY 8
+
+// A key and its nonce share one cache line
+#define AES_KEY_SLOT (2*RDRAND_MAX_KEY_LENGTH)
+
+// Random keys prepared at once, see aes_cfg_t.cycle
+#define AES_RANDOM_KEYS_CYCLE 8
+
+static const char *CIPHER_NAMES[RDRAND_CIPHER_COUNT] = {
+    "aes128-ctr",
+    "aes256-ctr",
+    "chacha20"
+};
+
+
 /**
  * Test if number is power of two.
  * http://stackoverflow.com/questions/600293/how-to-check-if-a-number-is-a-power-of-2
@@ -57,19 +83,417 @@ aes_cfg_t AES_CFG = {.keys={.amount=0}};
 int isPowerOfTwo(ulong x) {
     return x && (x & (x - 1)) == 0;
 }
-// bind current key to openssl, return 0 on failure
-int key_to_openssl() {
-    if ( EVP_CipherInit_ex( 
-                AES_CFG.en,
-                EVP_aes_128_ctr(),
-                NULL,
-                AES_CFG.keys.key_current,
-                AES_CFG.keys.nonce_current,
-                1 ) != 1 ) { 
+/**
+ * The AES_KERNEL_* kernel used by the context.
+ */
+static int aes_ctx_kernel(const aes_cfg_t *ctx) {
+    if (ctx->kernel == AES_KERNEL_AUTO)
+        return ctx->cipher == RDRAND_CIPHER_CHACHA20 ? chacha_native_best() : aes_native_best();
+    return ctx->kernel;
+}
+
+/**
+ * Check if the kernel implements the cipher and the CPU supports it.
+ */
+static int cipher_kernel_supported(int cipher, int kernel) {
+    if (cipher == RDRAND_CIPHER_CHACHA20)
+        return chacha_native_supported(kernel);
+    return aes_native_supported(kernel);
+}
+
+/**
+ * Encrypt by the native kernel, whichever cipher it implements.
+ */
+static void native_update(aes_native_t *n, int kernel, void *dest, const void *src, size_t len) {
+    if (kernel == AES_KERNEL_CHACHA_AVX2 || kernel == AES_KERNEL_CHACHA_AVX512)
+        chacha_native_xor(n, kernel, dest, src, len);
+    else
+        aes_native_ctr(n, kernel, dest, src, len);
+}
+
+static const EVP_CIPHER *cipher_evp(int cipher) {
+    switch (cipher) {
+        case RDRAND_CIPHER_AES256_CTR:
+            return EVP_aes_256_ctr();
+        case RDRAND_CIPHER_CHACHA20:
+            return EVP_chacha20();
+    }
+    return EVP_aes_128_ctr();
+}
+
+/**
+ * Make the IV of the cipher from a counter block, which is a nonce
+ * and a 64 bit big endian block counter for every cipher. ChaCha20
+ * takes the block counter first and little endian.
+ */
+static void cipher_iv(int cipher, const unsigned char *block, unsigned char *iv) {
+    int i;
+
+    if (cipher != RDRAND_CIPHER_CHACHA20) {
+        memcpy(iv, block, 16);
+        return;
+    }
+    for (i = 0; i < 8; i++)
+        iv[i] = block[15 - i];
+    memcpy(iv + 8, block, 8);
+}
+
+/**
+ * Check the length of given keys: AES-128 takes 8 (padded by zeros)
+ * or 16 bytes, the other ciphers their whole key.
+ */
+static int cipher_key_length_valid(int cipher, size_t key_length) {
+    if (cipher == RDRAND_CIPHER_AES128_CTR)
+        return key_length > RDRAND_MIN_KEY_LENGTH && key_length <= DEFAULT_KEY_LEN;
+    return key_length == rdrand_cipher_key_length(cipher);
+}
+
+/**
+ * Bytes of the nonce of a given key: half of the key, but the block
+ * counter keeps the second half of the IV.
+ */
+static size_t aes_nonce_length(size_t key_length) {
+    return key_length/2 < RDRAND_MAX_NONCE_LENGTH ? key_length/2 : RDRAND_MAX_NONCE_LENGTH;
+}
+
+/**
+ * Bytes encrypted by one key of the context.
+ */
+static unsigned int aes_ctx_rekey_interval(const aes_cfg_t *ctx) {
+    return ctx->rekey_interval ? ctx->rekey_interval : MAX_COUNTER;
+}
+
+/**
+ * Bytes encrypted between two checks of the key counter: the buffer
+ * size of the context, but not more than one key encrypts.
+ */
+static size_t aes_ctx_buffer_size(const aes_cfg_t *ctx) {
+    size_t size = ctx->buffer_size ? ctx->buffer_size : MAX_BUFFER_SIZE;
+
+    if (ctx->keys_type != KEYS_STREAM && size > aes_ctx_rekey_interval(ctx))
+        size = aes_ctx_rekey_interval(ctx);
+    return size;
+}
+
+// {{{ secure arena
+/**
+ * Map len bytes for key material: page aligned, zeroed, locked and
+ * excluded from core dumps, with a guard page on both sides, so an
+ * overrun faults instead of reading or writing the keys.
+ * Return the usable memory, or NULL on failure.
+ */
+void *keys_arena_create(aes_arena_t *a, size_t len) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t usable = (len + page - 1) / page * page;
+    unsigned char *base;
+
+    base = mmap(NULL, usable + 2*page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base, page, PROT_NONE) != 0
+            || mprotect(base + page + usable, page, PROT_NONE) != 0) {
+        munmap(base, usable + 2*page);
+        return NULL;
+    }
+#ifdef MADV_DONTDUMP
+    madvise(base + page, usable, MADV_DONTDUMP);
+#endif
+    // one lock for everything, a failure is only a warning
+    keys_mem_lock(base + page, usable);
+
+    a->base = base;
+    a->size = usable + 2*page;
+    return base + page;
+}
+
+/**
+ * Zeroize the whole arena at once, unlock and unmap it.
+ */
+void keys_arena_destroy(aes_arena_t *a) {
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (a->base == NULL)
+        return;
+    keys_mem_unlock(a->base + page, a->size - 2*page);
+    munmap(a->base, a->size);
+    a->base = NULL;
+    a->size = 0;
+}
+// }}} secure arena
+
+// {{{ key material reserve
+/** incremented in the child after fork, see reserve_take */
+static unsigned long reserve_generation = 0;
+static pthread_once_t reserve_once = PTHREAD_ONCE_INIT;
+
+static void reserve_atfork_child(void) {
+    reserve_generation++;
+}
+
+static void reserve_init_once(void) {
+    pthread_atfork(NULL, NULL, reserve_atfork_child);
+}
+
+/**
+ * Fill the buffer by RdSeed, and by RdRand when RdSeed runs dry.
+ * Returns the number of bytes generated from the beginning of buf.
+ */
+static size_t reserve_fill_cpu(unsigned char *buf, size_t len) {
+#ifdef STUB_RDRAND
+    // the stubs give the same values every time, all keys would be the same
+    (void) buf;
+    (void) len;
+    return 0;
+#else
+    unsigned int features = rdrand_get_features();
+    size_t done = 0;
+
+    if (features & RDRAND_FEATURE_RDSEED)
+        done = rdseed_get_bytes_retry(buf, len, AES_RESERVE_RDSEED_RETRY);
+    if (done < len && (features & RDRAND_FEATURE_RDRAND))
+        done += rdrand_get_bytes_retry(buf + done, len - done, -1);
+    return done;
+#endif
+}
+
+/**
+ * Generate a new batch of key material into the reserve of the context.
+ * Whatever the CPU can't give is generated by OpenSSL.
+ * Return 0 on failure.
+ */
+static int reserve_refill(aes_reserve_t *r) {
+    size_t done;
+
+    pthread_once(&reserve_once, reserve_init_once);
+    if (r->buf == NULL) {
+        r->buf = keys_arena_create(&r->arena, AES_RESERVE_SIZE);
+        if (r->buf == NULL)
+            return 0;
+    }
+    r->pos = 0;
+    r->avail = 0;
+    r->generation = reserve_generation;
+
+    done = reserve_fill_cpu(r->buf, AES_RESERVE_SIZE);
+    if (done < AES_RESERVE_SIZE
+            && RAND_bytes(r->buf + done, AES_RESERVE_SIZE - done) != 1) {
+        rdrand_wipe(r->buf, AES_RESERVE_SIZE);
+        return 0;
+    }
+    r->avail = AES_RESERVE_SIZE;
+    return 1;
+}
+
+/**
+ * Take len bytes of key material from the reserve of the context.
+ * A reserve generated before fork is thrown away, so the parent and
+ * the child never get the same keys.
+ * Return 0 on failure.
+ */
+static int reserve_take(aes_cfg_t *ctx, void *dest, size_t len) {
+    aes_reserve_t *r = &ctx->reserve;
+
+    if (r->avail - r->pos < len || r->generation != reserve_generation) {
+        if (r->buf != NULL)
+            rdrand_wipe(r->buf, AES_RESERVE_SIZE);
+        if (reserve_refill(r) == 0)
+            return 0;
+    }
+    memcpy(dest, r->buf + r->pos, len);
+    memset(r->buf + r->pos, 0, len);
+    r->pos += len;
+    return 1;
+}
+
+/**
+ * Wipe and free the reserve of the context.
+ */
+static void reserve_free(aes_reserve_t *r) {
+    keys_arena_destroy(&r->arena);
+    memset(r, 0, sizeof(*r));
+}
+// }}} key material reserve
+
+// {{{ key schedules
+/**
+ * Make a schedule of the key and nonce: expand the key for the kernel
+ * of the context and set the counter to the nonce.
+ * Return 0 on failure.
+ */
+static int schedule_set(aes_cfg_t *ctx, aes_schedule_t *s,
+        const unsigned char *key, const unsigned char *nonce) {
+    unsigned char iv[16];
+    int result = 1;
+
+    memset(s->key, 0, sizeof(s->key));
+    memset(s->nonce, 0, sizeof(s->nonce));
+    memcpy(s->key, key, ctx->keys.key_length);
+    memcpy(s->nonce, nonce, ctx->keys.key_length);
+    cipher_iv(ctx->cipher, s->nonce, iv);
+
+    // the native kernels start from the same key and counter as OpenSSL
+    if (aes_ctx_kernel(ctx) != AES_KERNEL_EVP) {
+        if (ctx->cipher == RDRAND_CIPHER_CHACHA20)
+            result = chacha_native_set_key(&s->native, s->key, iv);
+        else
+            result = aes_native_set_key(&s->native, s->key,
+                    ctx->cipher == RDRAND_CIPHER_AES256_CTR ? 256 : 128, iv);
+    } else if (s->en == NULL && (s->en = EVP_CIPHER_CTX_new()) == NULL) {
+        result = 0;
+    } else if ( EVP_CipherInit_ex(s->en, cipher_evp(ctx->cipher), NULL, s->key, iv, 1) != 1 ) {
         // enc=1 => encryption, enc=0 => decryption
         perror("EVP_CipherInit_ex");
+        result = 0;
+    }
+    rdrand_wipe(iv, sizeof(iv));
+    return result;
+}
+
+/**
+ * Get len bytes, 64 at most, of keystream of the schedule from the
+ * last blocks before the low 32 bits of the counter wrap, e.g. from
+ * xxxxxxxx xxxxxxxx xxxxxxxx fffffffe for two AES blocks. The data
+ * never gets there, the low 32 bits of the counter of a given key
+ * start at zero and RDRAND_AES_MAX_REKEY_INTERVAL bytes are far less
+ * than 2^32 blocks.
+ * The expanded key of the schedule is used as it is, only the counter
+ * moves. The schedule must not have encrypted anything yet: the EVP
+ * one is put back to the start of its data.
+ * Return 0 on failure.
+ */
+static int schedule_reserved_keystream(aes_cfg_t *ctx, aes_schedule_t *s,
+        unsigned char *ks, size_t len) {
+    static const unsigned char zero[64];
+    unsigned char block[16], iv[16];
+    aes_native_t native;
+    int kernel = aes_ctx_kernel(ctx);
+    size_t block_size = ctx->cipher == RDRAND_CIPHER_CHACHA20 ? 64 : 16;
+    uint32_t first = -(uint32_t)((len + block_size - 1) / block_size);
+    int out_len, result = 1;
+
+    memcpy(block, s->nonce, sizeof(block));
+    block[12] = first >> 24;
+    block[13] = first >> 16;
+    block[14] = first >> 8;
+    block[15] = first;
+    cipher_iv(ctx->cipher, block, iv);
+
+    if (kernel != AES_KERNEL_EVP) {
+        // a copy, the schedule keeps its counter
+        memcpy(&native, &s->native, sizeof(native));
+        memcpy(native.counter, iv, sizeof(iv));
+        native.num = 0;
+        native_update(&native, kernel, ks, zero, len);
+        rdrand_wipe(&native, sizeof(native));
+    } else {
+        // no cipher and no key: only the IV is set, the key stays expanded
+        result = EVP_CipherInit_ex(s->en, NULL, NULL, NULL, iv, -1) == 1
+            && EVP_EncryptUpdate(s->en, ks, &out_len, zero, len) == 1;
+        cipher_iv(ctx->cipher, s->nonce, iv);
+        if (EVP_CipherInit_ex(s->en, NULL, NULL, NULL, iv, -1) != 1)
+            result = 0;
+    }
+    rdrand_wipe(block, sizeof(block));
+    rdrand_wipe(iv, sizeof(iv));
+    return result;
+}
+
+/**
+ * Make a schedule of a new random key and nonce from the reserve.
+ * Return 0 on failure.
+ */
+static int schedule_random(aes_cfg_t *ctx, aes_schedule_t *s) {
+    unsigned char K[RDRAND_MAX_KEY_LENGTH] = {};
+    unsigned char N[RDRAND_MAX_KEY_LENGTH] = {};
+    size_t len = ctx->keys.key_length;
+    int result = 0;
+
+    if (reserve_take(ctx, K, len) == 0 || reserve_take(ctx, N, len) == 0)
+        fprintf(stderr, "ERROR: can't generate key, not enough entropy!\n");
+    else
+        result = schedule_set(ctx, s, K, N);
+    rdrand_wipe(K, sizeof(K));
+    rdrand_wipe(N, sizeof(N));
+    return result;
+}
+
+/**
+ * Prepare schedules for the first cycle as the keys are now (random
+ * keys fill the rest of the cycle), make the first one active and
+ * prepare the second cycle.
+ * Return 0 on failure.
+ */
+static int keys_prepare_ctx(aes_cfg_t *ctx) {
+    unsigned int i;
+
+    if (ctx->schedules == NULL)
+        return 0;
+    for (i=0; i < ctx->keys.amount; i++) {
+        if (schedule_set(ctx, &ctx->schedules[i],
+                    ctx->keys.keys[i], ctx->keys.nonces[i]) == 0)
+            return 0;
+    }
+    if (ctx->keys_type == KEYS_GENERATED) {
+        for (; i < ctx->cycle; i++) {
+            if (schedule_random(ctx, &ctx->schedules[i]) == 0)
+                return 0;
+        }
+    }
+    ctx->activation = 0;
+    ctx->active = &ctx->schedules[0];
+    ctx->keys.index = 0;
+    ctx->keys.key_current = ctx->keys.keys[0];
+    ctx->keys.nonce_current = ctx->keys.nonces[0];
+    ctx->position = 0;
+    // a stream has no key changes
+    if (ctx->keys_type == KEYS_STREAM)
+        return 1;
+    return keys_change_rotation_ctx(ctx);
+}
+// }}} key schedules
+
+/**
+ * Choose the implementation of the cipher of the context.
+ * Has to be called before the keys are set.
+ *
+ * @param  ctx        the context
+ * @param  kernel     AES_KERNEL_* enum
+ * @return            1 if the CPU supports it for the cipher
+ */
+int aes_ctx_use_kernel(aes_cfg_t *ctx, int kernel) {
+    if (!cipher_kernel_supported(ctx->cipher, kernel))
+        return 0;
+    ctx->kernel = kernel;
+    return 1;
+}
+
+/**
+ * Encrypt by AES-CTR of the context, with the chosen implementation.
+ * Both implementations keep the same counter, so the output doesn't
+ * depend on which one is used.
+ *
+ * @return            1 if it was successful
+ */
+int aes_ctx_update(aes_cfg_t *ctx, void *dest, const void *src, size_t len) {
+    int kernel = aes_ctx_kernel(ctx);
+    int out_len;
+
+    if (ctx->active == NULL)
+        return 0;
+    if (ctx->keys_type == KEYS_STREAM) {
+        // don't get into the next stream
+        if (len > RDRAND_AES_STREAM_LENGTH - ctx->position)
+            return 0;
+        ctx->position += len;
+    }
+    if (kernel != AES_KERNEL_EVP) {
+        native_update(&ctx->active->native, kernel, dest, src, len);
+        return 1;
+    }
+    // CTR mode doesn't buffer, the callers never pass more than an int
+    if (EVP_EncryptUpdate(ctx->active->en, dest, &out_len, src, len) != 1)
         return 0;
-    };
     return 1;
 }
 void memDump(unsigned char *mem, unsigned int length) {
@@ -82,46 +506,50 @@ void memDump(unsigned char *mem, unsigned int length) {
 // }}} misc
 
 // {{{ keys_allocate/free
-int keys_allocate(unsigned int amount, size_t key_length) {
+/**
+ * Allocate keys, nonces and schedules in one arena:
+ *
+ *   keys[amount] nonces[amount]            pointers into the slots
+ *   slot[amount]                           key and nonce, a cache line each
+ *   schedules[2*cycle]                     cache line aligned
+ */
+int keys_allocate_ctx(aes_cfg_t *ctx, unsigned int amount, size_t key_length) {
+    size_t slots_offset, schedules_offset;
+    unsigned char *mem;
+    unsigned int i;
+
     // test for valid numbers
-    if (!isPowerOfTwo(key_length) || amount == 0)
+    if (!isPowerOfTwo(key_length) || key_length > RDRAND_MAX_KEY_LENGTH || amount == 0)
         return 0;
-    AES_CFG.keys.amount = amount;
-    AES_CFG.keys.key_length = key_length;
-    //AES_CFG.keys.nonce_length = key_length/2; 
 
-    // init OpenSSL
-    EVP_CIPHER_CTX_init( AES_CFG.en );
-
-    // allocate first level of array
-    AES_CFG.keys.keys = malloc(sizeof(char*) *  amount);
-    AES_CFG.keys.nonces = malloc(sizeof(char*) * amount);
-    if (AES_CFG.keys.keys == NULL || AES_CFG.keys.nonces == NULL)
+    ctx->cycle = ctx->keys_type == KEYS_GENERATED ? AES_RANDOM_KEYS_CYCLE : amount;
+    slots_offset = (2 * amount * sizeof(char*) + AES_KEY_SLOT - 1) / AES_KEY_SLOT * AES_KEY_SLOT;
+    schedules_offset = slots_offset + amount * AES_KEY_SLOT;
+    mem = keys_arena_create(&ctx->arena, schedules_offset + 2 * ctx->cycle * sizeof(aes_schedule_t));
+    if (mem == NULL)
         return 0;
-    // and lock it
-    keys_mem_lock(AES_CFG.keys.keys, amount*sizeof(char*));
-    keys_mem_lock(AES_CFG.keys.nonces, amount*sizeof(char*));
 
-    // block
-    {
-        unsigned int i;
-        for (i=0; i < amount; i++){
-            // for keys and nonces
-            // allocate strings
-            AES_CFG.keys.keys[i]=malloc(key_length * sizeof(char));
-            // set it zero
-            memset(AES_CFG.keys.keys[i], 0, AES_CFG.keys.key_length);
-            // lock it
-            keys_mem_lock (AES_CFG.keys.keys[i], AES_CFG.keys.key_length);
-
-            AES_CFG.keys.nonces[i]=malloc(key_length * sizeof(char));
-            memset(AES_CFG.keys.nonces[i], 0, key_length);
-            keys_mem_lock (AES_CFG.keys.nonces[i], key_length);
-        }
+    ctx->keys.amount = amount;
+    ctx->keys.key_length = key_length;
+    //ctx->keys.nonce_length = key_length/2; 
+
+    // init OpenSSL
+    EVP_CIPHER_CTX_init( ctx->en );
+
+    ctx->keys.keys = (unsigned char **)mem;
+    ctx->keys.nonces = (unsigned char **)mem + amount;
+    for (i=0; i < amount; i++) {
+        ctx->keys.keys[i] = mem + slots_offset + i * AES_KEY_SLOT;
+        ctx->keys.nonces[i] = ctx->keys.keys[i] + RDRAND_MAX_KEY_LENGTH;
     }
     // set current to [0]
-    AES_CFG.keys.key_current = AES_CFG.keys.keys[0];
-    AES_CFG.keys.nonce_current = AES_CFG.keys.nonces[0];
+    ctx->keys.key_current = ctx->keys.keys[0];
+    ctx->keys.nonce_current = ctx->keys.nonces[0];
+
+    // the cycle of the active schedule and the next one
+    ctx->schedules = (aes_schedule_t *)(mem + schedules_offset);
+    ctx->active = NULL;
+    ctx->activation = 0;
 
     return 1;
 }
@@ -129,48 +557,31 @@ int keys_allocate(unsigned int amount, size_t key_length) {
 /**
  * Destroy saved keys and free the memory.
  */
-void keys_free() {
-    if (AES_CFG.keys.keys == NULL) {
+void keys_free_ctx(aes_cfg_t *ctx) {
+    unsigned int i;
+
+    if (ctx->keys.keys == NULL) {
         // If there is nothing to free
         return;
     }
 
+    ctx->keys.key_current = NULL;
+    ctx->keys.nonce_current = NULL;
+    ctx->keys.index = 0;
 
+    for (i=0; i < 2 * ctx->cycle; i++)
+        EVP_CIPHER_CTX_free(ctx->schedules[i].en);
+    // keys, nonces and schedules are wiped at once
+    keys_arena_destroy(&ctx->arena);
 
-    AES_CFG.keys.key_current = NULL;
-    AES_CFG.keys.nonce_current = NULL;
-    AES_CFG.keys.index = 0;
-
-    // Destroy keays in memory.
-    // Overwrite all keys and nonces, then free them.
-    // At the end, do the same for the arrays.
-    {
-        unsigned int i;
-        for (i=0; i < AES_CFG.keys.amount; i++) {
-            memset(AES_CFG.keys.keys[i], 0, AES_CFG.keys.key_length);
-            keys_mem_unlock (AES_CFG.keys.keys[i], AES_CFG.keys.key_length);
-            free(AES_CFG.keys.keys[i]);
-
-            memset(AES_CFG.keys.nonces[i], 0, AES_CFG.keys.key_length);
-            keys_mem_unlock(AES_CFG.keys.nonces[i], AES_CFG.keys.key_length);
-            free(AES_CFG.keys.nonces[i]);
-        }
-    }
-
-    memset(AES_CFG.keys.keys, 0, AES_CFG.keys.amount*sizeof(char*));
-    memset(AES_CFG.keys.nonces, 0, AES_CFG.keys.amount*sizeof(char*));
-
-    keys_mem_unlock(AES_CFG.keys.keys, AES_CFG.keys.amount*sizeof(char*));
-    keys_mem_unlock(AES_CFG.keys.nonces, AES_CFG.keys.amount*sizeof(char*));
-    
-    free(AES_CFG.keys.keys);
-    free(AES_CFG.keys.nonces);
-
-    AES_CFG.keys.keys = NULL;
-    AES_CFG.keys.nonces = NULL;
+    ctx->keys.keys = NULL;
+    ctx->keys.nonces = NULL;
+    ctx->schedules = NULL;
+    ctx->active = NULL;
+    ctx->activation = 0;
 
     // clean openssl
-    if ( EVP_CIPHER_CTX_cleanup(AES_CFG.en) != 1 ) {
+    if ( EVP_CIPHER_CTX_cleanup(ctx->en) != 1 ) {
         perror("EVP_CIPHER_CTX_cleanup");
     }
 }
@@ -248,122 +659,430 @@ int keys_mem_unlock(void * ptr, size_t len) {
 }
 // }}} keys_mem_lock/unlock
 
+// {{{ ciphers
+/**
+ * Name of the cipher, or NULL for an unknown one.
+ */
+const char *rdrand_cipher_name(int cipher) {
+    if (cipher < 0 || cipher >= RDRAND_CIPHER_COUNT)
+        return NULL;
+    return CIPHER_NAMES[cipher];
+}
+
+/**
+ * Length of keys of the cipher in bytes, or 0 for an unknown one.
+ */
+size_t rdrand_cipher_key_length(int cipher) {
+    switch (cipher) {
+        case RDRAND_CIPHER_AES128_CTR:
+            return DEFAULT_KEY_LEN;
+        case RDRAND_CIPHER_AES256_CTR:
+        case RDRAND_CIPHER_CHACHA20:
+            return RDRAND_MAX_KEY_LENGTH;
+    }
+    return 0;
+}
+// }}} ciphers
+
 
 /**
- * Set manually keys for AES.
+ * Create a new AES context. Every context has its own keys and
+ * counters, so it can be used from one thread while other threads
+ * use other contexts.
+ *
+ * @return            the context, or NULL on failure
+ */
+// {{{ rdrand_aes_ctx_create
+rdrand_aes_ctx_t *rdrand_aes_ctx_create(void) {
+    rdrand_aes_ctx_t *ctx;
+
+    ctx = calloc(1, sizeof(rdrand_aes_ctx_t));
+    if (ctx == NULL)
+        return NULL;
+    ctx->en = EVP_CIPHER_CTX_new();
+    if (ctx->en == NULL) {
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+// }}} rdrand_aes_ctx_create
+
+/**
+ * Set manually keys for AES of the context.
  * These keys will be rotated randomly.
  *
+ * @param  ctx        the context
  * @param  amount     Count of keys
- * @param  key_length Length of all keys in bytes
- *                    (must be pow(2))
+ * @param  key_length Length of all keys in bytes, 8 or 16 for
+ *                    AES-128, 32 for AES-256 and ChaCha20
  * @param  nonces     Array of nonces. Nonces have to be half of
- *                    length of keys.
+ *                    length of keys, RDRAND_MAX_NONCE_LENGTH at most.
  * @param  keys       Array of keys. All have to be the same length.
  * @return            1 if the keys were successfuly set
 */
-// {{{ rdrand_set_aes_keys
-int rdrand_set_aes_keys(unsigned int amount,
+// {{{ rdrand_aes_ctx_set_keys
+int rdrand_aes_ctx_set_keys(rdrand_aes_ctx_t *ctx,
+                        unsigned int amount,
                         size_t key_length,
                         unsigned char **keys,
                         unsigned char **nonces) {
     // don't allow bad key lengths
-    if(key_length <= RDRAND_MIN_KEY_LENGTH || key_length >= RDRAND_MAX_KEY_LENGTH)
+    if (!cipher_key_length_valid(ctx->cipher, key_length))
         return 0;
 
-    AES_CFG.en = EVP_CIPHER_CTX_new();
-    AES_CFG.keys.index=0;
-    AES_CFG.keys.next_counter=MAX_COUNTER;
-    AES_CFG.keys_type = KEYS_GIVEN;
-    AES_CFG.keys.key_current = NULL;
-    if (keys_allocate(amount, key_length) == 0) {
+    // replacing keys set before
+    keys_free_ctx(ctx);
+    if (ctx->en == NULL)
+        ctx->en = EVP_CIPHER_CTX_new();
+    ctx->keys.index=0;
+    ctx->keys.next_counter=aes_ctx_rekey_interval(ctx);
+    ctx->keys_type = KEYS_GIVEN;
+    ctx->keys.key_current = NULL;
+    if (keys_allocate_ctx(ctx, amount, key_length) == 0) {
         return 0;
     }
     { // subblock for var. i
         unsigned int i;
         for (i=0; i<amount; i++) {
-            memcpy(AES_CFG.keys.keys[i], keys[i], key_length);
-            memcpy(AES_CFG.keys.nonces[i], nonces[i], (key_length/2));
+            memcpy(ctx->keys.keys[i], keys[i], key_length);
+            memcpy(ctx->keys.nonces[i], nonces[i], aes_nonce_length(key_length));
         }
     }
-    key_to_openssl();
-    // random index
-    //keys_change();
-    return 1;
+    return keys_prepare_ctx(ctx);
 }
-// }}} rdrand_set_aes_keys
+// }}} rdrand_aes_ctx_set_keys
 
 /**
- * Set automatic key generation.
- * OpenSSL will be used as a key generator.
+ * Set automatic key generation for the context.
+ * Keys are generated by RdSeed (RdRand when it runs dry, OpenSSL
+ * when the CPU has neither) in batches, ahead of the key changes.
  */
-// {{{ rdrand_set_aes_random_key
-int rdrand_set_aes_random_key() {
-    AES_CFG.en = EVP_CIPHER_CTX_new();
-    AES_CFG.keys_type = KEYS_GENERATED;
-    AES_CFG.keys.index=0;
-    AES_CFG.keys.next_counter=0;
-    AES_CFG.keys.key_current = NULL;
+// {{{ rdrand_aes_ctx_set_random_key
+int rdrand_aes_ctx_set_random_key(rdrand_aes_ctx_t *ctx) {
+    keys_free_ctx(ctx);
+    if (ctx->en == NULL)
+        ctx->en = EVP_CIPHER_CTX_new();
+    ctx->keys_type = KEYS_GENERATED;
+    ctx->keys.index=0;
+    ctx->keys.next_counter=0;
+    ctx->keys.key_current = NULL;
     
-    if (keys_allocate(1, DEFAULT_KEY_LEN) == 0){
+    if (keys_allocate_ctx(ctx, 1, rdrand_cipher_key_length(ctx->cipher)) == 0){
         return 0;
     }
-    if(key_generate() == 0){
+    if (reserve_take(ctx, ctx->keys.keys[0], ctx->keys.key_length) == 0
+            || reserve_take(ctx, ctx->keys.nonces[0], ctx->keys.key_length) == 0) {
+        fprintf(stderr, "ERROR: can't generate key, not enough entropy!\n");
         return 0;
     }
+    return keys_prepare_ctx(ctx);
+}
+//}}} rdrand_aes_ctx_set_random_key
 
+/**
+ * Set how many bytes are encrypted by one key of the context before
+ * the next key is used. With random keys, the key is changed after
+ * a random amount of bytes up to the interval. The default interval
+ * is MAX_COUNTER. The interval is kept when new keys are set.
+ *
+ * @param  ctx        the context
+ * @param  bytes      the interval, <1, RDRAND_AES_MAX_REKEY_INTERVAL>
+ * @return            1 if the interval was set
+ */
+// {{{ rdrand_aes_ctx_set_rekey_interval
+int rdrand_aes_ctx_set_rekey_interval(rdrand_aes_ctx_t *ctx, unsigned int bytes) {
+    if (bytes == 0 || bytes > RDRAND_AES_MAX_REKEY_INTERVAL)
+        return 0;
+    ctx->rekey_interval = bytes;
+    // the current key doesn't get more than the new interval either
+    if (ctx->keys.next_counter > bytes)
+        ctx->keys.next_counter = bytes;
     return 1;
 }
-//}}} rdrand_set_aes_random_key
+// }}} rdrand_aes_ctx_set_rekey_interval
 
 /**
- * Perform cleaning of all AES related settings:
- * Discard keys, ...
+ * Set how many bytes the context encrypts between two checks of its
+ * key counter, the default is MAX_BUFFER_SIZE. Smaller buffers stay in
+ * the L1 cache, bigger ones check the counter less often. Never more
+ * than the rekey interval is encrypted at once. With given keys, every
+ * buffer size which divides the interval gives the same output.
+ *
+ * @param  ctx        the context
+ * @param  bytes      power of two, <16, RDRAND_AES_MAX_BUFFER_SIZE>
+ * @return            1 if the size was set
  */
-// {{{ rdrand_clean_aes
-void rdrand_clean_aes() {
-    keys_free();
-    AES_CFG.keys_type=0;
-    AES_CFG.keys.amount=0;
-    AES_CFG.keys.key_length=0;
-//    AES_CFG.keys.nonce_length=0;
-    AES_CFG.keys.next_counter=0;
-    EVP_CIPHER_CTX_free(AES_CFG.en);
+// {{{ rdrand_aes_ctx_set_buffer_size
+int rdrand_aes_ctx_set_buffer_size(rdrand_aes_ctx_t *ctx, unsigned int bytes) {
+    if (bytes < 16 || bytes > RDRAND_AES_MAX_BUFFER_SIZE || !isPowerOfTwo(bytes))
+        return 0;
+    ctx->buffer_size = bytes;
+    return 1;
+}
+// }}} rdrand_aes_ctx_set_buffer_size
 
+/**
+ * Set the cipher of the context. Its keys are discarded, so the cipher
+ * has to be set before them; it is kept when new keys are set. A kernel
+ * chosen for another cipher is replaced by the fastest one.
+ *
+ * @param  ctx        the context
+ * @param  cipher     RDRAND_CIPHER_* enum
+ * @return            1 if the cipher was set
+ */
+// {{{ rdrand_aes_ctx_set_cipher
+int rdrand_aes_ctx_set_cipher(rdrand_aes_ctx_t *ctx, int cipher) {
+    if (cipher < 0 || cipher >= RDRAND_CIPHER_COUNT)
+        return 0;
+    keys_free_ctx(ctx);
+    ctx->cipher = cipher;
+    if (!cipher_kernel_supported(cipher, ctx->kernel))
+        ctx->kernel = AES_KERNEL_AUTO;
+    return 1;
 }
-// }}} rdrand_clean_aes
+// }}} rdrand_aes_ctx_set_cipher
 
 /**
- * Encrypt the given buffer.
+ * Set the context to a deterministic AES-CTR keystream of one key.
+ * The key is never changed and RdRand is not used. The IV is the nonce
+ * followed by a 64 bit block counter, starting at zero.
+ * The cipher of the context has to be RDRAND_CIPHER_AES128_CTR.
+ *
+ * @param  ctx        the context
+ * @param  key_length length of the key in bytes, DEFAULT_KEY_LEN only
+ * @param  key        the key
+ * @param  nonce      the nonce, half of the length of the key
+ * @return            1 if the stream was set
+ */
+// {{{ rdrand_aes_ctx_set_stream
+int rdrand_aes_ctx_set_stream(rdrand_aes_ctx_t *ctx,
+                        size_t key_length,
+                        const unsigned char *key,
+                        const unsigned char *nonce) {
+    // the block counter has to get the whole second half of the IV
+    if (key_length != DEFAULT_KEY_LEN || ctx->cipher != RDRAND_CIPHER_AES128_CTR)
+        return 0;
+
+    keys_free_ctx(ctx);
+    if (ctx->en == NULL)
+        ctx->en = EVP_CIPHER_CTX_new();
+    ctx->keys.index=0;
+    ctx->keys.next_counter=0;
+    ctx->keys_type = KEYS_STREAM;
+    ctx->keys.key_current = NULL;
+    if (keys_allocate_ctx(ctx, 1, key_length) == 0) {
+        return 0;
+    }
+    memcpy(ctx->keys.keys[0], key, key_length);
+    memcpy(ctx->keys.nonces[0], nonce, key_length/2);
+    return keys_prepare_ctx(ctx);
+}
+// }}} rdrand_aes_ctx_set_stream
+
+/**
+ * Move in the keystream of the context to the given offset: the
+ * counter is set to the block of the offset directly and the used
+ * part of the block is skipped.
+ *
+ * @param  ctx        the context, set by rdrand_aes_ctx_set_stream
+ * @param  offset     <0, RDRAND_AES_STREAM_LENGTH>
+ * @return            1 on success
+ */
+// {{{ rdrand_aes_ctx_seek
+int rdrand_aes_ctx_seek(rdrand_aes_ctx_t *ctx, unsigned long long offset) {
+    static const unsigned char zero[16];
+    unsigned char iv[16], skip[16];
+    unsigned long long block = offset / 16;
+    unsigned int carry;
+    int i, result = 1;
+
+    if (ctx->keys_type != KEYS_STREAM || ctx->active == NULL
+            || offset > RDRAND_AES_STREAM_LENGTH)
+        return 0;
+
+    // 128 bit big endian addition of the block number
+    memcpy(iv, ctx->active->nonce, sizeof(iv));
+    for (i = 15, carry = 0; i >= 0 && (block || carry); i--) {
+        carry += iv[i] + (block & 0xff);
+        iv[i] = carry & 0xff;
+        carry >>= 8;
+        block >>= 8;
+    }
+
+    if (aes_ctx_kernel(ctx) != AES_KERNEL_EVP) {
+        memcpy(ctx->active->native.counter, iv, sizeof(iv));
+        ctx->active->native.num = 0;
+    } else if (EVP_EncryptInit_ex(ctx->active->en, NULL, NULL, NULL, iv) != 1) {
+        result = 0;
+    }
+    ctx->position = offset - offset % 16;
+    if (result && offset % 16)
+        result = aes_ctx_update(ctx, skip, zero, offset % 16);
+
+    rdrand_wipe(iv, sizeof(iv));
+    rdrand_wipe(skip, sizeof(skip));
+    return result;
+}
+// }}} rdrand_aes_ctx_seek
+
+/**
+ * Write the keystream of the context from its current offset into
+ * dest. The keystream is made by encrypting zeros in place, in pieces
+ * which stay in L1 cache.
+ *
+ * @param  ctx        the context, set by rdrand_aes_ctx_set_stream
+ * @param  dest       destination buffer
+ * @param  count      bytes to write
+ * @return            amount of bytes written, less than count
+ *                    at the end of the stream
+ */
+// {{{ rdrand_aes_ctx_keystream
+size_t rdrand_aes_ctx_keystream(rdrand_aes_ctx_t *ctx, void *dest, size_t count) {
+    unsigned char *out = dest;
+    size_t done, len;
+
+    if (ctx->keys_type != KEYS_STREAM)
+        return 0;
+    if (count > RDRAND_AES_STREAM_LENGTH - ctx->position)
+        count = RDRAND_AES_STREAM_LENGTH - ctx->position;
+
+    for (done = 0; done < count; done += len) {
+        len = count - done < MAX_BUFFER_SIZE ? count - done : MAX_BUFFER_SIZE;
+        memset(out + done, 0, len);
+        if (aes_ctx_update(ctx, out + done, out + done, len) != 1)
+            break;
+    }
+    return done;
+}
+// }}} rdrand_aes_ctx_keystream
+
+/**
+ * Create a new context for one of parallel streams of the given one.
+ * With random keys, the new context generates its own keys.
+ * With given keys, the new context gets the same key ring, but the
+ * stream number is put into the upper 32 bits of the counter part of
+ * every nonce, so no two streams ever encrypt with the same key and
+ * counter. Stream 0 is the same as a context set with the same keys.
+ * The counter of a stream of rdrand_aes_ctx_set_stream starts at zero,
+ * so the stream number gives the upper bits of the block number and
+ * the streams follow each other.
  *
+ * @param  ctx        the context to split
+ * @param  stream     number of the stream
+ * @return            the new context, or NULL on failure
+ */
+// {{{ rdrand_aes_ctx_split
+rdrand_aes_ctx_t *rdrand_aes_ctx_split(const rdrand_aes_ctx_t *ctx, unsigned int stream) {
+    rdrand_aes_ctx_t *split;
+    unsigned int i, j;
+    size_t half;
+
+    if (ctx->keys.keys == NULL)
+        return NULL;
+    split = rdrand_aes_ctx_create();
+    if (split == NULL)
+        return NULL;
+    split->cipher = ctx->cipher;
+    split->rekey_interval = ctx->rekey_interval;
+    split->buffer_size = ctx->buffer_size;
+
+    if (ctx->keys_type == KEYS_GENERATED) {
+        if (rdrand_aes_ctx_set_random_key(split) == 0)
+            goto fail;
+        return split;
+    }
+
+    if (ctx->keys_type == KEYS_STREAM) {
+        if (rdrand_aes_ctx_set_stream(split, ctx->keys.key_length,
+                    ctx->keys.keys[0], ctx->keys.nonces[0]) == 0)
+            goto fail;
+    } else if (rdrand_aes_ctx_set_keys(split, ctx->keys.amount, ctx->keys.key_length,
+                ctx->keys.keys, ctx->keys.nonces) == 0)
+        goto fail;
+    // nonces are the first half, the counter is the second half of the IV
+    half = aes_nonce_length(split->keys.key_length);
+    for (i=0; i < split->keys.amount; i++) {
+        for (j=0; j < 4 && half+j < split->keys.key_length; j++)
+            split->keys.nonces[i][half+j] ^= (stream >> (24 - 8*j)) & 0xff;
+    }
+    if (keys_prepare_ctx(split) == 0)
+        goto fail;
+    return split;
+
+fail:
+    rdrand_aes_ctx_destroy(split);
+    return NULL;
+}
+// }}} rdrand_aes_ctx_split
+
+/**
+ * Discard keys of the context and free its OpenSSL state.
+ */
+// {{{ aes_ctx_clean
+static void aes_ctx_clean(aes_cfg_t *ctx) {
+    keys_free_ctx(ctx);
+    ctx->keys_type=0;
+    ctx->keys.amount=0;
+    ctx->keys.key_length=0;
+//    ctx->keys.nonce_length=0;
+    ctx->keys.next_counter=0;
+    ctx->kernel = AES_KERNEL_AUTO;
+    ctx->cipher = RDRAND_CIPHER_AES128_CTR;
+    ctx->rekey_interval = 0;
+    ctx->buffer_size = 0;
+    reserve_free(&ctx->reserve);
+    EVP_CIPHER_CTX_free(ctx->en);
+    ctx->en = NULL;
+}
+// }}} aes_ctx_clean
+
+/**
+ * Destroy the context: discard its keys and free it.
+ */
+// {{{ rdrand_aes_ctx_destroy
+void rdrand_aes_ctx_destroy(rdrand_aes_ctx_t *ctx) {
+    if (ctx == NULL)
+        return;
+    aes_ctx_clean(ctx);
+    memset(ctx, 0, sizeof(rdrand_aes_ctx_t));
+    free(ctx);
+}
+// }}} rdrand_aes_ctx_destroy
+
+/**
+ * Encrypt the given buffer with the context.
+ * Source and destination can be the same buffer.
+ *
+ * @param ctx    the context
  * @param src    source data
  * @param dest   destination buffer
  * @param len    length of the buffer
  *
  * @return       1 on success
  */
-// {{{ rdrand_enc_buffer
-int rdrand_enc_buffer(void* dest, void* src, size_t len) {
+// {{{ rdrand_aes_ctx_enc_buffer
+int rdrand_aes_ctx_enc_buffer(rdrand_aes_ctx_t *ctx, void* dest, const void* src, size_t len) {
     size_t i,chunks, tail;
-    int out_len;
-    chunks = len / MAX_BUFFER_SIZE;
-    tail = len % MAX_BUFFER_SIZE;
+    size_t size = aes_ctx_buffer_size(ctx);
+    chunks = len / size;
+    tail = len % size;
 
     for (i=0; i<chunks; i++) {
         // By placing the counter at the beginning of the cycle
         // avoid situation, when counter would be just few bytes from regenerating,
-        // but all MAX_BUFFER_SIZE would be generated with old key.
-        if(counter(MAX_BUFFER_SIZE) == 0){
+        // but the whole buffer would be generated with old key.
+        if(counter_ctx(ctx, size) == 0){
             perror("rdrand_enc_buf: counter chunks");
             return 0;
         }
         
         // encrypt full buffer
-        if( EVP_EncryptUpdate(
-            AES_CFG.en,
-            dest+i*MAX_BUFFER_SIZE, 
-            &out_len, 
-            src+i*MAX_BUFFER_SIZE, 
-            MAX_BUFFER_SIZE) != 1 ) {
+        if( aes_ctx_update(
+            ctx,
+            dest+i*size, 
+            src+i*size, 
+            size) != 1 ) {
 
             perror("rdrand_enc_buf: EVP_EncryptUpdate");
             return 0;
@@ -371,11 +1090,10 @@ int rdrand_enc_buffer(void* dest, void* src, size_t len) {
     }
 
     if (tail != 0) {
-        if( EVP_EncryptUpdate(
-            AES_CFG.en,
-            dest + i*MAX_BUFFER_SIZE, 
-            &out_len, 
-            src + i*MAX_BUFFER_SIZE, 
+        if( aes_ctx_update(
+            ctx,
+            dest + i*size, 
+            src + i*size, 
             tail) != 1 ) {
 
             perror("rdrand_enc_buf: EVP_EncryptUpdate");
@@ -386,7 +1104,46 @@ int rdrand_enc_buffer(void* dest, void* src, size_t len) {
 
     return 1;
 }
-// }}}
+// }}} rdrand_aes_ctx_enc_buffer
+
+/**
+ * rdrand_aes_ctx_get_bytes for the native kernels. RdRand values
+ * are taken in small groups, which stay in L1 cache, and the keystream
+ * is XORed into them on the way to dest. So the data is stored only
+ * once, instead of into a buffer, an output buffer and then dest.
+ */
+// {{{ aes_ctx_get_bytes_native
+static size_t aes_ctx_get_bytes_native(
+    aes_cfg_t *ctx,
+    int kernel,
+    uint8_t *dest,
+    const size_t count,
+    int retry_limit) {
+
+    uint64_t group[AES_FUSED_GROUP/8];
+    size_t generated=0, done, len, part;
+    size_t size = aes_ctx_buffer_size(ctx);
+
+    while (generated < count) {
+        len = count - generated < size ? count - generated : size;
+        // keys change and such, once per buffer as with EVP
+        counter_ctx(ctx, len);
+
+        for (done = 0; done < len; done += part) {
+            part = len - done < AES_FUSED_GROUP ? len - done : AES_FUSED_GROUP;
+            if(rdrand_get_bytes_retry(group, part, retry_limit) != part)
+                break;
+            native_update(&ctx->active->native, kernel, dest + generated + done, (uint8_t *)group, part);
+        }
+        generated += done;
+        if (done != len)
+            break;
+    }
+    // don't leave the plaintext on the stack
+    rdrand_wipe(group, sizeof(group));
+    return generated;
+}
+// }}} aes_ctx_get_bytes_native
 
 /**
  * Get an array of 64 bit random values.
@@ -396,74 +1153,187 @@ int rdrand_enc_buffer(void* dest, void* src, size_t len) {
  *
  * All output from rdrand is passed through AES-CTR encryption.
  *
- * Either rdrand_set_aes_keys or rdrand_set_aes_random_key
+ * Either rdrand_aes_ctx_set_keys or rdrand_aes_ctx_set_random_key
  * has to be set in advance.
  *
+ * @param  ctx         the context
  * @param  dest        destination location
  * @param  count       bytes to generate
  * @param  retry_limit how many times to retry the RdRand instruction
  * @return             amount of sucessfully generated and ecrypted bytes
  */
-// {{{ rdrand_get_bytes_aes_ctr
-unsigned int rdrand_get_bytes_aes_ctr(
+// {{{ rdrand_aes_ctx_get_bytes
+size_t rdrand_aes_ctx_get_bytes(
+    rdrand_aes_ctx_t *ctx,
     void *dest,
-    const unsigned int count,
+    const size_t count,
     int retry_limit) {
 
-    // allow enough space in output buffer for additional block (padding)
-    unsigned char output[MAX_BUFFER_SIZE + EVP_MAX_BLOCK_LENGTH];
-    unsigned char buf[MAX_BUFFER_SIZE];
-    unsigned int buffers, tail, i, generated=0;
+    unsigned char *out = dest;
+    size_t len, generated=0;
+    size_t size = aes_ctx_buffer_size(ctx);
     int out_len;
+    int kernel = aes_ctx_kernel(ctx);
 
-    // keys change and such
-    //counter(0);
+    // the output of a stream must not depend on RdRand
+    if (ctx->keys_type == KEYS_STREAM)
+        return 0;
+    if (kernel != AES_KERNEL_EVP)
+        return aes_ctx_get_bytes_native(ctx, kernel, dest, count, retry_limit);
 
-    memset(output, 0, MAX_BUFFER_SIZE);
-    // compute cycles 
-    buffers = count/MAX_BUFFER_SIZE;
-    tail = count % MAX_BUFFER_SIZE;
-        
-    for (i=0; i < buffers; i++) {
+    while (generated < count) {
+        len = count - generated < size ? count - generated : size;
         // By placing the counter at the beginning of the cycle
         // avoid situation, when counter would be just few bytes from regenerating,
-        // but all MAX_BUFFER_SIZE would be generated with old key.
-        counter(MAX_BUFFER_SIZE);
-
-        // generate full buffer
-        if(rdrand_get_bytes_retry(buf, MAX_BUFFER_SIZE, retry_limit) != MAX_BUFFER_SIZE) {
-            return generated;
+        // but the whole buffer would be generated with old key.
+        counter_ctx(ctx, len);
+
+        // generate the buffer and encrypt it in place, CTR doesn't pad
+        if(rdrand_get_bytes_retry(out + generated, len, retry_limit) != len
+                || EVP_EncryptUpdate(ctx->active->en, out + generated, &out_len,
+                    out + generated, len) != 1) {
+            // don't leave unencrypted values behind
+            rdrand_wipe(out + generated, len);
+            break;
         }
-        // encrypt full buffer
-         if( EVP_EncryptUpdate(AES_CFG.en, output, &out_len, buf, MAX_BUFFER_SIZE) != 1 ) {
-            perror("EVP_EncryptUpdate");
-            return generated;
-        };
-
-        memcpy(dest + i*MAX_BUFFER_SIZE, output, MAX_BUFFER_SIZE);
-        generated += MAX_BUFFER_SIZE;
-    }
-    
-    if(tail) {
-        counter(tail);
-        // generate tail
-        if(rdrand_get_bytes_retry(buf, tail, retry_limit) != tail) {
-            return generated;
-        }
-        // encrypt tail
-         if( EVP_EncryptUpdate(AES_CFG.en, output, &out_len, buf, tail) != 1 ) {
-            perror("EVP_EncryptUpdate");
-            return generated;
-        };
-        memcpy(dest + i*MAX_BUFFER_SIZE, output, tail);
-        generated += tail;
+        generated += len;
     }
 
-
     return generated;
 }
 
-// }}} rdrand_get_bytes_aes_ctr
+// }}} rdrand_aes_ctx_get_bytes
+
+// {{{ global context
+/*
+ * The original API works on one global context.
+ */
+
+/**
+ * Encrypt the given buffer.
+ *
+ * @param src    source data
+ * @param dest   destination buffer
+ * @param len    length of the buffer
+ *
+ * @return       1 on success
+ */
+int rdrand_enc_buffer(void* dest, void* src, size_t len) {
+    return rdrand_aes_ctx_enc_buffer(&AES_CFG, dest, src, len);
+}
+
+/**
+ * Get an array of 64 bit random values.
+ * Will retry up to retry_limit times. Negative retry_limit
+ * implies default retry_limit RETRY_LIMIT
+ * Returns the number of bytes successfully acquired.
+ *
+ * All output from rdrand is passed through AES-CTR encryption.
+ *
+ * Either rdrand_set_aes_keys or rdrand_set_aes_random_key
+ * has to be set in advance.
+ */
+unsigned int rdrand_get_bytes_aes_ctr(
+    void *dest,
+    const unsigned int count,
+    int retry_limit) {
+    return rdrand_aes_ctx_get_bytes(&AES_CFG, dest, count, retry_limit);
+}
+
+/**
+ * Set manually keys for AES.
+ * These keys will be rotated randomly.
+ */
+int rdrand_set_aes_keys(unsigned int amount,
+                        size_t key_length,
+                        unsigned char **keys,
+                        unsigned char **nonces) {
+    return rdrand_aes_ctx_set_keys(&AES_CFG, amount, key_length, keys, nonces);
+}
+
+/**
+ * Set automatic key generation.
+ * Keys are generated by RdSeed (RdRand when it runs dry, OpenSSL
+ * when the CPU has neither) in batches, ahead of the key changes.
+ */
+int rdrand_set_aes_random_key() {
+    return rdrand_aes_ctx_set_random_key(&AES_CFG);
+}
+
+/**
+ * Set the global context to a deterministic keystream of one key.
+ */
+int rdrand_set_aes_stream(size_t key_length,
+                        const unsigned char *key,
+                        const unsigned char *nonce) {
+    return rdrand_aes_ctx_set_stream(&AES_CFG, key_length, key, nonce);
+}
+
+/**
+ * Perform cleaning of all AES related settings:
+ * Discard keys, ...
+ */
+void rdrand_clean_aes() {
+    aes_ctx_clean(&AES_CFG);
+}
+
+/**
+ * Set the rekey interval of the global context.
+ */
+int rdrand_set_aes_rekey_interval(unsigned int bytes) {
+    return rdrand_aes_ctx_set_rekey_interval(&AES_CFG, bytes);
+}
+
+/**
+ * Set the buffer size of the global context.
+ */
+int rdrand_set_aes_buffer_size(unsigned int bytes) {
+    return rdrand_aes_ctx_set_buffer_size(&AES_CFG, bytes);
+}
+
+/**
+ * Set the cipher of the global context.
+ */
+int rdrand_set_aes_cipher(int cipher) {
+    return rdrand_aes_ctx_set_cipher(&AES_CFG, cipher);
+}
+
+/**
+ * Create a new context for one of parallel streams
+ * of the global context.
+ */
+rdrand_aes_ctx_t *rdrand_aes_split(unsigned int stream) {
+    return rdrand_aes_ctx_split(&AES_CFG, stream);
+}
+
+int counter(unsigned int num) {
+    return counter_ctx(&AES_CFG, num);
+}
+
+int keys_change(void) {
+    return keys_change_ctx(&AES_CFG);
+}
+
+int keys_change_rotation(void) {
+    return keys_change_rotation_ctx(&AES_CFG);
+}
+
+int keys_randomize(void) {
+    return keys_randomize_ctx(&AES_CFG);
+}
+
+int key_generate(void) {
+    return key_generate_ctx(&AES_CFG);
+}
+
+int keys_allocate(unsigned int amount, size_t key_length) {
+    return keys_allocate_ctx(&AES_CFG, amount, key_length);
+}
+
+void keys_free(void) {
+    keys_free_ctx(&AES_CFG);
+}
+// }}} global context
 
 /**
  * Decrement counter and if needed, change used key.
@@ -472,25 +1342,30 @@ unsigned int rdrand_get_bytes_aes_ctr(
  * @return 1 if it went ok
  */
 // {{{ counter
-int counter(unsigned int num) {
+int counter_ctx(aes_cfg_t *ctx, unsigned int num) {
 
 
     int result = 0;
+    // a stream keeps its key
+    if (ctx->keys_type == KEYS_STREAM)
+        return 1;
     // if the counter would be negative after substraction of "num"
     // (or if is zero, so it will catch even num == 0 in that case)
     // regenerate it
-    if (AES_CFG.keys.next_counter == 0 || AES_CFG.keys.next_counter < num) {
+    if (ctx->keys.next_counter == 0 || ctx->keys.next_counter < num) {
         //perror("!!! DEBUG: KEY CHANGED !!!\n");
-        if (AES_CFG.keys_type == KEYS_GIVEN) {
-            result = keys_change(); // set a new random index
-            //keys_randomize(); // set a new random timer
-            AES_CFG.keys.next_counter = MAX_COUNTER;
+        if (ctx->keys_type == KEYS_GIVEN) {
+            result = keys_change_ctx(ctx); // switch to the next key
+            ctx->keys.next_counter = aes_ctx_rekey_interval(ctx);
         } else { // KEYS_GENERATED
-            result = key_generate(); // generate a new key and nonce
-            keys_randomize(); // set a new random timer
+            result = key_generate_ctx(ctx); // generate a new key and nonce
+            keys_randomize_ctx(ctx); // set a new random timer
         }
+        // the new key encrypts these num bytes already
+        ctx->keys.next_counter -= num < ctx->keys.next_counter ? num : ctx->keys.next_counter;
     } else {
-        AES_CFG.keys.next_counter -= num;
+        ctx->keys.next_counter -= num;
+        result = 1;
     }
 
     if(result == 0){
@@ -502,59 +1377,80 @@ int counter(unsigned int num) {
 
 // {{{ keys and randomizing
 /**
- * Set key index (and nonce too) for AES to another random one.
- * Will call keys_shuffle at the end.
+ * Switch to the next key of the ring. Its schedule was prepared with
+ * the whole cycle, so the switch is a pointer swap; only the first
+ * switch of a cycle prepares the next cycle.
  * Used when rdrand_set_aes_keys() was set.
  */
-
-int keys_change(void) {
-    /*unsigned int buf;
-    if (RAND_bytes((unsigned char*)&buf, sizeof(unsigned int)) != 1) {
-        fprintf(stderr, "ERROR: can't change keys index, not enough entropy!\n");
-        return 0;
-    }
-    AES_CFG.keys.index = ((double)buf / UINT_MAX)*AES_CFG.keys.amount;
-    */
-    AES_CFG.keys.index = (AES_CFG.keys.index+1) % AES_CFG.keys.amount;
-    AES_CFG.keys.key_current = AES_CFG.keys.keys[AES_CFG.keys.index];
-    AES_CFG.keys.nonce_current = AES_CFG.keys.nonces[AES_CFG.keys.index];
-
-    if(keys_change_rotation() == 0){
+int keys_change_ctx(aes_cfg_t *ctx) {
+    if (ctx->active == NULL) {
+        fprintf(stderr,"An internal error in librdrand-aes.c on line %d\n", __LINE__);
         return 0;
     }
-    key_to_openssl();
-    return 1;
+    ctx->activation++;
+    ctx->active = &ctx->schedules[ctx->activation % (2 * ctx->cycle)];
+    ctx->keys.index = ctx->activation % ctx->keys.amount;
+    ctx->keys.key_current = ctx->keys.keys[ctx->keys.index];
+    ctx->keys.nonce_current = ctx->keys.nonces[ctx->keys.index];
+    // keys[] show the keys in use
+    memcpy(ctx->keys.key_current, ctx->active->key, ctx->keys.key_length);
+    memcpy(ctx->keys.nonce_current, ctx->active->nonce, ctx->keys.key_length);
+
+    if (ctx->activation % ctx->cycle != 0)
+        return 1;
+    return keys_change_rotation_ctx(ctx);
 }
 
 /**
- * Encrypt the current key and nonce to prevent reusing the same counter.
+ * Prepare the schedules of the cycle after the one of the active key,
+ * in the half of the ring the previous cycle used, to prevent reusing
+ * the same key and counter.
+ * A given key is rotated by its keystream one cycle earlier, at
+ * a counter the data never gets to, so the rotated keys don't depend
+ * on the amount of data encrypted. Random keys are replaced by new
+ * random ones. Called when the active key is the first of its cycle
+ * and hasn't encrypted anything yet.
  */
-int keys_change_rotation(){
-    unsigned char K[AES_CFG.keys.key_length];
-    unsigned char N[AES_CFG.keys.key_length];
-    int tmp;
-
-    if ( AES_CFG.keys.key_current == NULL){
+int keys_change_rotation_ctx(aes_cfg_t *ctx){
+    unsigned char ks[RDRAND_MAX_KEY_LENGTH + RDRAND_MAX_NONCE_LENGTH];
+    unsigned char K[RDRAND_MAX_KEY_LENGTH] = {};
+    unsigned char N[RDRAND_MAX_KEY_LENGTH] = {};
+    size_t i, len = ctx->keys.key_length;
+    size_t nonce_len = aes_nonce_length(len);
+    aes_schedule_t *cur, *next;
+    unsigned int k, half;
+    int result = 1;
+
+    if (ctx->active == NULL){
         fprintf(stderr,"An internal error in librdrand-aes.c on line %d\n", __LINE__);
         return 0;
     }
+    half = (ctx->activation / ctx->cycle) % 2;
+    cur = &ctx->schedules[half * ctx->cycle];
+    next = &ctx->schedules[(1 - half) * ctx->cycle];
+
+    for (k=0; result && k < ctx->cycle; k++) {
+        if (ctx->keys_type != KEYS_GIVEN) {
+            result = schedule_random(ctx, &next[k]);
+            continue;
+        }
+        if (schedule_reserved_keystream(ctx, &cur[k], ks, len + nonce_len) == 0) {
+            result = 0;
+            break;
+        }
+        for (i=0; i < len; i++)
+            K[i] = cur[k].key[i] ^ ks[i];
+        // the second half of the IV is the counter, with the stream number
+        memcpy(N, cur[k].nonce, len);
+        for (i=0; i < nonce_len; i++)
+            N[i] ^= ks[len + i];
+        result = schedule_set(ctx, &next[k], K, N);
+    }
 
-    EVP_EncryptUpdate(
-            AES_CFG.en,
-            K,
-            &tmp,
-            AES_CFG.keys.key_current,
-            AES_CFG.keys.key_length) ;
-    EVP_EncryptUpdate(
-            AES_CFG.en,
-            N,
-            &tmp,
-            AES_CFG.keys.nonce_current,
-            AES_CFG.keys.key_length) ;
-
-    memcpy(AES_CFG.keys.key_current, K, AES_CFG.keys.key_length);
-    memcpy(AES_CFG.keys.nonce_current, N, AES_CFG.keys.key_length);
-    return 1;
+    rdrand_wipe(ks, sizeof(ks));
+    rdrand_wipe(K, sizeof(K));
+    rdrand_wipe(N, sizeof(N));
+    return result;
 }
 
 
@@ -562,36 +1458,24 @@ int keys_change_rotation(){
  * Set a random timeout for new key generation/step.
  * Called on every key change.
  */
-int keys_randomize() {
+int keys_randomize_ctx(aes_cfg_t *ctx) {
     unsigned int buf;
-    if (RAND_bytes((unsigned char*)&buf, sizeof(unsigned int)) != 1) { 
+    if (reserve_take(ctx, &buf, sizeof(unsigned int)) == 0) {
         fprintf(stderr, "ERROR: can't change keys index, not enough entropy!\n");
         return 0;
     } 
-    AES_CFG.keys.next_counter = ((double)buf/UINT_MAX)*MAX_COUNTER;
+    ctx->keys.next_counter = ((double)buf/UINT_MAX)*aes_ctx_rekey_interval(ctx);
     
     return 1;
 }
 
 /**
- * Generate a random key.
+ * Switch to the prepared random key, the next cycle of random keys
+ * is generated when the active one starts.
  * Used when rdrand_set_aes_random_key() was set.
  */
-int key_generate() {
-    unsigned char buf[RDRAND_MAX_KEY_LENGTH] = {};
-    if (RAND_bytes(buf, AES_CFG.keys.key_length) != 1) { 
-        fprintf(stderr, "ERROR: can't generate key, not enough entropy!\n");
-        return 0;
-    }
-    memcpy(AES_CFG.keys.keys[0],buf, AES_CFG.keys.key_length);
-
-    if (RAND_bytes(buf, AES_CFG.keys.key_length) != 1) { 
-        fprintf(stderr, "ERROR: can't generate nonce, not enough entropy!\n");
-        return 0;
-    }
-    memcpy(AES_CFG.keys.nonces[0],buf, AES_CFG.keys.key_length);
-    key_to_openssl();
-    return 1;
+int key_generate_ctx(aes_cfg_t *ctx) {
+    return keys_change_ctx(ctx);
 }
 // }}} keys and randomizing
 
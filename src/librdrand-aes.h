@@ -31,6 +31,19 @@
  *     - rdrand_get_bytes_aes_ctr
  * 3) Clean
  *     - rdrand_clean_aes
+ *
+ * These functions share one global context, so only one thread
+ * can use them at once. Threads can have a context each instead:
+ * 1) rdrand_aes_ctx_create
+ * 2) rdrand_aes_ctx_set_keys or rdrand_aes_ctx_set_random_key
+ * 3) rdrand_aes_ctx_get_bytes or rdrand_aes_ctx_enc_buffer
+ * 4) rdrand_aes_ctx_destroy
+ *
+ * A deterministic keystream, without RdRand, is read from a context
+ * set by rdrand_aes_ctx_set_stream:
+ * 1) rdrand_aes_ctx_split to get a stream of its own for every thread
+ * 2) rdrand_aes_ctx_seek to the offset of the slice of the thread
+ * 3) rdrand_aes_ctx_keystream
  */
 #ifndef LIBRDRAND_AES_H_INCLUDED
 #define LIBRDRAND_AES_H_INCLUDED
@@ -45,25 +58,41 @@
 #define RDRAND_MAX_KEY_LENGTH 32
 #define RDRAND_MIN_KEY_LENGTH 4
 
-// Maximum generated bytes without key change
-// Real maximum bytes between key changes can be determined by the following
-// (little complicated) calculation:
-//
-// max_value ( 
-//              MAX_COUNTER, 
-//              min_value(
-//                          MAX_BUFFER_SIZE,
-//                          generated bytes
-//              ) 
-// )
-//
-// So if the MAX_COUNTER is smaller than MAX_BUFFER_SIZE,
-// it may happen, than the keys will be changed 
-// after MAX_BUFFER_SIZE bytes instead.
+// Default bytes generated without key change, see
+// rdrand_aes_ctx_set_rekey_interval. The key counter is checked once
+// per buffer (see rdrand_aes_ctx_set_buffer_size), which is never
+// bigger than the interval, so no key encrypts more than the interval.
 #define MAX_COUNTER 4096
 
+// Maximal interval accepted by rdrand_aes_ctx_set_rekey_interval
+#define RDRAND_AES_MAX_REKEY_INTERVAL (1u << 30)
+
+// Bytes of one keystream of rdrand_aes_ctx_set_stream, 2^32 AES blocks;
+// the streams made by rdrand_aes_ctx_split follow each other.
+#define RDRAND_AES_STREAM_LENGTH (1ULL << 36)
+
+// Default bytes encrypted between two checks of the key counter
 #define MAX_BUFFER_SIZE 2048
 
+// Maximal size accepted by rdrand_aes_ctx_set_buffer_size
+#define RDRAND_AES_MAX_BUFFER_SIZE (1u << 20)
+
+/**
+ * Ciphers which encrypt RdRand output, see rdrand_aes_ctx_set_cipher.
+ * The library keeps the AES naming, but all of them are used the same
+ * way: a key, a nonce and a block counter.
+ */
+enum {
+    RDRAND_CIPHER_AES128_CTR,
+    RDRAND_CIPHER_AES256_CTR,
+    RDRAND_CIPHER_CHACHA20,
+    RDRAND_CIPHER_COUNT
+};
+
+// Maximal length of a nonce of a given key in bytes; the other
+// half of the 16 byte IV is the block counter.
+#define RDRAND_MAX_NONCE_LENGTH 8
+
 // OSX compatibility
 #ifdef OSX
 	typedef	unsigned long ulong;
@@ -107,10 +136,10 @@ unsigned int rdrand_get_bytes_aes_ctr(void *dest,
  * These keys will be rotated randomly.
  *
  * @param  amount     Count of keys
- * @param  key_length Length of all keys in bits 
- *                    (must be pow(2))
+ * @param  key_length Length of all keys in bytes, 8 or 16 for
+ *                    AES-128, 32 for AES-256 and ChaCha20
  * @param  nonces     Array of nonces. Nonces have to be half of 
- *                    length of keys.
+ *                    length of keys, RDRAND_MAX_NONCE_LENGTH at most.
  * @param  keys       Array of keys. All have to be the same length.
  * @return            True if the keys were successfuly set
  */
@@ -122,12 +151,49 @@ int rdrand_set_aes_keys(
 
 /**
  * Set automatic key generation.
- * OpenSSL will be used as a key generator.
+ * Keys are generated by RdSeed (RdRand when it runs dry, OpenSSL
+ * when the CPU has neither) in batches, ahead of the key changes.
  * 
  * @return True if the key was successfuly set
  */
 int rdrand_set_aes_random_key();
 
+/**
+ * Same as rdrand_aes_ctx_set_stream, for the global context.
+ */
+int rdrand_set_aes_stream(
+    size_t key_length,
+    const unsigned char *key,
+    const unsigned char *nonce);
+
+/**
+ * Set how many bytes are encrypted by one key before the next
+ * key is used. With random keys, the key is changed after a random
+ * amount of bytes up to the interval. The default is MAX_COUNTER.
+ *
+ * @param  bytes      the interval, <1, RDRAND_AES_MAX_REKEY_INTERVAL>
+ * @return            True if the interval was set
+ */
+int rdrand_set_aes_rekey_interval(unsigned int bytes);
+
+/**
+ * Set how many bytes are encrypted between two checks of the key
+ * counter. The default is MAX_BUFFER_SIZE, see rdrand_autotune
+ * for finding the best one.
+ *
+ * @param  bytes      power of two, <16, RDRAND_AES_MAX_BUFFER_SIZE>
+ * @return            True if the size was set
+ */
+int rdrand_set_aes_buffer_size(unsigned int bytes);
+
+/**
+ * Set the cipher of the global context, see rdrand_aes_ctx_set_cipher.
+ *
+ * @param  cipher     RDRAND_CIPHER_* enum
+ * @return            True if the cipher was set
+ */
+int rdrand_set_aes_cipher(int cipher);
+
 
 /**
  * Perform cleaning of all AES related settings:
@@ -135,4 +201,182 @@ int rdrand_set_aes_random_key();
  */
 void rdrand_clean_aes();
 
+/**************************************************************************
+ *                         Ciphers
+ **************************************************************************/
+
+/**
+ * Name of the cipher, as rdrand-gen --cipher takes it.
+ *
+ * @param  cipher     RDRAND_CIPHER_* enum
+ * @return            the name, or NULL for an unknown cipher
+ */
+const char *rdrand_cipher_name(int cipher);
+
+/**
+ * Length of keys of the cipher in bytes; random keys have this length.
+ *
+ * @param  cipher     RDRAND_CIPHER_* enum
+ * @return            the length, or 0 for an unknown cipher
+ */
+size_t rdrand_cipher_key_length(int cipher);
+
+/**
+ * Measure how fast every cipher encrypts with the fastest
+ * implementation the CPU supports. Takes a fraction of a second.
+ *
+ * @param  rates      bytes per second of every cipher,
+ *                    RDRAND_CIPHER_COUNT items
+ * @return            the fastest cipher, or RDRAND_FAILURE
+ */
+int rdrand_cipher_benchmark(double *rates);
+
+/**************************************************************************
+ *                         AES contexts
+ **************************************************************************/
+
+/**
+ * An AES-CTR context with its own keys and counters.
+ * A context must not be used by more threads at once.
+ */
+typedef struct rdrand_aes_ctx_s rdrand_aes_ctx_t;
+
+/**
+ * Create a new AES context. Every context has its own keys and
+ * counters, so it can be used from one thread while other threads
+ * use other contexts.
+ *
+ * @return            the context, or NULL on failure
+ */
+rdrand_aes_ctx_t *rdrand_aes_ctx_create(void);
+
+/**
+ * Set manually keys for AES of the context.
+ * These keys will be rotated randomly.
+ * Same as rdrand_set_aes_keys.
+ *
+ * @return            True if the keys were successfuly set
+ */
+int rdrand_aes_ctx_set_keys(
+    rdrand_aes_ctx_t *ctx,
+    unsigned int amount,
+    size_t key_length,
+    unsigned char **keys,
+    unsigned char **nonces);
+
+/**
+ * Set automatic key generation for the context.
+ * Keys are generated by RdSeed (RdRand when it runs dry, OpenSSL
+ * when the CPU has neither) in batches, ahead of the key changes.
+ *
+ * @return True if the key was successfuly set
+ */
+int rdrand_aes_ctx_set_random_key(rdrand_aes_ctx_t *ctx);
+
+/**
+ * Get bytes of random values, encrypted by AES-CTR of the context.
+ * Negative retry_limit implies default retry_limit RETRY_LIMIT
+ *
+ * @return             amount of sucessfully generated and ecrypted bytes
+ */
+size_t rdrand_aes_ctx_get_bytes(
+    rdrand_aes_ctx_t *ctx,
+    void *dest,
+    const size_t count,
+    int retry_limit);
+
+/**
+ * Encrypt the given buffer with the context.
+ * Source and destination can be the same buffer.
+ *
+ * @return       1 on success
+ */
+int rdrand_aes_ctx_enc_buffer(rdrand_aes_ctx_t *ctx, void* dest, const void* src, size_t len);
+
+/**
+ * Same as rdrand_set_aes_rekey_interval.
+ * The interval is kept when new keys are set.
+ */
+int rdrand_aes_ctx_set_rekey_interval(rdrand_aes_ctx_t *ctx, unsigned int bytes);
+
+/**
+ * Set the buffer size of the context.
+ * Same as rdrand_set_aes_buffer_size.
+ *
+ * @return            1 if the size was set
+ */
+int rdrand_aes_ctx_set_buffer_size(rdrand_aes_ctx_t *ctx, unsigned int bytes);
+
+/**
+ * Set the cipher of the context, RDRAND_CIPHER_AES128_CTR by default.
+ * Keys of the context are discarded, so the cipher has to be set
+ * before them; it is kept when new keys are set and by
+ * rdrand_aes_ctx_split.
+ *
+ * @param  cipher     RDRAND_CIPHER_* enum
+ * @return            1 if the cipher was set
+ */
+int rdrand_aes_ctx_set_cipher(rdrand_aes_ctx_t *ctx, int cipher);
+
+/**
+ * Set the context to a deterministic AES-CTR keystream of one key:
+ * the key is never changed and RdRand is not used, so the same key
+ * and nonce give always the same stream. Read it by
+ * rdrand_aes_ctx_keystream or XOR it into data by
+ * rdrand_aes_ctx_enc_buffer; rdrand_aes_ctx_get_bytes fails.
+ * Streams are AES-128 only.
+ *
+ * @param  key_length length of the key in bytes, DEFAULT_KEY_LEN only
+ * @param  key        the key
+ * @param  nonce      the nonce, half of the length of the key
+ * @return            1 if the stream was set
+ */
+int rdrand_aes_ctx_set_stream(
+    rdrand_aes_ctx_t *ctx,
+    size_t key_length,
+    const unsigned char *key,
+    const unsigned char *nonce);
+
+/**
+ * Move in the keystream of a context set by rdrand_aes_ctx_set_stream
+ * to the given offset, in constant time.
+ *
+ * @param  offset     <0, RDRAND_AES_STREAM_LENGTH>
+ * @return            1 on success
+ */
+int rdrand_aes_ctx_seek(rdrand_aes_ctx_t *ctx, unsigned long long offset);
+
+/**
+ * Write the keystream of a context set by rdrand_aes_ctx_set_stream
+ * from its current offset into dest.
+ *
+ * @return            amount of bytes written, less than count
+ *                    at the end of the stream
+ */
+size_t rdrand_aes_ctx_keystream(rdrand_aes_ctx_t *ctx, void *dest, size_t count);
+
+/**
+ * Create a new context for one of parallel streams of the given one.
+ * The streams never share a key and a counter, so every thread can
+ * encrypt with its own stream. With given keys, the streams are
+ * deterministic and stream 0 is the same as the given context.
+ * A stream of rdrand_aes_ctx_set_stream is split into streams which
+ * are RDRAND_AES_STREAM_LENGTH long, each starting at offset 0.
+ *
+ * @param  stream     number of the stream
+ * @return            the new context, or NULL on failure
+ */
+rdrand_aes_ctx_t *rdrand_aes_ctx_split(const rdrand_aes_ctx_t *ctx, unsigned int stream);
+
+/**
+ * Same as rdrand_aes_ctx_split, for the global context
+ * set by rdrand_set_aes_keys or rdrand_set_aes_random_key.
+ */
+rdrand_aes_ctx_t *rdrand_aes_split(unsigned int stream);
+
+/**
+ * Destroy the context: discard its keys and free it.
+ */
+void rdrand_aes_ctx_destroy(rdrand_aes_ctx_t *ctx);
+
 #endif // LIBRDRAND_AES_H_INCLUDED
@@ -24,7 +24,9 @@
 #ifndef LIBRDRAND_AES_PRIVATE_H_INCLUDED
 #define LIBRDRAND_AES_PRIVATE_H_INCLUDED
 
+#include <stdint.h>
 #include <openssl/evp.h>
+#include "./librdrand-aes.h"
 
 #ifndef TRUE
     #define TRUE 1
@@ -33,7 +35,9 @@
 
 enum {
     KEYS_GENERATED,
-    KEYS_GIVEN
+    KEYS_GIVEN,
+    /** one given key, never changed, see rdrand_aes_ctx_set_stream */
+    KEYS_STREAM
 };
 
 
@@ -49,16 +53,117 @@ typedef struct s_keys {
     size_t key_length; // in bits
 } t_keys;
 
-typedef struct aes_cfg_s {
+/**
+ * Cipher implementations. AES_KERNEL_AUTO picks the fastest
+ * one the CPU supports for the cipher of the context.
+ */
+enum {
+    AES_KERNEL_AUTO,
+    AES_KERNEL_EVP,
+    AES_KERNEL_AESNI,
+    AES_KERNEL_VAES,
+    AES_KERNEL_CHACHA_AVX2,
+    AES_KERNEL_CHACHA_AVX512
+};
+
+#define AES_NATIVE_MAX_ROUNDS 14
+
+/**
+ * State of the native kernels, the same as OpenSSL keeps:
+ * the counter (a 128 bit big endian one for AES-CTR, the IV for
+ * ChaCha20) and the unused part of the last keystream block.
+ */
+typedef struct aes_native_s {
+    /** the expanded AES key, or the ChaCha20 key */
+    uint8_t round_keys[(AES_NATIVE_MAX_ROUNDS + 1) * 16] __attribute__((aligned(16)));
+    unsigned int rounds;
+    uint8_t counter[16];
+    /** one AES or ChaCha20 block */
+    uint8_t keystream[64];
+    /** bytes of keystream already used */
+    unsigned int num;
+} aes_native_t;
+
+/**
+ * A key prepared for use: the key and nonce it was made of
+ * and its expanded schedule for the kernel of the context.
+ * Schedules start on a cache line.
+ */
+typedef struct aes_schedule_s {
+    aes_native_t native;
+    /** used with AES_KERNEL_EVP only */
+    EVP_CIPHER_CTX *en;
+    unsigned char key[RDRAND_MAX_KEY_LENGTH];
+    unsigned char nonce[RDRAND_MAX_KEY_LENGTH];
+} __attribute__((aligned(64))) aes_schedule_t;
+
+/**
+ * Memory for key material: page aligned, locked, excluded from
+ * core dumps and surrounded by inaccessible guard pages.
+ */
+typedef struct aes_arena_s {
+    /** the whole mapping, guard pages included */
+    unsigned char *base;
+    size_t size;
+} aes_arena_t;
+
+/**
+ * Material for key changes with random keys: keys, nonces and
+ * intervals, generated in batches by the CPU. Used bytes are wiped.
+ */
+typedef struct aes_reserve_s {
+    aes_arena_t arena;
+    unsigned char *buf;
+    /** first unused byte */
+    size_t pos;
+    /** end of the valid data */
+    size_t avail;
+    /** fork generation the data was generated in */
+    unsigned long generation;
+} aes_reserve_t;
+
+/**
+ * The AES context, rdrand_aes_ctx_t in the public API.
+ */
+typedef struct rdrand_aes_ctx_s {
     t_keys keys;
+    /** not used for encryption, the schedules keep their own */
     EVP_CIPHER_CTX *en;
     int keys_type;
+    /** RDRAND_CIPHER_* enum, see rdrand_aes_ctx_set_cipher */
+    int cipher;
+    /** AES_KERNEL_* enum, set by aes_ctx_use_kernel */
+    int kernel;
+    /**
+     * Ring of 2*cycle schedules: the cycle of the active one and the
+     * next cycle, prepared at once when the active cycle starts.
+     */
+    aes_schedule_t *schedules;
+    /** key changes per cycle: keys.amount, more for random keys */
+    unsigned int cycle;
+    aes_schedule_t *active;
+    /** key changes since the keys were set */
+    unsigned long activation;
+    /** bytes encrypted by one key, 0 means MAX_COUNTER */
+    unsigned int rekey_interval;
+    /** bytes encrypted between counter checks, 0 means MAX_BUFFER_SIZE */
+    unsigned int buffer_size;
+    /** offset in the keystream, KEYS_STREAM only */
+    unsigned long long position;
+    aes_reserve_t reserve;
+    /** keys, nonces and schedules, see keys_allocate_ctx */
+    aes_arena_t arena;
 } aes_cfg_t;
 
 #ifdef STUB_RDRAND  // for testing
      extern aes_cfg_t AES_CFG;
 #endif
 
+/*
+ * The functions below work on the global context AES_CFG,
+ * their _ctx variants on the given one.
+ */
+
 /**
  * Decrement counter and if needed, change used key.
  *
@@ -66,13 +171,15 @@ typedef struct aes_cfg_s {
  * @return 1 if it went OK
  */
 int counter(unsigned int num);
+int counter_ctx(aes_cfg_t *ctx, unsigned int num);
 
 /**
- * Set key index for AES to another random one.
+ * Switch to the next key of the ring, which is already prepared.
  * Used when rdrand_set_aes_keys() was set.
  * @return            1 if it was successful
  */
 int keys_change();
+int keys_change_ctx(aes_cfg_t *ctx);
 
 /**
  * Set a random timeout for new key generation/step.
@@ -80,17 +187,23 @@ int keys_change();
  * @return            1 if it was successful
  */
 int keys_randomize();
+int keys_randomize_ctx(aes_cfg_t *ctx);
 
 /**
- * Encrypt the current key and nonce to prevent reusing the same counter.
+ * Prepare the schedules of the cycle which follows the one of the
+ * active key, to prevent reusing the same key and counter.
+ * @return            1 if it was successful
  */
 int keys_change_rotation();
+int keys_change_rotation_ctx(aes_cfg_t *ctx);
 /**
- * Generate a random key.
+ * Switch to the prepared random key, the next cycle of random keys
+ * is generated when the active one starts.
  * Used when rdrand_set_aes_random_key() was set.
  * @return            1 if it was successful
  */
 int key_generate();
+int key_generate_ctx(aes_cfg_t *ctx);
 
 
 /**
@@ -100,11 +213,13 @@ int key_generate();
  * @return            1 if it was successful
  */
 int keys_allocate(unsigned int amount, size_t key_length);
+int keys_allocate_ctx(aes_cfg_t *ctx, unsigned int amount, size_t key_length);
 
 /**
  * Destroy saved keys and free the memory.
  */
 void keys_free();
+void keys_free_ctx(aes_cfg_t *ctx);
 
 /**
  * Lock memory to prevent saving it on swap
@@ -117,4 +232,92 @@ int keys_mem_lock(void * ptr, size_t len);
  */
 int keys_mem_unlock(void * ptr, size_t len);
 
+/**
+ * Map len bytes of locked memory with guard pages for key material.
+ * @return            the memory, or NULL on failure
+ */
+void *keys_arena_create(aes_arena_t *a, size_t len);
+/**
+ * Zeroize, unlock and unmap the arena.
+ */
+void keys_arena_destroy(aes_arena_t *a);
+
+/**
+ * Choose the implementation of the cipher of the context.
+ * @return            1 if the CPU supports it
+ */
+int aes_ctx_use_kernel(aes_cfg_t *ctx, int kernel);
+
+/**
+ * Encrypt by AES-CTR of the context, with the chosen implementation.
+ * @return            1 if it was successful
+ */
+int aes_ctx_update(aes_cfg_t *ctx, void *dest, const void *src, size_t len);
+
+/*
+ * Native AES-CTR kernels, in librdrand-aesni.c.
+ */
+
+/**
+ * Check if the CPU supports the AES_KERNEL_* kernel.
+ */
+int aes_native_supported(int kernel);
+
+/**
+ * The fastest AES_KERNEL_* kernel the CPU supports.
+ */
+int aes_native_best(void);
+
+/**
+ * Expand a 128 or 256 bit key and set the counter to iv.
+ * @return            1 if it was successful
+ */
+int aes_native_set_key(aes_native_t *n, const uint8_t *key, unsigned int bits, const uint8_t *iv);
+
+/**
+ * Encrypt len bytes of src into dest by the AES_KERNEL_AESNI or
+ * AES_KERNEL_VAES kernel, as EVP_EncryptUpdate in CTR mode does.
+ * Source and destination can be the same buffer.
+ */
+void aes_native_ctr(aes_native_t *n, int kernel, uint8_t *dest, const uint8_t *src, size_t len);
+
+/*
+ * Native ChaCha20 kernels, in librdrand-chacha.c.
+ */
+
+/**
+ * Check if the CPU supports the ChaCha20 AES_KERNEL_* kernel.
+ */
+int chacha_native_supported(int kernel);
+
+/**
+ * The fastest ChaCha20 AES_KERNEL_* kernel the CPU supports.
+ */
+int chacha_native_best(void);
+
+/**
+ * Set the 256 bit key and the IV: a 64 bit little endian block
+ * counter and a 64 bit nonce.
+ * @return            1 if it was successful
+ */
+int chacha_native_set_key(aes_native_t *n, const uint8_t *key, const uint8_t *iv);
+
+/**
+ * Encrypt len bytes of src into dest by the AES_KERNEL_CHACHA_AVX2 or
+ * AES_KERNEL_CHACHA_AVX512 kernel, as EVP_EncryptUpdate of
+ * EVP_chacha20 does. Source and destination can be the same buffer.
+ */
+void chacha_native_xor(aes_native_t *n, int kernel, uint8_t *dest, const uint8_t *src, size_t len);
+
+/*
+ * CTR_DRBG, in librdrand-drbg.c.
+ */
+
+/**
+ * Choose the AES_KERNEL_* kernel of the DRBG, before it is instantiated.
+ * @return            1 if the CPU supports it
+ */
+struct rdrand_drbg_s;
+int drbg_use_kernel(struct rdrand_drbg_s *drbg, int kernel);
+
 #endif  // LIBRDRAND_AES_PRIVATE_H_INCLUDED
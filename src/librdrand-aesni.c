@@ -0,0 +1,433 @@
+/* vim: set expandtab cindent fdm=marker ts=2 sw=2: */
+/*
+ * Copyright (C) 2013-2020 Jan Tulak <jan@tulak.me>
+ * Copyright (C) 2013-2022 Jirka Hladky hladky DOT jiri AT gmail DOT com
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+    Now the legal stuff is done. This file contain the native AES-CTR
+    kernels for CPUs with AES-NI and VAES. They are compiled with
+    target attributes, so the library still runs on any CPU, and
+    used only when rdrand_get_features() reports the instructions.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "./librdrand.h"
+#include "./librdrand-aes.private.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define HAVE_AES_NATIVE
+    #include <immintrin.h>
+    // VAES intrinsics are known since GCC 8
+    #if defined(__clang__) || __GNUC__ >= 8
+        #define HAVE_AES_VAES
+    #endif
+#endif
+
+// Blocks encrypted at once, so the latency of aesenc is hidden.
+#define AESNI_LANES 8
+// Blocks encrypted at once by VAES: 4 registers of 4 blocks.
+#define VAES_LANES 16
+
+/**
+ * Read a big endian 64 bit number.
+ */
+static inline uint64_t load_be64(const uint8_t *p)
+{
+	uint64_t x;
+	memcpy(&x, p, sizeof(x));
+	return __builtin_bswap64(x);
+}
+
+static inline void store_be64(uint8_t *p, uint64_t x)
+{
+	x = __builtin_bswap64(x);
+	memcpy(p, &x, sizeof(x));
+}
+
+/**
+ * Take the next counter block as two big endian halves and
+ * increment the 128 bit counter, the same way as OpenSSL does.
+ */
+static inline void ctr_next(uint64_t *hi, uint64_t *lo, uint64_t *block_hi, uint64_t *block_lo)
+{
+	*block_hi = __builtin_bswap64(*hi);
+	*block_lo = __builtin_bswap64(*lo);
+	if (++*lo == 0)
+		++*hi;
+}
+
+/**
+ * Check if the next blocks counters differ only in the last byte.
+ * Then they are made by adding to the last byte of the first one,
+ * without going through the 128 bit arithmetic for each of them.
+ */
+static inline int ctr_last_byte_only(uint64_t lo, unsigned int blocks)
+{
+	return (lo & 0xff) + blocks <= 0x100;
+}
+
+static inline void ctr_add(uint64_t *hi, uint64_t *lo, unsigned int blocks)
+{
+	*lo += blocks;
+	if (*lo < blocks)
+		++*hi;
+}
+
+#ifdef HAVE_AES_NATIVE
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+// {{{ key expansion
+static inline AESNI_TARGET __m128i key_expand_step(__m128i key, __m128i assist)
+{
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, assist);
+}
+
+// aeskeygenassist needs the round constant as an immediate
+#define KEY128_ROUND(rk, i, rcon) \
+	rk[i] = key_expand_step(rk[i-1], \
+			_mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i-1], rcon), 0xff))
+
+#define KEY256_ROUND(rk, i, rcon) \
+	rk[i] = key_expand_step(rk[i-2], \
+			_mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i-1], rcon), 0xff))
+
+#define KEY256_ROUND_ODD(rk, i) \
+	rk[i] = key_expand_step(rk[i-2], \
+			_mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i-1], 0), 0xaa))
+
+static AESNI_TARGET void aesni_expand_128(__m128i *rk, const uint8_t *key)
+{
+	rk[0] = _mm_loadu_si128((const __m128i *)key);
+	KEY128_ROUND(rk, 1, 0x01);
+	KEY128_ROUND(rk, 2, 0x02);
+	KEY128_ROUND(rk, 3, 0x04);
+	KEY128_ROUND(rk, 4, 0x08);
+	KEY128_ROUND(rk, 5, 0x10);
+	KEY128_ROUND(rk, 6, 0x20);
+	KEY128_ROUND(rk, 7, 0x40);
+	KEY128_ROUND(rk, 8, 0x80);
+	KEY128_ROUND(rk, 9, 0x1b);
+	KEY128_ROUND(rk, 10, 0x36);
+}
+
+static AESNI_TARGET void aesni_expand_256(__m128i *rk, const uint8_t *key)
+{
+	rk[0] = _mm_loadu_si128((const __m128i *)key);
+	rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+	KEY256_ROUND(rk, 2, 0x01);
+	KEY256_ROUND_ODD(rk, 3);
+	KEY256_ROUND(rk, 4, 0x02);
+	KEY256_ROUND_ODD(rk, 5);
+	KEY256_ROUND(rk, 6, 0x04);
+	KEY256_ROUND_ODD(rk, 7);
+	KEY256_ROUND(rk, 8, 0x08);
+	KEY256_ROUND_ODD(rk, 9);
+	KEY256_ROUND(rk, 10, 0x10);
+	KEY256_ROUND_ODD(rk, 11);
+	KEY256_ROUND(rk, 12, 0x20);
+	KEY256_ROUND_ODD(rk, 13);
+	KEY256_ROUND(rk, 14, 0x40);
+}
+// }}} key expansion
+
+// {{{ aesni_ctr_blocks
+/**
+ * Encrypt whole blocks, AESNI_LANES of them in parallel.
+ */
+static AESNI_TARGET void aesni_ctr_blocks(const aes_native_t *n, uint64_t *hi, uint64_t *lo,
+		uint8_t *dest, const uint8_t *src, size_t blocks)
+{
+	const __m128i *rk = (const __m128i *)n->round_keys;
+	const unsigned int rounds = n->rounds;
+	__m128i b[AESNI_LANES], k;
+	uint64_t bhi, blo;
+	unsigned int r, i;
+
+	for (; blocks >= AESNI_LANES; blocks -= AESNI_LANES)
+	{
+		k = _mm_load_si128(rk);
+		if (ctr_last_byte_only(*lo, AESNI_LANES))
+		{
+			// the last byte is the top byte of the upper 64 bit lane
+			__m128i first = _mm_set_epi64x(__builtin_bswap64(*lo), __builtin_bswap64(*hi));
+#pragma GCC unroll 8
+			for (i = 0; i < AESNI_LANES; i++)
+				b[i] = _mm_xor_si128(_mm_add_epi64(first, _mm_set_epi64x((uint64_t)i << 56, 0)), k);
+			ctr_add(hi, lo, AESNI_LANES);
+		}
+		else
+		{
+#pragma GCC unroll 8
+			for (i = 0; i < AESNI_LANES; i++)
+			{
+				ctr_next(hi, lo, &bhi, &blo);
+				b[i] = _mm_xor_si128(_mm_set_epi64x(blo, bhi), k);
+			}
+		}
+		for (r = 1; r < rounds; r++)
+		{
+			k = _mm_load_si128(rk + r);
+#pragma GCC unroll 8
+			for (i = 0; i < AESNI_LANES; i++)
+				b[i] = _mm_aesenc_si128(b[i], k);
+		}
+		k = _mm_load_si128(rk + rounds);
+#pragma GCC unroll 8
+		for (i = 0; i < AESNI_LANES; i++)
+		{
+			b[i] = _mm_aesenclast_si128(b[i], k);
+			_mm_storeu_si128((__m128i *)dest + i,
+					_mm_xor_si128(b[i], _mm_loadu_si128((const __m128i *)src + i)));
+		}
+		src += AESNI_LANES*16;
+		dest += AESNI_LANES*16;
+	}
+
+	for (; blocks; blocks--)
+	{
+		ctr_next(hi, lo, &bhi, &blo);
+		b[0] = _mm_xor_si128(_mm_set_epi64x(blo, bhi), _mm_load_si128(rk));
+		for (r = 1; r < rounds; r++)
+			b[0] = _mm_aesenc_si128(b[0], _mm_load_si128(rk + r));
+		b[0] = _mm_aesenclast_si128(b[0], _mm_load_si128(rk + rounds));
+		_mm_storeu_si128((__m128i *)dest,
+				_mm_xor_si128(b[0], _mm_loadu_si128((const __m128i *)src)));
+		src += 16;
+		dest += 16;
+	}
+}
+// }}} aesni_ctr_blocks
+
+#ifdef HAVE_AES_VAES
+#define VAES_TARGET __attribute__((target("vaes,avx512f")))
+
+// {{{ vaes_ctr_blocks
+/**
+ * Encrypt whole blocks by 512 bit VAES, VAES_LANES of them in parallel.
+ * Returns the number of blocks done, the rest is left for AES-NI.
+ */
+static VAES_TARGET size_t vaes_ctr_blocks(const aes_native_t *n, uint64_t *hi, uint64_t *lo,
+		uint8_t *dest, const uint8_t *src, size_t blocks)
+{
+	const __m128i *rk = (const __m128i *)n->round_keys;
+	const unsigned int rounds = n->rounds;
+	__m512i b[VAES_LANES/4], k;
+	uint64_t c[8];
+	size_t done;
+	unsigned int r, i, j;
+
+	for (done = 0; blocks - done >= VAES_LANES; done += VAES_LANES)
+	{
+		k = _mm512_broadcast_i32x4(_mm_load_si128(rk));
+		if (ctr_last_byte_only(*lo, VAES_LANES))
+		{
+			// the last byte is the top byte of the upper 64 bit lanes
+			__m512i first = _mm512_broadcast_i32x4(_mm_set_epi64x(__builtin_bswap64(*lo),
+						__builtin_bswap64(*hi)));
+#pragma GCC unroll 4
+			for (i = 0; i < VAES_LANES/4; i++)
+			{
+				const uint64_t base = (uint64_t)i*4;
+				b[i] = _mm512_xor_si512(_mm512_add_epi64(first, _mm512_set_epi64(
+								(base + 3) << 56, 0, (base + 2) << 56, 0,
+								(base + 1) << 56, 0, base << 56, 0)), k);
+			}
+			ctr_add(hi, lo, VAES_LANES);
+		}
+		else
+		{
+#pragma GCC unroll 4
+			for (i = 0; i < VAES_LANES/4; i++)
+			{
+				for (j = 0; j < 4; j++)
+					ctr_next(hi, lo, &c[2*j], &c[2*j + 1]);
+				b[i] = _mm512_xor_si512(_mm512_set_epi64(c[7], c[6], c[5], c[4],
+							c[3], c[2], c[1], c[0]), k);
+			}
+		}
+		for (r = 1; r < rounds; r++)
+		{
+			k = _mm512_broadcast_i32x4(_mm_load_si128(rk + r));
+#pragma GCC unroll 4
+			for (i = 0; i < VAES_LANES/4; i++)
+				b[i] = _mm512_aesenc_epi128(b[i], k);
+		}
+		k = _mm512_broadcast_i32x4(_mm_load_si128(rk + rounds));
+#pragma GCC unroll 4
+		for (i = 0; i < VAES_LANES/4; i++)
+		{
+			b[i] = _mm512_aesenclast_epi128(b[i], k);
+			_mm512_storeu_si512((__m512i *)dest + i,
+					_mm512_xor_si512(b[i], _mm512_loadu_si512((const __m512i *)src + i)));
+		}
+		src += VAES_LANES*16;
+		dest += VAES_LANES*16;
+	}
+	return done;
+}
+// }}} vaes_ctr_blocks
+#endif // HAVE_AES_VAES
+#endif // HAVE_AES_NATIVE
+
+
+/**
+ * Check if the CPU supports the AES_KERNEL_* kernel.
+ */
+// {{{ aes_native_supported
+int aes_native_supported(int kernel)
+{
+	unsigned int features = rdrand_get_features();
+	const unsigned int vaes = RDRAND_FEATURE_AESNI | RDRAND_FEATURE_VAES | RDRAND_FEATURE_AVX512F;
+
+	switch (kernel)
+	{
+	case AES_KERNEL_AUTO:
+	case AES_KERNEL_EVP:
+		return 1;
+#ifdef HAVE_AES_NATIVE
+	case AES_KERNEL_AESNI:
+		return (features & RDRAND_FEATURE_AESNI) != 0;
+#ifdef HAVE_AES_VAES
+	case AES_KERNEL_VAES:
+		return (features & vaes) == vaes;
+#endif
+#endif
+	}
+	(void) features;
+	(void) vaes;
+	return 0;
+}
+// }}} aes_native_supported
+
+/**
+ * The fastest AES_KERNEL_* kernel the CPU supports.
+ */
+// {{{ aes_native_best
+int aes_native_best(void)
+{
+	static int best = AES_KERNEL_AUTO;
+	int kernel = __atomic_load_n(&best, __ATOMIC_RELAXED);
+
+	if (kernel == AES_KERNEL_AUTO)
+	{
+		if (aes_native_supported(AES_KERNEL_VAES))
+			kernel = AES_KERNEL_VAES;
+		else if (aes_native_supported(AES_KERNEL_AESNI))
+			kernel = AES_KERNEL_AESNI;
+		else
+			kernel = AES_KERNEL_EVP;
+		__atomic_store_n(&best, kernel, __ATOMIC_RELAXED);
+	}
+	return kernel;
+}
+// }}} aes_native_best
+
+/**
+ * Expand a 128 or 256 bit key and set the counter to iv.
+ * Returns 1 if it was successful.
+ */
+// {{{ aes_native_set_key
+int aes_native_set_key(aes_native_t *n, const uint8_t *key, unsigned int bits, const uint8_t *iv)
+{
+#ifdef HAVE_AES_NATIVE
+	if (!aes_native_supported(AES_KERNEL_AESNI))
+		return 0;
+	switch (bits)
+	{
+	case 128:
+		aesni_expand_128((__m128i *)n->round_keys, key);
+		n->rounds = 10;
+		break;
+	case 256:
+		aesni_expand_256((__m128i *)n->round_keys, key);
+		n->rounds = 14;
+		break;
+	default:
+		return 0;
+	}
+	memcpy(n->counter, iv, sizeof(n->counter));
+	memset(n->keystream, 0, sizeof(n->keystream));
+	n->num = 0;
+	return 1;
+#else
+	(void) n;
+	(void) key;
+	(void) bits;
+	(void) iv;
+	return 0;
+#endif
+}
+// }}} aes_native_set_key
+
+/**
+ * Encrypt len bytes of src into dest by the AES_KERNEL_AESNI or
+ * AES_KERNEL_VAES kernel, as EVP_EncryptUpdate in CTR mode does.
+ * Source and destination can be the same buffer.
+ */
+// {{{ aes_native_ctr
+void aes_native_ctr(aes_native_t *n, int kernel, uint8_t *dest, const uint8_t *src, size_t len)
+{
+#ifdef HAVE_AES_NATIVE
+	static const uint8_t zero[16] = {0};
+	uint64_t hi, lo;
+	size_t blocks, done = 0;
+
+	// the rest of the last keystream block
+	while (n->num && len)
+	{
+		*dest++ = *src++ ^ n->keystream[n->num];
+		n->num = (n->num + 1) % 16;
+		len--;
+	}
+
+	hi = load_be64(n->counter);
+	lo = load_be64(n->counter + 8);
+	blocks = len / 16;
+#ifdef HAVE_AES_VAES
+	if (kernel == AES_KERNEL_VAES)
+		done = vaes_ctr_blocks(n, &hi, &lo, dest, src, blocks);
+#endif
+	aesni_ctr_blocks(n, &hi, &lo, dest + done*16, src + done*16, blocks - done);
+	dest += blocks*16;
+	src += blocks*16;
+	len %= 16;
+
+	// keystream of a partial block is kept for the next call
+	if (len)
+	{
+		aesni_ctr_blocks(n, &hi, &lo, n->keystream, zero, 1);
+		for (n->num = 0; n->num < len; n->num++)
+			dest[n->num] = src[n->num] ^ n->keystream[n->num];
+	}
+
+	store_be64(n->counter, hi);
+	store_be64(n->counter + 8, lo);
+#else
+	(void) n;
+	(void) kernel;
+	(void) dest;
+	(void) src;
+	(void) len;
+#endif
+}
+// }}} aes_native_ctr
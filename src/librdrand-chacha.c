@@ -0,0 +1,441 @@
+/* vim: set expandtab cindent fdm=marker ts=2 sw=2: */
+/*
+ * Copyright (C) 2013-2020 Jan Tulak <jan@tulak.me>
+ * Copyright (C) 2013-2025 Jirka Hladky hladky DOT jiri AT gmail DOT com
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+    Now the legal stuff is done. This file contain the native ChaCha20
+    kernels for CPUs with AVX2 and AVX-512. Every lane of a vector
+    register computes one block, so the kernels need no special
+    instructions, only wide registers. Like the AES kernels, they are
+    compiled with target attributes and used only when
+    rdrand_get_features() reports the instructions.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "./librdrand.h"
+#include "./librdrand.private.h"
+#include "./librdrand-aes.private.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define HAVE_CHACHA_NATIVE
+    #include <immintrin.h>
+#endif
+
+#define CHACHA_BLOCK 64
+#define CHACHA_DOUBLE_ROUNDS 10
+// Blocks computed at once: one per 32 bit lane.
+#define CHACHA_AVX2_LANES 8
+#define CHACHA_AVX512_LANES 16
+
+/*
+ * The state is kept in aes_native_t: the key in round_keys and the IV
+ * in counter, the way OpenSSL takes it: a 64 bit little endian block
+ * counter and a 64 bit nonce.
+ */
+
+static inline uint64_t load_le64(const uint8_t *p)
+{
+	uint64_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static inline void store_le64(uint8_t *p, uint64_t x)
+{
+	memcpy(p, &x, sizeof(x));
+}
+
+/**
+ * The input words of the ChaCha20 block function without the counter.
+ */
+static void chacha_words(const aes_native_t *n, uint32_t *w)
+{
+	w[0] = 0x61707865;
+	w[1] = 0x3320646e;
+	w[2] = 0x79622d32;
+	w[3] = 0x6b206574;
+	memcpy(w + 4, n->round_keys, 32);
+	w[12] = 0;
+	w[13] = 0;
+	memcpy(w + 14, n->counter + 8, 8);
+}
+
+/**
+ * Counters of the lanes: the low and the high words of the
+ * 64 bit counter, so a carry gets into the next word as in OpenSSL.
+ */
+static inline void chacha_lane_counters(uint64_t counter, uint32_t *lo, uint32_t *hi,
+		unsigned int lanes)
+{
+	unsigned int i;
+
+	for (i = 0; i < lanes; i++)
+	{
+		lo[i] = (uint32_t)(counter + i);
+		hi[i] = (uint32_t)((counter + i) >> 32);
+	}
+}
+
+#ifdef HAVE_CHACHA_NATIVE
+#define CHACHA_AVX2_TARGET __attribute__((target("avx2")))
+
+// {{{ chacha_avx2_blocks
+#define AVX2_ROTL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+// rotations by whole bytes are byte shuffles
+#define AVX2_QR(x, a, b, c, d) \
+	do { \
+		x[a] = _mm256_add_epi32(x[a], x[b]); \
+		x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot16); \
+		x[c] = _mm256_add_epi32(x[c], x[d]); \
+		x[b] = AVX2_ROTL(_mm256_xor_si256(x[b], x[c]), 12); \
+		x[a] = _mm256_add_epi32(x[a], x[b]); \
+		x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot8); \
+		x[c] = _mm256_add_epi32(x[c], x[d]); \
+		x[b] = AVX2_ROTL(_mm256_xor_si256(x[b], x[c]), 7); \
+	} while (0)
+
+/**
+ * Transpose 8 rows of 8 words, so row i gets the words of lane i,
+ * and XOR them into 32 bytes of each of the 8 blocks.
+ */
+static inline CHACHA_AVX2_TARGET void avx2_transpose_xor(const __m256i *x,
+		uint8_t *dest, const uint8_t *src)
+{
+	__m256i t[8], u[8];
+	unsigned int i;
+
+	for (i = 0; i < 8; i += 2)
+	{
+		t[i] = _mm256_unpacklo_epi32(x[i], x[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(x[i], x[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4)
+	{
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	// u[i] has lanes i and i+4 of rows 0-3, u[i+4] of rows 4-7
+	for (i = 0; i < 4; i++)
+	{
+		_mm256_storeu_si256((__m256i *)(dest + i*CHACHA_BLOCK), _mm256_xor_si256(
+					_mm256_permute2x128_si256(u[i], u[i + 4], 0x20),
+					_mm256_loadu_si256((const __m256i *)(src + i*CHACHA_BLOCK))));
+		_mm256_storeu_si256((__m256i *)(dest + (i + 4)*CHACHA_BLOCK), _mm256_xor_si256(
+					_mm256_permute2x128_si256(u[i], u[i + 4], 0x31),
+					_mm256_loadu_si256((const __m256i *)(src + (i + 4)*CHACHA_BLOCK))));
+	}
+}
+
+/**
+ * Encrypt whole blocks, CHACHA_AVX2_LANES of them in parallel.
+ * Returns the number of blocks done, the rest is left to the caller.
+ */
+static CHACHA_AVX2_TARGET size_t chacha_avx2_blocks(const aes_native_t *n, uint64_t *counter,
+		uint8_t *dest, const uint8_t *src, size_t blocks)
+{
+	const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+			13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+	const __m256i rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+			14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+	uint32_t w[16], lo[CHACHA_AVX2_LANES], hi[CHACHA_AVX2_LANES];
+	__m256i s[16], x[16];
+	size_t done;
+	unsigned int r, i;
+
+	chacha_words(n, w);
+	for (i = 0; i < 16; i++)
+		s[i] = _mm256_set1_epi32(w[i]);
+
+	for (done = 0; blocks - done >= CHACHA_AVX2_LANES; done += CHACHA_AVX2_LANES)
+	{
+		chacha_lane_counters(*counter, lo, hi, CHACHA_AVX2_LANES);
+		s[12] = _mm256_loadu_si256((const __m256i *)lo);
+		s[13] = _mm256_loadu_si256((const __m256i *)hi);
+		for (i = 0; i < 16; i++)
+			x[i] = s[i];
+		for (r = 0; r < CHACHA_DOUBLE_ROUNDS; r++)
+		{
+			AVX2_QR(x, 0, 4, 8, 12);
+			AVX2_QR(x, 1, 5, 9, 13);
+			AVX2_QR(x, 2, 6, 10, 14);
+			AVX2_QR(x, 3, 7, 11, 15);
+			AVX2_QR(x, 0, 5, 10, 15);
+			AVX2_QR(x, 1, 6, 11, 12);
+			AVX2_QR(x, 2, 7, 8, 13);
+			AVX2_QR(x, 3, 4, 9, 14);
+		}
+		for (i = 0; i < 16; i++)
+			x[i] = _mm256_add_epi32(x[i], s[i]);
+		avx2_transpose_xor(x, dest, src);
+		avx2_transpose_xor(x + 8, dest + 32, src + 32);
+
+		*counter += CHACHA_AVX2_LANES;
+		src += CHACHA_AVX2_LANES*CHACHA_BLOCK;
+		dest += CHACHA_AVX2_LANES*CHACHA_BLOCK;
+	}
+	return done;
+}
+// }}} chacha_avx2_blocks
+
+#define CHACHA_AVX512_TARGET __attribute__((target("avx512f")))
+
+// {{{ chacha_avx512_blocks
+#define AVX512_QR(x, a, b, c, d) \
+	do { \
+		x[a] = _mm512_add_epi32(x[a], x[b]); \
+		x[d] = _mm512_rol_epi32(_mm512_xor_si512(x[d], x[a]), 16); \
+		x[c] = _mm512_add_epi32(x[c], x[d]); \
+		x[b] = _mm512_rol_epi32(_mm512_xor_si512(x[b], x[c]), 12); \
+		x[a] = _mm512_add_epi32(x[a], x[b]); \
+		x[d] = _mm512_rol_epi32(_mm512_xor_si512(x[d], x[a]), 8); \
+		x[c] = _mm512_add_epi32(x[c], x[d]); \
+		x[b] = _mm512_rol_epi32(_mm512_xor_si512(x[b], x[c]), 7); \
+	} while (0)
+
+/**
+ * Transpose 16 rows of 16 words, so row i gets the words of lane i,
+ * and XOR them into the 16 blocks.
+ */
+static inline CHACHA_AVX512_TARGET void avx512_transpose_xor(const __m512i *x,
+		uint8_t *dest, const uint8_t *src)
+{
+	__m512i t[4], u[16], a, b, c, d, o[4];
+	unsigned int i, j;
+
+	// 4x4 words in every 128 bit lane: u[4*g + k] has words 4g..4g+3
+	// of lanes k, k+4, k+8 and k+12
+	for (i = 0; i < 16; i += 4)
+	{
+		t[0] = _mm512_unpacklo_epi32(x[i], x[i + 1]);
+		t[1] = _mm512_unpackhi_epi32(x[i], x[i + 1]);
+		t[2] = _mm512_unpacklo_epi32(x[i + 2], x[i + 3]);
+		t[3] = _mm512_unpackhi_epi32(x[i + 2], x[i + 3]);
+		u[i] = _mm512_unpacklo_epi64(t[0], t[2]);
+		u[i + 1] = _mm512_unpackhi_epi64(t[0], t[2]);
+		u[i + 2] = _mm512_unpacklo_epi64(t[1], t[3]);
+		u[i + 3] = _mm512_unpackhi_epi64(t[1], t[3]);
+	}
+	// then 4x4 of the 128 bit lanes
+	for (i = 0; i < 4; i++)
+	{
+		a = _mm512_shuffle_i32x4(u[i], u[i + 4], 0x44);
+		b = _mm512_shuffle_i32x4(u[i], u[i + 4], 0xee);
+		c = _mm512_shuffle_i32x4(u[i + 8], u[i + 12], 0x44);
+		d = _mm512_shuffle_i32x4(u[i + 8], u[i + 12], 0xee);
+		o[0] = _mm512_shuffle_i32x4(a, c, 0x88);
+		o[1] = _mm512_shuffle_i32x4(a, c, 0xdd);
+		o[2] = _mm512_shuffle_i32x4(b, d, 0x88);
+		o[3] = _mm512_shuffle_i32x4(b, d, 0xdd);
+		for (j = 0; j < 4; j++)
+		{
+			const size_t off = (i + 4*j)*CHACHA_BLOCK;
+			_mm512_storeu_si512((__m512i *)(dest + off), _mm512_xor_si512(o[j],
+						_mm512_loadu_si512((const __m512i *)(src + off))));
+		}
+	}
+}
+
+/**
+ * Encrypt whole blocks, CHACHA_AVX512_LANES of them in parallel.
+ * Returns the number of blocks done, the rest is left to the caller.
+ */
+static CHACHA_AVX512_TARGET size_t chacha_avx512_blocks(const aes_native_t *n, uint64_t *counter,
+		uint8_t *dest, const uint8_t *src, size_t blocks)
+{
+	uint32_t w[16], lo[CHACHA_AVX512_LANES], hi[CHACHA_AVX512_LANES];
+	__m512i s[16], x[16];
+	size_t done;
+	unsigned int r, i;
+
+	chacha_words(n, w);
+	for (i = 0; i < 16; i++)
+		s[i] = _mm512_set1_epi32(w[i]);
+
+	for (done = 0; blocks - done >= CHACHA_AVX512_LANES; done += CHACHA_AVX512_LANES)
+	{
+		chacha_lane_counters(*counter, lo, hi, CHACHA_AVX512_LANES);
+		s[12] = _mm512_loadu_si512((const void *)lo);
+		s[13] = _mm512_loadu_si512((const void *)hi);
+		for (i = 0; i < 16; i++)
+			x[i] = s[i];
+		for (r = 0; r < CHACHA_DOUBLE_ROUNDS; r++)
+		{
+			AVX512_QR(x, 0, 4, 8, 12);
+			AVX512_QR(x, 1, 5, 9, 13);
+			AVX512_QR(x, 2, 6, 10, 14);
+			AVX512_QR(x, 3, 7, 11, 15);
+			AVX512_QR(x, 0, 5, 10, 15);
+			AVX512_QR(x, 1, 6, 11, 12);
+			AVX512_QR(x, 2, 7, 8, 13);
+			AVX512_QR(x, 3, 4, 9, 14);
+		}
+		for (i = 0; i < 16; i++)
+			x[i] = _mm512_add_epi32(x[i], s[i]);
+		avx512_transpose_xor(x, dest, src);
+
+		*counter += CHACHA_AVX512_LANES;
+		src += CHACHA_AVX512_LANES*CHACHA_BLOCK;
+		dest += CHACHA_AVX512_LANES*CHACHA_BLOCK;
+	}
+	return done;
+}
+// }}} chacha_avx512_blocks
+#endif // HAVE_CHACHA_NATIVE
+
+
+/**
+ * Check if the CPU supports the ChaCha20 AES_KERNEL_* kernel.
+ */
+// {{{ chacha_native_supported
+int chacha_native_supported(int kernel)
+{
+	unsigned int features = rdrand_get_features();
+	const unsigned int avx512 = RDRAND_FEATURE_AVX2 | RDRAND_FEATURE_AVX512F;
+
+	switch (kernel)
+	{
+	case AES_KERNEL_AUTO:
+	case AES_KERNEL_EVP:
+		return 1;
+#ifdef HAVE_CHACHA_NATIVE
+	case AES_KERNEL_CHACHA_AVX2:
+		return (features & RDRAND_FEATURE_AVX2) != 0;
+	case AES_KERNEL_CHACHA_AVX512:
+		return (features & avx512) == avx512;
+#endif
+	}
+	(void) features;
+	(void) avx512;
+	return 0;
+}
+// }}} chacha_native_supported
+
+/**
+ * The fastest ChaCha20 AES_KERNEL_* kernel the CPU supports.
+ */
+// {{{ chacha_native_best
+int chacha_native_best(void)
+{
+	static int best = AES_KERNEL_AUTO;
+	int kernel = __atomic_load_n(&best, __ATOMIC_RELAXED);
+
+	if (kernel == AES_KERNEL_AUTO)
+	{
+		if (chacha_native_supported(AES_KERNEL_CHACHA_AVX512))
+			kernel = AES_KERNEL_CHACHA_AVX512;
+		else if (chacha_native_supported(AES_KERNEL_CHACHA_AVX2))
+			kernel = AES_KERNEL_CHACHA_AVX2;
+		else
+			kernel = AES_KERNEL_EVP;
+		__atomic_store_n(&best, kernel, __ATOMIC_RELAXED);
+	}
+	return kernel;
+}
+// }}} chacha_native_best
+
+/**
+ * Set the 256 bit key and the IV: a 64 bit little endian block
+ * counter and a 64 bit nonce, as EVP_chacha20 takes it.
+ * Returns 1 if it was successful.
+ */
+// {{{ chacha_native_set_key
+int chacha_native_set_key(aes_native_t *n, const uint8_t *key, const uint8_t *iv)
+{
+#ifdef HAVE_CHACHA_NATIVE
+	memcpy(n->round_keys, key, 32);
+	n->rounds = 2*CHACHA_DOUBLE_ROUNDS;
+	memcpy(n->counter, iv, sizeof(n->counter));
+	memset(n->keystream, 0, sizeof(n->keystream));
+	n->num = 0;
+	return 1;
+#else
+	(void) n;
+	(void) key;
+	(void) iv;
+	return 0;
+#endif
+}
+// }}} chacha_native_set_key
+
+/**
+ * Encrypt len bytes of src into dest by the AES_KERNEL_CHACHA_AVX2 or
+ * AES_KERNEL_CHACHA_AVX512 kernel, as EVP_EncryptUpdate of
+ * EVP_chacha20 does. Source and destination can be the same buffer.
+ */
+// {{{ chacha_native_xor
+void chacha_native_xor(aes_native_t *n, int kernel, uint8_t *dest, const uint8_t *src, size_t len)
+{
+#ifdef HAVE_CHACHA_NATIVE
+	static const uint8_t zero[CHACHA_AVX2_LANES*CHACHA_BLOCK] = {0};
+	uint8_t ks[CHACHA_AVX2_LANES*CHACHA_BLOCK];
+	uint64_t counter;
+	size_t blocks, done = 0, i;
+
+	// the rest of the last keystream block
+	while (n->num && len)
+	{
+		*dest++ = *src++ ^ n->keystream[n->num];
+		n->num = (n->num + 1) % CHACHA_BLOCK;
+		len--;
+	}
+
+	counter = load_le64(n->counter);
+	blocks = len / CHACHA_BLOCK;
+	if (kernel == AES_KERNEL_CHACHA_AVX512)
+		done = chacha_avx512_blocks(n, &counter, dest, src, blocks);
+	done += chacha_avx2_blocks(n, &counter, dest + done*CHACHA_BLOCK,
+			src + done*CHACHA_BLOCK, blocks - done);
+	dest += done*CHACHA_BLOCK;
+	src += done*CHACHA_BLOCK;
+	len -= done*CHACHA_BLOCK;
+
+	// less than a batch: the unused blocks of its keystream are dropped,
+	// the keystream of a partial block is kept for the next call
+	if (len)
+	{
+		uint64_t next = counter;
+
+		chacha_avx2_blocks(n, &next, ks, zero, CHACHA_AVX2_LANES);
+		for (i = 0; i < len; i++)
+			dest[i] = src[i] ^ ks[i];
+		counter += len / CHACHA_BLOCK;
+		n->num = len % CHACHA_BLOCK;
+		if (n->num)
+		{
+			memcpy(n->keystream, ks + (len - n->num), CHACHA_BLOCK);
+			counter++;
+		}
+		rdrand_wipe(ks, sizeof(ks));
+	}
+
+	store_le64(n->counter, counter);
+#else
+	(void) n;
+	(void) kernel;
+	(void) dest;
+	(void) src;
+	(void) len;
+#endif
+}
+// }}} chacha_native_xor
@@ -0,0 +1,625 @@
+/* vim: set expandtab cindent fdm=marker ts=2 sw=2: */
+/*
+ * Copyright (C) 2013-2020 Jan Tulak <jan@tulak.me>
+ * Copyright (C) 2013-2025 Jirka Hladky hladky DOT jiri AT gmail DOT com
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+    Now the legal stuff is done. This file contain the CTR_DRBG
+    of NIST SP 800-90A (AES-256, with the derivation function),
+    seeded by RdSeed or RdRand.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include "./librdrand.h"
+#include "./librdrand-aes.private.h"
+#include "./librdrand-drbg.h"
+#include "./librdrand.private.h"
+
+
+#define DRBG_KEY_LEN    32
+#define DRBG_BLOCK_LEN  16
+// seedlen of SP 800-90A, key and V
+#define DRBG_SEED_LEN   (DRBG_KEY_LEN + DRBG_BLOCK_LEN)
+
+// Entropy input (with the nonce) taken from RdSeed
+#define DRBG_ENTROPY_LEN DRBG_SEED_LEN
+// RdRand is a DRBG reseeded at least every 512 outputs, so this many
+// times more of its values are compressed into a seed by the
+// derivation function.
+#define DRBG_RDRAND_FACTOR 512
+
+// Keystream is generated through L1 cache in pieces of this size
+#define DRBG_PIECE 4096
+
+/**
+ * The state of SP 800-90A CTR_DRBG and the expanded AES key.
+ */
+struct rdrand_drbg_s {
+	/** the memory of this struct */
+	aes_arena_t arena;
+	/** AES_KERNEL_* enum */
+	int kernel;
+	aes_native_t native;
+	/** used with AES_KERNEL_EVP only */
+	EVP_CIPHER_CTX *evp;
+	uint8_t key[DRBG_KEY_LEN];
+	uint8_t v[DRBG_BLOCK_LEN];
+	uint64_t reseed_counter;
+	uint64_t reseed_interval;
+	int instantiated;
+	/** seeded from the CPU, so it can be reseeded from it */
+	int hw_seeded;
+	/** fork generation of the state, see drbg_atfork_child */
+	unsigned long generation;
+};
+
+/** A part of the input of the derivation function. */
+typedef struct drbg_piece_s {
+	const void *data;
+	size_t len;
+} drbg_piece_t;
+
+/** incremented in the child after fork */
+static unsigned long drbg_generation = 0;
+/** instances created, for the personalization of thread DRBGs */
+static unsigned long drbg_instances = 0;
+
+static pthread_once_t drbg_once = PTHREAD_ONCE_INIT;
+static pthread_key_t drbg_key;
+static __thread rdrand_drbg_t *thread_drbg = NULL;
+
+
+// {{{ helpers
+/**
+ * Add n to the 128 bit big endian counter.
+ */
+static void drbg_ctr_add(uint8_t *ctr, uint64_t n)
+{
+	int i;
+	unsigned int carry;
+
+	for (i = DRBG_BLOCK_LEN - 1; i >= 0 && n; i--)
+	{
+		carry = ctr[i] + (n & 0xff);
+		ctr[i] = carry & 0xff;
+		n = (n >> 8) + (carry >> 8);
+	}
+}
+
+static void drbg_atfork_child(void)
+{
+	drbg_generation++;
+}
+
+static void drbg_thread_destroy(void *arg)
+{
+	rdrand_drbg_destroy(arg);
+}
+
+static void drbg_init_once(void)
+{
+	pthread_key_create(&drbg_key, drbg_thread_destroy);
+	pthread_atfork(NULL, NULL, drbg_atfork_child);
+}
+// }}} helpers
+
+// {{{ block cipher
+/**
+ * Expand the AES-256 key for the kernel of the DRBG.
+ * Returns 1 on success.
+ */
+static int drbg_set_key(rdrand_drbg_t *d, const uint8_t *key)
+{
+	static const uint8_t zero[DRBG_BLOCK_LEN];
+
+	if (d->kernel != AES_KERNEL_EVP)
+		return aes_native_set_key(&d->native, key, 256, zero);
+	return EVP_EncryptInit_ex(d->evp, EVP_aes_256_ctr(), NULL, key, zero) == 1;
+}
+
+/**
+ * Write len bytes of the keystream of the current key, starting
+ * with the block encrypted from ctr, into dest.
+ * Returns 1 on success.
+ */
+static int drbg_keystream(rdrand_drbg_t *d, const uint8_t *ctr, uint8_t *dest, size_t len)
+{
+	size_t done, piece;
+	int out_len;
+
+	if (d->kernel != AES_KERNEL_EVP)
+	{
+		memcpy(d->native.counter, ctr, DRBG_BLOCK_LEN);
+		d->native.num = 0;
+	}
+	else if (EVP_EncryptInit_ex(d->evp, NULL, NULL, NULL, ctr) != 1)
+		return 0;
+
+	for (done = 0; done < len; done += piece)
+	{
+		piece = len - done < DRBG_PIECE ? len - done : DRBG_PIECE;
+		memset(dest + done, 0, piece);
+		if (d->kernel != AES_KERNEL_EVP)
+			aes_native_ctr(&d->native, d->kernel, dest + done, dest + done, piece);
+		else if (EVP_EncryptUpdate(d->evp, dest + done, &out_len, dest + done, piece) != 1)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Encrypt one block by the current key.
+ */
+static int drbg_block(rdrand_drbg_t *d, const uint8_t *in, uint8_t *out)
+{
+	uint8_t x[DRBG_BLOCK_LEN];
+	int result;
+
+	memcpy(x, in, DRBG_BLOCK_LEN);
+	result = drbg_keystream(d, x, out, DRBG_BLOCK_LEN);
+	rdrand_wipe(x, sizeof(x));
+	return result;
+}
+// }}} block cipher
+
+// {{{ derivation function
+/**
+ * The three BCC chains of Block_Cipher_df, computed over the
+ * input at once.
+ */
+typedef struct drbg_df_s {
+	uint8_t chain[3][DRBG_BLOCK_LEN];
+	uint8_t block[DRBG_BLOCK_LEN];
+	size_t fill;
+	int result;
+} drbg_df_t;
+
+static void drbg_df_absorb(rdrand_drbg_t *d, drbg_df_t *df, const uint8_t *data, size_t len)
+{
+	size_t n;
+	unsigned int i, j;
+
+	while (len)
+	{
+		n = DRBG_BLOCK_LEN - df->fill < len ? DRBG_BLOCK_LEN - df->fill : len;
+		memcpy(df->block + df->fill, data, n);
+		df->fill += n;
+		data += n;
+		len -= n;
+		if (df->fill < DRBG_BLOCK_LEN)
+			break;
+
+		for (i = 0; i < 3; i++)
+		{
+			for (j = 0; j < DRBG_BLOCK_LEN; j++)
+				df->chain[i][j] ^= df->block[j];
+			df->result &= drbg_block(d, df->chain[i], df->chain[i]);
+		}
+		df->fill = 0;
+	}
+}
+
+/**
+ * Block_Cipher_df of SP 800-90A: derive DRBG_SEED_LEN bytes from
+ * the concatenation of the pieces. The DRBG key is restored after.
+ * Returns 1 on success.
+ */
+static int drbg_df(rdrand_drbg_t *d, const drbg_piece_t *pieces, unsigned int count, uint8_t *out)
+{
+	static const uint8_t pad[DRBG_BLOCK_LEN] = {0x80};
+	uint8_t key[DRBG_KEY_LEN], x[DRBG_BLOCK_LEN], header[8];
+	uint64_t input_len = 0;
+	drbg_df_t df;
+	unsigned int i;
+	int result;
+
+	for (i = 0; i < count; i++)
+		input_len += pieces[i].len;
+	// L and N as 32 bit big endian numbers
+	for (i = 0; i < 4; i++)
+	{
+		header[i] = (input_len >> (24 - 8*i)) & 0xff;
+		header[4 + i] = (DRBG_SEED_LEN >> (24 - 8*i)) & 0xff;
+	}
+
+	for (i = 0; i < DRBG_KEY_LEN; i++)
+		key[i] = i;
+	memset(&df, 0, sizeof(df));
+	df.result = drbg_set_key(d, key);
+
+	// every chain starts with its number i as the IV block
+	for (i = 0; i < 3; i++)
+	{
+		memset(x, 0, sizeof(x));
+		x[3] = i;
+		df.result &= drbg_block(d, x, df.chain[i]);
+	}
+	drbg_df_absorb(d, &df, header, sizeof(header));
+	for (i = 0; i < count; i++)
+		drbg_df_absorb(d, &df, pieces[i].data, pieces[i].len);
+	// 0x80 and zeros up to the end of the block
+	drbg_df_absorb(d, &df, pad, DRBG_BLOCK_LEN - df.fill);
+
+	memcpy(key, df.chain[0], DRBG_BLOCK_LEN);
+	memcpy(key + DRBG_BLOCK_LEN, df.chain[1], DRBG_BLOCK_LEN);
+	memcpy(x, df.chain[2], DRBG_BLOCK_LEN);
+	result = df.result && drbg_set_key(d, key);
+	for (i = 0; i < DRBG_SEED_LEN / DRBG_BLOCK_LEN; i++)
+	{
+		result = result && drbg_block(d, x, x);
+		memcpy(out + i*DRBG_BLOCK_LEN, x, DRBG_BLOCK_LEN);
+	}
+	result = result && drbg_set_key(d, d->key);
+
+	rdrand_wipe(&df, sizeof(df));
+	rdrand_wipe(key, sizeof(key));
+	rdrand_wipe(x, sizeof(x));
+	return result;
+}
+// }}} derivation function
+
+// {{{ drbg mechanisms
+/**
+ * CTR_DRBG_Update of SP 800-90A with provided data of DRBG_SEED_LEN.
+ */
+static int drbg_update(rdrand_drbg_t *d, const uint8_t *provided)
+{
+	uint8_t temp[DRBG_SEED_LEN], ctr[DRBG_BLOCK_LEN];
+	unsigned int i;
+	int result;
+
+	memcpy(ctr, d->v, DRBG_BLOCK_LEN);
+	drbg_ctr_add(ctr, 1);
+	result = drbg_keystream(d, ctr, temp, DRBG_SEED_LEN);
+	for (i = 0; i < DRBG_SEED_LEN; i++)
+		temp[i] ^= provided[i];
+	memcpy(d->key, temp, DRBG_KEY_LEN);
+	memcpy(d->v, temp + DRBG_KEY_LEN, DRBG_BLOCK_LEN);
+	result = result && drbg_set_key(d, d->key);
+
+	rdrand_wipe(temp, sizeof(temp));
+	rdrand_wipe(ctr, sizeof(ctr));
+	return result;
+}
+
+/**
+ * Instantiate or reseed by the derivation function of the pieces.
+ */
+static int drbg_seed(rdrand_drbg_t *d, const drbg_piece_t *pieces, unsigned int count, int instantiate)
+{
+	uint8_t seed[DRBG_SEED_LEN];
+	int result;
+
+	if (instantiate)
+	{
+		memset(d->key, 0, sizeof(d->key));
+		memset(d->v, 0, sizeof(d->v));
+		d->instantiated = 0;
+	}
+	result = drbg_df(d, pieces, count, seed) && drbg_update(d, seed);
+	rdrand_wipe(seed, sizeof(seed));
+	if (!result)
+		return 0;
+
+	d->reseed_counter = 1;
+	d->instantiated = 1;
+	d->generation = drbg_generation;
+	return 1;
+}
+
+/**
+ * Get entropy input from RdSeed, or much more of RdRand values
+ * when RdSeed doesn't give enough. The input is appended as a piece
+ * and has to be freed by drbg_entropy_free.
+ * Returns 1 on success.
+ */
+static int drbg_entropy(drbg_piece_t *piece)
+{
+	unsigned int features = rdrand_get_features();
+	size_t len = DRBG_ENTROPY_LEN;
+	uint8_t *buf;
+
+	buf = malloc(DRBG_ENTROPY_LEN * DRBG_RDRAND_FACTOR);
+	if (buf == NULL)
+		return 0;
+
+	if (!(features & RDRAND_FEATURE_RDSEED)
+			|| rdseed_get_bytes_retry(buf, DRBG_ENTROPY_LEN, -1) != DRBG_ENTROPY_LEN)
+	{
+		len = DRBG_ENTROPY_LEN * DRBG_RDRAND_FACTOR;
+		if (!(features & RDRAND_FEATURE_RDRAND)
+				|| rdrand_get_bytes_retry(buf, len, -1) != len)
+		{
+			rdrand_wipe(buf, len);
+			free(buf);
+			return 0;
+		}
+	}
+	piece->data = buf;
+	piece->len = len;
+	return 1;
+}
+
+static void drbg_entropy_free(drbg_piece_t *piece)
+{
+	rdrand_wipe((void *)piece->data, piece->len);
+	free((void *)piece->data);
+	piece->data = NULL;
+	piece->len = 0;
+}
+
+/**
+ * One generate request of SP 800-90A, len <= RDRAND_DRBG_MAX_REQUEST.
+ */
+static int drbg_generate_request(rdrand_drbg_t *d, uint8_t *dest, size_t len,
+		const void *additional, size_t additional_len)
+{
+	static const uint8_t zero[DRBG_SEED_LEN];
+	uint8_t add[DRBG_SEED_LEN], ctr[DRBG_BLOCK_LEN];
+	drbg_piece_t piece = {additional, additional_len};
+	int result = 1;
+
+	if (additional_len)
+		result = drbg_df(d, &piece, 1, add) && drbg_update(d, add);
+
+	memcpy(ctr, d->v, DRBG_BLOCK_LEN);
+	drbg_ctr_add(ctr, 1);
+	result = result && drbg_keystream(d, ctr, dest, len);
+	// V is the counter of the last block used
+	drbg_ctr_add(d->v, (len + DRBG_BLOCK_LEN - 1) / DRBG_BLOCK_LEN);
+
+	result = result && drbg_update(d, additional_len ? add : zero);
+	d->reseed_counter++;
+
+	rdrand_wipe(add, sizeof(add));
+	rdrand_wipe(ctr, sizeof(ctr));
+	return result;
+}
+// }}} drbg mechanisms
+
+
+/**
+ * Create a new DRBG instance, not instantiated yet.
+ * The state is kept in locked memory.
+ */
+// {{{ rdrand_drbg_create
+rdrand_drbg_t *rdrand_drbg_create(void)
+{
+	rdrand_drbg_t *d;
+	aes_arena_t arena = {0};
+
+	// every instance has to see the forks, not only the thread ones
+	pthread_once(&drbg_once, drbg_init_once);
+	d = keys_arena_create(&arena, sizeof(rdrand_drbg_t));
+	if (d == NULL)
+		return NULL;
+	d->arena = arena;
+	d->kernel = aes_native_best();
+	d->evp = EVP_CIPHER_CTX_new();
+	d->reseed_interval = RDRAND_DRBG_DEFAULT_RESEED_INTERVAL;
+	if (d->evp == NULL)
+	{
+		keys_arena_destroy(&arena);
+		return NULL;
+	}
+	return d;
+}
+// }}} rdrand_drbg_create
+
+/**
+ * Choose the AES_KERNEL_* kernel of the DRBG, before it is instantiated.
+ * Returns 1 if the CPU supports it.
+ */
+// {{{ drbg_use_kernel
+int drbg_use_kernel(rdrand_drbg_t *d, int kernel)
+{
+	if (kernel == AES_KERNEL_AUTO)
+		kernel = aes_native_best();
+	if (!aes_native_supported(kernel))
+		return 0;
+	d->kernel = kernel;
+	d->instantiated = 0;
+	return 1;
+}
+// }}} drbg_use_kernel
+
+/**
+ * Instantiate the DRBG with entropy from RdSeed, or RdRand when
+ * the CPU doesn't have RdSeed or it doesn't give enough values.
+ * Returns 1 on success.
+ */
+// {{{ rdrand_drbg_instantiate
+int rdrand_drbg_instantiate(rdrand_drbg_t *d, const void *pers, size_t pers_len)
+{
+	drbg_piece_t pieces[2] = {{NULL, 0}, {pers, pers_len}};
+	int result;
+
+	if (drbg_entropy(&pieces[0]) == 0)
+		return 0;
+	result = drbg_seed(d, pieces, 2, 1);
+	drbg_entropy_free(&pieces[0]);
+	d->hw_seeded = result;
+	return result;
+}
+// }}} rdrand_drbg_instantiate
+
+/**
+ * Instantiate the DRBG with the given entropy input and nonce.
+ * Such instance is never reseeded automatically.
+ * Returns 1 on success.
+ */
+// {{{ rdrand_drbg_instantiate_with
+int rdrand_drbg_instantiate_with(rdrand_drbg_t *d,
+		const void *entropy, size_t entropy_len,
+		const void *nonce, size_t nonce_len,
+		const void *pers, size_t pers_len)
+{
+	drbg_piece_t pieces[3] = {
+		{entropy, entropy_len},
+		{nonce, nonce_len},
+		{pers, pers_len}
+	};
+
+	d->hw_seeded = 0;
+	return drbg_seed(d, pieces, 3, 1);
+}
+// }}} rdrand_drbg_instantiate_with
+
+/**
+ * Reseed the DRBG with entropy from the CPU.
+ * Returns 1 on success.
+ */
+// {{{ rdrand_drbg_reseed
+int rdrand_drbg_reseed(rdrand_drbg_t *d, const void *additional, size_t additional_len)
+{
+	drbg_piece_t pieces[2] = {{NULL, 0}, {additional, additional_len}};
+	int result;
+
+	if (!d->instantiated || drbg_entropy(&pieces[0]) == 0)
+		return 0;
+	result = drbg_seed(d, pieces, 2, 0);
+	drbg_entropy_free(&pieces[0]);
+	return result;
+}
+// }}} rdrand_drbg_reseed
+
+/**
+ * Reseed the DRBG with the given entropy input.
+ * Returns 1 on success.
+ */
+// {{{ rdrand_drbg_reseed_with
+int rdrand_drbg_reseed_with(rdrand_drbg_t *d,
+		const void *entropy, size_t entropy_len,
+		const void *additional, size_t additional_len)
+{
+	drbg_piece_t pieces[2] = {{entropy, entropy_len}, {additional, additional_len}};
+
+	if (!d->instantiated)
+		return 0;
+	return drbg_seed(d, pieces, 2, 0);
+}
+// }}} rdrand_drbg_reseed_with
+
+/**
+ * Set the number of requests after which the DRBG is reseeded.
+ * Returns 1 if the interval was set.
+ */
+// {{{ rdrand_drbg_set_reseed_interval
+int rdrand_drbg_set_reseed_interval(rdrand_drbg_t *d, unsigned long long requests)
+{
+	if (requests == 0 || requests > RDRAND_DRBG_MAX_RESEED_INTERVAL)
+		return 0;
+	d->reseed_interval = requests;
+	return 1;
+}
+// }}} rdrand_drbg_set_reseed_interval
+
+/**
+ * Generate len bytes into dest, in requests of up to
+ * RDRAND_DRBG_MAX_REQUEST bytes.
+ * Returns the amount of generated bytes.
+ */
+// {{{ rdrand_drbg_generate
+size_t rdrand_drbg_generate(rdrand_drbg_t *d, void *dest, size_t len,
+		const void *additional, size_t additional_len)
+{
+	uint8_t *out = dest;
+	size_t done, request;
+
+	if (!d->instantiated)
+		return 0;
+
+	for (done = 0; done < len; done += request)
+	{
+		// a child must not continue with the state of its parent
+		if (d->hw_seeded && (d->reseed_counter > d->reseed_interval
+					|| d->generation != drbg_generation))
+		{
+			if (rdrand_drbg_reseed(d, NULL, 0) == 0)
+				break;
+		}
+		else if (d->reseed_counter > RDRAND_DRBG_MAX_RESEED_INTERVAL)
+			break;
+
+		request = len - done < RDRAND_DRBG_MAX_REQUEST ? len - done : RDRAND_DRBG_MAX_REQUEST;
+		if (drbg_generate_request(d, out + done, request, additional, additional_len) == 0)
+			break;
+	}
+	return done;
+}
+// }}} rdrand_drbg_generate
+
+/**
+ * Destroy the instance: wipe its state and free it.
+ */
+// {{{ rdrand_drbg_destroy
+void rdrand_drbg_destroy(rdrand_drbg_t *d)
+{
+	aes_arena_t arena;
+
+	if (d == NULL)
+		return;
+	EVP_CIPHER_CTX_free(d->evp);
+	arena = d->arena;
+	keys_arena_destroy(&arena);
+}
+// }}} rdrand_drbg_destroy
+
+/**
+ * Generate len bytes by the DRBG of the calling thread.
+ * Returns the amount of generated bytes.
+ */
+// {{{ rdrand_drbg_get_bytes
+size_t rdrand_drbg_get_bytes(void *dest, size_t len)
+{
+	rdrand_drbg_t *d = thread_drbg;
+	struct {
+		unsigned long instance;
+		pid_t pid;
+		struct timespec time;
+	} pers;
+
+	if (d == NULL)
+	{
+		d = rdrand_drbg_create();
+		if (d == NULL)
+			return 0;
+
+		// every thread DRBG has a personalization string of its own
+		memset(&pers, 0, sizeof(pers));
+		pers.instance = __atomic_fetch_add(&drbg_instances, 1, __ATOMIC_RELAXED);
+		pers.pid = getpid();
+		clock_gettime(CLOCK_REALTIME, &pers.time);
+		if (rdrand_drbg_instantiate(d, &pers, sizeof(pers)) == 0)
+		{
+			rdrand_drbg_destroy(d);
+			return 0;
+		}
+		pthread_setspecific(drbg_key, d);
+		thread_drbg = d;
+	}
+	return rdrand_drbg_generate(d, dest, len, NULL, 0);
+}
+// }}} rdrand_drbg_get_bytes
@@ -0,0 +1,136 @@
+/* vim: set expandtab cindent fdm=marker ts=4 sw=4: */
+/*
+ * Copyright (C) 2013-2020 Jan Tulak <jan@tulak.me>
+ * Copyright (C) 2013-2025 Jirka Hladky hladky DOT jiri AT gmail DOT com
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+    Now the legal stuff is done. This file contain the library itself.
+*/
+
+/*
+ * CTR_DRBG of NIST SP 800-90A with AES-256 and the derivation function,
+ * seeded by RdSeed (or RdRand). The output is generated by AES on every
+ * thread, so it is not limited by the throughput of the DRNG of the CPU.
+ *
+ * Usage:
+ * 1) rdrand_drbg_create
+ * 2) rdrand_drbg_instantiate
+ * 3) rdrand_drbg_generate
+ * 4) rdrand_drbg_destroy
+ *
+ * Or just rdrand_drbg_get_bytes, with a DRBG of the calling thread.
+ */
+#ifndef LIBRDRAND_DRBG_H_INCLUDED
+#define LIBRDRAND_DRBG_H_INCLUDED
+#include <stdlib.h>
+
+// Maximal bytes generated by one request, between two state updates
+#define RDRAND_DRBG_MAX_REQUEST (64*1024)
+
+// Requests between reseeds, by default and at most
+#define RDRAND_DRBG_DEFAULT_RESEED_INTERVAL 1024ULL
+#define RDRAND_DRBG_MAX_RESEED_INTERVAL (1ULL << 48)
+
+/**
+ * A CTR_DRBG instance.
+ * An instance must not be used by more threads at once.
+ */
+typedef struct rdrand_drbg_s rdrand_drbg_t;
+
+/**
+ * Create a new DRBG instance, not instantiated yet.
+ *
+ * @return            the instance, or NULL on failure
+ */
+rdrand_drbg_t *rdrand_drbg_create(void);
+
+/**
+ * Instantiate the DRBG with entropy from RdSeed, or RdRand when
+ * the CPU doesn't have RdSeed or it doesn't give enough values.
+ *
+ * @param  drbg       the instance
+ * @param  pers       personalization string, can be NULL
+ * @param  pers_len   length of the personalization string
+ * @return            1 on success
+ */
+int rdrand_drbg_instantiate(rdrand_drbg_t *drbg, const void *pers, size_t pers_len);
+
+/**
+ * Instantiate the DRBG with the given entropy input and nonce,
+ * e.g. for known answer tests. Such instance is never reseeded
+ * automatically.
+ *
+ * @return            1 on success
+ */
+int rdrand_drbg_instantiate_with(rdrand_drbg_t *drbg,
+    const void *entropy, size_t entropy_len,
+    const void *nonce, size_t nonce_len,
+    const void *pers, size_t pers_len);
+
+/**
+ * Reseed the DRBG with entropy from the CPU.
+ *
+ * @param  additional additional input, can be NULL
+ * @return            1 on success
+ */
+int rdrand_drbg_reseed(rdrand_drbg_t *drbg, const void *additional, size_t additional_len);
+
+/**
+ * Reseed the DRBG with the given entropy input.
+ *
+ * @return            1 on success
+ */
+int rdrand_drbg_reseed_with(rdrand_drbg_t *drbg,
+    const void *entropy, size_t entropy_len,
+    const void *additional, size_t additional_len);
+
+/**
+ * Set the number of requests, of up to RDRAND_DRBG_MAX_REQUEST bytes,
+ * after which the DRBG is reseeded from the CPU.
+ *
+ * @param  requests   <1, RDRAND_DRBG_MAX_RESEED_INTERVAL>
+ * @return            1 if the interval was set
+ */
+int rdrand_drbg_set_reseed_interval(rdrand_drbg_t *drbg, unsigned long long requests);
+
+/**
+ * Generate len bytes into dest. Longer outputs are split into requests
+ * of RDRAND_DRBG_MAX_REQUEST bytes, each of them gets the additional
+ * input. The DRBG is reseeded when the reseed interval is over, and
+ * in a child process after fork.
+ *
+ * @param  additional additional input, can be NULL
+ * @return            amount of generated bytes
+ */
+size_t rdrand_drbg_generate(rdrand_drbg_t *drbg, void *dest, size_t len,
+    const void *additional, size_t additional_len);
+
+/**
+ * Destroy the instance: wipe its state and free it.
+ */
+void rdrand_drbg_destroy(rdrand_drbg_t *drbg);
+
+/**
+ * Generate len bytes by the DRBG of the calling thread. It is created
+ * and instantiated on the first use and destroyed on thread exit.
+ *
+ * @return            amount of generated bytes
+ */
+size_t rdrand_drbg_get_bytes(void *dest, size_t len);
+
+#endif // LIBRDRAND_DRBG_H_INCLUDED
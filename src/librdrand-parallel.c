@@ -0,0 +1,406 @@
+/* vim: set expandtab cindent fdm=marker ts=2 sw=2: */
+/*
+ * Copyright (C) 2013-2020 Jan Tulak <jan@tulak.me>
+ * Copyright (C) 2013-2022 Jirka Hladky hladky DOT jiri AT gmail DOT com
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+    Now the legal stuff is done. This file contain the parallel fill
+    of big buffers by a persistent pool of worker threads.
+*/
+
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE // pthread_setaffinity_np, CPU_SET
+#endif
+
+#include "./librdrand.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+
+// Slices are aligned to pages, so every page is first touched by
+// the one thread which fills it.
+#define PARALLEL_PAGE_SIZE 4096
+
+// Don't wake up workers for less than this amount of bytes per thread.
+#define PARALLEL_MIN_SLICE (256*1024)
+
+// Most NUMA nodes looked up in sysfs, the CPUs of the others are
+// counted to the node 0.
+#define PARALLEL_MAX_NODES 64
+
+/**
+ * One parallel fill. The slice i of the buffer is
+ * <bounds[i], bounds[i+1]) and is always filled by the worker i-1,
+ * the slice 0 by the calling thread.
+ */
+typedef struct parallel_job_s {
+	uint8_t *bounds[RDRAND_PARALLEL_MAX_THREADS + 1];
+	size_t generated[RDRAND_PARALLEL_MAX_THREADS];
+	unsigned int slices;
+	int retry_limit;
+} parallel_job_t;
+
+/**
+ * The worker pool. Workers are started lazily and kept waiting
+ * for the next job, so a fill costs only a wake up of the threads.
+ */
+static struct {
+	/** serializes the jobs */
+	pthread_mutex_t job_lock;
+	/** protects everything below */
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	pthread_t workers[RDRAND_PARALLEL_MAX_THREADS];
+	unsigned int nworkers;
+	/** incremented for every job */
+	unsigned long generation;
+	/**
+	 * generation before the job the new workers were started for,
+	 * they may start running only after it was announced
+	 */
+	unsigned long start_generation;
+	/** workers still filling the current job */
+	unsigned int pending;
+	int shutdown;
+	parallel_job_t job;
+	/**
+	 * CPUs the workers are pinned to, the worker n to cpus[(n+1) % ncpus].
+	 * Consecutive entries are on different nodes where possible.
+	 */
+	int cpus[CPU_SETSIZE];
+	unsigned int ncpus;
+} par = {
+	.job_lock = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t par_once = PTHREAD_ONCE_INIT;
+
+
+// {{{ CPU placement
+/**
+ * Read the node of every CPU from sysfs into node_of.
+ * A cpulist looks like "0-3,8-11".
+ */
+static void parallel_read_nodes(unsigned int *node_of)
+{
+	char path[64];
+	unsigned int node, first, last, cpu;
+	int c;
+	FILE *f;
+
+	for (node = 0; node < PARALLEL_MAX_NODES; node++)
+	{
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue; // node numbers can have holes
+		while (fscanf(f, "%u", &first) == 1)
+		{
+			last = first;
+			c = fgetc(f);
+			if (c == '-')
+			{
+				if (fscanf(f, "%u", &last) != 1)
+					break;
+				c = fgetc(f);
+			}
+			for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+				node_of[cpu] = node;
+			if (c != ',')
+				break;
+		}
+		fclose(f);
+	}
+}
+
+/**
+ * Order the CPUs this process may run on so that the nodes take turns:
+ * the first CPU of every node, then the second of every node, and so on.
+ * The slices, and so the first touches, are then spread over all nodes
+ * even when there are fewer threads than CPUs.
+ */
+static void parallel_cpu_order(void)
+{
+	static unsigned int node_of[CPU_SETSIZE], rank[CPU_SETSIZE];
+	unsigned int count[PARALLEL_MAX_NODES] = {0};
+	unsigned int cpu, r, allowed = 0;
+	cpu_set_t set;
+
+	par.ncpus = 0;
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		return;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		node_of[cpu] = 0;
+	parallel_read_nodes(node_of);
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+		rank[cpu] = count[node_of[cpu]]++;
+		allowed++;
+	}
+
+	for (r = 0; par.ncpus < allowed; r++)
+	{
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		{
+			if (CPU_ISSET(cpu, &set) && rank[cpu] == r)
+				par.cpus[par.ncpus++] = cpu;
+		}
+	}
+}
+
+/**
+ * Pin the worker n. A failure (e.g. the cpuset shrank meanwhile) only
+ * leaves the worker to the scheduler.
+ */
+static void parallel_pin_worker(unsigned int n)
+{
+	cpu_set_t set;
+
+	if (par.ncpus < 2)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(par.cpus[(n + 1) % par.ncpus], &set);
+	pthread_setaffinity_np(par.workers[n], sizeof(set), &set);
+}
+// }}} CPU placement
+
+// {{{ worker pool
+static void *parallel_worker(void *arg)
+{
+	unsigned int slice = (unsigned int)(uintptr_t)arg;
+	unsigned long seen;
+	uint8_t *start, *end;
+	int retry_limit;
+	size_t generated;
+
+	pthread_mutex_lock(&par.lock);
+	seen = par.start_generation;
+	for (;;)
+	{
+		while (par.generation == seen && !par.shutdown)
+			pthread_cond_wait(&par.work_cond, &par.lock);
+		if (par.shutdown)
+			break;
+		seen = par.generation;
+		if (slice >= par.job.slices)
+			continue;
+
+		start = par.job.bounds[slice];
+		end = par.job.bounds[slice + 1];
+		retry_limit = par.job.retry_limit;
+		pthread_mutex_unlock(&par.lock);
+
+		generated = rdrand_get_bytes_retry(start, end - start, retry_limit);
+
+		pthread_mutex_lock(&par.lock);
+		par.job.generated[slice] = generated;
+		if (--par.pending == 0)
+			pthread_cond_signal(&par.done_cond);
+	}
+	pthread_mutex_unlock(&par.lock);
+	return NULL;
+}
+
+/**
+ * Start workers until there are enough for the given number of slices.
+ * Returns the number of slices which can be used. Called with job_lock.
+ */
+static unsigned int parallel_start_workers(unsigned int slices)
+{
+	pthread_mutex_lock(&par.lock);
+	par.start_generation = par.generation;
+	pthread_mutex_unlock(&par.lock);
+
+	while (par.nworkers + 1 < slices)
+	{
+		// the worker n fills the slice n+1
+		if (pthread_create(&par.workers[par.nworkers], NULL, parallel_worker,
+					(void *)(uintptr_t)(par.nworkers + 1)) != 0)
+			return par.nworkers + 1;
+		parallel_pin_worker(par.nworkers);
+		par.nworkers++;
+	}
+	return slices;
+}
+
+/**
+ * Stop and join all workers. Called with job_lock.
+ */
+static void parallel_stop_workers(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&par.lock);
+	par.shutdown = 1;
+	pthread_cond_broadcast(&par.work_cond);
+	pthread_mutex_unlock(&par.lock);
+
+	for (i = 0; i < par.nworkers; i++)
+		pthread_join(par.workers[i], NULL);
+
+	par.nworkers = 0;
+	par.shutdown = 0;
+}
+
+// {{{ fork handlers
+static void parallel_atfork_prepare(void)
+{
+	pthread_mutex_lock(&par.job_lock);
+}
+
+static void parallel_atfork_parent(void)
+{
+	pthread_mutex_unlock(&par.job_lock);
+}
+
+/**
+ * Only the forking thread exists in the child, so the pool
+ * is started again from scratch when it is needed.
+ */
+static void parallel_atfork_child(void)
+{
+	par.nworkers = 0;
+	par.pending = 0;
+	pthread_mutex_init(&par.lock, NULL);
+	pthread_cond_init(&par.work_cond, NULL);
+	pthread_cond_init(&par.done_cond, NULL);
+	pthread_mutex_unlock(&par.job_lock);
+}
+// }}} fork handlers
+
+static void parallel_init_once(void)
+{
+	parallel_cpu_order();
+	pthread_atfork(parallel_atfork_prepare, parallel_atfork_parent, parallel_atfork_child);
+}
+
+/**
+ * Join the workers when the library is unloaded. If a fill is still
+ * running in another thread, the process is going away anyway.
+ */
+static void __attribute__((destructor)) parallel_fini(void)
+{
+	if (pthread_mutex_trylock(&par.job_lock) != 0)
+		return;
+	if (par.nworkers)
+		parallel_stop_workers();
+	pthread_mutex_unlock(&par.job_lock);
+}
+// }}} worker pool
+
+/**
+ * Split <dest, dest+len) into slices with page aligned bounds.
+ */
+static void parallel_split(parallel_job_t *job, uint8_t *dest, const size_t len)
+{
+	size_t step = len / job->slices;
+	uintptr_t bound;
+	unsigned int i;
+
+	job->bounds[0] = dest;
+	for (i = 1; i < job->slices; i++)
+	{
+		bound = (uintptr_t)dest + step * i;
+		bound = (bound + PARALLEL_PAGE_SIZE - 1) & ~(uintptr_t)(PARALLEL_PAGE_SIZE - 1);
+		if (bound > (uintptr_t)dest + len)
+			bound = (uintptr_t)dest + len;
+		job->bounds[i] = (uint8_t *)bound;
+	}
+	job->bounds[job->slices] = dest + len;
+}
+
+/**
+ * Fill a buffer with random bytes by a pool of worker threads.
+ * The buffer is split into page aligned slices, each of them is
+ * always filled (and so first touched) by the same thread. Workers
+ * are pinned to CPUs spread over the NUMA nodes.
+ * Threads 0 means the number of online CPUs, the calling thread
+ * is one of them.
+ * Negative retry_limit implies default retry_limit RETRY_LIMIT
+ * Returns the number of bytes successfully acquired from the
+ * beginning of the buffer.
+ */
+// {{{ rdrand_fill_parallel
+size_t rdrand_fill_parallel(void *dest, const size_t len, unsigned int threads, int retry_limit)
+{
+	unsigned int slices, i;
+	size_t generated;
+	long cpus;
+
+	if (threads == 0)
+	{
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (unsigned int)cpus : 1;
+	}
+	if (threads > RDRAND_PARALLEL_MAX_THREADS)
+		threads = RDRAND_PARALLEL_MAX_THREADS;
+
+	slices = threads;
+	if (len / PARALLEL_MIN_SLICE < slices)
+		slices = len / PARALLEL_MIN_SLICE;
+	if (slices <= 1)
+		return rdrand_get_bytes_retry(dest, len, retry_limit);
+
+	pthread_once(&par_once, parallel_init_once);
+	pthread_mutex_lock(&par.job_lock);
+
+	slices = parallel_start_workers(slices);
+
+	pthread_mutex_lock(&par.lock);
+	par.job.slices = slices;
+	par.job.retry_limit = retry_limit;
+	parallel_split(&par.job, dest, len);
+	par.pending = slices - 1;
+	par.generation++;
+	pthread_cond_broadcast(&par.work_cond);
+	pthread_mutex_unlock(&par.lock);
+
+	// the slice 0 is ours
+	par.job.generated[0] = rdrand_get_bytes_retry(par.job.bounds[0],
+			par.job.bounds[1] - par.job.bounds[0], retry_limit);
+
+	pthread_mutex_lock(&par.lock);
+	while (par.pending)
+		pthread_cond_wait(&par.done_cond, &par.lock);
+	pthread_mutex_unlock(&par.lock);
+
+	// only the valid prefix counts
+	generated = 0;
+	for (i = 0; i < slices; i++)
+	{
+		generated += par.job.generated[i];
+		if (par.job.generated[i] != (size_t)(par.job.bounds[i + 1] - par.job.bounds[i]))
+			break;
+	}
+
+	pthread_mutex_unlock(&par.job_lock);
+	return generated;
+}
+// }}} rdrand_fill_parallel
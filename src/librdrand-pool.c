@@ -0,0 +1,296 @@
+/* vim: set expandtab cindent fdm=marker ts=2 sw=2: */
+/*
+ * Copyright (C) 2013-2020 Jan Tulak <jan@tulak.me>
+ * Copyright (C) 2013-2022 Jirka Hladky hladky DOT jiri AT gmail DOT com
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+    Now the legal stuff is done. This file contain the thread-local
+    buffered pool of random values for the library.
+*/
+
+#include "./librdrand.h"
+#include "./librdrand.private.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+/**
+ * Per-thread cache of random bytes. Values handed out are wiped
+ * from the cache, so the cache never holds anything already used.
+ */
+typedef struct rdrand_pool_s {
+	uint8_t *buf;
+	/** size of buf in bytes */
+	size_t size;
+	/** first unused byte */
+	size_t pos;
+	/** end of the valid data */
+	size_t avail;
+	/** list of all pools, for wiping them after fork */
+	struct rdrand_pool_s *next;
+	struct rdrand_pool_s *prev;
+} rdrand_pool_t;
+
+static __thread rdrand_pool_t *thread_pool = NULL;
+
+/** Size of newly filled pools in bytes, see rdrand_pool_set_size. */
+static size_t pool_size = RDRAND_POOL_DEFAULT_SIZE;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static pthread_mutex_t pool_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static rdrand_pool_t *pool_list = NULL;
+
+
+// {{{ helpers
+/**
+ * Zero and release a pool. Called on thread exit, by the thread
+ * which owns the pool.
+ */
+static void pool_destroy(void *arg)
+{
+	rdrand_pool_t *p = arg;
+
+	// a later destructor may still draw from the pool, it gets a new one
+	thread_pool = NULL;
+
+	pthread_mutex_lock(&pool_list_lock);
+	if (p->prev)
+		p->prev->next = p->next;
+	else
+		pool_list = p->next;
+	if (p->next)
+		p->next->prev = p->prev;
+	pthread_mutex_unlock(&pool_list_lock);
+
+	rdrand_wipe(p->buf, p->size);
+	free(p->buf);
+	rdrand_wipe(p, sizeof(*p));
+	free(p);
+}
+
+// {{{ fork handlers
+static void pool_atfork_prepare(void)
+{
+	pthread_mutex_lock(&pool_list_lock);
+}
+
+static void pool_atfork_parent(void)
+{
+	pthread_mutex_unlock(&pool_list_lock);
+}
+
+/**
+ * The child must not hand out the same values as the parent, so all
+ * pools are emptied - including those of threads which don't exist
+ * in the child any more.
+ */
+static void pool_atfork_child(void)
+{
+	rdrand_pool_t *p;
+
+	for (p = pool_list; p != NULL; p = p->next)
+	{
+		rdrand_wipe(p->buf, p->size);
+		p->pos = 0;
+		p->avail = 0;
+	}
+	pthread_mutex_unlock(&pool_list_lock);
+}
+// }}} fork handlers
+
+static void pool_init_once(void)
+{
+	pthread_key_create(&pool_key, pool_destroy);
+	pthread_atfork(pool_atfork_prepare, pool_atfork_parent, pool_atfork_child);
+}
+
+/**
+ * Refill the pool of the calling thread, (re)allocating it if needed.
+ * Returns RDRAND_SUCCESS if at least some bytes were generated.
+ */
+static int __attribute__((noinline)) pool_refill(void)
+{
+	rdrand_pool_t *p = thread_pool;
+	size_t size = __atomic_load_n(&pool_size, __ATOMIC_RELAXED);
+
+	if (p == NULL)
+	{
+		pthread_once(&pool_once, pool_init_once);
+		p = calloc(1, sizeof(*p));
+		if (p == NULL)
+			return RDRAND_FAILURE;
+
+		pthread_mutex_lock(&pool_list_lock);
+		p->next = pool_list;
+		if (pool_list)
+			pool_list->prev = p;
+		pool_list = p;
+		pthread_mutex_unlock(&pool_list_lock);
+
+		pthread_setspecific(pool_key, p);
+		thread_pool = p;
+	}
+
+	// size was changed since the last refill
+	if (p->size != size)
+	{
+		uint8_t *buf = aligned_alloc(64, size);
+		if (buf == NULL)
+			return RDRAND_FAILURE;
+		rdrand_wipe(p->buf, p->size);
+		free(p->buf);
+		p->buf = buf;
+		p->size = size;
+	}
+
+	p->pos = 0;
+	p->avail = rdrand_get_bytes_retry(p->buf, p->size, -1);
+	if (p->avail == 0)
+		return RDRAND_FAILURE;
+	return RDRAND_SUCCESS;
+}
+
+/**
+ * Take len bytes (not more than 8) from the pool of the calling thread.
+ */
+static inline int pool_take(void *dest, size_t len)
+{
+	rdrand_pool_t *p = thread_pool;
+
+	if (__builtin_expect(p == NULL || p->avail - p->pos < len, 0))
+	{
+		if (pool_refill() != RDRAND_SUCCESS)
+			return RDRAND_FAILURE;
+		p = thread_pool;
+		if (p->avail < len)
+			return RDRAND_FAILURE;
+	}
+	memcpy(dest, p->buf + p->pos, len);
+	memset(p->buf + p->pos, 0, len);
+	p->pos += len;
+	return RDRAND_SUCCESS;
+}
+// }}} helpers
+
+
+/**
+ * Set the size of the per-thread pools in bytes.
+ * The new size is used by every pool on its next refill.
+ * Returns RDRAND_SUCCESS, or RDRAND_FAILURE if the size is not
+ * a multiple of 64 bytes in the range <64, RDRAND_POOL_MAX_SIZE>.
+ */
+// {{{ rdrand_pool_set_size
+int rdrand_pool_set_size(size_t size)
+{
+	if (size < 64 || size > RDRAND_POOL_MAX_SIZE || size % 64 != 0)
+		return RDRAND_FAILURE;
+	__atomic_store_n(&pool_size, size, __ATOMIC_RELAXED);
+	return RDRAND_SUCCESS;
+}
+// }}} rdrand_pool_set_size
+
+/**
+ * Get a 64 bit random number from the pool of the calling thread.
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+// {{{ rdrand_pool_get_u64
+int rdrand_pool_get_u64(uint64_t *dest)
+{
+	return pool_take(dest, sizeof(*dest));
+}
+// }}} rdrand_pool_get_u64
+
+/**
+ * Get a 32 bit random number from the pool of the calling thread.
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+// {{{ rdrand_pool_get_u32
+int rdrand_pool_get_u32(uint32_t *dest)
+{
+	return pool_take(dest, sizeof(*dest));
+}
+// }}} rdrand_pool_get_u32
+
+/**
+ * Get bytes of random values from the pool of the calling thread.
+ * Requests bigger than the pool are generated directly.
+ * Returns the number of bytes successfully acquired.
+ */
+// {{{ rdrand_pool_get_bytes
+size_t rdrand_pool_get_bytes(void *dest, const size_t size)
+{
+	uint8_t *out = dest;
+	size_t done = 0, chunk;
+	rdrand_pool_t *p;
+
+	if (size >= __atomic_load_n(&pool_size, __ATOMIC_RELAXED))
+		return rdrand_get_bytes_retry(dest, size, -1);
+
+	while (done < size)
+	{
+		p = thread_pool;
+		if (p == NULL || p->pos == p->avail)
+		{
+			if (pool_refill() != RDRAND_SUCCESS)
+				break;
+			p = thread_pool;
+		}
+		chunk = p->avail - p->pos;
+		if (chunk > size - done)
+			chunk = size - done;
+		memcpy(out + done, p->buf + p->pos, chunk);
+		memset(p->buf + p->pos, 0, chunk);
+		p->pos += chunk;
+		done += chunk;
+	}
+	return done;
+}
+// }}} rdrand_pool_get_bytes
+
+/**
+ * Get the number of random bytes cached for the calling thread.
+ */
+// {{{ rdrand_pool_available
+size_t rdrand_pool_available(void)
+{
+	rdrand_pool_t *p = thread_pool;
+
+	if (p == NULL)
+		return 0;
+	return p->avail - p->pos;
+}
+// }}} rdrand_pool_available
+
+/**
+ * Wipe the pool of the calling thread.
+ */
+// {{{ rdrand_pool_flush
+void rdrand_pool_flush(void)
+{
+	rdrand_pool_t *p = thread_pool;
+
+	if (p == NULL)
+		return;
+	rdrand_wipe(p->buf, p->size);
+	p->pos = 0;
+	p->avail = 0;
+}
+// }}} rdrand_pool_flush
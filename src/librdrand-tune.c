@@ -0,0 +1,433 @@
+/* vim: set expandtab cindent fdm=marker ts=2 sw=2: */
+/*
+ * Copyright (C) 2013-2020 Jan Tulak <jan@tulak.me>
+ * Copyright (C) 2013-2025 Jirka Hladky hladky DOT jiri AT gmail DOT com
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+    Now the legal stuff is done. This file contain the calibration of
+    buffer sizes for the machine the library runs on.
+*/
+
+#include "./librdrand.h"
+#include "./librdrand-aes.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <cpuid.h>
+
+
+// Time spent on one candidate size
+#define TUNE_SAMPLE_NS 40000000ULL
+
+// Sizes slower than the fastest one by this fraction are still fine
+#define TUNE_TOLERANCE 0.03
+
+// Version of the cache file, bumped when its meaning changes
+#define TUNE_FILE_VERSION 1
+
+/**
+ * One generating thread of the chunk sweep.
+ */
+typedef struct tune_worker_s {
+	size_t chunk;
+	uint8_t *buf;
+	size_t bytes;
+	unsigned long long elapsed;
+	int failed;
+} tune_worker_t;
+
+static unsigned long long tune_now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (unsigned long long)t.tv_sec*1000000000ULL + t.tv_nsec;
+}
+
+/**
+ * Fill the chunk again and again for TUNE_SAMPLE_NS. The threads
+ * start within microseconds, so their rates add up.
+ */
+static void *tune_chunk_worker(void *arg)
+{
+	tune_worker_t *w = arg;
+	unsigned long long start, now;
+
+	start = now = tune_now();
+	while (now - start < TUNE_SAMPLE_NS)
+	{
+		if (rdrand_get_bytes_retry(w->buf, w->chunk, -1) != w->chunk)
+		{
+			w->failed = 1;
+			break;
+		}
+		w->bytes += w->chunk;
+		now = tune_now();
+	}
+	w->elapsed = now - start;
+	return NULL;
+}
+
+/**
+ * Throughput of threads generating chunks of the given size,
+ * in bytes per second. Returns a negative value on failure.
+ */
+static double tune_chunk_rate(unsigned int threads, size_t chunk)
+{
+	tune_worker_t *w;
+	pthread_t *tid;
+	unsigned int i, started = 0;
+	double rate = -1;
+
+	w = calloc(threads, sizeof(tune_worker_t));
+	tid = calloc(threads, sizeof(pthread_t));
+	if (w == NULL || tid == NULL)
+		goto cleanup;
+
+	// allocated and touched before the clock starts
+	for (i = 0; i < threads; i++)
+	{
+		w[i].chunk = chunk;
+		if (posix_memalign((void **)&w[i].buf, 64, chunk) != 0)
+			goto cleanup;
+		memset(w[i].buf, 0, chunk);
+	}
+
+	for (started = 0; started < threads; started++)
+	{
+		if (pthread_create(&tid[started], NULL, tune_chunk_worker, &w[started]) != 0)
+			break;
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+	if (started < threads)
+		goto cleanup;
+
+	rate = 0;
+	for (i = 0; i < threads; i++)
+	{
+		if (w[i].failed || w[i].elapsed == 0)
+		{
+			rate = -1;
+			break;
+		}
+		rate += w[i].bytes * 1e9 / w[i].elapsed;
+	}
+
+cleanup:
+	for (i = 0; w != NULL && i < threads; i++)
+		free(w[i].buf);
+	free(w);
+	free(tid);
+	return rate;
+}
+
+/**
+ * Throughput of AES encrypting a chunk with the given buffer size,
+ * in bytes per second. Returns a negative value on failure.
+ */
+static double tune_aes_rate(rdrand_aes_ctx_t *ctx, uint8_t *chunk, size_t len, unsigned int buffer)
+{
+	unsigned long long start, now;
+	size_t bytes = 0;
+
+	if (rdrand_aes_ctx_set_buffer_size(ctx, buffer) != 1
+			// warm up: the schedules of the keys get into the cache
+			|| rdrand_aes_ctx_enc_buffer(ctx, chunk, chunk, len) != 1)
+		return -1;
+
+	start = now = tune_now();
+	while (now - start < TUNE_SAMPLE_NS)
+	{
+		if (rdrand_aes_ctx_enc_buffer(ctx, chunk, chunk, len) != 1)
+			return -1;
+		bytes += len;
+		now = tune_now();
+	}
+	return bytes * 1e9 / (now - start);
+}
+
+/**
+ * Index of the smallest size whose rate is within TUNE_TOLERANCE
+ * of the best one, the sizes grow with the index.
+ */
+static unsigned int tune_pick(const double *rates, unsigned int count)
+{
+	double best = 0;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		if (rates[i] > best)
+			best = rates[i];
+	for (i = 0; i < count; i++)
+		if (rates[i] >= best*(1 - TUNE_TOLERANCE))
+			break;
+	return i;
+}
+
+/**
+ * Calibrate for tune->threads threads, the cipher tune->cipher and
+ * the AES rekey interval tune->rekey_interval, which is kept as it is,
+ * it is a matter of security and not of speed. Takes about a second.
+ * The smallest size within a few percent of the fastest one is chosen.
+ * Returns RDRAND_SUCCESS, or RDRAND_FAILURE if the generator failed.
+ */
+// {{{ rdrand_autotune
+int rdrand_autotune(rdrand_tune_t *tune)
+{
+	double rates[32];
+	size_t sizes[32], size, chunk;
+	unsigned int i, count, threads = tune->threads, limit;
+	rdrand_aes_ctx_t *ctx;
+	uint8_t *buf;
+	long cpus;
+
+	if (threads == 0)
+	{
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (unsigned int)cpus : 1;
+	}
+
+	// chunks of the generating threads
+	count = 0;
+	for (size = RDRAND_TUNE_MIN_CHUNK; size <= RDRAND_TUNE_MAX_CHUNK; size *= 2)
+	{
+		sizes[count] = size;
+		rates[count] = tune_chunk_rate(threads, size);
+		if (rates[count++] < 0)
+			return RDRAND_FAILURE;
+	}
+	i = tune_pick(rates, count);
+	chunk = sizes[i];
+	tune->chunk_size = chunk;
+	tune->chunk_rate = rates[i];
+
+	// AES buffers, the bigger than a key encrypts are all the same
+	limit = tune->rekey_interval ? tune->rekey_interval : MAX_COUNTER;
+	ctx = rdrand_aes_ctx_create();
+	if (ctx == NULL || posix_memalign((void **)&buf, 64, chunk) != 0)
+	{
+		rdrand_aes_ctx_destroy(ctx);
+		return RDRAND_FAILURE;
+	}
+	memset(buf, 0, chunk);
+	count = 0;
+	if (rdrand_aes_ctx_set_cipher(ctx, tune->cipher) != 1
+			|| rdrand_aes_ctx_set_random_key(ctx) != 1
+			|| (tune->rekey_interval && rdrand_aes_ctx_set_rekey_interval(ctx, tune->rekey_interval) != 1))
+		goto aes_cleanup;
+	for (size = RDRAND_TUNE_MIN_AES_BUFFER; size <= RDRAND_TUNE_MAX_AES_BUFFER
+			&& size <= chunk && (size <= limit || count == 0); size *= 2)
+	{
+		sizes[count] = size;
+		rates[count] = tune_aes_rate(ctx, buf, chunk, size);
+		if (rates[count++] < 0)
+		{
+			count = 0;
+			break;
+		}
+	}
+
+aes_cleanup:
+	free(buf);
+	rdrand_aes_ctx_destroy(ctx);
+	if (count == 0)
+		return RDRAND_FAILURE;
+	i = tune_pick(rates, count);
+	tune->aes_buffer_size = sizes[i];
+	tune->aes_rate = rates[i];
+	return RDRAND_SUCCESS;
+}
+// }}} rdrand_autotune
+
+/**
+ * Measure how fast every cipher encrypts, with random keys and the
+ * default buffer size, each for TUNE_SAMPLE_NS.
+ * Returns the fastest cipher, or RDRAND_FAILURE.
+ */
+// {{{ rdrand_cipher_benchmark
+int rdrand_cipher_benchmark(double *rates)
+{
+	const size_t len = 64*1024;
+	rdrand_aes_ctx_t *ctx;
+	uint8_t *buf;
+	int cipher, best = RDRAND_FAILURE;
+
+	if (posix_memalign((void **)&buf, 64, len) != 0)
+		return RDRAND_FAILURE;
+	memset(buf, 0, len);
+	for (cipher = 0; cipher < RDRAND_CIPHER_COUNT; cipher++)
+	{
+		rates[cipher] = -1;
+		ctx = rdrand_aes_ctx_create();
+		if (ctx != NULL && rdrand_aes_ctx_set_cipher(ctx, cipher) == 1
+				&& rdrand_aes_ctx_set_random_key(ctx) == 1)
+			rates[cipher] = tune_aes_rate(ctx, buf, len, MAX_BUFFER_SIZE);
+		rdrand_aes_ctx_destroy(ctx);
+		if (rates[cipher] < 0)
+		{
+			best = RDRAND_FAILURE;
+			break;
+		}
+		if (best == RDRAND_FAILURE || rates[cipher] > rates[best])
+			best = cipher;
+	}
+	free(buf);
+	return best;
+}
+// }}} rdrand_cipher_benchmark
+
+/**
+ * Identity of the CPU the calibration is valid for: its brand string.
+ * The features are saved beside, a VM can hide some of them.
+ */
+static void tune_cpu(char *brand, size_t len)
+{
+	unsigned int regs[12], i;
+
+	memset(regs, 0, sizeof(regs));
+	if (__get_cpuid_max(0x80000000, NULL) >= 0x80000004)
+	{
+		for (i = 0; i < 3; i++)
+			__get_cpuid(0x80000002 + i, &regs[4*i], &regs[4*i+1], &regs[4*i+2], &regs[4*i+3]);
+	}
+	// trimmed and without spaces, so it is one word in the file
+	memcpy(brand, regs, len - 1 < sizeof(regs) ? len - 1 : sizeof(regs));
+	brand[len - 1 < sizeof(regs) ? len - 1 : sizeof(regs)] = '\0';
+	for (i = 0; brand[i]; i++)
+		if (brand[i] == ' ')
+			brand[i] = '_';
+	while (i > 0 && brand[i-1] == '_')
+		brand[--i] = '\0';
+	if (i == 0)
+		strcpy(brand, "unknown");
+}
+
+/**
+ * Save the result to a cache file.
+ * Returns RDRAND_SUCCESS, or RDRAND_FAILURE if it can't be written.
+ */
+// {{{ rdrand_tune_save
+int rdrand_tune_save(const rdrand_tune_t *tune, const char *path)
+{
+	char brand[64];
+	FILE *f;
+	int rc;
+
+	tune_cpu(brand, sizeof(brand));
+	f = fopen(path, "w");
+	if (f == NULL)
+		return RDRAND_FAILURE;
+	fprintf(f, "# librdrand autotune, made by rdrand_autotune\n");
+	fprintf(f, "version %d\n", TUNE_FILE_VERSION);
+	fprintf(f, "cpu %s\n", brand);
+	fprintf(f, "features %u\n", rdrand_get_features());
+	fprintf(f, "threads %u\n", tune->threads);
+	fprintf(f, "rekey_interval %u\n", tune->rekey_interval);
+	fprintf(f, "cipher %d\n", tune->cipher);
+	fprintf(f, "chunk_size %zu\n", tune->chunk_size);
+	fprintf(f, "aes_buffer_size %u\n", tune->aes_buffer_size);
+	fprintf(f, "chunk_rate %.0f\n", tune->chunk_rate);
+	fprintf(f, "aes_rate %.0f\n", tune->aes_rate);
+	rc = ferror(f);
+	if (fclose(f) != 0 || rc)
+		return RDRAND_FAILURE;
+	return RDRAND_SUCCESS;
+}
+// }}} rdrand_tune_save
+
+/**
+ * Load the result from a cache file, if it was made on this CPU
+ * for the same tune->threads, tune->cipher and tune->rekey_interval.
+ * Returns RDRAND_SUCCESS, or RDRAND_FAILURE if the file is missing,
+ * broken or made for something else.
+ */
+// {{{ rdrand_tune_load
+int rdrand_tune_load(rdrand_tune_t *tune, const char *path)
+{
+	char line[256], name[32], value[128], brand[64];
+	rdrand_tune_t loaded;
+	unsigned int version = 0, features = 0, found = 0;
+	unsigned long long number;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return RDRAND_FAILURE;
+	memset(&loaded, 0, sizeof(loaded));
+	tune_cpu(brand, sizeof(brand));
+
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%31s %127s", name, value) != 2)
+			break;
+		if (strcmp(name, "cpu") == 0)
+		{
+			if (strcmp(value, brand) != 0)
+				break;
+			found |= 1;
+			continue;
+		}
+		number = strtoull(value, NULL, 10);
+		if (strcmp(name, "version") == 0)
+			version = number;
+		else if (strcmp(name, "features") == 0)
+			features = number;
+		else if (strcmp(name, "threads") == 0)
+			loaded.threads = number;
+		else if (strcmp(name, "rekey_interval") == 0)
+			loaded.rekey_interval = number;
+		else if (strcmp(name, "cipher") == 0)
+			loaded.cipher = number;
+		else if (strcmp(name, "chunk_size") == 0)
+			loaded.chunk_size = number;
+		else if (strcmp(name, "aes_buffer_size") == 0)
+			loaded.aes_buffer_size = number;
+		else if (strcmp(name, "chunk_rate") == 0)
+			loaded.chunk_rate = number;
+		else if (strcmp(name, "aes_rate") == 0)
+			loaded.aes_rate = number;
+		else
+			continue;
+		found |= 2;
+	}
+	if (ferror(f) || !feof(f))
+		found = 0;
+	fclose(f);
+
+	if (found != 3 || version != TUNE_FILE_VERSION
+			|| features != rdrand_get_features()
+			|| loaded.threads != tune->threads
+			|| loaded.rekey_interval != tune->rekey_interval
+			|| loaded.cipher != tune->cipher
+			|| loaded.chunk_size < RDRAND_TUNE_MIN_CHUNK
+			|| loaded.chunk_size > RDRAND_TUNE_MAX_CHUNK
+			|| loaded.aes_buffer_size < RDRAND_TUNE_MIN_AES_BUFFER
+			|| loaded.aes_buffer_size > RDRAND_TUNE_MAX_AES_BUFFER
+			|| (loaded.aes_buffer_size & (loaded.aes_buffer_size - 1)))
+		return RDRAND_FAILURE;
+	*tune = loaded;
+	return RDRAND_SUCCESS;
+}
+// }}} rdrand_tune_load
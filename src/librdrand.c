@@ -24,11 +24,16 @@
 
 
 #include "./librdrand.h"
+#include "./librdrand-drbg.h"
+#include "./librdrand.private.h"
 #include <stddef.h>
 #include <string.h>
 #include <omp.h>
 #include <stdio.h>
 #include <unistd.h> // usleep
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
 
 
 // Delay for enforcing reseed in the rdrand_get_uint64_array_reseed_delay
@@ -38,6 +43,18 @@
 
 #define RETRY_LIMIT 10
 
+// RDSEED underflows often when more threads use it, so it is given
+// more attempts and a pause between them.
+#define RDSEED_RETRY_LIMIT 100
+
+// Bytes of RDSEED for one seed of rdrand_get_uint64_array_reseed_rdseed:
+// the seed length of the AES-256 CTR_DRBG which conditions it.
+#define RESEED_RDSEED_ENTROPY 48
+
+// Maximal number of pause instructions between two RDSEED attempts.
+// The pause doubles on each failed attempt up to this value.
+#define RDSEED_BACKOFF_MAX 1024
+
 
 #if defined(__X86_64__) || defined(_WIN64) || defined(_LP64)
 # define _X86_64
@@ -50,6 +67,26 @@
  */
 #define RDRAND_MASK     0x40000000
 
+/**
+ * Mask for CPUINFO result. RdSeed support is declared on 18th bit
+ * in EBX register of the leaf 7 (subleaf 0).
+ */
+#define RDSEED_MASK     0x00040000
+
+/**
+ * Other masks needed for rdrand_get_features.
+ * Leaf 1, ECX: AES-NI, OSXSAVE.
+ * Leaf 7 (subleaf 0), EBX: AVX2, AVX512F; ECX: VAES.
+ * XCR0: SSE+AVX states and opmask+ZMM states enabled by the OS.
+ */
+#define AESNI_MASK      0x02000000
+#define OSXSAVE_MASK    0x08000000
+#define AVX2_MASK       0x00000020
+#define AVX512F_MASK    0x00010000
+#define VAES_MASK       0x00000200
+#define XCR0_AVX        0x06
+#define XCR0_AVX512     0xe6
+
 //#define PRINT_IF_UNDERFLOW(rc, line) if(rc == RDRAND_FAILURE) fprintf(stderr,"ERROR: UNDERFLOW on line %d!!!\n",line)
 #define PRINT_IF_UNDERFLOW(rc, line)
 
@@ -109,10 +146,34 @@
 		*x=~(*x & 0);
 		return  RDRAND_SUCCESS;
 	}
+
+	#define RDSEED16_STEP rdseed16_step_native
+	#define RDSEED32_STEP rdseed32_step_native
+	#define RDSEED64_STEP rdseed64_step_native
+
+	inline int rdseed16_step(uint16_t *x)
+	{
+		*x=~(*x & 0);
+		return  RDRAND_SUCCESS;
+	}
+	inline int rdseed32_step(uint32_t *x)
+	{
+		*x=~(*x & 0);
+		return  RDRAND_SUCCESS;
+	}
+	inline int rdseed64_step(uint64_t *x)
+	{
+		*x=~(*x & 0);
+		return  RDRAND_SUCCESS;
+	}
 #else
 	#define RDRAND16_STEP rdrand16_step
 	#define RDRAND32_STEP rdrand32_step
 	#define RDRAND64_STEP rdrand64_step
+
+	#define RDSEED16_STEP rdseed16_step
+	#define RDSEED32_STEP rdseed32_step
+	#define RDSEED64_STEP rdseed64_step
 #endif // STUB_RDRAND
 // }}}
 
@@ -210,6 +271,163 @@
 #endif /* HAVE_X86INTRIN_H && HAVE_RDRAND_IN_GCC*/
 // }}} RDRAND_STEPs
 
+// {{{ RDSEED_STEPs
+        /**
+         * 16 bits of entropy through RDSEED
+         *
+         * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+         */
+        int RDSEED16_STEP(uint16_t *x)
+        {
+            unsigned char err = 1;
+            asm volatile (".byte 0x66; .byte 0x0f; .byte 0xc7; .byte 0xf8; setc %1"
+                      : "=a" (*x), "=qm" (err));
+            if(err == 1)
+            {
+                return RDRAND_SUCCESS;
+            }
+            return RDRAND_FAILURE;
+        }
+
+
+        /**
+         * 32 bits of entropy through RDSEED
+         *
+         * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+         */
+        int RDSEED32_STEP(uint32_t *x)
+        {
+            unsigned char err = 1;
+            asm volatile (".byte 0x0f; .byte 0xc7; .byte 0xf8; setc %1"
+                      : "=a" (*x), "=qm" (err));
+            if(err == 1)
+            {
+                return RDRAND_SUCCESS;
+            }
+            return RDRAND_FAILURE;
+        }
+
+
+        /**
+         * 64 bits of entropy through RDSEED
+         *
+         * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+         */
+        int RDSEED64_STEP(uint64_t *x)
+        {
+            unsigned char err = 1;
+            /* support for 32bit architecture */
+            #ifdef _X86_64
+                asm volatile (".byte 0x48; .byte 0x0f; .byte 0xc7; .byte 0xf8; setc %1"
+                          : "=a" (*x), "=qm" (err));
+            #else
+                uint32_t *x32;
+                x32=(uint32_t*)x;
+                asm volatile (".byte 0x0f; .byte 0xc7; .byte 0xf8; setc %1"
+                          : "=a" (*x32), "=qm" (err));
+                /* test after the first call*/
+                if(err != 1)
+                {
+                    return RDRAND_FAILURE;
+                }
+
+                asm volatile (".byte 0x0f; .byte 0xc7; .byte 0xf8; setc %1"
+                          : "=a" (*(x32+1)), "=qm" (err));
+
+            #endif
+
+            if(err == 1)
+            {
+                return RDRAND_SUCCESS;
+            }
+            return RDRAND_FAILURE;
+        }
+
+/**
+ * Wait before the next RDSEED attempt. The wait doubles with every
+ * failed attempt, so the entropy source has time to refill while
+ * the first retries stay cheap.
+ */
+static inline void rdseed_backoff(int attempt)
+{
+	unsigned int i, pauses;
+
+	pauses = attempt < 10 ? 1u << attempt : RDSEED_BACKOFF_MAX;
+	for(i = 0; i < pauses; i++)
+	{
+		asm volatile ("pause" ::: "memory");
+	}
+}
+// }}} RDSEED_STEPs
+
+// {{{ RDRAND64_BULK
+/**
+ * Number of independent 64 bit RDRAND requests the bulk kernel keeps
+ * in flight. Carry flags of the whole group are checked only once.
+ */
+#define RDRAND_BULK_LANES 8
+
+/**
+ * Most 64 bit values passed to one call of the fill kernel, which
+ * counts in unsigned int. Longer requests are split into such chunks.
+ */
+#define RDRAND_FILL_CHUNK (1u << 30)
+
+#if defined(_X86_64) && !defined(STUB_RDRAND)
+        #define HAVE_RDRAND64_BULK_MULTI
+        /**
+         * Fill RDRAND_BULK_LANES 64 bit values with no branch between
+         * the instructions, so the core can issue them all at once.
+         * Carry flags are summed up into one counter by adc.
+         *
+         * Returns RDRAND_SUCCESS only if all lanes succeeded, otherwise
+         * RDRAND_FAILURE and the content of x is undefined.
+         */
+        static inline int rdrand64_bulk_step_multi(uint64_t *x)
+        {
+            uint64_t r0, r1, r2, r3, r4, r5, r6, r7;
+            uint32_t ok = 0;
+
+            asm volatile ("rdrand %0\n\t" "adcl $0, %8\n\t"
+                          "rdrand %1\n\t" "adcl $0, %8\n\t"
+                          "rdrand %2\n\t" "adcl $0, %8\n\t"
+                          "rdrand %3\n\t" "adcl $0, %8\n\t"
+                          "rdrand %4\n\t" "adcl $0, %8\n\t"
+                          "rdrand %5\n\t" "adcl $0, %8\n\t"
+                          "rdrand %6\n\t" "adcl $0, %8\n\t"
+                          "rdrand %7\n\t" "adcl $0, %8"
+                      : "=r" (r0), "=r" (r1), "=r" (r2), "=r" (r3),
+                        "=r" (r4), "=r" (r5), "=r" (r6), "=r" (r7),
+                        "+r" (ok)
+                      :
+                      : "cc");
+            x[0] = r0; x[1] = r1; x[2] = r2; x[3] = r3;
+            x[4] = r4; x[5] = r5; x[6] = r6; x[7] = r7;
+
+            if(ok == RDRAND_BULK_LANES)
+            {
+                return RDRAND_SUCCESS;
+            }
+            return RDRAND_FAILURE;
+        }
+#endif /* _X86_64 && !STUB_RDRAND */
+
+        /**
+         * Portable (and stub) variant of the bulk step, one value
+         * at a time.
+         */
+        static inline int rdrand64_bulk_step_single(uint64_t *x)
+        {
+            int i, rc = RDRAND_SUCCESS;
+            for(i = 0; i < RDRAND_BULK_LANES; i++)
+            {
+                if(rdrand64_step(&x[i]) != RDRAND_SUCCESS)
+                    rc = RDRAND_FAILURE;
+            }
+            return rc;
+        }
+// }}} RDRAND64_BULK
+
 // {{{ rdrand_testSupport
 struct cpuid
 {
@@ -218,9 +436,9 @@ struct cpuid
 typedef struct cpuid cpuid_t;
 
 /**
- *  cpuid ASM wrapper
+ *  cpuid ASM wrapper for leaves with subleaves (ECX input)
  */
-void cpuid(cpuid_t *result,uint32_t eax)
+void cpuid_count(cpuid_t *result, uint32_t eax, uint32_t ecx)
 {
 #ifdef _X86_64
 	asm volatile ("cpuid"
@@ -228,7 +446,7 @@ void cpuid(cpuid_t *result,uint32_t eax)
 			      "=b" (result->ebx),
 			      "=c" (result->ecx),
 			      "=d" (result->edx)
-			      : "a"  (eax)
+			      : "a"  (eax), "c" (ecx)
 			      : "memory");
 
 #else // 32-bit
@@ -239,60 +457,158 @@ void cpuid(cpuid_t *result,uint32_t eax)
           "movl %%ebx, %1\n\t" // Copy the %ebx result elsewhere
           "popl %%ebx    \n\t" // Restore %ebx
           : "=a"(result->eax), "=r"(result->ebx), "=c"(result->ecx), "=d"(result->edx)
-          : "a"(eax)
+          : "a"(eax), "c"(ecx)
           : "cc"
         );
 #endif // _X86_64
 }
 
 /**
- * Detect if the CPU support RdRand instruction.
- * Returns RDRAND_SUPPORTED  or RDRAND_UNSUPPORTED.
+ *  cpuid ASM wrapper
  */
-int rdrand_testSupport()
+void cpuid(cpuid_t *result,uint32_t eax)
+{
+	cpuid_count(result, eax, 0);
+}
+
+/**
+ * Read an extended control register, XCR0 tells which register
+ * states the OS saves on context switch.
+ */
+static uint64_t xgetbv(uint32_t index)
+{
+	uint32_t eax, edx;
+	asm volatile (".byte 0x0f; .byte 0x01; .byte 0xd0"
+			      : "=a" (eax), "=d" (edx)
+			      : "c" (index));
+	return ((uint64_t)edx << 32) | eax;
+}
+
+/**
+ * Features found by the probe, valid when rdrand_features_probed is set.
+ */
+static unsigned int rdrand_features;
+static volatile int rdrand_features_probed = 0;
+
+/**
+ * Set by the probe on "GenuineIntel" CPUs, whose DRNG overlaps
+ * RDRAND requests issued back to back.
+ */
+static int rdrand_cpu_intel = 0;
+
+static void rdrand_bind_kernels(unsigned int features);
+
+/**
+ * One time CPU probe, run as a library constructor. Can be also called
+ * later (e.g. from constructors of other libraries which run first),
+ * the result is always the same.
+ */
+static void __attribute__((constructor)) rdrand_probe_features(void)
 {
 	cpuid_t reg;
+	uint32_t max_leaf, ecx1;
+	uint64_t xcr0 = 0;
+	unsigned int features = 0;
+
+	cpuid(&reg,0);
+	max_leaf = reg.eax;
+	// vendor string is in EBX, EDX, ECX: "Genu" "ineI" "ntel"
+	rdrand_cpu_intel = reg.ebx == 0x756e6547 && reg.edx == 0x49656e69 && reg.ecx == 0x6c65746e;
+
+	cpuid(&reg,1); // get feature bits
+	ecx1 = reg.ecx;
+	if( ecx1 & RDRAND_MASK )
+		features |= RDRAND_FEATURE_RDRAND;
+	if( ecx1 & AESNI_MASK )
+		features |= RDRAND_FEATURE_AESNI;
+	// AVX states usable only when the OS enabled them by XSETBV
+	if( ecx1 & OSXSAVE_MASK )
+		xcr0 = xgetbv(0);
+
+	if( max_leaf >= 7 )
+	{
+		cpuid_count(&reg,7,0); // get extended feature bits
+		if( reg.ebx & RDSEED_MASK )
+			features |= RDRAND_FEATURE_RDSEED;
+		if( (xcr0 & XCR0_AVX) == XCR0_AVX )
+		{
+			if( reg.ebx & AVX2_MASK )
+				features |= RDRAND_FEATURE_AVX2;
+			if( reg.ecx & VAES_MASK )
+				features |= RDRAND_FEATURE_VAES;
+			if( (reg.ebx & AVX512F_MASK) && (xcr0 & XCR0_AVX512) == XCR0_AVX512 )
+				features |= RDRAND_FEATURE_AVX512F;
+		}
+	}
 
   #ifdef STUB_RDRAND
-    return RDRAND_SUPPORTED;
+	features |= RDRAND_FEATURE_RDRAND | RDRAND_FEATURE_RDSEED;
   #endif
 
-  // Test if CPU supports RdRand
-  cpuid(&reg,1); // get feature bits
-  if( reg.ecx & RDRAND_MASK )
-  {
-    return RDRAND_SUPPORTED;
-  }
+	rdrand_features = features;
+	rdrand_bind_kernels(features);
+	rdrand_features_probed = 1;
+}
+
+/**
+ * Get CPU features relevant for the library, as a mask
+ * of RDRAND_FEATURE_* flags. The CPU is probed only once.
+ */
+unsigned int rdrand_get_features()
+{
+	if( !rdrand_features_probed )
+		rdrand_probe_features();
+	return rdrand_features;
+}
+
+/**
+ * Detect if the CPU support RdRand instruction.
+ * Returns RDRAND_SUPPORTED  or RDRAND_UNSUPPORTED.
+ */
+int rdrand_testSupport()
+{
+	if( rdrand_get_features() & RDRAND_FEATURE_RDRAND )
+	{
+		return RDRAND_SUPPORTED;
+	}
+
+	return RDRAND_UNSUPPORTED;
+}
+
+/**
+ * Detect if the CPU support RdSeed instruction.
+ * Returns RDRAND_SUPPORTED  or RDRAND_UNSUPPORTED.
+ */
+int rdseed_testSupport()
+{
+	if( rdrand_get_features() & RDRAND_FEATURE_RDSEED )
+	{
+		return RDRAND_SUPPORTED;
+	}
 
 	return RDRAND_UNSUPPORTED;
 }
 // }}} rdrand_testSupport
 
 
+// {{{ single value kernels
 /**
- * Get a 16 bit random number
- *
- * The 16 bit result is zero extended to 32 bits.
- * Will retry up to retry_limit times. Negative retry_limit
- * implies default retry_limit RETRY_LIMIT.
- * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ * Retry loops behind rdrand_get_uintXX_retry, retry_limit is
+ * already resolved. Return RDRAND_SUCCESS or RDRAND_FAILURE.
  */
-// {{{ rdrand_get_uint16_retry
-int rdrand_get_uint16_retry(uint16_t *dest, int retry_limit)
+static int rdrand16_retry_native(uint16_t *dest, int retry_limit)
 {
 	int rc;
 	int count;
 	uint16_t x;
 
-	if ( retry_limit < 0 )
-		retry_limit = RETRY_LIMIT;
 	count = 0;
 	do
 	{
 		rc=rdrand16_step( &x );
 		++count;
 	}
-	while((rc == 0) && (count < retry_limit));
+	while((rc == RDRAND_FAILURE) && (count < retry_limit));
 	PRINT_IF_UNDERFLOW (rc, __LINE__);
 
 	if(rc == RDRAND_SUCCESS)
@@ -302,24 +618,13 @@ int rdrand_get_uint16_retry(uint16_t *dest, int retry_limit)
 	}
 	return RDRAND_FAILURE;
 }
-// }}} rdrand_get_uint16_retry
 
-/**
- * Get a 32 bit random number
- *
- * Will retry up to retry_limit times. Negative retry_limit
- * implies default retry_limit RETRY_LIMIT.
- * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
- */
-// {{{ rdrand_get_uint32_retry
-int rdrand_get_uint32_retry(uint32_t *dest, int retry_limit)
+static int rdrand32_retry_native(uint32_t *dest, int retry_limit)
 {
 	int rc;
 	int count;
 	uint32_t x;
 
-	if ( retry_limit < 0 )
-		retry_limit = RETRY_LIMIT;
 	count = 0;
 	do
 	{
@@ -336,25 +641,13 @@ int rdrand_get_uint32_retry(uint32_t *dest, int retry_limit)
 	}
 	return RDRAND_FAILURE;
 }
-// }}}
 
-
-/**
- * Get a 64 bit random number
- *
- * Will retry up to retry_limit times. Negative retry_limit
- * implies default retry_limit RETRY_LIMIT.
- * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
- */
-// {{{ rdrand_get_uint64_retry
-int rdrand_get_uint64_retry(uint64_t *dest, int retry_limit)
+static int rdrand64_retry_native(uint64_t *dest, int retry_limit)
 {
 	int rc;
 	int count;
 	uint64_t x;
 
-	if ( retry_limit < 0 )
-		retry_limit = RETRY_LIMIT;
 	count = 0;
 	do
 	{
@@ -371,50 +664,253 @@ int rdrand_get_uint64_retry(uint64_t *dest, int retry_limit)
 	}
 	return RDRAND_FAILURE;
 }
-// }}}
 
 /**
- * Get an array of 16 bit random numbers
- * Will retry up to retry_limit times. Negative retry_limit
- * implies default retry_limit RETRY_LIMIT
- * Returns the number of bytes successfully acquired
- * For higher speed, uses 64bit generating when possible.
+ * The same for RDSEED, with a growing pause between the attempts.
  */
-// {{{ unsigned int rdrand_get_uint16_array_retry
-unsigned int rdrand_get_uint16_array_retry(uint16_t *dest,  const unsigned int count, int retry_limit)
+static int rdseed16_retry_native(uint16_t *dest, int retry_limit)
 {
 	int rc;
-	int retry_count;
-	unsigned int generated_16 = 0;
-	unsigned int generated_64 = 0;
+	int count;
+	uint16_t x;
 
-	unsigned int count_64 = count / 4;
-	unsigned int count_16 = count - 4 * count_64;
+	count = 0;
+	while((rc=rdseed16_step( &x )) == RDRAND_FAILURE && ++count < retry_limit)
+	{
+		rdseed_backoff(count);
+	}
+	PRINT_IF_UNDERFLOW (rc, __LINE__);
 
-	uint16_t x_16;
-	uint64_t* dest_64;
+	if(rc == RDRAND_SUCCESS)
+	{
+		*dest = x;
+		return RDRAND_SUCCESS;
+	}
+	return RDRAND_FAILURE;
+}
 
-	if ( retry_limit < 0 )
-		retry_limit = RETRY_LIMIT;
+static int rdseed32_retry_native(uint32_t *dest, int retry_limit)
+{
+	int rc;
+	int count;
+	uint32_t x;
 
-	if ( count_16 > 0 )
+	count = 0;
+	while((rc=rdseed32_step( &x )) == RDRAND_FAILURE && ++count < retry_limit)
 	{
-		retry_count = 0;
-		do
-		{
-			rc=rdrand16_step( &x_16 );
-			++retry_count;
-		}
-		while((rc == RDRAND_FAILURE) && (retry_count < retry_limit));
-		PRINT_IF_UNDERFLOW (rc, __LINE__);
+		rdseed_backoff(count);
+	}
+	PRINT_IF_UNDERFLOW (rc, __LINE__);
 
-		if (rc == RDRAND_SUCCESS)
-		{
-			*dest = x_16;
-			++dest;
-			++generated_16;
-		}
-		else
+	if(rc == RDRAND_SUCCESS)
+	{
+		*dest = x;
+		return RDRAND_SUCCESS;
+	}
+	return RDRAND_FAILURE;
+}
+
+static int rdseed64_retry_native(uint64_t *dest, int retry_limit)
+{
+	int rc;
+	int count;
+	uint64_t x;
+
+	count = 0;
+	while((rc=rdseed64_step( &x )) == RDRAND_FAILURE && ++count < retry_limit)
+	{
+		rdseed_backoff(count);
+	}
+	PRINT_IF_UNDERFLOW (rc, __LINE__);
+
+	if(rc == RDRAND_SUCCESS)
+	{
+		*dest = x;
+		return RDRAND_SUCCESS;
+	}
+	return RDRAND_FAILURE;
+}
+
+/**
+ * Used on CPUs without RDRAND (RDSEED), like rdrand64_fill_none.
+ */
+static int rdrand16_retry_none(uint16_t *dest, int retry_limit)
+{
+	(void) dest;
+	(void) retry_limit;
+	return RDRAND_FAILURE;
+}
+
+static int rdrand32_retry_none(uint32_t *dest, int retry_limit)
+{
+	(void) dest;
+	(void) retry_limit;
+	return RDRAND_FAILURE;
+}
+
+static int rdrand64_retry_none(uint64_t *dest, int retry_limit)
+{
+	(void) dest;
+	(void) retry_limit;
+	return RDRAND_FAILURE;
+}
+
+static int rdseed16_retry_none(uint16_t *dest, int retry_limit)
+{
+	(void) dest;
+	(void) retry_limit;
+	return RDRAND_FAILURE;
+}
+
+static int rdseed32_retry_none(uint32_t *dest, int retry_limit)
+{
+	(void) dest;
+	(void) retry_limit;
+	return RDRAND_FAILURE;
+}
+
+static int rdseed64_retry_none(uint64_t *dest, int retry_limit)
+{
+	(void) dest;
+	(void) retry_limit;
+	return RDRAND_FAILURE;
+}
+
+static int rdrand16_retry_resolve(uint16_t *dest, int retry_limit);
+static int rdrand32_retry_resolve(uint32_t *dest, int retry_limit);
+static int rdrand64_retry_resolve(uint64_t *dest, int retry_limit);
+static int rdseed16_retry_resolve(uint16_t *dest, int retry_limit);
+static int rdseed32_retry_resolve(uint32_t *dest, int retry_limit);
+static int rdseed64_retry_resolve(uint64_t *dest, int retry_limit);
+
+/**
+ * Bound by rdrand_bind_kernels together with rdrand64_fill.
+ */
+static int (*rdrand16_retry)(uint16_t *, int) = rdrand16_retry_resolve;
+static int (*rdrand32_retry)(uint32_t *, int) = rdrand32_retry_resolve;
+static int (*rdrand64_retry)(uint64_t *, int) = rdrand64_retry_resolve;
+static int (*rdseed16_retry)(uint16_t *, int) = rdseed16_retry_resolve;
+static int (*rdseed32_retry)(uint32_t *, int) = rdseed32_retry_resolve;
+static int (*rdseed64_retry)(uint64_t *, int) = rdseed64_retry_resolve;
+
+static int rdrand16_retry_resolve(uint16_t *dest, int retry_limit)
+{
+	rdrand_get_features();
+	return rdrand16_retry(dest, retry_limit);
+}
+
+static int rdrand32_retry_resolve(uint32_t *dest, int retry_limit)
+{
+	rdrand_get_features();
+	return rdrand32_retry(dest, retry_limit);
+}
+
+static int rdrand64_retry_resolve(uint64_t *dest, int retry_limit)
+{
+	rdrand_get_features();
+	return rdrand64_retry(dest, retry_limit);
+}
+
+static int rdseed16_retry_resolve(uint16_t *dest, int retry_limit)
+{
+	rdrand_get_features();
+	return rdseed16_retry(dest, retry_limit);
+}
+
+static int rdseed32_retry_resolve(uint32_t *dest, int retry_limit)
+{
+	rdrand_get_features();
+	return rdseed32_retry(dest, retry_limit);
+}
+
+static int rdseed64_retry_resolve(uint64_t *dest, int retry_limit)
+{
+	rdrand_get_features();
+	return rdseed64_retry(dest, retry_limit);
+}
+// }}} single value kernels
+
+/**
+ * Get a 16 bit random number
+ *
+ * The 16 bit result is zero extended to 32 bits.
+ * Will retry up to retry_limit times. Negative retry_limit
+ * implies default retry_limit RETRY_LIMIT.
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+// {{{ rdrand_get_uint16_retry
+int rdrand_get_uint16_retry(uint16_t *dest, int retry_limit)
+{
+	if ( retry_limit < 0 )
+		retry_limit = RETRY_LIMIT;
+	return rdrand16_retry(dest, retry_limit);
+}
+// }}} rdrand_get_uint16_retry
+
+/**
+ * Get a 32 bit random number
+ *
+ * Will retry up to retry_limit times. Negative retry_limit
+ * implies default retry_limit RETRY_LIMIT.
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+// {{{ rdrand_get_uint32_retry
+int rdrand_get_uint32_retry(uint32_t *dest, int retry_limit)
+{
+	if ( retry_limit < 0 )
+		retry_limit = RETRY_LIMIT;
+	return rdrand32_retry(dest, retry_limit);
+}
+// }}}
+
+
+/**
+ * Get a 64 bit random number
+ *
+ * Will retry up to retry_limit times. Negative retry_limit
+ * implies default retry_limit RETRY_LIMIT.
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+// {{{ rdrand_get_uint64_retry
+int rdrand_get_uint64_retry(uint64_t *dest, int retry_limit)
+{
+	if ( retry_limit < 0 )
+		retry_limit = RETRY_LIMIT;
+	return rdrand64_retry(dest, retry_limit);
+}
+// }}}
+
+/**
+ * Get an array of 16 bit random numbers
+ * Will retry up to retry_limit times. Negative retry_limit
+ * implies default retry_limit RETRY_LIMIT
+ * Returns the number of bytes successfully acquired
+ * For higher speed, uses 64bit generating when possible.
+ */
+// {{{ unsigned int rdrand_get_uint16_array_retry
+unsigned int rdrand_get_uint16_array_retry(uint16_t *dest,  const unsigned int count, int retry_limit)
+{
+	unsigned int generated_16 = 0;
+	unsigned int generated_64 = 0;
+
+	unsigned int count_64 = count / 4;
+	unsigned int count_16 = count - 4 * count_64;
+
+	uint16_t x_16;
+	uint64_t* dest_64;
+
+	if ( retry_limit < 0 )
+		retry_limit = RETRY_LIMIT;
+
+	if ( count_16 > 0 )
+	{
+		if (rdrand16_retry(&x_16, retry_limit) == RDRAND_SUCCESS)
+		{
+			*dest = x_16;
+			++dest;
+			++generated_16;
+		}
+		else
 		{
 			return generated_16;
 		}
@@ -439,8 +935,6 @@ unsigned int rdrand_get_uint16_array_retry(uint16_t *dest,  const unsigned int c
 // {{{ rdrand_get_uint32_array_retry
 unsigned int rdrand_get_uint32_array_retry(uint32_t *dest,  const unsigned int count, int retry_limit)
 {
-	int rc;
-	int retry_count;
 	unsigned int generated_32 = 0;
 	unsigned int generated_64 = 0;
 
@@ -455,16 +949,7 @@ unsigned int rdrand_get_uint32_array_retry(uint32_t *dest,  const unsigned int c
 
 	if ( count_32 > 0 )
 	{
-		retry_count = 0;
-		do
-		{
-			rc=rdrand32_step( &x_32 );
-			++retry_count;
-		}
-		while((rc == RDRAND_FAILURE) && (retry_count < retry_limit));
-		PRINT_IF_UNDERFLOW (rc, __LINE__);
-
-		if (rc == RDRAND_SUCCESS)
+		if (rdrand32_retry(&x_32, retry_limit) == RDRAND_SUCCESS)
 		{
 			*dest = x_32;
 			++dest;
@@ -485,14 +970,13 @@ unsigned int rdrand_get_uint32_array_retry(uint32_t *dest,  const unsigned int c
 }
 // }}}
 
+// {{{ rdrand64_retry_words
 /**
- * Get an array of 64 bit random numbers
- * Will retry up to retry_limit times. Negative retry_limit
- * implies default retry_limit RETRY_LIMIT
- * Returns the number of bytes successfully acquired
+ * Fill count 64 bit values one by one, each with its own retry loop.
+ * Used for the tail of the bulk kernel and when a whole group failed.
+ * Returns the number of values successfully acquired.
  */
-// {{{ rdrand_get_uint64_array_retry
-unsigned int rdrand_get_uint64_array_retry(uint64_t *dest, const unsigned int count, int retry_limit)
+static unsigned int rdrand64_retry_words(uint64_t *dest, const unsigned int count, int retry_limit)
 {
 	int rc;
 	int retry_count;
@@ -500,9 +984,6 @@ unsigned int rdrand_get_uint64_array_retry(uint64_t *dest, const unsigned int co
 	unsigned int i;
 	uint64_t x_64;
 
-	if ( retry_limit < 0 )
-		retry_limit = RETRY_LIMIT;
-
 	for ( i=0; i<count; ++i)
 	{
 		retry_count = 0;
@@ -528,6 +1009,219 @@ unsigned int rdrand_get_uint64_array_retry(uint64_t *dest, const unsigned int co
 
 	return generated_64;
 }
+
+/**
+ * Cold path of the bulk kernel: regenerate a group in which at least
+ * one lane underflowed. Kept out of line so the hot loop stays small.
+ */
+static unsigned int __attribute__((noinline, cold))
+rdrand64_bulk_retry(uint64_t *dest, int retry_limit)
+{
+	return rdrand64_retry_words(dest, RDRAND_BULK_LANES, retry_limit);
+}
+// }}}
+
+// {{{ rdrand64 fill kernels
+/**
+ * Body of the fill kernels, instantiated for each bulk step.
+ */
+static inline __attribute__((always_inline)) unsigned int
+rdrand64_fill_groups(uint64_t *dest, const unsigned int count, int retry_limit,
+                     int (*bulk_step)(uint64_t *))
+{
+	unsigned int generated_64 = 0;
+	unsigned int regenerated;
+
+	/* whole groups, RDRAND_BULK_LANES requests in flight */
+	while ( count - generated_64 >= RDRAND_BULK_LANES )
+	{
+		if ( __builtin_expect(bulk_step(dest) != RDRAND_SUCCESS, 0) )
+		{
+			regenerated = rdrand64_bulk_retry(dest, retry_limit);
+			if ( regenerated != RDRAND_BULK_LANES )
+			{
+				return generated_64 + regenerated;
+			}
+		}
+		dest += RDRAND_BULK_LANES;
+		generated_64 += RDRAND_BULK_LANES;
+	}
+
+	/* the rest, which doesn't fill a whole group */
+	generated_64 += rdrand64_retry_words(dest, count - generated_64, retry_limit);
+
+	return generated_64;
+}
+
+#ifdef HAVE_RDRAND64_BULK_MULTI
+static unsigned int rdrand64_fill_multi(uint64_t *dest, const unsigned int count, int retry_limit)
+{
+	return rdrand64_fill_groups(dest, count, retry_limit, rdrand64_bulk_step_multi);
+}
+#endif
+
+static unsigned int rdrand64_fill_single(uint64_t *dest, const unsigned int count, int retry_limit)
+{
+	return rdrand64_fill_groups(dest, count, retry_limit, rdrand64_bulk_step_single);
+}
+
+/**
+ * Used on CPUs without RDRAND, so the library reports failure
+ * instead of crashing on an illegal instruction.
+ */
+static unsigned int rdrand64_fill_none(uint64_t *dest, const unsigned int count, int retry_limit)
+{
+	(void) dest;
+	(void) count;
+	(void) retry_limit;
+	return 0;
+}
+
+static unsigned int rdrand64_fill_resolve(uint64_t *dest, const unsigned int count, int retry_limit);
+
+/**
+ * The best fill kernel for the running CPU. Bound by the feature probe,
+ * the resolver covers calls which come before the library constructor.
+ */
+static unsigned int (*rdrand64_fill)(uint64_t *, const unsigned int, int) = rdrand64_fill_resolve;
+
+/**
+ * Bind all kernels which execute RDRAND. The multi lane kernel pays off
+ * only where the DRNG serves the requests in parallel, on Intel; other
+ * CPUs (AMD runs RDRAND in microcode, one request at a time) get the
+ * single lane kernel, which checks each value as it comes.
+ */
+static void rdrand_bind_kernels(unsigned int features)
+{
+	if ( features & RDRAND_FEATURE_RDSEED )
+	{
+		rdseed16_retry = rdseed16_retry_native;
+		rdseed32_retry = rdseed32_retry_native;
+		rdseed64_retry = rdseed64_retry_native;
+	}
+	else
+	{
+		rdseed16_retry = rdseed16_retry_none;
+		rdseed32_retry = rdseed32_retry_none;
+		rdseed64_retry = rdseed64_retry_none;
+	}
+
+	if ( !(features & RDRAND_FEATURE_RDRAND) )
+	{
+		rdrand16_retry = rdrand16_retry_none;
+		rdrand32_retry = rdrand32_retry_none;
+		rdrand64_retry = rdrand64_retry_none;
+		rdrand64_fill = rdrand64_fill_none;
+		return;
+	}
+	rdrand16_retry = rdrand16_retry_native;
+	rdrand32_retry = rdrand32_retry_native;
+	rdrand64_retry = rdrand64_retry_native;
+	rdrand64_fill = rdrand64_fill_single;
+#ifdef HAVE_RDRAND64_BULK_MULTI
+	if ( rdrand_cpu_intel )
+		rdrand64_fill = rdrand64_fill_multi;
+#endif
+}
+
+#ifdef STUB_RDRAND
+void rdrand_bind_features(unsigned int features)
+{
+	rdrand_get_features();
+	rdrand_bind_kernels(features);
+}
+#endif
+
+static unsigned int rdrand64_fill_resolve(uint64_t *dest, const unsigned int count, int retry_limit)
+{
+	rdrand_get_features();
+	return rdrand64_fill(dest, count, retry_limit);
+}
+
+/**
+ * rdrand64_fill for counts which don't fit into unsigned int.
+ * Stops at the first chunk which wasn't fully generated.
+ */
+static size_t rdrand64_fill_long(uint64_t *dest, const size_t count, int retry_limit)
+{
+	size_t generated = 0;
+	unsigned int chunk, done;
+
+	while (generated < count)
+	{
+		chunk = count - generated > RDRAND_FILL_CHUNK ? RDRAND_FILL_CHUNK : count - generated;
+		done = rdrand64_fill(dest + generated, chunk, retry_limit);
+		generated += done;
+		if (done != chunk)
+			break;
+	}
+	return generated;
+}
+// }}} rdrand64 fill kernels
+
+/**
+ * Get an array of 64 bit random numbers
+ * Will retry up to retry_limit times. Negative retry_limit
+ * implies default retry_limit RETRY_LIMIT
+ * Returns the number of bytes successfully acquired
+ */
+// {{{ rdrand_get_uint64_array_retry
+unsigned int rdrand_get_uint64_array_retry(uint64_t *dest, const unsigned int count, int retry_limit)
+{
+	if ( retry_limit < 0 )
+		retry_limit = RETRY_LIMIT;
+
+	return rdrand64_fill(dest, count, retry_limit);
+}
+// }}}
+
+/**
+ * Variants of the array functions above for counts which don't
+ * fit into unsigned int.
+ * Return the number of values successfully acquired.
+ */
+// {{{ rdrand_get_uintXX_array_retry_long
+size_t rdrand_get_uint16_array_retry_long(uint16_t *dest, const size_t count, int retry_limit)
+{
+	size_t generated = 0;
+
+	if ( retry_limit < 0 )
+		retry_limit = RETRY_LIMIT;
+
+	while ( generated < count % 4 )
+	{
+		if (rdrand16_retry(dest, retry_limit) != RDRAND_SUCCESS)
+			return generated;
+		++dest;
+		++generated;
+	}
+	return generated + 4 * rdrand64_fill_long((uint64_t *) dest, count / 4, retry_limit);
+}
+
+size_t rdrand_get_uint32_array_retry_long(uint32_t *dest, const size_t count, int retry_limit)
+{
+	size_t generated = 0;
+
+	if ( retry_limit < 0 )
+		retry_limit = RETRY_LIMIT;
+
+	if ( count % 2 > 0 )
+	{
+		if (rdrand32_retry(dest, retry_limit) != RDRAND_SUCCESS)
+			return 0;
+		++dest;
+		++generated;
+	}
+	return generated + 2 * rdrand64_fill_long((uint64_t *) dest, count / 2, retry_limit);
+}
+
+size_t rdrand_get_uint64_array_retry_long(uint64_t *dest, const size_t count, int retry_limit)
+{
+	if ( retry_limit < 0 )
+		retry_limit = RETRY_LIMIT;
+
+	return rdrand64_fill_long(dest, count, retry_limit);
+}
 // }}}
 
 /**
@@ -540,8 +1234,6 @@ unsigned int rdrand_get_uint64_array_retry(uint64_t *dest, const unsigned int co
 // {{{  rdrand_get_uint8_array_retry
 unsigned int rdrand_get_uint8_array_retry(uint8_t *dest,  const unsigned int count, int retry_limit)
 {
-	int rc;
-	int retry_count;
 	unsigned int generated_8 = 0;
 	unsigned int generated_64 = 0;
 
@@ -558,15 +1250,7 @@ unsigned int rdrand_get_uint8_array_retry(uint8_t *dest,  const unsigned int cou
 
 	if ( count_8 > 0 )
 	{
-		retry_count = 0;
-		do
-		{
-			rc=rdrand64_step( &x_64 );
-			++retry_count;
-		}
-		while((rc == RDRAND_FAILURE) && (retry_count < retry_limit));
-		PRINT_IF_UNDERFLOW (rc, __LINE__);
-		if (rc == RDRAND_SUCCESS)
+		if (rdrand64_retry(&x_64, retry_limit) == RDRAND_SUCCESS)
 		{
 			memcpy((void*) dest, (void*) &x_64, count_8);
 			dest += count_8;
@@ -601,8 +1285,8 @@ size_t rdrand_get_bytes_retry(void *dest, const size_t size, int retry_limit)
 	uint64_t *alignedStart;
 	uint64_t *restStart;
 
-	unsigned int alignedBytes;
-	unsigned int qWords;
+	size_t alignedBytes;
+	size_t qWords;
 	unsigned int offset;
 	unsigned int rest;
 
@@ -626,7 +1310,7 @@ size_t rdrand_get_bytes_retry(void *dest, const size_t size, int retry_limit)
 	else
 	{
 		/* get offset of first 64bit aligned block in the target buffer */
-		offset = 8-(unsigned long int)start % (unsigned long int) 8;
+		offset = (8-(unsigned long int)start % (unsigned long int) 8) % 8;
 		if(offset == 0)
 		{
 			alignedStart = (uint64_t *)start;
@@ -646,7 +1330,7 @@ size_t rdrand_get_bytes_retry(void *dest, const size_t size, int retry_limit)
 	rest = alignedBytes % 8;
 	qWords = (alignedBytes - rest) >> 3; // divide by 8;
 
-	DEBUG_PRINT_9("DEBUG 9: offset: %u, qWords: %u, rest: %u\n", offset, qWords,rest);
+	DEBUG_PRINT_9("DEBUG 9: offset: %u, qWords: %zu, rest: %u\n", offset, qWords,rest);
 
 	/* fill the begining */
 	if(offset != 0)
@@ -657,7 +1341,7 @@ size_t rdrand_get_bytes_retry(void *dest, const size_t size, int retry_limit)
 	/* fill the main 64bit blocks */
 	if(qWords)
 	{
-		generatedBytes += 8*rdrand_get_uint64_array_retry(alignedStart,qWords, retry_limit);
+		generatedBytes += 8*rdrand64_fill_long(alignedStart,qWords, retry_limit);
 	}
 
 	/* fill the rest */
@@ -671,6 +1355,59 @@ size_t rdrand_get_bytes_retry(void *dest, const size_t size, int retry_limit)
 }
 // }}}
 
+// {{{ block writers
+/**
+ * Size of the blocks the writers fill and hand to the file at once.
+ */
+#define RDRAND_WRITE_BLOCK (256*1024)
+
+/**
+ * Allocate the block for a writer of count bytes.
+ * Returns NULL if there is nothing to write or no memory.
+ */
+static uint8_t *write_block_alloc(const size_t count, size_t *block)
+{
+	*block = count < RDRAND_WRITE_BLOCK ? (count + 63) & ~(size_t)63 : RDRAND_WRITE_BLOCK;
+	if (*block == 0)
+		return NULL;
+	return aligned_alloc(64, *block);
+}
+
+/**
+ * Wipe and free the block of a writer.
+ */
+static void write_block_free(uint8_t *buf, const size_t block)
+{
+	rdrand_wipe(buf, block);
+	free(buf);
+}
+
+/**
+ * write() the whole buffer, continuing after partial writes and signals.
+ * Returns the number of bytes written.
+ */
+static size_t write_all(int fd, const uint8_t *buf, const size_t len)
+{
+	size_t written = 0;
+	ssize_t rc;
+
+	while (written < len)
+	{
+		rc = write(fd, buf + written, len - written);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (rc == 0)
+			break;
+		written += rc;
+	}
+	return written;
+}
+// }}} block writers
+
 /**
  * Write count bytes of random data to a file.
  * implies default retry_limit RETRY_LIMIT
@@ -679,35 +1416,55 @@ size_t rdrand_get_bytes_retry(void *dest, const size_t size, int retry_limit)
 // {{{  rdrand_fwrite
 size_t rdrand_fwrite(FILE *f, const size_t count, int retry_limit)
 {
-	uint64_t tmprand;
-	size_t count64;
-	size_t count8;
-	size_t generated = 0;
-
-	generated = 0;
+	uint8_t *buf;
+	size_t block, todo, generated, written = 0;
 
-	count64 = count >> 3; // divide by 8
-	count8 = count % 8;
+	buf = write_block_alloc(count, &block);
+	if (buf == NULL)
+		return 0;
 
-	// generate 64bit blocks
-	for(; count64 > 0; count64--)
+	while (written < count)
 	{
-		if(!rdrand_get_uint64_retry(&tmprand, retry_limit))
-			return generated;
-		fwrite(&tmprand,sizeof(uint64_t),1,f);
-		generated += 8;
+		todo = count - written < block ? count - written : block;
+		generated = rdrand_get_bytes_retry(buf, todo, retry_limit);
+		generated = fwrite(buf, 1, generated, f);
+		written += generated;
+		if (generated != todo)
+			break;
 	}
 
-	// generate the rest unaligned bytes
-	if(count8)
+	write_block_free(buf, block);
+	return written;
+}
+// }}}
+
+/**
+ * Write count bytes of random data to a file descriptor, without stdio.
+ * Negative retry_limit implies default retry_limit RETRY_LIMIT
+ * Returns the number of bytes successfully written.
+ */
+// {{{  rdrand_write_fd
+size_t rdrand_write_fd(int fd, const size_t count, int retry_limit)
+{
+	uint8_t *buf;
+	size_t block, todo, generated, written = 0;
+
+	buf = write_block_alloc(count, &block);
+	if (buf == NULL)
+		return 0;
+
+	while (written < count)
 	{
-		if(!rdrand_get_uint64_retry(&tmprand, retry_limit))
-			return generated;
-		fwrite(&tmprand,sizeof(uint8_t),count8,f);
-		generated += count8;
+		todo = count - written < block ? count - written : block;
+		generated = rdrand_get_bytes_retry(buf, todo, retry_limit);
+		generated = write_all(fd, buf, generated);
+		written += generated;
+		if (generated != todo)
+			break;
 	}
 
-	return generated;
+	write_block_free(buf, block);
+	return written;
 }
 // }}}
 
@@ -777,7 +1534,7 @@ unsigned int rdrand_get_uint64_array_reseed_skip(uint64_t *dest, const unsigned
 		// load 1024 numbers to force reseed
 		for(n=0; n< 1024; n++)
 		{
-			rdrand64_step( &x_64 );
+			rdrand64_retry( &x_64, 1 );
 		}
 		// load unique number
 		rc = rdrand_get_uint64_retry(&x_64, retry_limit);
@@ -797,3 +1554,210 @@ unsigned int rdrand_get_uint64_array_reseed_skip(uint64_t *dest, const unsigned
 	return generated_64;
 }
 // }}}
+
+
+// {{{ reseed_rdseed DRBG
+static pthread_once_t reseed_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reseed_key;
+/** CTR_DRBG of the calling thread for rdrand_get_uint64_array_reseed_rdseed */
+static __thread rdrand_drbg_t *reseed_drbg = NULL;
+
+/**
+ * Key destructor, runs on the thread which owns the DRBG.
+ */
+static void reseed_drbg_destroy(void *arg)
+{
+	reseed_drbg = NULL;
+	rdrand_drbg_destroy(arg);
+}
+
+static void reseed_init_once(void)
+{
+	pthread_key_create(&reseed_key, reseed_drbg_destroy);
+}
+
+/**
+ * Seed the DRBG of the calling thread anew by RDSEED values,
+ * conditioned by its derivation function.
+ * Returns 1 on success.
+ */
+static int reseed_rdseed_seed(int retry_limit)
+{
+	uint8_t entropy[RESEED_RDSEED_ENTROPY];
+	int result = 0;
+
+	if (rdseed_get_bytes_retry(entropy, sizeof(entropy), retry_limit) != sizeof(entropy))
+		return 0;
+	if (reseed_drbg != NULL)
+	{
+		result = rdrand_drbg_reseed_with(reseed_drbg, entropy, sizeof(entropy), NULL, 0);
+	}
+	else
+	{
+		pthread_once(&reseed_once, reseed_init_once);
+		reseed_drbg = rdrand_drbg_create();
+		if (reseed_drbg != NULL)
+			result = rdrand_drbg_instantiate_with(reseed_drbg, entropy, sizeof(entropy),
+					NULL, 0, NULL, 0);
+		if (result)
+			pthread_setspecific(reseed_key, reseed_drbg);
+		else
+		{
+			rdrand_drbg_destroy(reseed_drbg);
+			reseed_drbg = NULL;
+		}
+	}
+	rdrand_wipe(entropy, sizeof(entropy));
+	return result;
+}
+// }}}
+
+/**
+ * Get an array of 64 bit random values.
+ * Will retry up to retry_limit times. Negative retry_limit
+ * implies default retry_limit RDSEED_RETRY_LIMIT
+ * Returns the number of values successfully acquired.
+ *
+ * Every RDRAND_RESEED_RDSEED_BLOCK values are expanded by an AES-256
+ * CTR_DRBG of the thread from one seed of fresh RDSEED values, so no
+ * two blocks of values come from the same seed. Falls back to the
+ * skipping when the CPU doesn't have RDSEED.
+ */
+// {{{ rdrand_get_uint64_array_reseed_rdseed
+unsigned int rdrand_get_uint64_array_reseed_rdseed(uint64_t *dest, const unsigned int count, int retry_limit)
+{
+	unsigned int generated_64 = 0, n;
+
+	if ( rdseed_testSupport() != RDRAND_SUPPORTED )
+	{
+		return rdrand_get_uint64_array_reseed_skip(dest, count, retry_limit);
+	}
+
+	while (generated_64 < count)
+	{
+		n = count - generated_64 < RDRAND_RESEED_RDSEED_BLOCK ? count - generated_64 : RDRAND_RESEED_RDSEED_BLOCK;
+		if (!reseed_rdseed_seed(retry_limit)
+				|| rdrand_drbg_generate(reseed_drbg, dest + generated_64, n*8, NULL, 0) != n*8)
+			break;
+		generated_64 += n;
+	}
+
+	return generated_64;
+}
+// }}}
+
+/**
+ * Get a 16 bit seed value
+ *
+ * Will retry up to retry_limit times, with an increasing pause between
+ * the attempts. Negative retry_limit implies default RDSEED_RETRY_LIMIT.
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+// {{{ rdseed_get_uint16_retry
+int rdseed_get_uint16_retry(uint16_t *dest, int retry_limit)
+{
+	if ( retry_limit < 0 )
+		retry_limit = RDSEED_RETRY_LIMIT;
+	return rdseed16_retry(dest, retry_limit);
+}
+// }}} rdseed_get_uint16_retry
+
+/**
+ * Get a 32 bit seed value
+ *
+ * Will retry up to retry_limit times, with an increasing pause between
+ * the attempts. Negative retry_limit implies default RDSEED_RETRY_LIMIT.
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+// {{{ rdseed_get_uint32_retry
+int rdseed_get_uint32_retry(uint32_t *dest, int retry_limit)
+{
+	if ( retry_limit < 0 )
+		retry_limit = RDSEED_RETRY_LIMIT;
+	return rdseed32_retry(dest, retry_limit);
+}
+// }}} rdseed_get_uint32_retry
+
+/**
+ * Get a 64 bit seed value
+ *
+ * Will retry up to retry_limit times, with an increasing pause between
+ * the attempts. Negative retry_limit implies default RDSEED_RETRY_LIMIT.
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+// {{{ rdseed_get_uint64_retry
+int rdseed_get_uint64_retry(uint64_t *dest, int retry_limit)
+{
+	if ( retry_limit < 0 )
+		retry_limit = RDSEED_RETRY_LIMIT;
+	return rdseed64_retry(dest, retry_limit);
+}
+// }}} rdseed_get_uint64_retry
+
+/**
+ * Get an array of 64 bit seed values
+ * Will retry up to retry_limit times for each value. Negative
+ * retry_limit implies default RDSEED_RETRY_LIMIT
+ * Returns the number of values successfully acquired
+ */
+// {{{ rdseed_get_uint64_array_retry
+unsigned int rdseed_get_uint64_array_retry(uint64_t *dest, const unsigned int count, int retry_limit)
+{
+	unsigned int i;
+
+	if ( retry_limit < 0 )
+		retry_limit = RDSEED_RETRY_LIMIT;
+
+	for ( i=0; i<count; ++i)
+	{
+		if (rdseed64_retry(&dest[i], retry_limit) != RDRAND_SUCCESS)
+		{
+			break;
+		}
+	}
+
+	return i;
+}
+// }}} rdseed_get_uint64_array_retry
+
+/**
+ * Get bytes of seed values.
+ * Will retry up to retry_limit times for each 64 bit value. Negative
+ * retry_limit implies default RDSEED_RETRY_LIMIT
+ * Returns the number of bytes successfully acquired.
+ */
+// {{{ rdseed_get_bytes_retry
+size_t rdseed_get_bytes_retry(void *dest, const size_t size, int retry_limit)
+{
+	uint8_t *start = dest;
+	size_t generatedBytes = 0;
+	uint64_t x_64;
+
+	if ( retry_limit < 0 )
+		retry_limit = RDSEED_RETRY_LIMIT;
+
+	/* 64bit blocks, memcpy works also for unaligned destination */
+	while ( size - generatedBytes >= 8 )
+	{
+		if (rdseed64_retry(&x_64, retry_limit) != RDRAND_SUCCESS)
+		{
+			return generatedBytes;
+		}
+		memcpy(start + generatedBytes, &x_64, 8);
+		generatedBytes += 8;
+	}
+
+	/* fill the rest */
+	if ( size - generatedBytes > 0 )
+	{
+		if (rdseed64_retry(&x_64, retry_limit) != RDRAND_SUCCESS)
+		{
+			return generatedBytes;
+		}
+		memcpy(start + generatedBytes, &x_64, size - generatedBytes);
+		generatedBytes = size;
+	}
+
+	return generatedBytes;
+}
+// }}} rdseed_get_bytes_retry
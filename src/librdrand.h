@@ -40,6 +40,11 @@
 	int rdrand16_step_native(uint16_t *x);
 	int rdrand32_step_native(uint32_t *x);
 	int rdrand64_step_native(uint64_t *x);
+	int rdseed16_step_native(uint16_t *x);
+	int rdseed32_step_native(uint32_t *x);
+	int rdseed64_step_native(uint64_t *x);
+	/** Bind the kernels as for a CPU with the given features. */
+	void rdrand_bind_features(unsigned int features);
 #endif //STUB_RDRAND
 
 
@@ -62,6 +67,26 @@
  */
 #define RDRAND_UNSUPPORTED  -2
 
+/**
+ * CPU features reported by rdrand_get_features().
+ * AVX2, AVX512F and VAES are reported only if the OS saves
+ * the register states too.
+ */
+#define RDRAND_FEATURE_RDRAND   0x01
+#define RDRAND_FEATURE_RDSEED   0x02
+#define RDRAND_FEATURE_AESNI    0x04
+#define RDRAND_FEATURE_VAES     0x08
+#define RDRAND_FEATURE_AVX2     0x10
+#define RDRAND_FEATURE_AVX512F  0x20
+
+/**
+ * Get CPU features relevant for the library as a mask
+ * of RDRAND_FEATURE_* flags.
+ * The CPU is probed only once, when the library is loaded,
+ * and the library binds its fastest kernels according to the result.
+ */
+unsigned int rdrand_get_features();
+
 /**
  * Detect if the CPU support RdRand instruction.
  * Returns RDRAND_SUPPORTED  or RDRAND_UNSUPPORTED.
@@ -144,6 +169,15 @@ unsigned int rdrand_get_uint32_array_retry(uint32_t *dest, const unsigned int co
  */
 unsigned int rdrand_get_uint64_array_retry(uint64_t *dest, const unsigned int count, int retry_limit);
 
+/**
+ * Variants of rdrand_get_uintXX_array_retry for counts which
+ * don't fit into unsigned int.
+ * Return the number of values successfully acquired.
+ */
+size_t rdrand_get_uint16_array_retry_long(uint16_t *dest, const size_t count, int retry_limit);
+size_t rdrand_get_uint32_array_retry_long(uint32_t *dest, const size_t count, int retry_limit);
+size_t rdrand_get_uint64_array_retry_long(uint64_t *dest, const size_t count, int retry_limit);
+
 /**
  * Get an array of 8 bit random numbers
  * Will retry up to retry_limit times. Negative retry_limit
@@ -169,6 +203,13 @@ size_t rdrand_get_bytes_retry(void *dest, const size_t size, int retry_limit);
  */
 size_t rdrand_fwrite(FILE *f, const size_t count, int retry_limit);
 
+/**
+ * Write count bytes of random data to a file descriptor, without stdio.
+ * Negative retry_limit implies default retry_limit RETRY_LIMIT
+ * Returns the number of bytes successfully written.
+ */
+size_t rdrand_write_fd(int fd, const size_t count, int retry_limit);
+
 
 /**
  * Get an array of 64 bit random values.
@@ -191,5 +232,235 @@ unsigned int rdrand_get_uint64_array_reseed_delay(uint64_t *dest, const unsigned
  */
 unsigned int rdrand_get_uint64_array_reseed_skip(uint64_t *dest, const unsigned int count, int retry_limit);
 
+
+/**
+ * Values of rdrand_get_uint64_array_reseed_rdseed made from one seed.
+ */
+#define RDRAND_RESEED_RDSEED_BLOCK 128
+
+/**
+ * Get an array of 64 bit random values.
+ * Will retry up to retry_limit times. Negative retry_limit
+ * implies default retry_limit RDSEED_RETRY_LIMIT
+ * Returns the number of values successfully acquired.
+ *
+ * Unlike the two functions above, which aim at a fresh seed of the
+ * DRNG for every value, this one reseeds once per block: every
+ * RDRAND_RESEED_RDSEED_BLOCK values (1 KiB) are expanded by an AES-256
+ * CTR_DRBG of the calling thread from one 48 byte seed of fresh RDSEED
+ * values. Values within a block share their seed, blocks don't.
+ * On CPUs without RDSEED it falls back to
+ * rdrand_get_uint64_array_reseed_skip().
+ */
+unsigned int rdrand_get_uint64_array_reseed_rdseed(uint64_t *dest, const unsigned int count, int retry_limit);
+
+/** ********************************************************************
+ *                             RDSEED
+ * RDSEED returns values straight from the conditioned entropy source,
+ * so every value is suitable for seeding another DRBG. It underflows
+ * much more often than RDRAND, that's why the retry functions back off
+ * between attempts and use a higher default limit RDSEED_RETRY_LIMIT.
+ */
+
+/**
+ * Detect if the CPU support RdSeed instruction.
+ * Returns RDRAND_SUPPORTED  or RDRAND_UNSUPPORTED.
+ */
+int rdseed_testSupport();
+
+/**
+ * 16 bits of entropy through RDSEED
+ *
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+int rdseed16_step(uint16_t *x);
+
+/**
+ * 32 bits of entropy through RDSEED
+ *
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+int rdseed32_step(uint32_t *x);
+
+/**
+ * 64 bits of entropy through RDSEED
+ *
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+int rdseed64_step(uint64_t *x);
+
+/**
+ * Get a 16 bit seed value
+ *
+ * Will retry up to retry_limit times, with an increasing pause between
+ * the attempts. Negative retry_limit implies default RDSEED_RETRY_LIMIT.
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+int rdseed_get_uint16_retry(uint16_t *dest, int retry_limit);
+
+/**
+ * Get a 32 bit seed value
+ *
+ * Will retry up to retry_limit times, with an increasing pause between
+ * the attempts. Negative retry_limit implies default RDSEED_RETRY_LIMIT.
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+int rdseed_get_uint32_retry(uint32_t *dest, int retry_limit);
+
+/**
+ * Get a 64 bit seed value
+ *
+ * Will retry up to retry_limit times, with an increasing pause between
+ * the attempts. Negative retry_limit implies default RDSEED_RETRY_LIMIT.
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+int rdseed_get_uint64_retry(uint64_t *dest, int retry_limit);
+
+/**
+ * Get an array of 64 bit seed values
+ * Will retry up to retry_limit times for each value. Negative
+ * retry_limit implies default RDSEED_RETRY_LIMIT
+ * Returns the number of values successfully acquired
+ */
+unsigned int rdseed_get_uint64_array_retry(uint64_t *dest, const unsigned int count, int retry_limit);
+
+/**
+ * Get bytes of seed values.
+ * Will retry up to retry_limit times for each 64 bit value. Negative
+ * retry_limit implies default RDSEED_RETRY_LIMIT
+ * Returns the number of bytes successfully acquired.
+ */
+size_t rdseed_get_bytes_retry(void *dest, const size_t size, int retry_limit);
+
+/**************************************************************************
+ *                         Thread-local pool
+ * Small draws are served from a per-thread buffer which is refilled in
+ * bulk, so they don't pay the RDRAND latency for every value. Values are
+ * wiped from the pool when taken, pools are emptied in the child after
+ * fork() and wiped on thread exit.
+ **************************************************************************/
+
+/**
+ * Default and maximal size of the per-thread pool in bytes.
+ */
+#define RDRAND_POOL_DEFAULT_SIZE  4096
+#define RDRAND_POOL_MAX_SIZE      (1024*1024)
+
+/**
+ * Set the size of the per-thread pools in bytes.
+ * The new size is used by every pool on its next refill.
+ * Returns RDRAND_SUCCESS, or RDRAND_FAILURE if the size is not
+ * a multiple of 64 bytes in the range <64, RDRAND_POOL_MAX_SIZE>.
+ */
+int rdrand_pool_set_size(size_t size);
+
+/**
+ * Get a 64 bit random number from the pool of the calling thread.
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+int rdrand_pool_get_u64(uint64_t *dest);
+
+/**
+ * Get a 32 bit random number from the pool of the calling thread.
+ * Returns RDRAND_SUCCESS on success, or RDRAND_FAILURE on underflow.
+ */
+int rdrand_pool_get_u32(uint32_t *dest);
+
+/**
+ * Get bytes of random values from the pool of the calling thread.
+ * Requests bigger than the pool are generated directly.
+ * Returns the number of bytes successfully acquired.
+ */
+size_t rdrand_pool_get_bytes(void *dest, const size_t size);
+
+/**
+ * Get the number of random bytes cached for the calling thread.
+ */
+size_t rdrand_pool_available(void);
+
+/**
+ * Wipe the pool of the calling thread.
+ */
+void rdrand_pool_flush(void);
+
+/**************************************************************************
+ *                         Parallel fill
+ **************************************************************************/
+
+/**
+ * Most threads used by rdrand_fill_parallel.
+ */
+#define RDRAND_PARALLEL_MAX_THREADS 256
+
+/**
+ * Fill a buffer with random bytes by a pool of worker threads.
+ * The buffer is split into page aligned slices, each of them is
+ * always filled (and so first touched) by the same thread. Workers
+ * are pinned to CPUs spread over the NUMA nodes.
+ * Threads 0 means the number of online CPUs, the calling thread
+ * is one of them.
+ * Negative retry_limit implies default retry_limit RETRY_LIMIT
+ * Returns the number of bytes successfully acquired from the
+ * beginning of the buffer.
+ */
+size_t rdrand_fill_parallel(void *dest, const size_t len, unsigned int threads, int retry_limit);
+
+/**************************************************************************
+ *                         Autotune
+ * A short calibration sweep finds the sizes of the buffers with the
+ * best throughput on this machine. The result can be kept in a cache
+ * file, which is valid only for the same CPU and settings.
+ **************************************************************************/
+
+/**
+ * Sizes tried by rdrand_autotune, in bytes.
+ */
+#define RDRAND_TUNE_MIN_CHUNK       (4*1024)
+#define RDRAND_TUNE_MAX_CHUNK       (256*1024)
+#define RDRAND_TUNE_MIN_AES_BUFFER  256
+#define RDRAND_TUNE_MAX_AES_BUFFER  (64*1024)
+
+/**
+ * Result of the calibration, and the settings it was made for.
+ */
+typedef struct rdrand_tune_s {
+    /** generating threads, 0 means the number of online CPUs */
+    unsigned int threads;
+    /** AES rekey interval, 0 means the library default */
+    unsigned int rekey_interval;
+    /** cipher of the AES context, RDRAND_CIPHER_* of librdrand-aes.h */
+    int cipher;
+    /** bytes generated by one thread at once */
+    size_t chunk_size;
+    /** bytes encrypted between two checks of the AES key counter */
+    unsigned int aes_buffer_size;
+    /** throughput of the chosen sizes in bytes per second */
+    double chunk_rate;
+    double aes_rate;
+} rdrand_tune_t;
+
+/**
+ * Calibrate for tune->threads threads, the cipher tune->cipher and
+ * the AES rekey interval tune->rekey_interval, which is kept as it is,
+ * it is a matter of security and not of speed. Takes about a second.
+ * The smallest size within a few percent of the fastest one is chosen.
+ * Returns RDRAND_SUCCESS, or RDRAND_FAILURE if the generator failed.
+ */
+int rdrand_autotune(rdrand_tune_t *tune);
+
+/**
+ * Load the result from a cache file, if it was made on this CPU
+ * for the same tune->threads, tune->cipher and tune->rekey_interval.
+ * Returns RDRAND_SUCCESS, or RDRAND_FAILURE if the file is missing,
+ * broken or made for something else.
+ */
+int rdrand_tune_load(rdrand_tune_t *tune, const char *path);
+
+/**
+ * Save the result to a cache file.
+ * Returns RDRAND_SUCCESS, or RDRAND_FAILURE if it can't be written.
+ */
+int rdrand_tune_save(const rdrand_tune_t *tune, const char *path);
+
 #endif
 
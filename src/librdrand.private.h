@@ -0,0 +1,40 @@
+/* vim: set expandtab cindent fdm=marker ts=2 sw=2: */
+/*
+ * Copyright (C) 2013-2020 Jan Tulak <jan@tulak.me>
+ * Copyright (C) 2013-2025 Jirka Hladky hladky DOT jiri AT gmail DOT com
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+    Now the legal stuff is done. This file contain helpers shared by
+    the parts of the library, not installed.
+*/
+#ifndef LIBRDRAND_PRIVATE_H_INCLUDED
+#define LIBRDRAND_PRIVATE_H_INCLUDED
+
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * memset which the compiler can't drop as a dead store.
+ */
+static inline void rdrand_wipe(void *ptr, size_t len)
+{
+	memset(ptr, 0, len);
+	asm volatile ("" : : "r" (ptr) : "memory");
+}
+
+#endif // LIBRDRAND_PRIVATE_H_INCLUDED
@@ -27,6 +27,9 @@
 
 
 // {{{ INCLUDES
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE // vmsplice, F_SETPIPE_SZ
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -39,8 +42,25 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#if defined(__has_include)
+    #if __has_include(<linux/fs.h>)
+        #include <linux/fs.h> // BLKGETSIZE64
+    #endif
+    #if __has_include(<linux/io_uring.h>)
+        #include <linux/io_uring.h>
+        #include <sys/syscall.h>
+    #endif
+#endif
 #include "./librdrand.h"
 #include "./librdrand-aes.h"
+#include "./librdrand-drbg.h"
 //#include <rdrand-0.1/rdrand.h>
 #include "./rdrand-gen.h"
 // }}} INCLUDES
@@ -59,10 +79,6 @@
 
 
 // {{{ IFDEFs
-#ifdef _OPENMP
-    #include <omp.h>
-#endif
-
 #ifndef NO_ERROR_PRINTS
     #define EPRINT(...) fprintf(stderr,__VA_ARGS__)
 #else
@@ -73,17 +89,24 @@
 #if defined(__X86_64__) || defined(_WIN64) || defined(_LP64)
 #define _X86_64
 #endif
+
+#if defined(IORING_SETUP_SQPOLL) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING
+#endif
 // }}} IFDEFs
 
 // {{{ macros
 #define SIZEOF(a) ( sizeof (a) / sizeof (a[0]) )
 
 #define RETRY_LIMIT 10
+#define RDSEED_RETRY_LIMIT 100
 #define SLOW_RETRY_LIMIT_CYCLES 100
 #define SLOW_RETRY_LIMIT 1000
 #define SLOW_RETRY_DELAY 1000 // 1 ms
 
 #define VERSION "2.1.6"
+// alignment of O_DIRECT buffers, chunks and offsets
+#define DIRECT_ALIGN 4096
 // }}} macros
 
 // {{{
@@ -117,7 +140,11 @@ const char *METHOD_NAMES[] =
 {
 	"get_bytes",
 	"reseed_delay",
-	"reseed_skip"
+	"reseed_skip",
+	"rdseed",
+	"reseed_rdseed",
+	"ctr_drbg",
+	"aes_stream"
 };
 // }}} METHOD_NAMES
 
@@ -134,12 +161,43 @@ static const char* HELP_TEXT =
 	"  --output     -o FILE Save the generated data to the file.\n"
 	"  --threads    -t NUM  Run the generator in NUM threads (default %u).\n"
     "  --aes-ctr    -a      Encrypt the output with AES-CTR.\n"
-	"  --aes-keys   -k FILE Use given key file for the AES encryption instead of random one. Works only when -a is set.\n"
+	"  --aes-keys   -k FILE Use given key file for the AES encryption instead of random one. Works only when -a is set,\n"
+	"                       or with the aes_stream method, which needs it.\n"
+	"  --aes-rekey  -r NUM  Change the AES key after NUM bytes (default %u, random up to NUM\n"
+	"                       for random keys). Suffixes: K, M, G. Works only when -a is set.\n"
+	"  --cipher     -c NAME Encrypt with the cipher NAME: aes128-ctr (default), aes256-ctr or\n"
+	"                       chacha20, or auto for the fastest one on this machine (with random\n"
+	"                       keys only). Works only when -a is set.\n"
+	"  --seek       -s NUM  Start the aes_stream output at the offset NUM. Suffixes: K, M, G.\n"
+	"  --stream     -i NUM  Use the stream NUM of the key of aes_stream (default 0). Streams are\n"
+	"                       %llu bytes long; without -n, the rest of the stream is generated.\n"
+	"  --autotune   -T      Find the best chunk and AES buffer sizes for this machine first.\n"
+	"  --tune-file  -F FILE Keep the result of --autotune in FILE and use it next time,\n"
+	"                       if it was made on this CPU with the same -t, -r and -c.\n"
+	"  --splice     -S      If the output is a pipe, hand the data to it by vmsplice instead of\n"
+	"                       copying them. The reader must read the data out of the pipe,\n"
+	"                       not splice them further.\n"
+	"  --io-uring   -U      Write to a file by io_uring, with many chunks in flight, so the\n"
+	"                       generating threads don't wait for the disk.\n"
+	"  --direct     -D      Write the output file with O_DIRECT, not through the page cache,\n"
+	"                       and preallocate it for -n. Works only with -o.\n"
+	"  --shards     -j NUM  Split the output of -n bytes to NUM ranges, each generated and\n"
+	"                       written at its offset by its own thread (default -t with -P).\n"
+	"  --output-pattern -P PATTERN\n"
+	"                       Write the ranges of --shards to the files PATTERN, with the number\n"
+	"                       of the range, like out.%%03d, instead of one output.\n"
+	"  --mmap       -M      Map the output file of -n bytes and generate right into it, in\n"
+	"                       the ranges of --shards (default one for every thread).\n"
+	"  --wipe       -w DEV  Overwrite the block device or file DEV by the AES stream of -k,\n"
+	"                       or of a random key, in a region for every thread. Without -n,\n"
+	"                       the whole DEV. -s and -i work as with aes_stream.\n"
+	"  --verify     -y      After --wipe, read DEV back and compare it with the AES stream.\n"
 	"  --verbose    -v      Be verbose (will print on stderr).\n"
 	"  --version    -V      Print version.\n"
 	"\n"
     "AES keys in file for -k argument has to be 24 bytes long "
-    "in hexadecimal form (128bit key + 64bit nonce).\n"
+    "in hexadecimal form (128bit key + 64bit nonce),\n"
+    "40 bytes long (256bit key + 64bit nonce) for aes256-ctr and chacha20.\n"
     "The file can contain 128 keys at maximum.\n"
     "\n"
     "Report bugs to jan@tulak.me or hladky.jiri@gmail.com\n"
@@ -207,6 +265,18 @@ int hexToByte(const char *hex, size_t hex_length, unsigned char* byte, size_t by
 // }}}
 
 
+/**
+ * The biggest chunk in 64bit blocks.
+ */
+static size_t chunk_limit(cnf_t * config){
+    size_t limit = config->max_chunk_size ? config->max_chunk_size : MAX_CHUNK_SIZE;
+
+    // O_DIRECT writes whole blocks
+    if(config->direct_flag)
+        limit = limit < DIRECT_ALIGN/8 ? DIRECT_ALIGN/8 : limit - limit % (DIRECT_ALIGN/8);
+    return limit;
+}
+
 /** Compute the size of a chunk:
  *  Total bytes / 8 = number of 64bit blocks.
  *  No. 64bit blocks / threads = size of chunk
@@ -217,10 +287,13 @@ void compute_chunk_size(cnf_t * config){
     {
         // number of 64bit blocks
         config->blocks = config->bytes / 8;
-        // size of one chunk - max size is limited to MAX_CHUNK_SIZE
+        // size of one chunk - max size is limited to MAX_CHUNK_SIZE,
+        // or to the size found by the autotune
         config->chunk_size = config->blocks / config->threads;
-        if(config->chunk_size > MAX_CHUNK_SIZE)
-            config->chunk_size = MAX_CHUNK_SIZE;
+        if(config->chunk_size > chunk_limit(config))
+            config->chunk_size = chunk_limit(config);
+        if(config->direct_flag)
+            config->chunk_size -= config->chunk_size % (DIRECT_ALIGN/8);
 
         // if there are some chunks (so at least 64 bytes will be generated)
         if(config->chunk_size > 0)
@@ -249,11 +322,89 @@ void compute_chunk_size(cnf_t * config){
     else if(config->bytes == 0)
     {
         // infinite generation
-        config->chunk_size = MAX_CHUNK_SIZE;
+        config->chunk_size = chunk_limit(config);
     }
 }
 // }}} compute_chunk_size
 
+/**
+ * Check that the --output-pattern has exactly one conversion,
+ * the number of the shard, like out.%03d.
+ */
+// {{{ pattern_valid
+static int pattern_valid(const char *pattern)
+{
+	int conversions = 0;
+
+	for (; *pattern; pattern++)
+	{
+		if (*pattern != '%')
+			continue;
+		pattern++;
+		if (*pattern == '%')
+			continue;
+		pattern += strspn(pattern, "-+ #0");
+		pattern += strspn(pattern, "0123456789");
+		if (*pattern != 'd' && *pattern != 'i' && *pattern != 'u'
+				&& *pattern != 'x' && *pattern != 'X')
+			return 0;
+		conversions++;
+	}
+	return conversions == 1;
+}
+// }}} pattern_valid
+
+/**
+ * Parse a size with an optional K, M, G or T suffix.
+ * Return EXIT_SUCCESS, or EXIT_FAILURE with an error printed.
+ */
+// {{{ parse_size
+static int parse_size(const char *arg, double *size)
+{
+	double size_as_double;
+	char *size_suffix;
+
+	errno = 0;
+	size_as_double = strtod(arg,&size_suffix);
+	if ((arg == size_suffix) ||
+	     errno == ERANGE ||
+	     (size_as_double < 0) ||
+	     (size_as_double >= UINT64_MAX) ){
+	    #ifdef _X86_64
+	        EPRINT("Size has to be in range <0, %lu>!\n",UINT64_MAX);
+	    #else
+	        EPRINT("Size has to be in range <0, %llu>!\n",UINT64_MAX);
+	    #endif // _X86_64
+	    return EXIT_FAILURE;
+	}
+	if(strlen(size_suffix) > 0)
+	{
+		switch(*size_suffix)
+		{
+		case 't': case 'T':
+			size_as_double *= pow(2,40);
+			break;
+		case 'g': case 'G':
+			size_as_double *= pow(2,30);
+			break;
+		case 'm': case 'M':
+			size_as_double *= pow(2,20);
+			break;
+		case 'k': case 'K':
+			size_as_double *= pow(2,10);
+			break;
+		default:
+			EPRINT("Unknown suffix %s when parsing %s.\n",
+			    size_suffix,
+			    arg);
+			return EXIT_FAILURE;
+		}
+	}
+	*size = size_as_double;
+	return EXIT_SUCCESS;
+}
+// }}} parse_size
+
 /**
  * Parse arguments and save flags/values to cnf_t* config.
  */
@@ -263,7 +414,6 @@ int parse_args(int argc, char** argv, cnf_t* config)
 	int i;
 	char optC;
 	double size_as_double;
-	char *size_suffix;
 
 	static struct option long_options[] =
 	{
@@ -276,6 +426,20 @@ int parse_args(int argc, char** argv, cnf_t* config)
 		{"output",  required_argument, 0, 'o'},
 		{"threads",  required_argument, 0, 't'},
 		{"aes-keys",  required_argument, 0, 'k'},
+		{"aes-rekey",  required_argument, 0, 'r'},
+		{"cipher",  required_argument, 0, 'c'},
+		{"seek",  required_argument, 0, 's'},
+		{"stream",  required_argument, 0, 'i'},
+		{"autotune",  no_argument, 0, 'T'},
+		{"tune-file",  required_argument, 0, 'F'},
+		{"splice",  no_argument, 0, 'S'},
+		{"io-uring",  no_argument, 0, 'U'},
+		{"direct",  no_argument, 0, 'D'},
+		{"shards",  required_argument, 0, 'j'},
+		{"output-pattern",  required_argument, 0, 'P'},
+		{"mmap",  no_argument, 0, 'M'},
+		{"wipe",  required_argument, 0, 'w'},
+		{"verify",  no_argument, 0, 'y'},
 		{0, 0, 0, 0}
 	};
 
@@ -286,7 +450,7 @@ int parse_args(int argc, char** argv, cnf_t* config)
 		/* getopt_long stores the option index here. */
 		int option_index = 0;
 
-		optC = getopt_long (argc, argv, "hak:vVn:m:o:t:",
+		optC = getopt_long (argc, argv, "hak:r:c:s:i:TF:SUDj:P:Mw:yvVn:m:o:t:",
 				    long_options, &option_index);
 
 		/* Detect the end of the options. */
@@ -312,46 +476,104 @@ int parse_args(int argc, char** argv, cnf_t* config)
 			config->aeskeys_filename = optarg;
 			break;
 
+		case 'T':
+			config->autotune_flag = 1;
+			break;
+
+		case 'F':
+			config->tune_filename = optarg;
+			config->autotune_flag = 1;
+			break;
+
+		case 'S':
+			config->splice_flag = 1;
+			break;
+
+		case 'U':
+			config->uring_flag = 1;
+			break;
+
+		case 'D':
+			config->direct_flag = 1;
+			break;
+
 		case 'n':
       // {{{ parse amount
-			size_as_double = strtod(optarg,&size_suffix);
-			if ((optarg == size_suffix) ||
-             errno == ERANGE ||
-             (size_as_double < 0) || 
-             (size_as_double >= UINT64_MAX) ){
-			    #ifdef _X86_64
-                    EPRINT("Size has to be in range <0, %lu>!\n",UINT64_MAX);
-			    #else
-                    EPRINT("Size has to be in range <0, %llu>!\n",UINT64_MAX);
-			    #endif // _X86_64
-                //exit(EXIT_FAILURE);
-                return EXIT_FAILURE;
+			if (parse_size(optarg, &size_as_double) != EXIT_SUCCESS)
+				return EXIT_FAILURE;
+      // }}} parse amount
+			config->bytes = (size_t)floor(size_as_double);
+			break;
+
+		case 'r':
+      // {{{ parse rekey interval
+			if (parse_size(optarg, &size_as_double) != EXIT_SUCCESS)
+				return EXIT_FAILURE;
+			if (size_as_double < 1 || size_as_double > RDRAND_AES_MAX_REKEY_INTERVAL)
+			{
+				EPRINT("The AES rekey interval has to be in range <1, %u>!\n",
+				    RDRAND_AES_MAX_REKEY_INTERVAL);
+				return EXIT_FAILURE;
 			}
-			if(strlen(size_suffix) > 0)
+			config->aes_rekey = (unsigned int)floor(size_as_double);
+      // }}} parse rekey interval
+			break;
+
+		case 'c':
+      // {{{ parse cipher
+			config->cipher = RDRAND_CIPHER_COUNT;
+			if(strcmp(optarg, "auto") == 0)
+				config->cipher = CIPHER_AUTO;
+			for(i = 0; i<RDRAND_CIPHER_COUNT; i++)
 			{
-				switch(*size_suffix)
+				if(strcmp(optarg, rdrand_cipher_name(i)) == 0)
 				{
-				case 't': case 'T':
-					size_as_double *= pow(2,40);
+					config->cipher = i;
 					break;
-				case 'g': case 'G':
-					size_as_double *= pow(2,30);
-					break;
-				case 'm': case 'M':
-					size_as_double *= pow(2,20);
-					break;
-				case 'k': case 'K':
-					size_as_double *= pow(2,10);
-					break;
-				default:
-					EPRINT("Unknown suffix %s when parsing %s.\n",
-                        size_suffix, 
-                        optarg);
-                    return EXIT_FAILURE;
 				}
 			}
-      // }}} parse amount
-			config->bytes = (size_t)floor(size_as_double);
+			if(config->cipher == RDRAND_CIPHER_COUNT)
+			{
+				EPRINT("Error: Unknown cipher to use!\n"
+				    "Available ciphers: aes128-ctr, aes256-ctr, chacha20 and auto.\n");
+				return EXIT_FAILURE;
+			}
+      // }}} parse cipher
+			break;
+
+		case 's':
+      // {{{ parse stream offset
+			if (parse_size(optarg, &size_as_double) != EXIT_SUCCESS)
+				return EXIT_FAILURE;
+			if (size_as_double > RDRAND_AES_STREAM_LENGTH)
+			{
+				EPRINT("The offset in the AES stream has to be in range <0, %llu>!\n",
+				    RDRAND_AES_STREAM_LENGTH);
+				return EXIT_FAILURE;
+			}
+			config->aes_seek = (unsigned long long)floor(size_as_double);
+			config->aes_seek_flag = 1;
+      // }}} parse stream offset
+			break;
+
+		case 'i':
+      // {{{ parse stream number
+		    {
+                char*p;
+                unsigned long stream;
+                errno = 0;
+                stream=strtoul(optarg,&p,10);
+                if((p ==optarg)||(*p !=0)
+                   ||errno ==ERANGE
+                   ||(stream > UINT_MAX))
+                {
+                    EPRINT("Invalid stream parameter!\n");
+                    return EXIT_FAILURE;
+                }
+                config->aes_stream = stream;
+                config->aes_seek_flag = 1;
+		    }
+      // }}} parse stream number
 			break;
 
 		case 't':
@@ -378,6 +600,48 @@ int parse_args(int argc, char** argv, cnf_t* config)
 			config->output_filename = optarg;
 			break;
 
+		case 'M':
+			config->mmap_flag = 1;
+			break;
+
+		case 'w':
+			config->wipe_device = optarg;
+			break;
+
+		case 'y':
+			config->verify_flag = 1;
+			break;
+
+		case 'P':
+			config->output_pattern = optarg;
+			if(!pattern_valid(optarg))
+			{
+				EPRINT("Invalid output pattern, it needs one number like out.%%03d!\n");
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 'j':
+      // {{{ parse shards
+		    {
+                char*p;
+                unsigned long shards;
+
+                errno = 0;
+                shards=strtoul(optarg,&p,10);
+                if((p ==optarg)||(*p !=0)
+                   ||errno ==ERANGE
+                   ||(shards <1)
+                   ||(shards>16384))
+                {
+                    EPRINT("Invalid shards parameter!\n");
+                    return EXIT_FAILURE;
+                }
+                config->shards = shards;
+		    }
+      // }}} parse shards
+			break;
+
 		case 'm':                 // method
       // {{{ parse method
 		    config->method = METHODS_COUNT;
@@ -412,11 +676,89 @@ int parse_args(int argc, char** argv, cnf_t* config)
 		}
 	}
 
-    if(config->aes_flag == 0 && config->aeskeys_filename != NULL){
+    // the wipe writes the AES stream of -k, or of a random key
+    if(config->wipe_device != NULL){
+        if(config->method != DEFAULT_METHOD || config->aes_flag || config->aes_rekey
+                || config->output_filename != NULL || config->output_pattern != NULL
+                || config->shards != 0 || config->mmap_flag || config->splice_flag
+                || config->uring_flag || config->direct_flag){
+            EPRINT("The -w argument writes the AES stream to the device by its own threads,\n"
+                    "it can't be used with -m, -a, -r, -o, -P, -j, -M, -S, -U or -D.\n");
+            return EXIT_FAILURE;
+        }
+        config->method = GET_AES_STREAM;
+    } else if(config->verify_flag){
+        EPRINT("The -y argument verifies the wipe, it needs -w.\n");
+        return EXIT_FAILURE;
+    }
+    if(config->method == GET_AES_STREAM){
+        if((config->aeskeys_filename == NULL && config->wipe_device == NULL)
+                || config->aes_flag || config->aes_rekey){
+            EPRINT("The aes_stream method needs a key file given by -k,\n"
+                    "it can't be used with -a or -r.\n");
+            return EXIT_FAILURE;
+        }
+        // the wipe goes on with the next streams, its size is the device's
+        if(config->wipe_device == NULL){
+            if(config->bytes > RDRAND_AES_STREAM_LENGTH - config->aes_seek){
+                EPRINT("The AES stream ends after %llu bytes!\n", RDRAND_AES_STREAM_LENGTH);
+                return EXIT_FAILURE;
+            }
+            // the stream is finite
+            if(config->bytes == 0)
+                config->bytes = RDRAND_AES_STREAM_LENGTH - config->aes_seek;
+        }
+    } else if(config->aes_seek_flag){
+        EPRINT("The -s and -i arguments work only with the aes_stream method.\n");
+        return EXIT_FAILURE;
+    }
+    if(config->aes_flag == 0 && config->aeskeys_filename != NULL
+            && config->method != GET_AES_STREAM){
         EPRINT("You have specified keyfile for AES, but did not enable it.\n"
                 "The -k argument has to be specified in pair with -a.\n");
         return EXIT_FAILURE;
     }
+    if(config->aes_flag == 0 && config->cipher != RDRAND_CIPHER_AES128_CTR){
+        EPRINT("You have specified the cipher, but did not enable AES.\n"
+                "The -c argument has to be specified in pair with -a,\n"
+                "the aes_stream method is aes128-ctr only.\n");
+        return EXIT_FAILURE;
+    }
+    if(config->cipher == CIPHER_AUTO && config->aeskeys_filename != NULL){
+        EPRINT("The auto cipher needs random keys, the key file fits one cipher only.\n");
+        return EXIT_FAILURE;
+    }
+    if(config->aes_flag == 0 && config->aes_rekey != 0){
+        EPRINT("You have specified the AES rekey interval, but did not enable AES.\n"
+                "The -r argument has to be specified in pair with -a.\n");
+        return EXIT_FAILURE;
+    }
+    if(config->splice_flag && config->uring_flag){
+        EPRINT("The -S and -U arguments are for different outputs, use one of them.\n");
+        return EXIT_FAILURE;
+    }
+    if(config->mmap_flag && config->output_filename == NULL && config->output_pattern == NULL){
+        EPRINT("The -M argument maps the output file, it needs -o or -P.\n");
+        return EXIT_FAILURE;
+    }
+    if((config->output_pattern != NULL || config->mmap_flag) && config->shards == 0)
+        config->shards = config->threads;
+    if(config->shards != 0 && config->bytes == 0){
+        EPRINT("The output can be sharded only to ranges of a given size, use -n.\n");
+        return EXIT_FAILURE;
+    }
+    if(config->output_pattern != NULL && config->output_filename != NULL){
+        EPRINT("The -P argument gives the output files, it can't be used with -o.\n");
+        return EXIT_FAILURE;
+    }
+    if(config->shards != 0 && (config->splice_flag || config->uring_flag || config->direct_flag)){
+        EPRINT("The sharded output is written by its threads, it can't be used with -S, -U or -D.\n");
+        return EXIT_FAILURE;
+    }
+    if(config->direct_flag && (config->output_filename == NULL || config->splice_flag)){
+        EPRINT("The -D argument writes to a file, it needs -o and can't be used with -S.\n");
+        return EXIT_FAILURE;
+    }
 
 	  compute_chunk_size(config);
 
@@ -425,6 +767,44 @@ int parse_args(int argc, char** argv, cnf_t* config)
 }
 // }}} parse_args
 
+/**
+ * Get count 64bit values by the reseed method of config.
+ * @return generated values
+ */
+static unsigned int generate_uint64(cnf_t *config, uint64_t *dest, unsigned int count, int retry)
+{
+	switch(config->method)
+	{
+	case GET_RESEED64_DELAY:
+		return rdrand_get_uint64_array_reseed_delay(dest, count, retry);
+	case GET_RESEED64_SKIP:
+		return rdrand_get_uint64_array_reseed_skip(dest, count, retry);
+	case GET_RESEED64_RDSEED:
+		return rdrand_get_uint64_array_reseed_rdseed(dest, count,
+		        retry > RDSEED_RETRY_LIMIT ? retry : RDSEED_RETRY_LIMIT);
+	}
+	return 0;
+}
+
+/**
+ * Fill len bytes by the reseed method of config. It gives whole
+ * 64bit values only, the last bytes are cut from one more value.
+ * @return generated bytes
+ */
+static size_t generate_words(cnf_t *config, uint8_t *buf, unsigned int len, int retry)
+{
+	size_t res;
+	uint64_t tail;
+
+	res = generate_uint64(config, (uint64_t*)buf, len/8, retry)*8;
+	if (res != len/8*8 || res == len)
+		return res;
+	if (generate_uint64(config, &tail, 1, retry) != 1)
+		return res;
+	memcpy(buf + res, &tail, len - res);
+	return len;
+}
+
 /**
  * call specific generating method according to config
  * @param config
@@ -443,10 +823,18 @@ size_t generate_with_metod(cnf_t *config,uint8_t *buf, unsigned int blocks, int
 		res= rdrand_get_bytes_retry((uint8_t*)buf, blocks,retry);
 		break;
 	case GET_RESEED64_DELAY:
-		res= rdrand_get_uint64_array_reseed_delay((uint64_t*)buf, blocks/8, retry)*8;
-		break;
 	case GET_RESEED64_SKIP:
-		res= rdrand_get_uint64_array_reseed_skip((uint64_t*)buf, blocks/8, retry)*8;
+	case GET_RESEED64_RDSEED:
+		res= generate_words(config, buf, blocks, retry);
+		break;
+	case GET_RDSEED:
+		// RDSEED underflows much more often, give it more attempts
+		res= rdseed_get_bytes_retry((uint8_t*)buf, blocks,
+		        retry > RDSEED_RETRY_LIMIT ? retry : RDSEED_RETRY_LIMIT);
+		break;
+	case GET_CTR_DRBG:
+		// every thread has its own DRBG, reseeded from RdSeed
+		res= rdrand_drbg_get_bytes(buf, blocks);
 		break;
 	}
 	return res;
@@ -454,252 +842,2001 @@ size_t generate_with_metod(cnf_t *config,uint8_t *buf, unsigned int blocks, int
 // }}} generate_with_metod
 
 
+// {{{ buffer arena
 /**
- * Fill chunks with random data
- * Return number of generated bytes
+ * All buffers of the generator are slices of one arena. It is mapped
+ * once for the whole run, backed by 2 MiB pages when possible and
+ * prefaulted, so the generating threads never fault or miss the TLB
+ * on their buffers, and there is no limit of the stack size.
  */
-// {{{ generate_chunk
-size_t generate_chunk(cnf_t *config)
-{
-	unsigned int i, n, retry, first_run=1, aes_thread=0;
-	size_t written, written_total,buf_size, buf_size_bytes;
-    // NOTE: chunk_size is count of 64bit blocks!
-	uint64_t buf[config->chunk_size*config->threads],
-             gen_buf1[config->chunk_size*config->threads],
-             gen_buf2[config->chunk_size*config->threads],
-             *gen_current, *gen_previous;
-
-// EPRINT("key: ");
-// memDump_gen(AES_CFG.keys.key_current, AES_CFG.keys.key_length);
-// EPRINT("nonce: ");
-// memDump_gen(AES_CFG.keys.nonce_current, AES_CFG.keys.key_length);
-
-	buf_size = config->chunk_size*config->threads;
-	buf_size_bytes = buf_size*8;
-	written_total = 0;
-
-    // decide whether aes is used and thus one more thread will run or not
-    if(config->aes_flag) {
-        // when aes is used, two buffers are needed.
-        // While one is filled by rdrand, the other one is being encrypted.
-        // Swaping them is faster than copying.
-        gen_current = gen_buf1;
-        gen_previous = gen_buf2;
-        aes_thread=1;
-    }else {
-        gen_current = buf;
-    }
-    
-    #ifdef _OPENMP
-        omp_set_num_threads(config->threads+aes_thread);
-    #endif // _OPENMP
-	// for all chunks (or indefinitely if bytes are set to 0)
-	for(n = 0; n < config->chunk_count+aes_thread || config->bytes == 0; n++)
-	{
-		written = 0;
-		/** At first fill chunks in all parallel threads */
-    #ifdef _OPENMP
-        #pragma omp parallel for reduction(+:written)
-    #endif // _OPENMP
-		for ( i=0; i < config->threads+aes_thread; ++i)
-		{
-            //EPRINT("XXX - thread: %u, n: %u\n", i,n);
-            // all threads set in settings will generate values
-            // but one more will encrypt them if needed
-            //if(i < config->threads && (n < config->chunk_count || config->bytes == 0) ) {
-            if (i < config->threads) {
-                if(n < config->chunk_count || config->bytes == 0 ) {
-                    //fprintf(stderr,"  Generating thread: %u, n: %u\n",i,n);
-                    written += generate_with_metod(
-                        config, 
-                        (uint8_t*)&gen_current[i*config->chunk_size], 
-                        config->chunk_size*8, 
-                        RETRY_LIMIT)/8;
-                }
-            } else if (!first_run ){
-                // running just in single thread if aes is used
-                // and don't run in first cycle
-                // - no data in buffers.
-                
-                //fprintf(stderr,"  Encrypting thread: %u, n: %u\n",i,n);
-                rdrand_enc_buffer(buf, gen_previous, buf_size_bytes);
-            }
+#define ARENA_LINE  64
+#define ARENA_HUGE  (2*1024*1024)
+#define ARENA_ALIGN(x) (((x) + ARENA_LINE - 1) & ~(size_t)(ARENA_LINE - 1))
 
-		}
+#ifndef MAP_ANONYMOUS
+    #define MAP_ANONYMOUS MAP_ANON
+#endif
 
-        // if not enough data was generated, try to slow down and print an error
-        // {{{ error handling
-		if ( written != buf_size && n < config->chunk_count)
-		{
-			/* if we can't lower threads count anymore */
-			if ( config->threads == 1 )
-			{
-				if(config->printedWarningFlag == 0)
-				{
-					config->printedWarningFlag++;
-					EPRINT( "Warning: %zu bytes was generated, "
-                            "but %zu was expected. "
-                            "Trying to get randomness with slower speed.\n",
-                            written, buf_size);
-				}
-				// reset the retry - LIMIT should work work for each run independently
-				// and also the delay should be as small as possible
-				retry = 0;
-				while(written != buf_size && retry++ < SLOW_RETRY_LIMIT_CYCLES)
-				{
-					usleep(retry*SLOW_RETRY_DELAY);
-					// try to generate the rest
-					written += generate_with_metod(
-                        config, 
-                        (uint8_t*)gen_current+written, 
-                        config->threads*config->chunk_size-written*8, 
-                        SLOW_RETRY_LIMIT)/8; 
-				}
-				if( written != buf_size )
-				{
-					EPRINT( "Error:  %zu bytes generated, but %zu bytes expected. "
-                            "Probably there is a hardware problem with your CPU.\n", 
-                            written, 
-                            buf_size);
-					break;
-				}
-			}
-			else
-			{
-                EPRINT("n: %u\n",n);
-				/* try to lower threads count to avoid underflow */
-				config->threads--;
-				EPRINT( "Warning: %zu bytes generated, but %zu bytes expected. "
-                        "Probably slow internal generator "
-                        "- decreaseing threads count by one to %u to avoid problems.\n", 
-                        written, 
-                        buf_size, 
-                        config->threads);
-				buf_size -= config->chunk_size;
-
-				/* run this iteration again */
-				n--;
-				continue;
-			}
-		}
-        // }}} error handling
-
-        // If the chunk was generated ok (we are here),
-        // move it to the encryption buffer.
-        // From there it will be moved in next round to the output.
-        if( config->aes_flag){
-            //memcpy(enc_buf, gen_buf, buf_size_bytes);
-            //Swap current and previous buffer
-            { uint64_t*tmp;
-                tmp = gen_current;
-                gen_current = gen_previous;
-                gen_previous = tmp;
-            }
-            if (first_run) {
-                // if it is first run, skip it - no data ready
-                first_run = 0;
-                continue;
-            }
-        }
+typedef struct arena_s {
+	uint8_t *base;
+	size_t size;
+	/** first free byte */
+	size_t used;
+} arena_t;
 
-		written = fwrite(buf, sizeof(buf[0]), buf_size, config->output);
-		written_total += written;
+/**
+ * Map an arena of at least size bytes.
+ * Returns 0 on failure.
+ */
+static int arena_create(arena_t *a, size_t size)
+{
+	void *base = MAP_FAILED;
 
-		if ( written !=  buf_size)
-		{
-			perror("fwrite");
-			EPRINT( "ERROR: %zu bytes written, but %zu bytes to write\n", 
-          sizeof(buf[0]) * written, 
-          buf_size);
-      break;
-		}
+	a->used = 0;
+	a->size = size = size ? size : ARENA_LINE;
 
-	} // for all chunks
-	return written_total*8;
+#ifdef MAP_HUGETLB
+	// reserved huge pages, if the admin set up any
+	if (size >= ARENA_HUGE)
+	{
+		size_t huge_size = (size + ARENA_HUGE - 1) & ~(size_t)(ARENA_HUGE - 1);
+		base = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+		if (base != MAP_FAILED)
+			a->size = huge_size;
+	}
+#endif
+	if (base == MAP_FAILED)
+	{
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED)
+			return 0;
+#ifdef MADV_HUGEPAGE
+		// transparent huge pages otherwise, must be asked for before the faults
+		if (size >= ARENA_HUGE)
+			madvise(base, size, MADV_HUGEPAGE);
+#endif
+		// prefault
+		memset(base, 0, size);
+	}
+	a->base = base;
+	return 1;
 }
-// }}} generate_chunk
 
+/**
+ * Take a cache line aligned slice of len bytes from the arena.
+ */
+static void *arena_slice(arena_t *a, size_t len)
+{
+	uint8_t *slice;
+
+	if (ARENA_ALIGN(len) > a->size - a->used)
+		return NULL;
+	slice = a->base + a->used;
+	a->used += ARENA_ALIGN(len);
+	return slice;
+}
 
 /**
- * Fill the ending bytes with random data
- * Return number of generated bytes
+ * Align the next slice of the arena to align bytes, a power of 2.
  */
-// {{{ generate_ending
-size_t generate_ending(cnf_t *config)
+static void arena_align(arena_t *a, size_t align)
 {
-	size_t written_total;
-  uint8_t buf[config->ending_bytes];
-  uint8_t enc_buf[config->ending_bytes];
+	a->used = (a->used + align - 1) & ~(align - 1);
+	if (a->used > a->size)
+		a->used = a->size;
+}
 
-  written_total = generate_with_metod(config, enc_buf, config->ending_bytes, RETRY_LIMIT);
-	/* test generated amount */
-	if ( written_total != config->ending_bytes )
-	{
-		EPRINT( "ERROR: bytes generated %zu, bytes expected %zu\n", written_total, config->ending_bytes);
-		return written_total;
-	}
-    
-    if(config->aes_flag) {
-        //fprintf(stderr,"Encrypting tail\n");
-        // encrypt the previous-run buffer
-        if(rdrand_enc_buffer(buf, enc_buf, config->ending_bytes) != 1){
-            EPRINT("ERROR: Encryption of last %zu bytes failed!\n", config->ending_bytes);
-        }
-    } else {
-        //fprintf(stderr,"Just memcpy tail\n");
-        // this will run in single thread
-        memcpy(buf, enc_buf, config->ending_bytes);
-    }
+static void arena_destroy(arena_t *a)
+{
+	munmap(a->base, a->size);
+	a->base = NULL;
+}
+// }}} buffer arena
 
-	written_total = fwrite(buf, sizeof(buf[0]), config->ending_bytes, config->output);
-	if ( written_total !=  config->ending_bytes )
-	{
-		EPRINT( "ERROR: fwrite - bytes written %zu, bytes to write %zu\n", written_total, config->ending_bytes);
-		return written_total;
+// {{{ pipe output
+/**
+ * With --splice, the chunks are handed to an output pipe by vmsplice
+ * instead of being copied into it by fwrite. The pipe then refers to
+ * the pages of the ring, so a slot can be filled again only after the
+ * reader took its data out of the pipe. That is sure once a whole pipe
+ * of data was spliced after it, so the writer keeps that many chunks
+ * more and the ring has that many slots more.
+ */
+#define PIPE_SPLICE_SIZE  (1024*1024)
+#define PIPE_SPLICE_MIN   (64*1024)
 
+/**
+ * Enlarge the output pipe and keep its size in config->pipe_size.
+ * It stays 0 without --splice or if the output is not a pipe.
+ */
+static void splice_setup(cnf_t *config)
+{
+	config->pipe_size = 0;
+#if defined(F_SETPIPE_SZ) && defined(SPLICE_F_GIFT)
+	struct stat st;
+	int fd, size;
+
+	if (!config->splice_flag)
+		return;
+	fd = fileno(config->output);
+	if (fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+		return;
+	// the bigger the pipe, the less often the reader and writer wait for
+	// each other; unprivileged users can't go over /proc/sys/fs/pipe-max-size
+	for (size = PIPE_SPLICE_SIZE; size >= PIPE_SPLICE_MIN; size /= 2)
+	{
+		if (fcntl(fd, F_SETPIPE_SZ, size) >= 0)
+			break;
 	}
-	return written_total;
+	size = fcntl(fd, F_GETPIPE_SZ);
+	if (size <= 0)
+		return;
+	// whatever is in the stdio buffer goes first
+	if (fflush(config->output) != 0)
+		return;
+	config->pipe_size = size;
+#endif
 }
-// }}} generate_ending
 
 /**
- * Generate requested amount of bytes
- * Return amount of bytes truly generated.
+ * Chunks the output pipe can hold. The writer frees a spliced
+ * slot only after so many chunks more were spliced.
  */
-// {{{ generate
-size_t generate(cnf_t *config)
+static unsigned int splice_held(cnf_t *config)
 {
-	size_t written;
-	written = 0;
-	/** At first fill chunks in all parallel threads.
-	 *  If no size is specified, then the program
-	 *  will never get over this.
-	 */
-	written = generate_chunk(config);
+	size_t chunk_bytes = config->chunk_size*8;
 
-	/** Then fill the few ending bytes in one thread. */
-	written += generate_ending(config);
-	return written;
+	if (config->pipe_size == 0 || chunk_bytes == 0)
+		return 0;
+	return (config->pipe_size + chunk_bytes - 1) / chunk_bytes;
 }
-// }}} generate
-
 
-/** load keys from file saved in config into AES_CFG
- *
- * @param config
- *
- * @return  FILE_ERRORS enum
+/**
+ * Write len bytes of buf into the output pipe by vmsplice. If the kernel
+ * refuses it, *splicing is cleared and the rest is written by fwrite.
+ * Return number of written bytes.
  */
-// {{{ load_keys
-int load_keys(cnf_t * config) {
-    FILE*file;
-    unsigned char *key, *nonce, *keys[MAX_KEYS], *nonces[MAX_KEYS];
-    unsigned int key_len, nonce_len, first_len=0, amount =0, i;
-    int res;
+static size_t splice_write(cnf_t *config, uint8_t *buf, size_t len, int *splicing)
+{
+#if defined(F_SETPIPE_SZ) && defined(SPLICE_F_GIFT)
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct pollfd pfd = { .fd = fileno(config->output), .events = POLLOUT };
+	ssize_t n;
 
-    file=fopen(config->aeskeys_filename,"r");
-    if(file == NULL){
-      EPRINT("ERROR: Can't open file %s!\n", config->aeskeys_filename);
+	while (iov.iov_len > 0)
+	{
+		n = vmsplice(pfd.fd, &iov, 1, SPLICE_F_GIFT);
+		if (n > 0)
+		{
+			iov.iov_base = (uint8_t *)iov.iov_base + n;
+			iov.iov_len -= n;
+		}
+		else if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && errno == EAGAIN)
+			poll(&pfd, 1, -1);
+		else if (n < 0 && errno == EPIPE)
+			return len - iov.iov_len;
+		else
+			break;
+	}
+	if (iov.iov_len == 0)
+		return len;
+	// e.g. a kernel without vmsplice
+	*splicing = 0;
+	return len - iov.iov_len + fwrite(iov.iov_base, 1, iov.iov_len, config->output);
+#else
+	*splicing = 0;
+	return fwrite(buf, 1, len, config->output);
+#endif
+}
+// }}} pipe output
+
+// {{{ direct output
+/**
+ * With --direct, the chunks are written to the output file opened
+ * once more with O_DIRECT, straight from the buffers of the ring and
+ * not through the page cache. The buffers, the chunks and the offsets
+ * are aligned to DIRECT_ALIGN for it; the unaligned ending bytes are
+ * written as usual, by the stream of the output.
+ */
+
+/**
+ * Open the output file again with O_DIRECT, at the current position,
+ * and preallocate it for --amount. config->direct_fd stays -1 without
+ * --direct or if the file system refuses it.
+ */
+static void direct_setup(cnf_t *config)
+{
+	off_t base;
+	int fd;
+
+	config->direct_fd = -1;
+	if (!config->direct_flag || config->output_filename == NULL || config->chunk_size == 0)
+		return;
+	// whatever is in the stdio buffer goes first
+	if (fflush(config->output) != 0)
+		return;
+	base = lseek(fileno(config->output), 0, SEEK_CUR);
+	if (base < 0 || base % DIRECT_ALIGN != 0)
+		return;
+	fd = open(config->output_filename, O_WRONLY | O_DIRECT);
+	if (fd < 0)
+		return;
+	if (lseek(fd, base, SEEK_SET) != base)
+	{
+		close(fd);
+		return;
+	}
+	// all the extents at once; the size grows only by the writes,
+	// so an interrupted output doesn't end by zeros
+	if (config->bytes != 0)
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, base, config->bytes);
+	config->direct_fd = fd;
+}
+
+/**
+ * Write len bytes of buf by the O_DIRECT descriptor.
+ * Return number of written bytes.
+ */
+static size_t direct_write(cnf_t *config, const uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len)
+	{
+		n = write(config->direct_fd, buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+/**
+ * Move the output stream behind the chunks, for the ending bytes,
+ * and close the O_DIRECT descriptor.
+ */
+static void direct_finish(cnf_t *config)
+{
+	off_t end;
+
+	if (config->direct_fd < 0)
+		return;
+	end = lseek(config->direct_fd, 0, SEEK_CUR);
+	if (end < 0 || fseeko(config->output, end, SEEK_SET) != 0)
+		perror("fseeko");
+	close(config->direct_fd);
+	config->direct_fd = -1;
+}
+
+/**
+ * Bytes of the arena for the buffer of one chunk. Spliced and direct
+ * chunks take whole pages, so the kernel can take the pages as they are.
+ */
+static int output_aligned(cnf_t *config)
+{
+	return config->pipe_size != 0 || config->direct_fd >= 0;
+}
+
+static size_t output_buffer_size(cnf_t *config)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if (!output_aligned(config))
+		return ARENA_ALIGN(config->chunk_size*8);
+	return (config->chunk_size*8 + page - 1) & ~(page - 1);
+}
+// }}} direct output
+
+// {{{ pipeline
+/**
+ * Stages of a chunk in the pipeline. Every slot of the ring carries
+ * a stamp seq*SLOT_STAGES+stage, so each stage waits for exactly the
+ * chunk it has to process next and the slots are handed over without
+ * any lock.
+ */
+#define SLOT_FREE       0
+#define SLOT_GENERATED  1
+#define SLOT_READY      2
+#define SLOT_STAGES     4
+
+// Slots in the ring per producer thread.
+#define PIPELINE_DEPTH 2
+// How many times to check a slot before going to sleep on it.
+#define SLOT_SPIN 1000
+
+#ifdef _X86_64
+    #define CPU_RELAX() asm volatile ("pause")
+#else
+    #define CPU_RELAX() ((void)0)
+#endif
+
+typedef struct __attribute__((aligned(ARENA_LINE))) slot_s {
+	/** seq*SLOT_STAGES + stage */
+	unsigned long stamp;
+	/** threads sleeping on the cond */
+	unsigned int sleepers;
+	/** bytes generated into buf, less than a chunk means an error */
+	size_t generated;
+	uint64_t *buf;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} slot_t;
+
+typedef struct pipeline_s {
+	cnf_t *config;
+	slot_t *slots;
+	unsigned int nslots;
+	/** bytes in one chunk */
+	size_t chunk_bytes;
+	/** chunks to generate, unless infinite is set */
+	size_t chunks;
+	int infinite;
+	/** next chunk to be taken by a producer */
+	size_t next_seq;
+	/** producers still running */
+	unsigned int producers;
+	/** AES streams, the encryptor i encrypts the chunks i, i+encryptors, ... */
+	rdrand_aes_ctx_t **aes;
+	unsigned int encryptors;
+	/** next encryptor to start */
+	unsigned int next_encryptor;
+	/** keystreams of the aes_stream method, one per producer */
+	rdrand_aes_ctx_t **keystreams;
+	/** next producer to start */
+	unsigned int next_producer;
+	/** set when the writer stops before the end */
+	int stop;
+} pipeline_t;
+
+/**
+ * Slots in the ring for the given config.
+ */
+static unsigned int pipeline_slots(cnf_t *config)
+{
+	return config->threads*PIPELINE_DEPTH + 2 + splice_held(config) + config->uring_depth;
+}
+
+/**
+ * Threads of the AES stage for the given config.
+ */
+static unsigned int pipeline_encryptors(cnf_t *config)
+{
+	unsigned int encryptors = config->aes_threads;
+	long cpus;
+
+	if (encryptors == 0)
+	{
+		// AES is much faster than the generator, a thread per CPU is enough
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		encryptors = cpus > 0 ? (unsigned int)cpus : 1;
+		if (encryptors > config->threads)
+			encryptors = config->threads;
+	}
+	if (encryptors > pipeline_slots(config))
+		encryptors = pipeline_slots(config);
+	return encryptors;
+}
+
+/**
+ * Wait until the slot gets the given stamp.
+ * Returns 0 if the pipeline was stopped in the meantime.
+ */
+static int slot_wait(pipeline_t *p, slot_t *s, unsigned long stamp)
+{
+	unsigned int spin;
+
+	for (spin = 0; spin < SLOT_SPIN; spin++)
+	{
+		if (__atomic_load_n(&s->stamp, __ATOMIC_ACQUIRE) == stamp)
+			return 1;
+		if (__atomic_load_n(&p->stop, __ATOMIC_RELAXED))
+			return 0;
+		CPU_RELAX();
+	}
+
+	pthread_mutex_lock(&s->lock);
+	__atomic_add_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&s->stamp, __ATOMIC_SEQ_CST) != stamp
+			&& !__atomic_load_n(&p->stop, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&s->cond, &s->lock);
+	__atomic_sub_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&s->lock);
+
+	return __atomic_load_n(&s->stamp, __ATOMIC_ACQUIRE) == stamp;
+}
+
+/**
+ * Pass the slot to the next stage. The lock is taken only if
+ * somebody sleeps on the slot.
+ */
+static void slot_publish(slot_t *s, unsigned long stamp)
+{
+	__atomic_store_n(&s->stamp, stamp, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->sleepers, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&s->lock);
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/**
+ * Stop all stages and wake up everybody who waits for a slot.
+ */
+static void pipeline_stop(pipeline_t *p)
+{
+	unsigned int i;
+
+	__atomic_store_n(&p->stop, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < p->nslots; i++)
+	{
+		pthread_mutex_lock(&p->slots[i].lock);
+		pthread_cond_broadcast(&p->slots[i].cond);
+		pthread_mutex_unlock(&p->slots[i].lock);
+	}
+}
+
+/**
+ * Fill buf with the AES stream of the aes_stream method, from the
+ * given offset after the --seek one. Every chunk seeks on its own,
+ * so the output doesn't depend on which producer makes which chunk.
+ * Returns the number of generated bytes.
+ */
+static size_t generate_keystream(cnf_t *config, rdrand_aes_ctx_t *keystream,
+		size_t offset, uint8_t *buf, size_t len)
+{
+	size_t res = 0;
+
+	if (rdrand_aes_ctx_seek(keystream, config->aes_seek + offset) == 1)
+		res = rdrand_aes_ctx_keystream(keystream, buf, len);
+	if (res != len)
+		EPRINT("ERROR: The AES stream ends after %llu bytes!\n", RDRAND_AES_STREAM_LENGTH);
+	return res;
+}
+
+/**
+ * Only generated bytes of len were generated into buf, try to get
+ * the rest with slower speed. Return number of generated bytes.
+ */
+static size_t generate_slow(cnf_t *config, uint8_t *buf, size_t generated, size_t len)
+{
+	unsigned int retry;
+
+	// reset the retry - LIMIT should work work for each run independently
+	// and also the delay should be as small as possible
+	retry = 0;
+	while (generated != len && retry++ < SLOW_RETRY_LIMIT_CYCLES)
+	{
+		usleep(retry*SLOW_RETRY_DELAY);
+		// try to generate the rest
+		generated += generate_with_metod(
+				config,
+				buf + generated,
+				len - generated,
+				SLOW_RETRY_LIMIT);
+	}
+	if (generated != len)
+	{
+		EPRINT( "Error:  %zu bytes generated, but %zu bytes expected. "
+				"Probably there is a hardware problem with your CPU.\n",
+				generated,
+				len);
+	}
+	return generated;
+}
+
+/**
+ * A chunk wasn't fully generated. Lower the number of producers if possible,
+ * then try to get the rest of the chunk with slower speed.
+ * Returns 1 if the calling producer should stop.
+ */
+// {{{ generate_underflow
+static int generate_underflow(pipeline_t *p, slot_t *s)
+{
+	cnf_t *config = p->config;
+	unsigned int producers;
+	int retire = 0;
+
+	/* try to lower threads count to avoid underflow */
+	producers = __atomic_load_n(&p->producers, __ATOMIC_RELAXED);
+	while (producers > 1)
+	{
+		if (__atomic_compare_exchange_n(&p->producers, &producers, producers - 1,
+					0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			EPRINT( "Warning: %zu bytes generated, but %zu bytes expected. "
+					"Probably slow internal generator "
+					"- decreaseing threads count by one to %u to avoid problems.\n",
+					s->generated,
+					p->chunk_bytes,
+					producers - 1);
+			retire = 1;
+			break;
+		}
+	}
+
+	if (!retire && __atomic_fetch_add(&config->printedWarningFlag, 1, __ATOMIC_RELAXED) == 0)
+	{
+		EPRINT( "Warning: %zu bytes was generated, "
+				"but %zu was expected. "
+				"Trying to get randomness with slower speed.\n",
+				s->generated, p->chunk_bytes);
+	}
+
+	s->generated = generate_slow(config, (uint8_t*)s->buf, s->generated, p->chunk_bytes);
+	return retire;
+}
+// }}} generate_underflow
+
+/**
+ * Producer stage: take the next free slot and fill it with random data.
+ */
+static void *pipeline_producer(void *arg)
+{
+	pipeline_t *p = arg;
+	unsigned int id = __atomic_fetch_add(&p->next_producer, 1, __ATOMIC_RELAXED);
+	rdrand_aes_ctx_t *keystream = p->keystreams ? p->keystreams[id] : NULL;
+	slot_t *s;
+	size_t seq;
+	int retire = 0;
+
+	while (!retire)
+	{
+		seq = __atomic_fetch_add(&p->next_seq, 1, __ATOMIC_RELAXED);
+		if (!p->infinite && seq >= p->chunks)
+			break;
+
+		s = &p->slots[seq % p->nslots];
+		if (!slot_wait(p, s, seq*SLOT_STAGES + SLOT_FREE))
+			break;
+
+		if (keystream != NULL)
+			s->generated = generate_keystream(p->config, keystream, seq*p->chunk_bytes,
+					(uint8_t*)s->buf, p->chunk_bytes);
+		else
+			s->generated = generate_with_metod(p->config, (uint8_t*)s->buf, p->chunk_bytes, RETRY_LIMIT);
+		if (s->generated != p->chunk_bytes && keystream == NULL)
+			retire = generate_underflow(p, s);
+
+		slot_publish(s, seq*SLOT_STAGES + (p->config->aes_flag ? SLOT_GENERATED : SLOT_READY));
+	}
+	return NULL;
+}
+
+/**
+ * AES stage: encrypt the chunks in place. Every encryptor has its own
+ * AES stream and takes every encryptors-th chunk, so the chunks of
+ * one stream are encrypted in their order.
+ */
+static void *pipeline_encryptor(void *arg)
+{
+	pipeline_t *p = arg;
+	unsigned int id = __atomic_fetch_add(&p->next_encryptor, 1, __ATOMIC_RELAXED);
+	rdrand_aes_ctx_t *aes = p->aes[id];
+	slot_t *s;
+	size_t seq;
+
+	for (seq = id; p->infinite || seq < p->chunks; seq += p->encryptors)
+	{
+		s = &p->slots[seq % p->nslots];
+		if (!slot_wait(p, s, seq*SLOT_STAGES + SLOT_GENERATED))
+			break;
+
+		if (s->generated == p->chunk_bytes
+				&& rdrand_aes_ctx_enc_buffer(aes, s->buf, s->buf, p->chunk_bytes) != 1)
+		{
+			EPRINT("ERROR: Encryption of %zu bytes failed!\n", p->chunk_bytes);
+			s->generated = 0;
+		}
+		slot_publish(s, seq*SLOT_STAGES + SLOT_READY);
+	}
+	return NULL;
+}
+// }}} pipeline
+
+// {{{ io_uring output
+/**
+ * With --io-uring, the writer only submits the ready chunks to an
+ * io_uring and goes on, the kernel writes them while the producers
+ * fill the next ones. A slot is freed when the write of its chunk
+ * completes. Chunks are written at their offsets, so the writes can
+ * complete in any order. The slots are the registered buffers and
+ * the output a registered file, so the kernel doesn't pin the pages
+ * and look up the file for every write.
+ */
+#define URING_INFLIGHT   (2*1024*1024)
+#define URING_MIN_DEPTH  4
+#define URING_MAX_DEPTH  128
+
+/**
+ * Decide how many writes --io-uring keeps in flight and keep it
+ * in config->uring_depth. It stays 0 without --io-uring or if the
+ * output can't be written at an offset, like a pipe.
+ */
+static void uring_setup(cnf_t *config)
+{
+	config->uring_depth = 0;
+#ifdef HAVE_IO_URING
+	size_t depth;
+
+	if (!config->uring_flag || config->chunk_size == 0)
+		return;
+	// whatever is in the stdio buffer goes first
+	if (fflush(config->output) != 0 || lseek(fileno(config->output), 0, SEEK_CUR) < 0)
+		return;
+	depth = URING_INFLIGHT / (config->chunk_size*8);
+	if (depth < URING_MIN_DEPTH)
+		depth = URING_MIN_DEPTH;
+	if (depth > URING_MAX_DEPTH)
+		depth = URING_MAX_DEPTH;
+	config->uring_depth = depth;
+#endif
+}
+
+#ifdef HAVE_IO_URING
+typedef struct uring_s {
+	/** the ring, -1 if it is not used */
+	int fd;
+	uint8_t *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	/** the output */
+	int out;
+	/** the output is the registered file 0 */
+	int fixed_file;
+	/** the slot i is the registered buffer i */
+	int fixed_buffers;
+	/** offset of the first chunk in the output */
+	off_t base;
+	/** writes in flight */
+	unsigned int inflight;
+	/** bytes of the completed writes */
+	size_t written;
+	/** a write failed */
+	int failed;
+	/** the completions can't be waited for */
+	int broken;
+} uring_t;
+
+static void uring_destroy(uring_t *u)
+{
+	if (u->sqes != NULL && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_size);
+	if (u->fd >= 0)
+		close(u->fd);
+	u->fd = -1;
+}
+
+/**
+ * Set up the ring for the slots of the pipeline.
+ * Returns 0 if io_uring is not used.
+ */
+static int uring_create(uring_t *u, pipeline_t *p)
+{
+	struct io_uring_params params;
+	struct iovec *iov;
+	unsigned int i;
+
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+	if (p->config->uring_depth == 0)
+		return 0;
+	u->out = p->config->direct_fd >= 0 ? p->config->direct_fd : fileno(p->config->output);
+	u->base = lseek(u->out, 0, SEEK_CUR);
+	if (u->base < 0)
+		return 0;
+
+	memset(&params, 0, sizeof(params));
+	u->fd = syscall(__NR_io_uring_setup, p->config->uring_depth, &params);
+	if (u->fd < 0)
+		return 0;
+	u->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+	u->cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED)
+	{
+		uring_destroy(u);
+		return 0;
+	}
+	u->sq_tail = (unsigned int *)(u->sq_ring + params.sq_off.tail);
+	u->sq_mask = (unsigned int *)(u->sq_ring + params.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)(u->sq_ring + params.sq_off.array);
+	u->cq_head = (unsigned int *)(u->cq_ring + params.cq_off.head);
+	u->cq_tail = (unsigned int *)(u->cq_ring + params.cq_off.tail);
+	u->cq_mask = (unsigned int *)(u->cq_ring + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(u->cq_ring + params.cq_off.cqes);
+
+	// both are optional, the buffers e.g. don't fit in RLIMIT_MEMLOCK
+	u->fixed_file = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES, &u->out, 1) == 0;
+	iov = calloc(p->nslots, sizeof(struct iovec));
+	if (iov != NULL)
+	{
+		for (i = 0; i < p->nslots; i++)
+		{
+			iov[i].iov_base = p->slots[i].buf;
+			iov[i].iov_len = p->chunk_bytes;
+		}
+		u->fixed_buffers = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+				iov, p->nslots) == 0;
+		free(iov);
+	}
+	return 1;
+}
+
+/**
+ * Take the completed writes and free their slots. With wait,
+ * wait for one at least. Returns 0 if a write failed.
+ */
+static int uring_reap(uring_t *u, pipeline_t *p, int wait)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+	size_t seq, done;
+	ssize_t n;
+	slot_t *s;
+
+	while (1)
+	{
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		if (head != tail || !wait)
+			break;
+		if (syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+				&& errno != EINTR)
+		{
+			perror("io_uring_enter");
+			u->failed = 1;
+			u->broken = 1;
+			return 0;
+		}
+	}
+	for (; head != tail; head++)
+	{
+		cqe = &u->cqes[head & *u->cq_mask];
+		seq = cqe->user_data;
+		s = &p->slots[seq % p->nslots];
+		done = cqe->res > 0 ? (size_t)cqe->res : 0;
+		// the writes in flight fail the same way, report the first one
+		if (cqe->res < 0 && !u->failed)
+		{
+			errno = -cqe->res;
+			perror("io_uring write");
+		}
+		if (cqe->res < 0)
+			u->failed = 1;
+		// the rest of a short write, e.g. on a full disk, by a plain one
+		while (!u->failed && done < p->chunk_bytes)
+		{
+			n = pwrite(u->out, (uint8_t *)s->buf + done, p->chunk_bytes - done,
+					u->base + seq*p->chunk_bytes + done);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+			{
+				perror("pwrite");
+				u->failed = 1;
+				break;
+			}
+			done += n;
+		}
+		u->written += done;
+		u->inflight--;
+		slot_publish(s, (seq + p->nslots)*SLOT_STAGES + SLOT_FREE);
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return !u->failed;
+}
+
+/**
+ * Submit the write of the chunk seq, whose slot is ready.
+ * Returns 0 if the ring failed.
+ */
+static int uring_write(uring_t *u, pipeline_t *p, size_t seq)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, index = seq % p->nslots, depth = p->config->uring_depth;
+	long res;
+
+	// the writes complete in any order, but all the chunks a depth
+	// before have to be written: the writer waits for the next chunk
+	// without reaping, its producer must not wait for a slot in flight
+	while (seq >= depth && __atomic_load_n(&p->slots[(seq - depth) % p->nslots].stamp,
+				__ATOMIC_ACQUIRE) < (seq - depth + p->nslots)*SLOT_STAGES)
+	{
+		if (!uring_reap(u, p, 1))
+			return 0;
+	}
+	tail = *u->sq_tail;
+	sqe = &u->sqes[tail & *u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = u->fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->flags = u->fixed_file ? IOSQE_FIXED_FILE : 0;
+	sqe->fd = u->fixed_file ? 0 : u->out;
+	sqe->off = u->base + seq*p->chunk_bytes;
+	sqe->addr = (uintptr_t)p->slots[index].buf;
+	sqe->len = p->chunk_bytes;
+	sqe->buf_index = index;
+	sqe->user_data = seq;
+	u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do
+		res = syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0);
+	while (res < 0 && errno == EINTR);
+	if (res != 1)
+	{
+		perror("io_uring_enter");
+		u->failed = 1;
+		return 0;
+	}
+	u->inflight++;
+	// free the slots of finished writes as soon as possible
+	return uring_reap(u, p, 0);
+}
+
+/**
+ * Wait for all the writes and move the output behind the chunks.
+ * Return number of written bytes.
+ */
+static size_t uring_finish(uring_t *u, pipeline_t *p)
+{
+	// after a failure too, the writes in flight still read the buffers
+	while (u->inflight > 0 && !u->broken)
+		uring_reap(u, p, 1);
+	// the ending bytes go right after the chunks
+	if (lseek(u->out, u->base + u->written, SEEK_SET) < 0
+			|| fseeko(p->config->output, u->base + u->written, SEEK_SET) != 0)
+		perror("fseeko");
+	uring_destroy(u);
+	return u->written;
+}
+#else
+typedef struct uring_s {
+	int fd;
+} uring_t;
+
+static int uring_create(uring_t *u, pipeline_t *p)
+{
+	(void)p;
+	u->fd = -1;
+	return 0;
+}
+
+static int uring_write(uring_t *u, pipeline_t *p, size_t seq)
+{
+	(void)u; (void)p; (void)seq;
+	return 0;
+}
+
+static size_t uring_finish(uring_t *u, pipeline_t *p)
+{
+	(void)u; (void)p;
+	return 0;
+}
+#endif
+// }}} io_uring output
+
+/**
+ * Fill chunks with random data, using buffers from the arena,
+ * encrypted by the given AES streams if AES is used. The aes_stream
+ * method fills them by the given keystreams instead.
+ * Return number of generated bytes
+ */
+// {{{ generate_chunk
+size_t generate_chunk(cnf_t *config, arena_t *arena, rdrand_aes_ctx_t **aes, unsigned int encryptors,
+		rdrand_aes_ctx_t **keystreams)
+{
+	pipeline_t p = { .config = config, .aes = aes, .encryptors = encryptors, .keystreams = keystreams };
+	pthread_t *producers, *encryptor;
+	uring_t uring = { .fd = -1 };
+	slot_t *s;
+	unsigned int i, started, encrypting = 0, held;
+	size_t seq, written, written_total = 0;
+	int splicing;
+
+	if (config->bytes != 0 && config->chunk_count == 0)
+		return 0;
+
+	// NOTE: chunk_size is count of 64bit blocks!
+	p.chunk_bytes = config->chunk_size*8;
+	p.chunks = config->chunk_count*config->threads;
+	p.infinite = config->bytes == 0;
+	p.nslots = pipeline_slots(config);
+	held = splice_held(config);
+	splicing = config->pipe_size != 0;
+
+	// slots get a cache line each, so the stages don't fight over them
+	p.slots = arena_slice(arena, p.nslots*sizeof(slot_t));
+	if (output_aligned(config))
+		arena_align(arena, sysconf(_SC_PAGESIZE));
+	producers = calloc(config->threads, sizeof(pthread_t));
+	encryptor = calloc(encryptors ? encryptors : 1, sizeof(pthread_t));
+	if (p.slots == NULL || producers == NULL || encryptor == NULL)
+	{
+		EPRINT("ERROR: Can't allocate buffers for %u threads!\n", config->threads);
+		free(producers);
+		free(encryptor);
+		return 0;
+	}
+	for (i = 0; i < p.nslots; i++)
+	{
+		s = &p.slots[i];
+		s->stamp = (unsigned long)i*SLOT_STAGES + SLOT_FREE;
+		s->buf = arena_slice(arena, output_buffer_size(config));
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->cond, NULL);
+		if (s->buf == NULL)
+		{
+			EPRINT("ERROR: Can't allocate buffers for %u threads!\n", config->threads);
+			p.nslots = i + 1;
+			goto cleanup;
+		}
+	}
+
+	// AES runs as its own stage, between the producers and the writer
+	for (encrypting = 0; config->aes_flag && encrypting < encryptors; encrypting++)
+	{
+		if (pthread_create(&encryptor[encrypting], NULL, pipeline_encryptor, &p) != 0)
+		{
+			// every encryptor has its share of the chunks, all of them must run
+			EPRINT("ERROR: Can't start the encryption threads!\n");
+			pipeline_stop(&p);
+			goto join;
+		}
+	}
+	p.producers = config->threads;
+	for (started = 0; started < config->threads; started++)
+	{
+		if (pthread_create(&producers[started], NULL, pipeline_producer, &p) != 0)
+			break;
+	}
+	__atomic_sub_fetch(&p.producers, config->threads - started, __ATOMIC_RELAXED);
+	if (started == 0)
+		EPRINT("ERROR: Can't start the generating threads!\n");
+	if (started && !uring_create(&uring, &p) && config->uring_depth != 0)
+		EPRINT("Warning: Can't set up io_uring, writing by fwrite.\n");
+
+	// this thread is the writer, it drains the ring in order
+	for (seq = 0; started && (p.infinite || seq < p.chunks); seq++)
+	{
+		s = &p.slots[seq % p.nslots];
+		slot_wait(&p, s, seq*SLOT_STAGES + SLOT_READY);
+
+		// the error was already reported by the stage
+		if (s->generated != p.chunk_bytes)
+			break;
+
+		// the slot is freed by the completion of the write
+		if (uring.fd >= 0)
+		{
+			if (!uring_write(&uring, &p, seq))
+				break;
+			continue;
+		}
+		if (splicing)
+			written = splice_write(config, (uint8_t *)s->buf, p.chunk_bytes, &splicing);
+		else if (config->direct_fd >= 0)
+			written = direct_write(config, (uint8_t *)s->buf, p.chunk_bytes);
+		else
+			written = fwrite(s->buf, 1, p.chunk_bytes, config->output);
+		written_total += written;
+		if (written != p.chunk_bytes)
+		{
+			perror(splicing ? "vmsplice" : config->direct_fd >= 0 ? "write" : "fwrite");
+			EPRINT( "ERROR: %zu bytes written, but %zu bytes to write\n",
+					written,
+					p.chunk_bytes);
+			break;
+		}
+		// a spliced chunk may be still in the pipe, the one a pipe before is not
+		if (seq >= held)
+			slot_publish(&p.slots[(seq - held) % p.nslots],
+					(seq - held + p.nslots)*SLOT_STAGES + SLOT_FREE);
+	}
+
+	if (started && uring.fd >= 0)
+		written_total += uring_finish(&uring, &p);
+
+	pipeline_stop(&p);
+	for (i = 0; i < started; i++)
+		pthread_join(producers[i], NULL);
+join:
+	for (i = 0; i < encrypting; i++)
+		pthread_join(encryptor[i], NULL);
+
+cleanup:
+	for (i = 0; i < p.nslots; i++)
+	{
+		pthread_mutex_destroy(&p.slots[i].lock);
+		pthread_cond_destroy(&p.slots[i].cond);
+	}
+	free(producers);
+	free(encryptor);
+	return written_total;
+}
+// }}} generate_chunk
+
+
+/**
+ * Fill the ending bytes with random data,
+ * encrypted by the given AES stream if AES is used,
+ * or by the given keystream of the aes_stream method.
+ * Return number of generated bytes
+ */
+// {{{ generate_ending
+size_t generate_ending(cnf_t *config, arena_t *arena, rdrand_aes_ctx_t *aes,
+		rdrand_aes_ctx_t *keystream)
+{
+	size_t written_total;
+  uint8_t *buf = arena_slice(arena, config->ending_bytes);
+
+  if (buf == NULL)
+    return 0;
+  if (keystream != NULL)
+    written_total = generate_keystream(config, keystream,
+        config->chunk_size*config->chunk_count*config->threads*8, buf, config->ending_bytes);
+  else
+    written_total = generate_with_metod(config, buf, config->ending_bytes, RETRY_LIMIT);
+	/* test generated amount */
+	if ( written_total != config->ending_bytes )
+	{
+		EPRINT( "ERROR: bytes generated %zu, bytes expected %zu\n", written_total, config->ending_bytes);
+		return written_total;
+	}
+    
+    if(config->aes_flag) {
+        //fprintf(stderr,"Encrypting tail\n");
+        // encrypt the tail in place
+        if(rdrand_aes_ctx_enc_buffer(aes, buf, buf, config->ending_bytes) != 1){
+            EPRINT("ERROR: Encryption of last %zu bytes failed!\n", config->ending_bytes);
+        }
+    }
+
+	written_total = fwrite(buf, sizeof(buf[0]), config->ending_bytes, config->output);
+	if ( written_total !=  config->ending_bytes )
+	{
+		EPRINT( "ERROR: fwrite - bytes written %zu, bytes to write %zu\n", written_total, config->ending_bytes);
+		return written_total;
+
+	}
+	return written_total;
+}
+// }}} generate_ending
+
+/**
+ * Generate requested amount of bytes
+ * Return amount of bytes truly generated.
+ */
+// {{{ aes streams
+/**
+ * Split the global AES context into count contexts, the i-th one
+ * gets the stream first + i*step. Returns NULL on failure.
+ */
+static rdrand_aes_ctx_t **aes_streams_create(unsigned int count, unsigned int first, unsigned int step)
+{
+	rdrand_aes_ctx_t **aes;
+	unsigned int i;
+
+	aes = calloc(count, sizeof(rdrand_aes_ctx_t *));
+	if (aes == NULL)
+		return NULL;
+	for (i = 0; i < count; i++)
+	{
+		aes[i] = rdrand_aes_split(first + i*step);
+		if (aes[i] == NULL)
+		{
+			while (i--)
+				rdrand_aes_ctx_destroy(aes[i]);
+			free(aes);
+			return NULL;
+		}
+	}
+	return aes;
+}
+
+static void aes_streams_destroy(rdrand_aes_ctx_t **aes, unsigned int count)
+{
+	unsigned int i;
+
+	if (aes == NULL)
+		return;
+	for (i = 0; i < count; i++)
+		rdrand_aes_ctx_destroy(aes[i]);
+	free(aes);
+}
+// }}} aes streams
+
+// {{{ shards
+/**
+ * With --shards, the output of --amount bytes is split into contiguous
+ * ranges, each one generated, encrypted and written at its offset by
+ * its own thread. There is no writer and no order between the threads.
+ * The ranges are in one output, or in the files of --output-pattern.
+ *
+ * With --mmap, the ranges are the same, but each thread maps its range
+ * window by window and generates right into the page cache, with no
+ * copy and no write.
+ */
+#define MMAP_WINDOW (32*1024*1024)
+
+typedef struct shard_s {
+	cnf_t *config;
+	/** the file of the range and its offset in it */
+	int fd;
+	off_t offset;
+	/** offset of the range in the whole output, and its length */
+	size_t start;
+	size_t len;
+	uint8_t *buf;
+	size_t buf_len;
+	/** the AES stream of the range, if AES is used */
+	rdrand_aes_ctx_t *aes;
+	/** the keystream of the aes_stream method */
+	rdrand_aes_ctx_t *keystream;
+	/** bytes written */
+	size_t written;
+} shard_t;
+
+/**
+ * Fill dest with len bytes of the range at done: generate them and
+ * encrypt them by the AES stream of the range.
+ * Returns 1 if it went OK.
+ */
+static int shard_fill(shard_t *sh, uint8_t *dest, size_t done, size_t len)
+{
+	cnf_t *config = sh->config;
+	size_t whole = len & ~(size_t)7, generated;
+	uint64_t tail;
+
+	if (sh->keystream != NULL)
+		return generate_keystream(config, sh->keystream, sh->start + done, dest, len) == len;
+
+	generated = generate_with_metod(config, dest, whole, RETRY_LIMIT);
+	if (generated != whole)
+		generated = generate_slow(config, dest, generated, whole);
+	if (generated != whole)
+		return 0;
+	// the methods of 64bit blocks generate whole blocks only
+	if (whole != len)
+	{
+		generated = generate_with_metod(config, (uint8_t *)&tail, sizeof(tail), RETRY_LIMIT);
+		if (generate_slow(config, (uint8_t *)&tail, generated, sizeof(tail)) != sizeof(tail))
+			return 0;
+		memcpy(dest + whole, &tail, len - whole);
+	}
+	if (sh->aes != NULL && rdrand_aes_ctx_enc_buffer(sh->aes, dest, dest, len) != 1)
+	{
+		EPRINT("ERROR: Encryption of %zu bytes failed!\n", len);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Write the window of a range out, drop it from the page cache
+ * and unmap it. Returns 1 if it was written.
+ */
+static int shard_unmap(shard_t *sh, uint8_t *win, size_t lead, size_t len, off_t at)
+{
+	int ok = 1;
+
+	if (msync(win, lead + len, MS_SYNC) != 0)
+	{
+		perror("msync");
+		ok = 0;
+	}
+	munmap(win, lead + len);
+	// nobody reads it again, keep the page cache for the others
+	posix_fadvise(sh->fd, at - lead, lead + len, POSIX_FADV_DONTNEED);
+	return ok;
+}
+
+/**
+ * Fill the range by --mmap: map it window by window and generate into
+ * the mapping. A window is written back asynchronously while the next
+ * one is filled, then synchronously before it is unmapped.
+ */
+static void shard_map(shard_t *sh)
+{
+	size_t page = sysconf(_SC_PAGESIZE), done, len, lead, prev_lead = 0, prev_len = 0;
+	uint8_t *win, *prev = NULL;
+	off_t at, prev_at = 0;
+
+	for (done = 0; done < sh->len; done += len)
+	{
+		len = sh->len - done < MMAP_WINDOW ? sh->len - done : MMAP_WINDOW;
+		at = sh->offset + done;
+		// mappings start on a page, ranges of 64bit blocks may not
+		lead = at % page;
+		win = mmap(NULL, lead + len, PROT_READ | PROT_WRITE, MAP_SHARED, sh->fd, at - lead);
+		if (win == MAP_FAILED)
+		{
+			perror("mmap");
+			break;
+		}
+#ifdef MADV_HUGEPAGE
+		// only some file systems have huge pages in the page cache
+		madvise(win, lead + len, MADV_HUGEPAGE);
+#endif
+		if (!shard_fill(sh, win + lead, done, len))
+		{
+			munmap(win, lead + len);
+			break;
+		}
+		msync(win, lead + len, MS_ASYNC);
+
+		if (prev != NULL && !shard_unmap(sh, prev, prev_lead, prev_len, prev_at))
+		{
+			prev = NULL;
+			munmap(win, lead + len);
+			break;
+		}
+		if (prev != NULL)
+			sh->written += prev_len;
+		prev = win;
+		prev_lead = lead;
+		prev_len = len;
+		prev_at = at;
+	}
+	if (prev != NULL && shard_unmap(sh, prev, prev_lead, prev_len, prev_at))
+		sh->written += prev_len;
+}
+
+static void *shard_worker(void *arg)
+{
+	shard_t *sh = arg;
+	size_t done, len, written;
+	ssize_t n;
+
+	if (sh->config->mmap_flag)
+	{
+		shard_map(sh);
+		return NULL;
+	}
+	for (done = 0; done < sh->len; done += len)
+	{
+		len = sh->len - done < sh->buf_len ? sh->len - done : sh->buf_len;
+		if (!shard_fill(sh, sh->buf, done, len))
+			break;
+		for (written = 0; written < len; written += n)
+		{
+			n = pwrite(sh->fd, sh->buf + written, len - written, sh->offset + done + written);
+			if (n < 0 && errno == EINTR)
+			{
+				n = 0;
+				continue;
+			}
+			if (n <= 0)
+			{
+				perror("pwrite");
+				return NULL;
+			}
+			sh->written += n;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Reserve the extents of a range of the file. With --mmap, the file
+ * gets its size too, a mapping can't grow it.
+ */
+static void shard_reserve(cnf_t *config, int fd, off_t offset, size_t len)
+{
+	struct stat st;
+
+	if (!config->mmap_flag)
+	{
+		// the size grows by the writes, in any order
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len);
+		return;
+	}
+	// reserved blocks, so a full disk fails here and not by SIGBUS in the mapping
+	if (fallocate(fd, 0, offset, len) != 0
+			&& fstat(fd, &st) == 0 && st.st_size < (off_t)(offset + len))
+	{
+		if (ftruncate(fd, offset + len) != 0)
+			perror("ftruncate");
+	}
+}
+
+/**
+ * Name of the file of the shard i, by --output-pattern.
+ * Has to be freed.
+ */
+static char *shard_name(cnf_t *config, unsigned int i)
+{
+	char *name;
+	int len;
+
+	len = snprintf(NULL, 0, config->output_pattern, i);
+	if (len < 0)
+		return NULL;
+	name = malloc(len + 1);
+	if (name != NULL)
+		snprintf(name, len + 1, config->output_pattern, i);
+	return name;
+}
+
+/**
+ * Generate the output by --shards.
+ * Return amount of bytes truly generated.
+ */
+static size_t generate_shards(cnf_t *config)
+{
+	shard_t *shards;
+	pthread_t *threads;
+	rdrand_aes_ctx_t **aes = NULL, **keystreams = NULL;
+	arena_t arena = { .base = NULL };
+	size_t buf_len = chunk_limit(config)*8, per, written = 0;
+	off_t base = 0;
+	unsigned int i, started = 0;
+	int fd = -1;
+	char *name;
+
+	shards = calloc(config->shards, sizeof(shard_t));
+	threads = calloc(config->shards, sizeof(pthread_t));
+	if (shards == NULL || threads == NULL)
+	{
+		EPRINT("ERROR: Can't allocate buffers for %u shards!\n", config->shards);
+		goto cleanup;
+	}
+	for (i = 0; i < config->shards; i++)
+		shards[i].fd = -1;
+
+	/** Every range is encrypted by its own AES stream, the keystream
+	 *  of aes_stream is at the offset of the range.
+	 */
+	if (config->aes_flag && (aes = aes_streams_create(config->shards, 0, 1)) == NULL)
+	{
+		EPRINT("ERROR: Can't set up AES for %u shards!\n", config->shards);
+		goto cleanup;
+	}
+	if (config->method == GET_AES_STREAM
+			&& (keystreams = aes_streams_create(config->shards, config->aes_stream, 0)) == NULL)
+	{
+		EPRINT("ERROR: Can't set up the AES stream for %u shards!\n", config->shards);
+		goto cleanup;
+	}
+	if (!arena_create(&arena, config->shards*ARENA_ALIGN(buf_len)))
+	{
+		EPRINT("ERROR: Can't allocate buffers for %u shards!\n", config->shards);
+		goto cleanup;
+	}
+
+	if (config->output_pattern == NULL)
+	{
+		// whatever is in the stdio buffer goes first
+		fflush(config->output);
+		base = lseek(fileno(config->output), 0, SEEK_CUR);
+		if (base < 0)
+		{
+			EPRINT("ERROR: The output can't be written at an offset, it can't be sharded!\n");
+			goto cleanup;
+		}
+		// the stream is write only, a shared mapping has to read too
+		fd = fileno(config->output);
+		if (config->mmap_flag && (fd = open(config->output_filename, O_RDWR)) < 0)
+		{
+			EPRINT("ERROR: Can't open file %s!\n", config->output_filename);
+			goto cleanup;
+		}
+		// all the extents at once, the ranges are written in any order
+		shard_reserve(config, fd, base, config->bytes);
+	}
+
+	// ranges of whole 64bit blocks, the last one gets the rest
+	per = (config->bytes / config->shards) & ~(size_t)7;
+	for (i = 0; i < config->shards; i++)
+	{
+		shard_t *sh = &shards[i];
+
+		sh->config = config;
+		sh->start = i*per;
+		sh->len = i + 1 < config->shards ? per : config->bytes - sh->start;
+		sh->buf = arena_slice(&arena, buf_len);
+		sh->buf_len = buf_len;
+		sh->aes = aes ? aes[i] : NULL;
+		sh->keystream = keystreams ? keystreams[i] : NULL;
+		if (config->output_pattern == NULL)
+		{
+			sh->fd = fd;
+			sh->offset = base + sh->start;
+			continue;
+		}
+		name = shard_name(config, i);
+		if (name != NULL)
+			sh->fd = open(name, (config->mmap_flag ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0666);
+		if (sh->fd < 0)
+		{
+			EPRINT("ERROR: Can't open file %s!\n", name ? name : config->output_pattern);
+			free(name);
+			goto cleanup;
+		}
+		if (config->verbose_flag)
+			EPRINT("Shard %u: %zu bytes to %s.\n", i, sh->len, name);
+		free(name);
+		shard_reserve(config, sh->fd, 0, sh->len);
+	}
+
+	for (started = 0; started < config->shards; started++)
+	{
+		if (pthread_create(&threads[started], NULL, shard_worker, &shards[started]) != 0)
+		{
+			EPRINT("ERROR: Can't start the generating threads!\n");
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+		written += shards[i].written;
+		if (shards[i].written != shards[i].len)
+			EPRINT("ERROR: Shard %u: %zu bytes written, but %zu bytes to write\n",
+					i, shards[i].written, shards[i].len);
+	}
+	// the stream of the output goes on behind the ranges
+	if (config->output_pattern == NULL
+			&& fseeko(config->output, base + written, SEEK_SET) != 0)
+		perror("fseeko");
+
+cleanup:
+	if (fd >= 0 && fd != fileno(config->output))
+		close(fd);
+	for (i = 0; config->output_pattern != NULL && shards != NULL && i < config->shards; i++)
+	{
+		if (shards[i].fd >= 0)
+			close(shards[i].fd);
+	}
+	if (arena.base != NULL)
+		arena_destroy(&arena);
+	aes_streams_destroy(aes, config->shards);
+	aes_streams_destroy(keystreams, config->shards);
+	free(shards);
+	free(threads);
+	return written;
+}
+// }}} shards
+
+// {{{ wipe
+/**
+ * With --wipe, the device is overwritten by the AES stream of the key,
+ * which goes on with the next streams behind the end of one, so the
+ * data can be made once more for --verify instead of being stored.
+ *
+ * The device is split into a region for every thread. A region starts
+ * on DIRECT_ALIGN and its thread writes it by its own O_DIRECT
+ * descriptor, so every thread is a queue of its own to the device.
+ * Only the unaligned end of the device goes through the page cache.
+ */
+#define WIPE_BUFFER (1024*1024)
+// how often the progress is checked, in microseconds
+#define WIPE_POLL 100000
+
+typedef struct wipe_region_s {
+	cnf_t *config;
+	/** the device with O_DIRECT, or without it if the device refuses it */
+	int fd;
+	/** the device through the page cache, for the unaligned end */
+	int tail_fd;
+	/** offset of the region on the device, and its length */
+	unsigned long long start;
+	size_t len;
+	uint8_t *buf;
+	/** the data read back by --verify */
+	uint8_t *check;
+	/** the keystream of the stream the region is in now */
+	rdrand_aes_ctx_t *keystream;
+	unsigned int stream;
+	int verifying;
+	/** bytes of the pass done, read by the progress */
+	size_t done;
+	/** bytes which differ from the keystream, and the first of them */
+	size_t bad;
+	unsigned long long first_bad;
+	int failed;
+	int finished;
+} wipe_region_t;
+
+/**
+ * Set a random key of the AES stream for --wipe without -k. Nobody
+ * else knows it, so the data can be verified only in the same run.
+ * Returns 1 if it went OK.
+ */
+int wipe_random_key(void)
+{
+	unsigned char key[16], nonce[RDRAND_MAX_NONCE_LENGTH];
+	int res;
+
+#ifndef STUB_RDRAND
+	if (rdrand_testSupport() != RDRAND_SUPPORTED)
+		return 0;
+#endif
+	res = rdrand_get_bytes_retry(key, sizeof(key), RETRY_LIMIT) == sizeof(key)
+		&& rdrand_get_bytes_retry(nonce, sizeof(nonce), RETRY_LIMIT) == sizeof(nonce)
+		&& rdrand_set_aes_stream(sizeof(key), key, nonce) == 1;
+	memset(key, 0, sizeof(key));
+	memset(nonce, 0, sizeof(nonce));
+	return res;
+}
+
+/**
+ * Fill buf with the data of the device at pos: the AES stream
+ * at the offset --seek + pos, in as many streams as it takes.
+ * Returns 1 if it went OK.
+ */
+static int wipe_keystream(wipe_region_t *r, unsigned long long pos, uint8_t *buf, size_t len)
+{
+	unsigned long long at;
+	unsigned int stream;
+	size_t n;
+
+	while (len > 0)
+	{
+		at = r->config->aes_seek + pos;
+		stream = r->config->aes_stream + at / RDRAND_AES_STREAM_LENGTH;
+		at %= RDRAND_AES_STREAM_LENGTH;
+		n = len < RDRAND_AES_STREAM_LENGTH - at ? len : RDRAND_AES_STREAM_LENGTH - at;
+		if (r->keystream == NULL || r->stream != stream)
+		{
+			if (r->keystream != NULL)
+				rdrand_aes_ctx_destroy(r->keystream);
+			r->keystream = rdrand_aes_split(stream);
+			r->stream = stream;
+			if (r->keystream == NULL)
+				return 0;
+		}
+		if (rdrand_aes_ctx_seek(r->keystream, at) != 1
+				|| rdrand_aes_ctx_keystream(r->keystream, buf, n) != n)
+			return 0;
+		pos += n;
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/**
+ * Write or read len bytes at pos of the device, the aligned part
+ * by the descriptor of the region, the rest by the page cache.
+ * Returns 1 if all of them were transferred.
+ */
+static int wipe_io(wipe_region_t *r, uint8_t *buf, size_t len, unsigned long long pos, int writing)
+{
+	size_t done, aligned = len & ~(size_t)(DIRECT_ALIGN - 1);
+	ssize_t n;
+	int fd;
+
+	for (done = 0; done < len; done += n)
+	{
+		fd = done < aligned ? r->fd : r->tail_fd;
+		if (writing)
+			n = pwrite(fd, buf + done, (done < aligned ? aligned : len) - done, pos + done);
+		else
+			n = pread(fd, buf + done, (done < aligned ? aligned : len) - done, pos + done);
+		if (n < 0 && errno == EINTR)
+		{
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+		{
+			EPRINT("ERROR: Can't %s %s at %llu: %s\n", writing ? "write" : "read",
+					r->config->wipe_device, pos + done, n < 0 ? strerror(errno) : "end of the device");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Count the bytes of the region at pos which were not read back
+ * as they were written.
+ */
+static void wipe_compare(wipe_region_t *r, size_t len, unsigned long long pos)
+{
+	size_t i;
+
+	if (memcmp(r->buf, r->check, len) == 0)
+		return;
+	for (i = 0; i < len; i++)
+	{
+		if (r->buf[i] == r->check[i])
+			continue;
+		if (r->bad++ == 0)
+			r->first_bad = pos + i;
+	}
+}
+
+static void *wipe_worker(void *arg)
+{
+	wipe_region_t *r = arg;
+	unsigned long long pos;
+	size_t done, len;
+
+	for (done = 0; done < r->len; done += len)
+	{
+		len = r->len - done < WIPE_BUFFER ? r->len - done : WIPE_BUFFER;
+		pos = r->start + done;
+		if (!wipe_keystream(r, pos, r->buf, len))
+		{
+			EPRINT("ERROR: Can't make the AES stream for %llu!\n", pos);
+			r->failed = 1;
+			break;
+		}
+		if (!wipe_io(r, r->verifying ? r->check : r->buf, len, pos, !r->verifying))
+		{
+			r->failed = 1;
+			break;
+		}
+		if (r->verifying)
+			wipe_compare(r, len, pos);
+		__atomic_store_n(&r->done, done + len, __ATOMIC_RELAXED);
+	}
+	// the data have to be on the device before they are read back
+	if (!r->verifying && !r->failed && fdatasync(r->fd) != 0)
+	{
+		perror("fdatasync");
+		r->failed = 1;
+	}
+	__atomic_store_n(&r->finished, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ * Size of the device: of the block device, or of the file.
+ * Returns 0 if it can't be found.
+ */
+static unsigned long long wipe_size(int fd)
+{
+	unsigned long long size = 0;
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+		return 0;
+#ifdef BLKGETSIZE64
+	if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) != 0)
+		return 0;
+#endif
+	if (S_ISREG(st.st_mode))
+		size = st.st_size;
+	return size;
+}
+
+/**
+ * Print the progress of all the regions on one line, in place
+ * on a terminal.
+ */
+static void wipe_progress(wipe_region_t *regions, unsigned int count, const char *pass, char end)
+{
+#ifndef NO_ERROR_PRINTS
+	size_t done, total = 0, len = 0;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+	{
+		total += __atomic_load_n(&regions[i].done, __ATOMIC_RELAXED);
+		len += regions[i].len;
+	}
+	EPRINT("%s %5.1f%%:", pass, len ? 100.0*total/len : 100.0);
+	for (i = 0; i < count; i++)
+	{
+		done = __atomic_load_n(&regions[i].done, __ATOMIC_RELAXED);
+		EPRINT(" %u:%5.1f%%", i, regions[i].len ? 100.0*done/regions[i].len : 100.0);
+	}
+	EPRINT("%c", end);
+#else
+	(void)regions;
+	(void)count;
+	(void)pass;
+	(void)end;
+#endif
+}
+
+/**
+ * Run one pass of all the regions, each in its own thread, and show
+ * their progress. Returns 1 if all the regions went through.
+ */
+static int wipe_pass(wipe_region_t *regions, pthread_t *threads, unsigned int count, int verifying)
+{
+	const char *pass = verifying ? "Verifying" : "Wiping";
+	int tty = isatty(STDERR_FILENO), ok = 1;
+	unsigned int i, started, finished, ticks = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		regions[i].verifying = verifying;
+		regions[i].done = 0;
+		regions[i].finished = 0;
+	}
+	for (started = 0; started < count; started++)
+	{
+		if (pthread_create(&threads[started], NULL, wipe_worker, &regions[started]) != 0)
+		{
+			EPRINT("ERROR: Can't start the %s threads!\n", verifying ? "verifying" : "wiping");
+			ok = 0;
+			break;
+		}
+	}
+	// every second on a terminal, every minute to a log
+	do {
+		usleep(WIPE_POLL);
+		for (i = 0, finished = 0; i < started; i++)
+			finished += __atomic_load_n(&regions[i].finished, __ATOMIC_ACQUIRE);
+		if (++ticks % (tty ? 1000000/WIPE_POLL : 60000000/WIPE_POLL) == 0 && finished < started)
+			wipe_progress(regions, count, pass, tty ? '\r' : '\n');
+	} while (finished < started);
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+		ok &= !regions[i].failed;
+	}
+	wipe_progress(regions, count, pass, '\n');
+	return ok;
+}
+
+/**
+ * Wipe the device of --wipe, and verify it with --verify.
+ * Return amount of bytes written, or verified with --verify.
+ */
+static size_t wipe(cnf_t *config)
+{
+	wipe_region_t *regions;
+	pthread_t *threads;
+	arena_t arena = { .base = NULL };
+	unsigned long long size;
+	size_t per, result = 0;
+	unsigned int i, count;
+	struct stat st;
+	int fd, flags = O_RDWR;
+
+	// nobody can mount a block device while it is wiped
+	if (stat(config->wipe_device, &st) == 0 && S_ISBLK(st.st_mode))
+		flags |= O_EXCL;
+	fd = open(config->wipe_device, flags);
+	if (fd < 0)
+	{
+		EPRINT("ERROR: Can't open %s: %s\n", config->wipe_device, strerror(errno));
+		return 0;
+	}
+	size = wipe_size(fd);
+	if (size == 0)
+	{
+		EPRINT("ERROR: Can't find the size of %s!\n", config->wipe_device);
+		close(fd);
+		return 0;
+	}
+	if (config->bytes > size)
+	{
+		EPRINT("ERROR: %s has only %llu bytes!\n", config->wipe_device, size);
+		close(fd);
+		return 0;
+	}
+	if (config->bytes == 0)
+		config->bytes = size;
+
+	// aligned regions, the last one gets the rest; small devices get fewer
+	count = config->threads;
+	per = (config->bytes / count) & ~(size_t)(DIRECT_ALIGN - 1);
+	if (per == 0)
+	{
+		count = 1;
+		per = config->bytes;
+	}
+	regions = calloc(count, sizeof(wipe_region_t));
+	threads = calloc(count, sizeof(pthread_t));
+	if (regions == NULL || threads == NULL
+			|| !arena_create(&arena, count*WIPE_BUFFER*(config->verify_flag ? 2 : 1)))
+	{
+		EPRINT("ERROR: Can't allocate buffers for %u threads!\n", count);
+		goto cleanup;
+	}
+	for (i = 0; i < count; i++)
+	{
+		wipe_region_t *r = &regions[i];
+
+		r->config = config;
+		r->start = (unsigned long long)i*per;
+		r->len = i + 1 < count ? per : config->bytes - r->start;
+		r->tail_fd = fd;
+		r->fd = open(config->wipe_device, O_RDWR | O_DIRECT);
+		if (r->fd < 0)
+			r->fd = fd;
+		r->buf = arena_slice(&arena, WIPE_BUFFER);
+		if (config->verify_flag)
+			r->check = arena_slice(&arena, WIPE_BUFFER);
+		if (config->verbose_flag)
+			EPRINT("Region %u: %zu bytes at %llu%s.\n", i, r->len, r->start,
+					r->fd == fd ? ", without O_DIRECT" : "");
+	}
+
+	if (!wipe_pass(regions, threads, count, 0))
+	{
+		for (i = 0; i < count; i++)
+			result += regions[i].done;
+		goto cleanup;
+	}
+	if (fdatasync(fd) != 0)
+		perror("fdatasync");
+	if (!config->verify_flag)
+	{
+		result = config->bytes;
+		goto cleanup;
+	}
+
+	// read the device, not what is left in the page cache
+	posix_fadvise(fd, 0, config->bytes, POSIX_FADV_DONTNEED);
+	wipe_pass(regions, threads, count, 1);
+	for (i = 0; i < count; i++)
+	{
+		result += regions[i].done - regions[i].bad;
+		if (regions[i].bad != 0)
+			EPRINT("ERROR: Region %u: %zu bytes differ, the first one at %llu!\n",
+					i, regions[i].bad, regions[i].first_bad);
+		else if (regions[i].done != regions[i].len)
+			EPRINT("ERROR: Region %u: only %zu of %zu bytes verified!\n",
+					i, regions[i].done, regions[i].len);
+	}
+
+cleanup:
+	for (i = 0; regions != NULL && i < count; i++)
+	{
+		if (regions[i].config != NULL && regions[i].fd != fd)
+			close(regions[i].fd);
+		if (regions[i].keystream != NULL)
+			rdrand_aes_ctx_destroy(regions[i].keystream);
+	}
+	if (arena.base != NULL)
+		arena_destroy(&arena);
+	close(fd);
+	free(regions);
+	free(threads);
+	return result;
+}
+// }}} wipe
+
+// {{{ generate
+size_t generate(cnf_t *config)
+{
+	size_t written;
+	arena_t arena;
+	rdrand_aes_ctx_t **aes = NULL, **keystreams = NULL;
+	unsigned int encryptors = 0;
+
+	/** Sharded and mapped outputs have no pipeline, every thread writes its range. */
+	if (config->shards != 0)
+		return generate_shards(config);
+	/** So does --wipe, every thread has its region of the device. */
+	if (config->wipe_device != NULL)
+		return wipe(config);
+
+	/** Every AES thread encrypts with its own stream, the first
+	 *  one also the ending bytes.
+	 */
+	if (config->aes_flag)
+	{
+		encryptors = pipeline_encryptors(config);
+		aes = aes_streams_create(encryptors, 0, 1);
+		if (aes == NULL)
+		{
+			EPRINT("ERROR: Can't set up AES for %u threads!\n", encryptors);
+			return 0;
+		}
+	}
+	/** Every producer of aes_stream reads the same stream. */
+	if (config->method == GET_AES_STREAM)
+	{
+		keystreams = aes_streams_create(config->threads, config->aes_stream, 0);
+		if (keystreams == NULL)
+		{
+			EPRINT("ERROR: Can't set up the AES stream for %u threads!\n", config->threads);
+			return 0;
+		}
+	}
+
+	/** With --splice, the ring is as big as to cover the output pipe. */
+	splice_setup(config);
+	if (config->verbose_flag && config->splice_flag)
+	{
+		if (config->pipe_size != 0)
+			EPRINT("Splicing into a pipe of %zu bytes.\n", config->pipe_size);
+		else
+			EPRINT("Warning: The output is not a pipe, --splice is ignored.\n");
+	}
+
+	/** With --direct, the chunks go by an O_DIRECT descriptor. */
+	direct_setup(config);
+	if (config->verbose_flag && config->direct_flag && config->direct_fd < 0)
+		EPRINT("Warning: The output can't be opened with O_DIRECT, --direct is ignored.\n");
+
+	/** With --io-uring, the ring has a slot more for every write in flight. */
+	uring_setup(config);
+	if (config->verbose_flag && config->uring_flag)
+	{
+		if (config->uring_depth != 0)
+			EPRINT("Writing by io_uring, %u chunks in flight.\n", config->uring_depth);
+		else
+			EPRINT("Warning: The output can't be written by io_uring, --io-uring is ignored.\n");
+	}
+
+	/** All the buffers are allocated at once: the ring of chunks
+	 *  with its slots and the ending bytes.
+	 */
+	if (!arena_create(&arena,
+				pipeline_slots(config)*(ARENA_ALIGN(sizeof(slot_t)) + output_buffer_size(config))
+				+ (output_aligned(config) ? (size_t)sysconf(_SC_PAGESIZE) : 0)
+				+ ARENA_ALIGN(config->ending_bytes)))
+	{
+		EPRINT("ERROR: Can't allocate buffers for %u threads!\n", config->threads);
+		aes_streams_destroy(aes, encryptors);
+		aes_streams_destroy(keystreams, config->threads);
+		return 0;
+	}
+
+	written = 0;
+	/** At first fill chunks in all parallel threads.
+	 *  If no size is specified, then the program
+	 *  will never get over this.
+	 */
+	written = generate_chunk(config, &arena, aes, encryptors, keystreams);
+	direct_finish(config);
+
+	/** Then fill the few ending bytes in one thread. */
+	written += generate_ending(config, &arena, aes ? aes[0] : NULL,
+			keystreams ? keystreams[0] : NULL);
+
+	arena_destroy(&arena);
+	aes_streams_destroy(aes, encryptors);
+	aes_streams_destroy(keystreams, config->threads);
+	return written;
+}
+// }}} generate
+
+
+/** load keys from file saved in config into AES_CFG
+ *
+ * @param config
+ *
+ * @return  FILE_ERRORS enum
+ */
+// {{{ load_keys
+int load_keys(cnf_t * config) {
+    FILE*file;
+    unsigned char *key, *nonce, *keys[MAX_KEYS], *nonces[MAX_KEYS];
+    unsigned int key_len, nonce_len, first_len=0, amount =0, i;
+    int res;
+
+    file=fopen(config->aeskeys_filename,"r");
+    if(file == NULL){
+      EPRINT("ERROR: Can't open file %s!\n", config->aeskeys_filename);
       exit(EXIT_FAILURE);
     }
     
@@ -743,7 +2880,11 @@ int load_keys(cnf_t * config) {
     if(amount == 0)
         return E_KEY_NONCE_BAD_LENGTH;
     
-    if(rdrand_set_aes_keys(amount, first_len, keys, nonces) == 0)
+    // aes_stream uses the first key only
+    if(config->method == GET_AES_STREAM) {
+        if(rdrand_set_aes_stream(first_len, keys[0], nonces[0]) == 0)
+            return E_KEY_NONCE_BAD_LENGTH;
+    } else if(rdrand_set_aes_keys(amount, first_len, keys, nonces) == 0)
         return E_KEY_NONCE_BAD_LENGTH;
 
     // free memory, keys are copied into AES_CFG
@@ -779,7 +2920,7 @@ int load_key_line(
     
     int c;
     unsigned int i;
-    char buf[2*RDRAND_MAX_KEY_LENGTH] = {};
+    char buf[2*(RDRAND_MAX_KEY_LENGTH + RDRAND_MAX_NONCE_LENGTH)] = {};
 
     
     i=0;
@@ -790,7 +2931,7 @@ int load_key_line(
             (c >= '0' && c <= '9')
             ) {
             
-            if(i > RDRAND_MAX_KEY_LENGTH*2)
+            if(i >= sizeof(buf))
                 return E_KEY_NONCE_BAD_LENGTH;
             buf[i] = c;
         } else {
@@ -799,12 +2940,14 @@ int load_key_line(
         }
         i++;
     }
-    // nonce is half of key, so key is first 2/3 of line and nonce the last 1/3
-    *key_len = (i/3)*2;
-    *nonce_len = i/3;
+    // nonce is half of key, so key is first 2/3 of line and nonce the last 1/3,
+    // but the nonce has 64 bits at most, the rest of the IV is the counter
+    *nonce_len = i/3 < 2*RDRAND_MAX_NONCE_LENGTH ? i/3 : 2*RDRAND_MAX_NONCE_LENGTH;
+    *key_len = i - *nonce_len;
 
     // special cases, when there is no need for malloc
-    if(*key_len + *nonce_len != i)
+    if(*key_len % 2 || *nonce_len % 2
+            || *nonce_len != (*key_len/2 < 2*RDRAND_MAX_NONCE_LENGTH ? *key_len/2 : 2*RDRAND_MAX_NONCE_LENGTH))
         return E_KEY_NONCE_BAD_LENGTH;
     if(c == EOF)
         return E_EOF;
@@ -822,6 +2965,64 @@ int load_key_line(
 }
 // }}}
 
+/**
+ * Find the best chunk and AES buffer sizes, or load them from
+ * the cache file, and use them. The defaults stay on failure.
+ */
+// {{{ autotune
+void autotune(cnf_t * config) {
+    rdrand_tune_t tune = { .threads = config->threads, .rekey_interval = config->aes_rekey,
+        .cipher = config->cipher };
+    int loaded = 0;
+
+    if(config->tune_filename != NULL)
+        loaded = rdrand_tune_load(&tune, config->tune_filename) == RDRAND_SUCCESS;
+    if(!loaded) {
+        if(rdrand_autotune(&tune) != RDRAND_SUCCESS) {
+            EPRINT("Warning: The autotune failed, using the default sizes.\n");
+            return;
+        }
+        if(config->tune_filename != NULL
+                && rdrand_tune_save(&tune, config->tune_filename) != RDRAND_SUCCESS)
+            EPRINT("Warning: Can't save the autotune to %s.\n", config->tune_filename);
+    }
+
+    config->max_chunk_size = tune.chunk_size / 8;
+    rdrand_set_aes_buffer_size(tune.aes_buffer_size);
+    compute_chunk_size(config);
+    if(config->verbose_flag) {
+        EPRINT("Autotune%s: chunks of %zu bytes (%.0f MB/s), AES buffers of %u bytes (%.0f MB/s).\n",
+                loaded ? " loaded" : "",
+                tune.chunk_size, tune.chunk_rate / 1e6,
+                tune.aes_buffer_size, tune.aes_rate / 1e6);
+    }
+}
+// }}} autotune
+
+/**
+ * Measure all ciphers and return the fastest one,
+ * or aes128-ctr if the measurement failed.
+ */
+// {{{ choose_cipher
+int choose_cipher(cnf_t * config) {
+    double rates[RDRAND_CIPHER_COUNT];
+    int i, best;
+
+    best = rdrand_cipher_benchmark(rates);
+    if(best == RDRAND_FAILURE) {
+        EPRINT("Warning: The cipher benchmark failed, using %s.\n",
+                rdrand_cipher_name(RDRAND_CIPHER_AES128_CTR));
+        return RDRAND_CIPHER_AES128_CTR;
+    }
+    if(config->verbose_flag) {
+        for(i = 0; i < RDRAND_CIPHER_COUNT; i++)
+            EPRINT("Cipher %-10s %8.0f MB/s%s\n", rdrand_cipher_name(i), rates[i] / 1e6,
+                    i == best ? " (chosen)" : "");
+    }
+    return best;
+}
+// }}} choose_cipher
+
 /*****************************************************************************/
 // {{{ MAIN
 #ifndef NO_MAIN // for testing
@@ -837,7 +3038,8 @@ int main(int argc, char** argv)
 
 	if(config.help_flag)
 	{
-		printf(HELP_TEXT,argv[0],METHOD_NAMES[DEFAULT_METHOD],DEFAULT_THREADS);
+		printf(HELP_TEXT,argv[0],METHOD_NAMES[DEFAULT_METHOD],DEFAULT_THREADS,MAX_COUNTER,
+		    RDRAND_AES_STREAM_LENGTH);
 		print_available_methods(stdout);
 		exit(EXIT_SUCCESS);
 	}
@@ -857,14 +3059,18 @@ int main(int argc, char** argv)
 		}
 	}
 
-  // if AES is used
-  if(config.aes_flag) {
+  // if AES is used, aes_stream has always a key file, --wipe may have none
+  if(config.aes_flag || config.method == GET_AES_STREAM) {
+    if(config.cipher == CIPHER_AUTO)
+        config.cipher = choose_cipher(&config);
+    rdrand_set_aes_cipher(config.cipher);
     // if key filename is given
     if(config.aeskeys_filename != NULL) {
         switch( load_keys(&config)){
             case E_KEY_NONCE_BAD_LENGTH:
                 EPRINT("ERROR: File %s has incorrect syntax!\n"
-                        "All lines has to be the same length of 24 bytes,\n"
+                        "All lines has to be the same length of 24 bytes\n"
+                        "(40 bytes for aes256-ctr and chacha20).\n"
                         "Maximum number of allowed keys is 128.\n",
                         config.aeskeys_filename);
                 exit(EXIT_FAILURE);
@@ -880,21 +3086,49 @@ int main(int argc, char** argv)
                 break;
         }
         
+    } else if(config.wipe_device != NULL) {
+      if(!wipe_random_key()) {
+          EPRINT("ERROR: Can't make a random key for the wipe!\n");
+          exit(EXIT_FAILURE);
+      }
     } else {
       // key filename is not set, generate keys
       rdrand_set_aes_random_key();
 
     }
+    if(config.aes_rekey != 0)
+      rdrand_set_aes_rekey_interval(config.aes_rekey);
   }
   // FIXME valgrind...
+    #ifndef STUB_RDRAND
+    if(config.method == GET_RDSEED && rdseed_testSupport() != RDRAND_SUPPORTED)
+    {
+        EPRINT("ERROR: The CPU of this machine do not have RdSeed!\n");
+        exit(EXIT_FAILURE);
+    }
+    #endif // STUB_RDRAND
+
     #ifdef STUB_RDRAND
     if(1)
     #else 
-    if(rdrand_testSupport() == RDRAND_SUPPORTED)
+    // aes_stream doesn't use RdRand
+    if(config.method == GET_AES_STREAM || rdrand_testSupport() == RDRAND_SUPPORTED)
     #endif // STUB_RDRAND
     {
+        if(config.autotune_flag)
+            autotune(&config);
 
-        if(config.verbose_flag)
+        if(config.verbose_flag && config.wipe_device != NULL)
+        {
+            EPRINT("Wiping %s in %u threads by the stream %u of %s, from the offset %llu%s.\n",
+                    config.wipe_device,
+                    config.threads,
+                    config.aes_stream,
+                    config.aeskeys_filename ? config.aeskeys_filename : "a random key",
+                    config.aes_seek,
+                    config.verify_flag ? ", then verifying it" : "");
+        }
+        else if(config.verbose_flag)
         {
             if(config.bytes)
             {
@@ -910,8 +3144,15 @@ int main(int argc, char** argv)
                       config.threads);
             }
 
+            if(config.method == GET_AES_STREAM) {
+                EPRINT("Output is the stream %u of the first key in `%s', from the offset %llu.\n",
+                        config.aes_stream,
+                        config.aeskeys_filename,
+                        config.aes_seek);
+            }
             if(config.aes_flag) {
-                EPRINT("Output of RdRand is further encrypted with 128bit AES-CTR.\n");
+                EPRINT("Output of RdRand is further encrypted with %s.\n",
+                        rdrand_cipher_name(config.cipher));
                 if(config.aeskeys_filename == NULL){
                     EPRINT("Encryption keys are generated automaticaly.\n");
                 }else{
@@ -926,6 +3167,13 @@ int main(int argc, char** argv)
             // TODO print it also on ^C
             EPRINT( "Generated %zu bytes.\n", generated);
         }
+        if(config.wipe_device != NULL && (generated == 0 || generated != config.bytes))
+        {
+            EPRINT("ERROR: Only %zu of %zu bytes of %s were %s!\n", generated, config.bytes,
+                    config.wipe_device, config.verify_flag ? "verified" : "wiped");
+            rdrand_clean_aes();
+            exit(EXIT_FAILURE);
+        }
 
     }
     else
@@ -936,7 +3184,7 @@ int main(int argc, char** argv)
 
 	fclose(config.output);
 
-  if(config.aes_flag) {
+  if(config.aes_flag || config.method == GET_AES_STREAM) {
     rdrand_clean_aes();
   }
 
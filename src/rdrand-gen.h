@@ -43,6 +43,9 @@
 #define MAX_CHUNK_SIZE 2048
 #define MAX_KEYS 128
 
+// --cipher auto, the fastest RDRAND_CIPHER_*
+#define CIPHER_AUTO (-1)
+
 /* Macro for default config settings.
  * Please note, changing of values not marked as CAN CHANGE
  * can has undefined result.
@@ -52,6 +55,7 @@
     .output=stdout, \
     .method=DEFAULT_METHOD, \
     .threads=DEFAULT_THREADS, \
+    .direct_fd=-1, \
     .bytes=DEFAULT_BYTES\
 }
 #if 0
@@ -83,6 +87,10 @@ enum {
     GET_BYTES,
     GET_RESEED64_DELAY,
     GET_RESEED64_SKIP,
+    GET_RDSEED,
+    GET_RESEED64_RDSEED,
+    GET_CTR_DRBG,
+    GET_AES_STREAM,
 
     // helper constants
     METHODS_COUNT
@@ -125,6 +133,46 @@ typedef struct cnf {
     int aes_flag;
     /** number of threads */
     unsigned int threads;
+    /** number of AES threads, 0 for one per thread up to the number of CPUs - CAN CHANGE */
+    unsigned int aes_threads;
+    /** bytes per AES key for --aes-rekey/-r, 0 for the library default */
+    unsigned int aes_rekey;
+    /** RDRAND_CIPHER_* enum or CIPHER_AUTO for --cipher/-c */
+    int cipher;
+    /** offset in the AES stream for --seek/-s */
+    unsigned long long aes_seek;
+    /** number of the AES stream for --stream/-i */
+    unsigned int aes_stream;
+    /** Flag of --seek/-s or --stream/-i */
+    int aes_seek_flag;
+    /** Flag of --autotune/-T or --tune-file/-F */
+    int autotune_flag;
+    /** cache file of the autotune for --tune-file/-F */
+    char* tune_filename;
+    /** Flag of --splice/-S */
+    int splice_flag;
+    /** bytes of the output pipe with --splice, set by generate(), 0 if not splicing */
+    size_t pipe_size;
+    /** Flag of --io-uring/-U */
+    int uring_flag;
+    /** writes in flight with --io-uring, set by generate(), 0 if not used */
+    unsigned int uring_depth;
+    /** Flag of --direct/-D */
+    int direct_flag;
+    /** the output opened with O_DIRECT, set by generate(), -1 if not used */
+    int direct_fd;
+    /** number of output ranges for --shards/-j, 0 without sharding */
+    unsigned int shards;
+    /** printf pattern of the shard files for --output-pattern/-P */
+    char* output_pattern;
+    /** Flag of --mmap/-M */
+    int mmap_flag;
+    /** the device or file for --wipe/-w */
+    char* wipe_device;
+    /** Flag of --verify/-y */
+    int verify_flag;
+    /** most 64bit blocks in a chunk, 0 for MAX_CHUNK_SIZE */
+    size_t max_chunk_size;
     /** number of bytes to generate */
     size_t bytes;
     /** amount of 64bit blocks */
@@ -142,6 +190,12 @@ typedef struct cnf {
  */
 int parse_args(int argc, char** argv, cnf_t* config);
 
+/**
+ * Compute the size and count of chunks and the ending bytes
+ * for config->bytes and the threads.
+ */
+void compute_chunk_size(cnf_t * config);
+
 
 
 /** load keys from file saved in config into AES_CFG
@@ -152,6 +206,12 @@ int parse_args(int argc, char** argv, cnf_t* config);
  */
 int load_keys(cnf_t * config);
 
+/** Set a random key of the AES stream for --wipe without --aes-keys.
+ *
+ * @return  1 if it went OK
+ */
+int wipe_random_key(void);
+
 /** Load a single line from given file. Key and nonce will be returned
  *  by parameter.
  *
@@ -171,4 +231,19 @@ int load_key_line(
 
 size_t generate(cnf_t *config);
 
+/** Benchmark the ciphers for --cipher auto.
+ *
+ * @param config
+ *
+ * @return  the fastest RDRAND_CIPHER_*
+ */
+int choose_cipher(cnf_t * config);
+
+/** Find the best chunk and AES buffer sizes by the library autotune,
+ *  or load them from config->tune_filename, and use them.
+ *
+ * @param config
+ */
+void autotune(cnf_t * config);
+
 #endif  // RDRAND_GEN_H